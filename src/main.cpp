@@ -4,23 +4,159 @@
 using std::cout;
 using std::endl;
 
-#include "renderer/loader/pbrtloader.h"
+#include "renderer/loader/binarymesh.h"
+#include "renderer/loader/sceneloader.h"
 #include "renderer/core/cpurender.h"
+#include "renderer/core/distributed.h"
 #include "renderer/core/gpurender.h"
+#include "renderer/core/parallel.h"
+#include "renderer/core/renderserver.h"
+#include "renderer/core/wavefront.h"
 
-int main() {   
+int main(int argc, char** argv) {
     std::vector<std::string> scenes(100);
     scenes[0] = "E:/Document/Graphics/code/GPU-Renderer/scene/cornell-box/scene.pbrt";
     scenes[1] = "E:/Document/Graphics/code/GPU-Renderer/scene/veach-mis/scene.pbrt";
     scenes[2] = "E:/Document/Graphics/code/GPU-Renderer/scene/veach-bidir/scene.pbrt";
     std::string filepath = scenes[2];
+
+    // renderer [--threads n] [--wavefront] [--checkpoint file [--checkpoint-interval s] [--resume]] [--bvh-cache dir] [scene.pbrt|model.obj]
+    // renderer [--threads n] --serve socket
+    // renderer --check-scene scene.pbrt|model.obj
+    // renderer --connect socket render scene=... output=...
+    // renderer [--threads n] (--coordinate port [--reissue-after s] | --worker host:port) scene.pbrt
+    // renderer [--threads n] --convert-mesh mesh.ply|scene.pbrt output [--mesh-bvh]
+    int nThreads = 0;
+    bool wavefront = false;
+    std::string checkpointFile;
+    Float checkpointInterval = 60;
+    bool resume = false;
+    std::string serverSocket;
+    int coordinatorPort = 0;
+    Float reissueAfter = 60;
+    std::string workerHost;
+    int workerPort = 0;
+    std::string bvhCacheDirectory;
+    std::string meshOutput;
+    bool meshBvh = false;
+    bool checkScene = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg(argv[i]);
+        if (arg == "--threads" && i + 1 < argc) {
+            nThreads = atoi(argv[++i]);
+        }
+        else if (arg == "--wavefront") {
+            wavefront = true;
+        }
+        else if (arg == "--checkpoint" && i + 1 < argc) {
+            checkpointFile = argv[++i];
+        }
+        else if (arg == "--checkpoint-interval" && i + 1 < argc) {
+            checkpointInterval = atof(argv[++i]);
+        }
+        else if (arg == "--resume") {
+            resume = true;
+        }
+        else if (arg == "--bvh-cache" && i + 1 < argc) {
+            bvhCacheDirectory = argv[++i];
+        }
+        else if (arg == "--serve" && i + 1 < argc) {
+            serverSocket = argv[++i];
+        }
+        else if (arg == "--coordinate" && i + 1 < argc) {
+            coordinatorPort = atoi(argv[++i]);
+        }
+        else if (arg == "--reissue-after" && i + 1 < argc) {
+            reissueAfter = atof(argv[++i]);
+        }
+        else if (arg == "--worker" && i + 1 < argc) {
+            std::string address = argv[++i];
+            size_t split = address.rfind(':');
+            ASSERT(split != std::string::npos, "Worker address must be host:port");
+            workerHost = address.substr(0, split);
+            workerPort = atoi(address.c_str() + split + 1);
+        }
+        else if (arg == "--convert-mesh" && i + 2 < argc) {
+            filepath = argv[++i];
+            meshOutput = argv[++i];
+        }
+        else if (arg == "--check-scene" && i + 1 < argc) {
+            // Exits with 0 if the scene loads, the render server runs this first
+            filepath = argv[++i];
+            checkScene = true;
+        }
+        else if (arg == "--mesh-bvh") {
+            meshBvh = true;
+        }
+        else if (arg == "--connect" && i + 1 < argc) {
+            // The rest of the command line is the request
+            std::string socketPath = argv[++i], request;
+            while (++i < argc) {
+                request += std::string(argv[i]) + (i + 1 < argc ? " " : "");
+            }
+            SocketInit();
+            SocketHandle connection = ConnectLocal(socketPath);
+            std::string reply;
+            if (connection == InvalidSocket || !SendLine(connection, request) || !RecvLine(connection, &reply)) {
+                fprintf(stderr, "Can't reach the render server at %s\n", socketPath.c_str());
+                return 1;
+            }
+            CloseSocket(connection);
+            printf("%s\n", reply.c_str());
+            return reply.compare(0, 2, "ok") == 0 ? 0 : 1;
+        }
+        else {
+            filepath = arg;
+        }
+    }
+    ParallelInit(nThreads);
+
+    if (!meshOutput.empty()) {
+        bool converted = ConvertToBinaryMeshes(filepath, meshOutput, meshBvh);
+        ParallelCleanup();
+        return converted ? 0 : 1;
+    }
+    if (!serverSocket.empty()) {
+        RenderServer server(serverSocket);
+        server.Run();
+        ParallelCleanup();
+        return 0;
+    }
+
     filesystem::path path(filepath);
     getFileResolver()->prepend(path.parent_path());
-    SceneLoader* sceneLoader = nullptr; 
-    sceneLoader = new  PBRTLoader(filepath);
+    std::shared_ptr<SceneLoader> sceneLoader = CreateSceneLoader(filepath);
+    ASSERT(sceneLoader, "Can't load scenes like " + filepath);
     std::shared_ptr<Renderer> renderer = sceneLoader->Load();  
+    if (checkScene) {
+        ParallelCleanup();
+        return 0;
+    }
+    ASSERT(!resume || !checkpointFile.empty(), "Can't resume without --checkpoint");
+    renderer->m_checkpointFile = checkpointFile;
+    renderer->m_checkpointInterval = checkpointInterval;
+    renderer->m_resume = resume;
+    renderer->m_scene.m_bvhCacheDirectory = bvhCacheDirectory;
+
+    if (coordinatorPort > 0) {
+        Coordinator coordinator(renderer, coordinatorPort, 64, reissueAfter);
+        coordinator.Run();
+        ParallelCleanup();
+        return 0;
+    }
+    if (!workerHost.empty()) {
+        RunWorker(renderer, workerHost, workerPort);
+        ParallelCleanup();
+        return 0;
+    }
 
-    render(renderer);
+    if (wavefront) {
+        WavefrontRender(renderer);
+    }
+    else {
+        render(renderer);
+    }
+    ParallelCleanup();
     return 0;
 
     Gui::init(renderer);             
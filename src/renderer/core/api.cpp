@@ -9,6 +9,7 @@
 #include "renderer/core/film.h"
 #include "renderer/core/triangle.h"
 #include "renderer/core/material.h"
+#include "renderer/core/sampler.h"
 
 
 class Options {
@@ -16,6 +17,7 @@ public:
     Options() {
         m_currentTransform.Identity();
         m_hasAreaLight = false;
+        m_objectPrimitiveBegin = -1;
     }
 
     void 
@@ -39,14 +41,18 @@ public:
         const ParameterSet& params,
         int triangleID);
 
+    void MakeAccelerator();
     void MakeCamera();
     void MakeFilm();
+    void MakeSampler();
     void MakeIntegrator();
     void MakeRenderer();
 
     Transform m_currentTransform;
     std::vector<Transform> m_transformStack;
 
+    std::string m_acceleratorType;
+    ParameterSet m_acceleratorParameterSet;
     std::string m_integratorType;
     ParameterSet m_integratorParameterSet;
     std::string m_samplerType;
@@ -61,6 +67,7 @@ public:
 
     Camera m_camera;
     Film m_film;
+    Sampler m_sampler;
     Integrator m_integrator;
     std::shared_ptr<Renderer> m_renderer;
 
@@ -68,6 +75,11 @@ public:
     std::string m_areaLightType;
     ParameterSet m_areaLightParameterSet;
 
+    // First primitive of the object being defined, -1 outside ObjectBegin
+    int m_objectPrimitiveBegin;
+    std::string m_currentObject;
+    std::map<std::string, int> m_namedObjects;
+
     int m_currentMaterial;
     std::map<std::string, int> m_namedMaterials;
     int m_currentMedium;
@@ -79,6 +91,11 @@ public:
 
 static std::unique_ptr<Options> options(new Options);
 
+void apiInit()
+{
+    options.reset(new Options);
+}
+
 void apiAttributeBegin()
 {
     options->m_transformStack.push_back(options->m_currentTransform);
@@ -109,11 +126,42 @@ apiWorldEnd()
 
     options->MakeFilm();
     options->MakeCamera();
+    options->MakeSampler();
     options->MakeIntegrator();    
+    options->MakeAccelerator();
     options->MakeRenderer();
     return options->m_renderer;
 }
 
+void apiObjectBegin(const std::string& name, ParameterSet params)
+{
+    ASSERT(options->m_objectPrimitiveBegin == -1, "ObjectBegin called inside of instance definition");
+    apiAttributeBegin();
+    options->m_currentObject = name;
+    options->m_objectPrimitiveBegin = options->m_scene.m_primitives.size();
+}
+
+void apiObjectEnd()
+{
+    ASSERT(options->m_objectPrimitiveBegin != -1, "ObjectEnd called outside of instance definition");
+    InstancedObject object(options->m_objectPrimitiveBegin, options->m_scene.m_primitives.size());
+    options->m_namedObjects[options->m_currentObject] = options->m_scene.AddObject(object);
+    options->m_objectPrimitiveBegin = -1;
+    apiAttributeEnd();
+}
+
+void apiObjectInstance(const std::string& name, ParameterSet params)
+{
+    ASSERT(options->m_objectPrimitiveBegin == -1, "ObjectInstance can't be called inside instance definition");
+    ASSERT(options->m_namedObjects.count(name), "No named object " + name);
+    int objectID = options->m_namedObjects[name];
+    const InstancedObject& object = options->m_scene.m_objects[objectID];
+    if (object.m_primitiveBegin == object.m_primitiveEnd) {
+        return;
+    }
+    options->m_scene.AddInstance(Instance(objectID, options->m_currentTransform));
+}
+
 void apiTransformBegin()
 {
     options->m_transformStack.push_back(options->m_currentTransform);
@@ -135,6 +183,12 @@ void apiTransform(const Float m[16])
     options->m_currentTransform *= t;
 }
 
+void apiAccelerator(const std::string& type, ParameterSet params)
+{
+    options->m_acceleratorType = type;
+    options->m_acceleratorParameterSet = params;
+}
+
 void apiIntegrator(const std::string& type, ParameterSet params)
 {
     options->m_integratorType = type;
@@ -175,13 +229,18 @@ void apiMakeNamedMaterial(const std::string& name, ParameterSet params)
     options->MakeNamedMaterial(name, params);
 }
 
-void apiShape(const std::string& type, ParameterSet params)
-{ 
-    std::pair<int,int> shapes = options->MakeShape(type, params);
+// Primitives with the current material and area light for the new shapes
+static void AddShapePrimitives(std::pair<int, int> shapes)
+{
     int mtlID = options->m_currentMaterial;
+    // Area lights are sampled in world space, so instanced shapes can't emit
+    bool isAreaLight = options->m_hasAreaLight && options->m_objectPrimitiveBegin == -1;
+    if (options->m_hasAreaLight && !isAreaLight) {
+        printf("Warning : area lights not supported with object instancing\n");
+    }
     for (int shapeID = shapes.first; shapeID < shapes.second; shapeID++) {        
         int areaLightID = -1;
-        if (options->m_hasAreaLight) {
+        if (isAreaLight) {
             areaLightID = options->MakeLight(options->m_areaLightType, 
                 options->m_areaLightParameterSet, shapeID);
         }
@@ -192,6 +251,16 @@ void apiShape(const std::string& type, ParameterSet params)
     }
 }
 
+void apiShape(const std::string& type, ParameterSet params)
+{ 
+    AddShapePrimitives(options->MakeShape(type, params));
+}
+
+void apiTriangleMesh(TriangleMesh* mesh)
+{
+    AddShapePrimitives(options->m_scene.AddTriangles(mesh));
+}
+
 void apiAreaLightSource(const std::string& type, ParameterSet params)
 {
     options->m_hasAreaLight = true;
@@ -251,6 +320,12 @@ std::pair<int, int> Options::MakeShape(
     else if (type == "plymesh") {
         triangles = CreatePLYMeshShape(params, objToWorld, worldToObj);
     }
+    else if (type == "binarymesh") {
+        triangles = CreateBinaryMeshShape(params, objToWorld, worldToObj);
+    }
+    else if (type == "objmesh") {
+        return m_scene.AddTriangles(CreateOBJMeshShape(params, objToWorld, worldToObj));
+    }
     else if (type == "sphere") {
         triangles = CreateSphereShape(params, objToWorld, worldToObj);
     }
@@ -285,19 +360,89 @@ void Options::MakeFilm() {
     m_film = *CreateFilm(m_filmParameterSet);
 }
 
+void Options::MakeSampler()
+{
+    const std::string& type = m_samplerType;
+    int samplerType;
+    if (type == "random") {
+        samplerType = Sampler::Random;
+    }
+    else if (type == "stratified" || type == "pmj02bn") {
+        samplerType = Sampler::Stratified;
+    }
+    else if (type == "halton") {
+        samplerType = Sampler::Halton;
+    }
+    else if (type.empty() || type == "sobol" || type == "zsobol" || type == "paddedsobol" ||
+        type == "02sequence" || type == "lowdiscrepancy") {
+        samplerType = Sampler::Sobol;
+    }
+    else {
+        ASSERT(0, "Can't support sampler " + type);
+    }
+    m_sampler = *CreateSampler(m_samplerParameterSet, samplerType);
+}
+
 void Options::MakeIntegrator()
 {
     m_integrator = *CreateIntegrator(m_integratorParameterSet);    
-    int nSample = m_samplerParameterSet.GetInt("pixelsamples");
-    m_integrator.m_nSample = nSample;
+    m_integrator.m_nSample = m_sampler.m_sampleNum;
+
+    std::string lightSampler = m_integratorParameterSet.GetString("lightsampler", "bvh");
+    if (lightSampler == "uniform") {
+        m_scene.m_lightSampler = Scene::Uniform;
+    }
+    else if (lightSampler == "power") {
+        m_scene.m_lightSampler = Scene::Power;
+    }
+    else if (lightSampler == "bvh") {
+        m_scene.m_lightSampler = Scene::BVH;
+    }
+    else {
+        ASSERT(0, "Can't support light sampler " + lightSampler);
+    }
+}
+
+void Options::MakeAccelerator()
+{
+    const ParameterSet& params = m_acceleratorParameterSet;
+    ASSERT(m_acceleratorType.empty() || m_acceleratorType == "bvh",
+        "Can't support accelerator " + m_acceleratorType);
+
+    std::string splitMethod = params.GetString("splitmethod", "sah");
+    if (splitMethod == "sah") {
+        m_scene.m_splitMethod = BVHAccelerator::SAH;
+    }
+    else if (splitMethod == "middle") {
+        m_scene.m_splitMethod = BVHAccelerator::Middle;
+    }
+    else if (splitMethod == "equal") {
+        m_scene.m_splitMethod = BVHAccelerator::EqualCounts;
+    }
+    else if (splitMethod == "lbvh") {
+        m_scene.m_splitMethod = BVHAccelerator::LBVH;
+    }
+    else if (splitMethod == "hlbvh") {
+        m_scene.m_splitMethod = BVHAccelerator::HLBVH;
+    }
+    else {
+        ASSERT(0, "Can't support BVH split method " + splitMethod);
+    }
+    m_scene.m_maxPrimsInNode = params.GetInt("maxnodeprims", 255);
+
+    int width = params.GetInt("width", WideBVHAccelerator::DefaultWidth());
+    ASSERT(width == 2 || width == 4 || width == 8, "BVH width must be 2, 4 or 8");
+    m_scene.m_bvhWidth = width;
+    m_scene.m_precomputeTriangles = params.GetBool("precompute", true);
 }
 
 void Options::MakeRenderer()
 {    
     m_renderer = std::make_shared<Renderer>();
-    m_renderer->m_scene = m_scene;
+    m_renderer->m_scene = std::move(m_scene);
     m_renderer->m_camera = m_camera;
     m_renderer->m_integrator = m_integrator;    
+    m_renderer->m_sampler = m_sampler;
 }
 
 
@@ -6,15 +6,22 @@
 #include "renderer/core/parameterset.h"
 #include "renderer/core/renderer.h"
 
+// Starts a new scene description, state left by an earlier one is dropped
+void apiInit();
 void apiAttributeBegin();
 void apiAttributeEnd();
 void apiWorldBegin();
 std::shared_ptr<Renderer> apiWorldEnd();
 
+void apiObjectBegin(const std::string& name, ParameterSet params);
+void apiObjectEnd();
+void apiObjectInstance(const std::string& name, ParameterSet params);
+
 void apiTransformBegin();
 void apiTransformEnd();
 void apiTransform(const Float m[16]);
 
+void apiAccelerator(const std::string& type, ParameterSet params);
 void apiIntegrator(const std::string& type, ParameterSet params);
 void apiSampler(const std::string& type, ParameterSet params);
 void apiFilter(const std::string& type, ParameterSet params);
@@ -23,6 +30,8 @@ void apiCamera(const std::string& type, ParameterSet params);
 void apiNamedMaterial(const std::string& name, ParameterSet params);
 void apiMakeNamedMaterial(const std::string& name, ParameterSet params);
 void apiShape(const std::string& type, ParameterSet params);
+// Adds a mesh a loader built itself, in world space, like apiShape would
+void apiTriangleMesh(TriangleMesh* mesh);
 void apiAreaLightSource(const std::string& type, ParameterSet params);
 
 
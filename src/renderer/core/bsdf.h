@@ -13,7 +13,7 @@ public:
     LambertReflectBSDF(
         const Spectrum& r);
 
-    Spectrum Sample(const Vector3f& wo, Vector3f* wi, Float* pdf, unsigned int& seed) const;
+    Spectrum Sample(const Vector3f& wo, Vector3f* wi, Float* pdf, const Point2f& u) const;
     Spectrum F(const Vector3f& wo, const Vector3f& wi) const;
     Spectrum F(const Vector3f& wo, const Vector3f& wi, Float* pdf) const;
 
@@ -39,7 +39,7 @@ public:
         const Float& etaI,
         const Float& etaT);
 
-    Spectrum Sample(const Vector3f& wo, Vector3f* wi, Float* pdf, unsigned int& seed) const;
+    Spectrum Sample(const Vector3f& wo, Vector3f* wi, Float* pdf, const Point2f& u) const;
     Spectrum F(const Vector3f& wo, const Vector3f& wi) const;
     Spectrum F(const Vector3f& wo, const Vector3f& wi, Float* pdf) const;
 
@@ -60,7 +60,7 @@ public:
         const Float& etaA,
         const Float& etaB);
 
-    Spectrum Sample(const Vector3f& wo, Vector3f* wi, Float* pdf, unsigned int& seed) const;
+    Spectrum Sample(const Vector3f& wo, Vector3f* wi, Float* pdf, const Point2f& u) const;
     Spectrum F(const Vector3f& wo, const Vector3f& wi) const;
     Spectrum F(const Vector3f& wo, const Vector3f& wi, Float* pdf) const;
 
@@ -79,7 +79,7 @@ public:
         const Float& etaA,
         const Float& etaB);
 
-    Spectrum Sample(const Vector3f& wo, Vector3f* wi, Float* pdf, unsigned int& seed) const;
+    Spectrum Sample(const Vector3f& wo, Vector3f* wi, Float* pdf, const Point2f& u) const;
     Spectrum F(const Vector3f& wo, const Vector3f& wi) const;
     Spectrum F(const Vector3f& wo, const Vector3f& wi, Float* pdf) const;
 
@@ -112,7 +112,7 @@ public:
         const Float& uroughness,
         const Float& vroughness);
 
-    Spectrum Sample(const Vector3f& wo, Vector3f* wi, Float* pdf, unsigned int& seed) const;
+    Spectrum Sample(const Vector3f& wo, Vector3f* wi, Float* pdf, const Point2f& u) const;
     Spectrum F(const Vector3f& wo, const Vector3f& wi) const;
     Spectrum F(const Vector3f& wo, const Vector3f& wi, Float* pdf) const;
 
@@ -139,7 +139,7 @@ public:
         const Float& uroughness,
         const Float& vroughness);
 
-    Spectrum Sample(const Vector3f& wo, Vector3f* wi, Float* pdf, unsigned int& seed) const;
+    Spectrum Sample(const Vector3f& wo, Vector3f* wi, Float* pdf, const Point2f& u) const;
     Spectrum F(const Vector3f& wo, const Vector3f& wi) const;
     Spectrum F(const Vector3f& wo, const Vector3f& wi, Float* pdf) const;
     Float Pdf(const Vector3f& wo, const Vector3f& wi) const;
@@ -164,9 +164,9 @@ Spectrum LambertReflectBSDF::Sample(
     const Vector3f& wo, 
     Vector3f* wi, 
     Float* pdf, 
-    unsigned int& seed) const
+    const Point2f& u) const
 {
-    *wi = CosineSampleHemisphere(seed);
+    *wi = CosineSampleHemisphere(u);
     if (wo.z < 0) wi->z *= -1;
     *pdf = CosineSampleHemispherePdf(AbsCosTheta(*wi));
     return m_r * InvPi * AbsCosTheta(*wi);
@@ -216,7 +216,7 @@ Spectrum SpecularReflectBSDF::Sample(
     const Vector3f& wo, 
     Vector3f* wi, 
     Float* pdf, 
-    unsigned int& seed) const
+    const Point2f& u) const
 {
     *wi = Vector3f(-wo.x, -wo.y, wo.z);
     *pdf = 1;
@@ -262,7 +262,7 @@ Spectrum SpecularTransmission::Sample(
     const Vector3f& wo, 
     Vector3f* wi, 
     Float* pdf, 
-    unsigned int& seed) const
+    const Point2f& u) const
 {
     // Figure out which $\eta$ is incident and which is transmitted
     bool entering = CosTheta(wo) > 0;
@@ -313,11 +313,10 @@ Spectrum FresnelSpecular::Sample(
     const Vector3f& wo, 
     Vector3f* wi, 
     Float* pdf, 
-    unsigned int& seed) const
+    const Point2f& u) const
 {
     Float F = FrDielectric(CosTheta(wo), m_etaA, m_etaB);
-    Float u = NextRandom(seed);
-    if (u < F) {
+    if (u.x < F) {
         // Compute specular reflection for _FresnelSpecular_
 
         // Compute perfect specular reflection direction
@@ -398,11 +397,12 @@ Spectrum GGXSmithReflectBSDF::Sample(
     const Vector3f& wo, 
     Vector3f* wi, 
     Float* pdf, 
-    unsigned int& seed) const
+    const Point2f& u) const
 {
     // Sample microfacet orientation $\wh$ and reflected direction $\wi$    
+    *pdf = 0;
     if (wo.z == 0) return Spectrum(0.f);    
-    Vector3f wh = m_distribution.Sample_wh(wo, seed);
+    Vector3f wh = m_distribution.Sample_wh(wo, u);
     *wi = Reflect(wo, wh);
     if (!SameHemisphere(wo, *wi)) return Spectrum(0.f);
 
@@ -473,10 +473,11 @@ Spectrum GGXSmithTransmission::Sample(
     const Vector3f& wo,
     Vector3f* wi, 
     Float* pdf, 
-    unsigned int& seed) const
+    const Point2f& u) const
 {
+    *pdf = 0;
     if (wo.z == 0) return 0.;
-    Vector3f wh = m_distribution.Sample_wh(wo, seed);
+    Vector3f wh = m_distribution.Sample_wh(wo, u);
     Float eta;
     if (CosTheta(wo) > 0) {
         eta = (m_etaA / m_etaB);
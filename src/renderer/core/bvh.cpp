@@ -1,8 +1,16 @@
 #include "bvh.h"
 
+#include "renderer/core/bvhcache.h"
 #include "renderer/core/triangle.h"
 #include "renderer/core/interaction.h"
 #include "renderer/core/memory.h"
+#include "renderer/core/parallel.h"
+
+#include <cstring>
+#include <limits>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 struct BVHPrimitiveInfo {
     BVHPrimitiveInfo() {}
@@ -43,49 +51,84 @@ struct BucketInfo {
     Bounds3f bounds;
 };
 
-struct LinearBVHNode {
-    Bounds3f bounds;
-    union {
-        int primitivesOffset; // Leaf      the offset in m_primitives array
-        int rightChildOffset; // Interior  the offset in node array
-    };
-    uint16_t nPrimitives;     // the number of m_primitives in this node
-    uint8_t axis;             // SplitAxis   
-    uint8_t pad;              // Ensure 32 byte size
-};
 
 
+// Subtrees with fewer primitives are built serially by the current task
+static constexpr int parallelBuildThreshold = 4096;
+// Nodes with more primitives bin their primitives in parallel
+static constexpr int parallelBinningThreshold = 1 << 16;
+static constexpr int binningChunkSize = 1 << 14;
+
+// Compute bounds of the primitives in [begin, end) and of their centroids.
+// Partial results are merged in chunk order, and Union is exact, so the
+// result does not depend on the number of threads.
+static void ComputeBounds(
+    const std::vector<BVHPrimitiveInfo>& primitiveInfo,
+    int begin,
+    int end,
+    Bounds3f* bounds,
+    Bounds3f* centroidBounds)
+{
+    int nChunks = (end - begin + binningChunkSize - 1) / binningChunkSize;
+    if (end - begin < parallelBinningThreshold)
+        nChunks = 1;
+    std::vector<Bounds3f> chunkBounds(nChunks), chunkCentroidBounds(nChunks);
+    ParallelFor([&](int chunk) {
+        int chunkBegin = begin + chunk * binningChunkSize;
+        int chunkEnd = nChunks == 1 ? end : min(chunkBegin + binningChunkSize, end);
+        for (int i = chunkBegin; i < chunkEnd; i++) {
+            chunkBounds[chunk] = Union(chunkBounds[chunk], primitiveInfo[i].bounds);
+            chunkCentroidBounds[chunk] = Union(chunkCentroidBounds[chunk], primitiveInfo[i].centroid);
+        }
+    }, nChunks);
+
+    for (int chunk = 0; chunk < nChunks; chunk++) {
+        *bounds = Union(*bounds, chunkBounds[chunk]);
+        *centroidBounds = Union(*centroidBounds, chunkCentroidBounds[chunk]);
+    }
+}
+
+// Initialize BucketInfo for SAH partition buckets
+template <int nBuckets>
+static void BinPrimitives(
+    const std::vector<BVHPrimitiveInfo>& primitiveInfo,
+    int begin,
+    int end,
+    const Bounds3f& centroidBounds,
+    int dim,
+    BucketInfo buckets[nBuckets])
+{
+    int nChunks = (end - begin + binningChunkSize - 1) / binningChunkSize;
+    if (end - begin < parallelBinningThreshold)
+        nChunks = 1;
+    std::vector<BucketInfo> chunkBuckets(nChunks * nBuckets);
+    ParallelFor([&](int chunk) {
+        BucketInfo* local = &chunkBuckets[chunk * nBuckets];
+        int chunkBegin = begin + chunk * binningChunkSize;
+        int chunkEnd = nChunks == 1 ? end : min(chunkBegin + binningChunkSize, end);
+        for (int i = chunkBegin; i < chunkEnd; i++) {
+            int b = nBuckets * centroidBounds.Offset(primitiveInfo[i].centroid)[dim];
+            if (b == nBuckets) b = nBuckets - 1;
+            local[b].count++;
+            local[b].bounds = Union(local[b].bounds, primitiveInfo[i].bounds);
+        }
+    }, nChunks);
+
+    for (int chunk = 0; chunk < nChunks; chunk++) {
+        for (int b = 0; b < nBuckets; b++) {
+            buckets[b].count += chunkBuckets[chunk * nBuckets + b].count;
+            buckets[b].bounds = Union(buckets[b].bounds, chunkBuckets[chunk * nBuckets + b].bounds);
+        }
+    }
+}
 
 BVHAccelerator::BVHAccelerator(
     std::vector<Primitive>& primitives,
     const std::vector<Triangle>& triangles,
     const SplitMethod& splitMethod,
-    int maxPrimsInNode) :
-    m_primitives(primitives),
-    m_splitMethod(splitMethod), m_maxPrimsInNode(min(maxPrimsInNode, 255)) 
+    int maxPrimsInNode)
 {
-    if (m_primitives.empty())
-        return;
-
-    //Initialize primitiveInfo array for m_primitives
-    std::vector<BVHPrimitiveInfo> primitiveInfo(m_primitives.size());
-    for (int i = 0; i < m_primitives.size(); i++)
-        primitiveInfo[i] = BVHPrimitiveInfo(i, triangles[m_primitives[i].m_shapeID].WorldBounds());
-
-    // Build BVH tree for m_primitives using primitiveInfo
-    MemoryArena arena(1 << 20);
-    unsigned int totalNodes = 0;
-    std::vector<Primitive> orderedPrims;
-    orderedPrims.resize(m_primitives.size());
-    BVHBuildNode* root;
-    root = RecursiveBuild(arena, primitiveInfo, 0, m_primitives.size(), &totalNodes, orderedPrims);
-    m_primitives.swap(orderedPrims);
-    orderedPrims.resize(0);
-
-    // Compute representation of depth-first traversal of BVH tree
-    m_nodes = AllocAligned<LinearBVHNode>(totalNodes);
-    int offset = 0;
-    FlattenBVHTree(root, &offset);
+    Build(primitives, triangles, splitMethod, maxPrimsInNode);
 }
 
 void BVHAccelerator::Build(
@@ -93,185 +136,662 @@ void BVHAccelerator::Build(
     const std::vector<Triangle>& triangles, 
     const SplitMethod& splitMethod, 
     int maxPrimsInNode)
+{
+    if (BuildFromMeshBVH(primitives, triangles, splitMethod, maxPrimsInNode)) {
+        return;
+    }
+    std::vector<Bounds3f> primitiveBounds(primitives.size());
+    ParallelFor([&](int i) {
+        primitiveBounds[i] = triangles[primitives[i].m_shapeID].WorldBounds();
+    }, primitives.size(), binningChunkSize);
+    if (m_cacheDirectory.empty() || primitives.empty()) {
+        Build(primitives, primitiveBounds, splitMethod, maxPrimsInNode);
+        return;
+    }
+
+    BVHCacheKey key = HashBVHInput(primitiveBounds, splitMethod, maxPrimsInNode);
+    if (!LoadCachedBVH(m_cacheDirectory, key, primitives, splitMethod, maxPrimsInNode, this)) {
+        Build(primitives, primitiveBounds, splitMethod, maxPrimsInNode);
+        SaveCachedBVH(m_cacheDirectory, key, primitives, *this);
+    }
+}
+
+void BVHAccelerator::Build(
+    const std::vector<Primitive>& primitives,
+    const std::vector<Bounds3f>& primitiveBounds,
+    const SplitMethod& splitMethod,
+    int maxPrimsInNode)
 {
     m_primitives = primitives;
     m_splitMethod = splitMethod;
     m_maxPrimsInNode = min(maxPrimsInNode, 255);
+    FreeAligned(m_nodes);
+    m_nodes = nullptr;
+    m_totalNodes = 0;
+    m_triangleRecords.clear();
 
     if (m_primitives.empty())
         return;
 
     //Initialize primitiveInfo array for m_primitives
     std::vector<BVHPrimitiveInfo> primitiveInfo(m_primitives.size());
-    for (int i = 0; i < m_primitives.size(); i++)
-        primitiveInfo[i] = BVHPrimitiveInfo(i, triangles[m_primitives[i].m_shapeID].WorldBounds());
+    ParallelFor([&](int i) {
+        primitiveInfo[i] = BVHPrimitiveInfo(i, primitiveBounds[i]);
+    }, m_primitives.size(), binningChunkSize);
 
-    // Build BVH tree for m_primitives using primitiveInfo
-    MemoryArena arena(1 << 20);
+    // Build BVH tree for m_primitives using primitiveInfo,
+    // each thread allocates build nodes from its own arena
+    std::vector<MemoryArena> arenas(MaxThreadIndex());
     unsigned int totalNodes = 0;
-    std::vector<Primitive> orderedPrims;
-    orderedPrims.resize(m_primitives.size());
+    std::vector<Primitive> orderedPrims(m_primitives.size());
     BVHBuildNode* root;
-    root = RecursiveBuild(arena, primitiveInfo, 0, m_primitives.size(), &totalNodes, orderedPrims);
+    if (m_splitMethod == SplitMethod::LBVH || m_splitMethod == SplitMethod::HLBVH) {
+        root = HLBVHBuild(arenas, primitiveInfo, &totalNodes, orderedPrims);
+    }
+    else {
+        root = RecursiveBuild(arenas, primitiveInfo, 0, m_primitives.size(), &totalNodes, orderedPrims);
+    }
     m_primitives.swap(orderedPrims);
-    orderedPrims.resize(0);
 
     // Compute representation of depth-first traversal of BVH tree
+    m_totalNodes = totalNodes;
     m_nodes = AllocAligned<LinearBVHNode>(totalNodes);
     int offset = 0;
     FlattenBVHTree(root, &offset);
+
+    // Morton trees are only as shallow as the codes tell primitives apart,
+    // one that doesn't fit the traversal stacks is built with SAH instead
+    int depth = BVHDepth(m_nodes, m_totalNodes);
+    if (depth > maxBVHDepth && (splitMethod == SplitMethod::LBVH || splitMethod == SplitMethod::HLBVH)) {
+        printf("Warning : The BVH is %d levels deep, building it with SAH\n", depth);
+        Build(primitives, primitiveBounds, SplitMethod::SAH, maxPrimsInNode);
+        m_splitMethod = splitMethod;
+        return;
+    }
+    ASSERT(depth <= maxBVHDepth, "The BVH is too deep to traverse");
+}
+
+bool BVHAccelerator::BuildFromMeshBVH(
+    const std::vector<Primitive>& primitives,
+    const std::vector<Triangle>& triangles,
+    const SplitMethod& splitMethod,
+    int maxPrimsInNode)
+{
+    // Only when the primitives are all triangles of one mesh, in mesh order
+    if (primitives.empty()) {
+        return false;
+    }
+    const TriangleMesh* mesh = triangles[primitives[0].m_shapeID].m_triangleMeshPtr;
+    const MeshBVH* meshBvh = mesh->m_bvh;
+    if (!meshBvh || meshBvh->splitMethod != splitMethod ||
+        meshBvh->maxPrimsInNode != min(maxPrimsInNode, 255) || primitives.size() != mesh->m_triangleNum) {
+        return false;
+    }
+    for (int i = 0; i < primitives.size(); i++) {
+        const Triangle& triangle = triangles[primitives[i].m_shapeID];
+        if (triangle.m_triangleMeshPtr != mesh || triangle.m_index != i) {
+            return false;
+        }
+    }
+
+    BuildFromNodes(primitives, splitMethod, maxPrimsInNode, meshBvh->nodes, meshBvh->totalNodes, meshBvh->order);
+    return true;
+}
+
+void BVHAccelerator::BuildFromNodes(
+    const std::vector<Primitive>& primitives,
+    const SplitMethod& splitMethod,
+    int maxPrimsInNode,
+    const LinearBVHNode* nodes,
+    int totalNodes,
+    const int* order)
+{
+    m_splitMethod = splitMethod;
+    m_maxPrimsInNode = min(maxPrimsInNode, 255);
+    m_triangleRecords.clear();
+    m_primitives.resize(primitives.size());
+    for (int i = 0; i < primitives.size(); i++) {
+        m_primitives[i] = primitives[order[i]];
+    }
+    FreeAligned(m_nodes);
+    m_totalNodes = totalNodes;
+    m_nodes = AllocAligned<LinearBVHNode>(m_totalNodes);
+    memcpy(m_nodes, nodes, m_totalNodes * sizeof(LinearBVHNode));
+}
+
+int BVHDepth(const LinearBVHNode* nodes, int totalNodes)
+{
+    // Both children come after their parent, so one pass sees every parent first
+    std::vector<int> depth(totalNodes, 0);
+    int maxDepth = 0;
+    for (int i = 0; i < totalNodes; i++) {
+        maxDepth = max(maxDepth, depth[i]);
+        if (nodes[i].nPrimitives == 0) {
+            depth[i + 1] = depth[nodes[i].rightChildOffset] = depth[i] + 1;
+        }
+    }
+    return maxDepth;
+}
+
+bool ValidBVHNodes(
+    const LinearBVHNode* nodes,
+    int totalNodes,
+    const int* order,
+    int nPrimitives)
+{
+    for (int i = 0; i < totalNodes; i++) {
+        const LinearBVHNode& node = nodes[i];
+        bool valid = node.nPrimitives > 0 ?
+            node.primitivesOffset >= 0 && node.primitivesOffset + node.nPrimitives <= nPrimitives :
+            node.rightChildOffset > i + 1 && node.rightChildOffset < totalNodes;
+        if (!valid) {
+            return false;
+        }
+    }
+    for (int i = 0; i < nPrimitives; i++) {
+        if (order[i] < 0 || order[i] >= nPrimitives) {
+            return false;
+        }
+    }
+    return BVHDepth(nodes, totalNodes) <= maxBVHDepth;
 }
 
 BVHBuildNode* BVHAccelerator::RecursiveBuild(
-    MemoryArena& arena,
+    std::vector<MemoryArena>& arenas,
     std::vector<BVHPrimitiveInfo>& primitiveInfo,
     unsigned int begin,
     unsigned int end,
     unsigned int* totalNodes,
     std::vector<Primitive>& orderedPrims)
 {
-    BVHBuildNode* node = arena.Alloc<BVHBuildNode>();
+    BVHBuildNode* node = arenas[ThreadIndex()].Alloc<BVHBuildNode>();
     (*totalNodes)++;
 
-    // Compute bounds of all m_primitives in this BVH node
-    Bounds3f bounds;
-    for (int i = begin; i < end; i++)
-        bounds = Union(bounds, primitiveInfo[i].bounds);
+    // Primitives of a leaf keep the range [begin, end) in orderedPrims,
+    // so the layout does not depend on which task creates the leaf
+    auto createLeaf = [&](const Bounds3f& bounds) {
+        for (int i = begin; i < end; i++) {
+            int idx = primitiveInfo[i].idx;
+            orderedPrims[i] = m_primitives[idx];
+        }
+        node->InitLeaf(bounds, begin, end - begin);
+        return node;
+    };
+
+    // Compute bounds of all m_primitives in this BVH node and of their centroids
+    Bounds3f bounds, centroidBounds;
+    ComputeBounds(primitiveInfo, begin, end, &bounds, &centroidBounds);
 
     int nPrimitives = end - begin;
     if (nPrimitives == 1) {
         // Create leaf node
-        int firstPrimOffset = (int)orderedPrims.size();
-        for (int i = begin; i < end; i++) {
-            int idx = primitiveInfo[i].idx;
-            orderedPrims.push_back(m_primitives[idx]);
-        }
-        node->InitLeaf(bounds, firstPrimOffset, nPrimitives);
+        return createLeaf(bounds);
     }
-    else {
-        // Compute bound of primitive centroid, choose split dimension
-        Bounds3f centroidBounds;
-        for (int i = begin; i < end; i++)
-            centroidBounds = Union(centroidBounds, primitiveInfo[i].centroid);
-        int dim = centroidBounds.MaximumExtent();
-
-        // Partition m_primitives into two sets and build children
-        int mid = (begin + end) >> 1;
-        if (centroidBounds.pMin[dim] == centroidBounds.pMax[dim]) {
-            // Create leaf node
-            int firstPrimOffset = (int)orderedPrims.size();
-            for (int i = begin; i < end; i++) {
-                int idx = primitiveInfo[i].idx;
-                orderedPrims.push_back(m_primitives[idx]);
-            }
-            node->InitLeaf(bounds, firstPrimOffset, nPrimitives);
+
+    // Choose split dimension
+    int dim = centroidBounds.MaximumExtent();
+
+    // Partition m_primitives into two sets and build children
+    int mid = (begin + end) >> 1;
+    if (centroidBounds.pMin[dim] == centroidBounds.pMax[dim]) {
+        // Create leaf node
+        return createLeaf(bounds);
+    }
+
+    // Partition m_primitives based on m_splitMethod
+    switch (m_splitMethod) {
+    case SplitMethod::Middle: {
+        // Partition m_primitives through node's midpoint
+        Float pMid = (centroidBounds.pMin[dim] + centroidBounds.pMax[dim]) * 0.5;
+        BVHPrimitiveInfo* midPtr = std::partition(&primitiveInfo[begin], &primitiveInfo[end - 1] + 1,
+            [dim, pMid](BVHPrimitiveInfo& prim) {
+                return prim.centroid[dim] < pMid;
+            });
+        mid = midPtr - &primitiveInfo[0];
+        if (mid != begin && mid != end)
+            break;
+    }
+    case SplitMethod::EqualCounts: {
+        // Partition m_primitives into equally-sized subsets
+        mid = (begin + end) >> 1;
+        std::nth_element(&primitiveInfo[begin], &primitiveInfo[mid], &primitiveInfo[end - 1] + 1,
+            [dim](BVHPrimitiveInfo& prim1, BVHPrimitiveInfo& prim2) {
+                return prim1.centroid[dim] < prim2.centroid[dim];
+            });
+        break;
+    }
+    case SplitMethod::SAH:
+    default: {
+        // Partition m_primitives using approximate SAH
+        if (nPrimitives <= 4) {
+            // Partition m_primitives into equally-sized subsets
+            mid = (begin + end) >> 1;
+            std::nth_element(&primitiveInfo[begin], &primitiveInfo[mid], &primitiveInfo[end - 1] + 1,
+                [dim](BVHPrimitiveInfo& prim1, BVHPrimitiveInfo& prim2) {
+                    return prim1.centroid[dim] < prim2.centroid[dim];
+                });
         }
         else {
-            // Partition m_primitives based on m_splitMethod
-            switch (m_splitMethod) {
-            case SplitMethod::Middle: {
-                // Partition m_primitives through node's midpoint
-                Float pMid = (centroidBounds.pMin[dim] + centroidBounds.pMax[dim]) * 0.5;
+            // Allocate BucketInfo for SAH partition buckets
+            constexpr int nBuckets = 12;
+            BucketInfo buckets[nBuckets];
+            BinPrimitives<nBuckets>(primitiveInfo, begin, end, centroidBounds, dim, buckets);
+
+            // Compute costs for splitting after each bucket
+            // cost = 1 + (countPre * boundsPre.Area + countSuf * boundsSuf.Area) / bounds.Area
+            Float costPre[nBuckets], costSuf[nBuckets];
+            Bounds3f  boundsPre;
+            int countPre = 0;
+            for (size_t i = 0; i < nBuckets; i++) {
+                boundsPre = Union(boundsPre, buckets[i].bounds);
+                countPre += buckets[i].count;
+                costPre[i] = countPre * boundsPre.Area();
+            }
+            Bounds3f boundsSuf;
+            int countSuf = 0;
+            for (int i = nBuckets - 1; i >= 0; i--) {
+                boundsSuf = Union(boundsSuf, buckets[i].bounds);
+                countSuf += buckets[i].count;
+                costSuf[i] = countSuf * boundsSuf.Area();
+            }
+
+            // Find bucket to split at that minimizes SAH metric
+            Float minCost = costPre[0] + costSuf[1];
+            int minCostSplitBucket = 0; // Split after minCostSplitBucket                     
+            for (int i = 1; i < nBuckets - 1; i++) {
+                if (costPre[i] + costSuf[i + 1] < minCost) {
+                    minCost = costPre[i] + costSuf[i + 1];
+                    minCostSplitBucket = i;
+                }
+            }
+            minCost = minCost / bounds.Area() + 1;
+
+            // Either create leaf or split m_primitives at selected SAH bucket
+            Float leafCost = nPrimitives;
+            if (nPrimitives > m_maxPrimsInNode || minCost < leafCost) {
                 BVHPrimitiveInfo* midPtr = std::partition(&primitiveInfo[begin], &primitiveInfo[end - 1] + 1,
-                    [dim, pMid](BVHPrimitiveInfo& prim) {
-                        return prim.centroid[dim] < pMid;
+                    [=](BVHPrimitiveInfo& prim) {
+                        int b = nBuckets * centroidBounds.Offset(prim.centroid)[dim];
+                        if (b == nBuckets) b = nBuckets - 1;
+                        return b <= minCostSplitBucket;
                     });
                 mid = midPtr - &primitiveInfo[0];
-                if (mid != begin && mid != end)
-                    break;
             }
-            case SplitMethod::EqualCounts: {
-                // Partition m_primitives into equally-sized subsets
-                mid = (begin + end) >> 1;
-                std::nth_element(&primitiveInfo[begin], &primitiveInfo[mid], &primitiveInfo[end - 1] + 1,
-                    [dim](BVHPrimitiveInfo& prim1, BVHPrimitiveInfo& prim2) {
-                        return prim1.centroid[dim] < prim2.centroid[dim];
-                    });
-                break;
+            else {
+                // Create leaf node
+                return createLeaf(bounds);
             }
-            case SplitMethod::SAH:
-            default: {
-                // Partition m_primitives using approximate SAH
-                if (nPrimitives <= 4) {
-                    // Partition m_primitives into equally-sized subsets
-                    mid = (begin + end) >> 1;
-                    std::nth_element(&primitiveInfo[begin], &primitiveInfo[mid], &primitiveInfo[end - 1] + 1,
-                        [dim](BVHPrimitiveInfo& prim1, BVHPrimitiveInfo& prim2) {
-                            return prim1.centroid[dim] < prim2.centroid[dim];
-                        });
-                }
-                else {
-                    // Allocate BucketInfo for SAH partition buckets
-                    constexpr int nBuckets = 12;
-                    BucketInfo buckets[nBuckets];
+        }
+    }
+    }
 
-                    // Initialize BucketInfo for SAH partition buckets
-                    for (size_t i = begin; i < end; i++) {
-                        int b = nBuckets * centroidBounds.Offset(primitiveInfo[i].centroid)[dim];
-                        if (b == nBuckets) b = nBuckets - 1;
-                        buckets[b].count++;
-                        buckets[b].bounds = Union(buckets[b].bounds, primitiveInfo[i].bounds);
-                    }
+    // Build the children, large subtrees are built as parallel tasks.
+    // Node counts are summed after both children finish.
+    BVHBuildNode* children[2];
+    unsigned int childNodes[2] = { 0, 0 };
+    if (nPrimitives > parallelBuildThreshold) {
+        TaskGroup group;
+        group.Run([&]() {
+            children[0] = RecursiveBuild(arenas, primitiveInfo, begin, mid, &childNodes[0], orderedPrims);
+        });
+        children[1] = RecursiveBuild(arenas, primitiveInfo, mid, end, &childNodes[1], orderedPrims);
+        group.Wait();
+    }
+    else {
+        children[0] = RecursiveBuild(arenas, primitiveInfo, begin, mid, &childNodes[0], orderedPrims);
+        children[1] = RecursiveBuild(arenas, primitiveInfo, mid, end, &childNodes[1], orderedPrims);
+    }
+    *totalNodes += childNodes[0] + childNodes[1];
+    node->InitInterior(bounds, children[0], children[1], dim);
+    return node;
+}
 
-                    // Compute costs for splitting after each bucket
-                    // cost = 1 + (countPre * boundsPre.Area + countSuf * boundsSuf.Area) / bounds.Area
-                    Float costPre[nBuckets], costSuf[nBuckets];
-                    Bounds3f  boundsPre;
-                    int countPre = 0;
-                    for (size_t i = 0; i < nBuckets; i++) {
-                        boundsPre = Union(boundsPre, buckets[i].bounds);
-                        countPre += buckets[i].count;
-                        costPre[i] = countPre * boundsPre.Area();
-                    }
-                    Bounds3f boundsSuf;
-                    int countSuf = 0;
-                    for (int i = nBuckets - 1; i >= 0; i--) {
-                        boundsSuf = Union(boundsSuf, buckets[i].bounds);
-                        countSuf += buckets[i].count;
-                        costSuf[i] = countSuf * boundsSuf.Area();
-                    }
+struct MortonPrimitive {
+    int primitiveIndex;     // the index in primitiveInfo array
+    uint64_t mortonCode;
+};
 
-                    // Find bucket to split at that minimizes SAH metric
-                    Float minCost = costPre[0] + costSuf[1];
-                    int minCostSplitBucket = 0; // Split after minCostSplitBucket                     
-                    for (int i = 1; i < nBuckets - 1; i++) {
-                        if (costPre[i] + costSuf[i + 1] < minCost) {
-                            minCost = costPre[i] + costSuf[i + 1];
-                            minCostSplitBucket = i;
-                        }
-                    }
-                    minCost = minCost * bounds.Area() + 1;
-
-                    // Either create leaf or split m_primitives at selected SAH bucket
-                    Float leafCost = nPrimitives;
-                    if (nPrimitives > m_maxPrimsInNode || minCost < leafCost) {
-                        BVHPrimitiveInfo* midPtr = std::partition(&primitiveInfo[begin], &primitiveInfo[end - 1] + 1,
-                            [=](BVHPrimitiveInfo& prim) {
-                                int b = nBuckets * centroidBounds.Offset(prim.centroid)[dim];
-                                if (b == nBuckets) b = nBuckets - 1;
-                                return b <= minCostSplitBucket;
-                            });
-                        mid = midPtr - &primitiveInfo[0];
-                    }
-                    else {
-                        // Create leaf node
-                        int firstPrimOffset = (int)orderedPrims.size();
-                        for (int i = begin; i < end; i++) {
-                            int idx = primitiveInfo[i].idx;
-                            orderedPrims.push_back(m_primitives[idx]);
-                        }
-                        node->InitLeaf(bounds, firstPrimOffset, nPrimitives);
-                    }
+// Spread the low 21 bits of x so that there are two zero bits between each
+inline uint64_t LeftShift3(uint64_t x)
+{
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffff;
+    x = (x | x << 16) & 0x1f0000ff0000ff;
+    x = (x | x << 8) & 0x100f00f00f00f00f;
+    x = (x | x << 4) & 0x10c30c30c30c30c3;
+    x = (x | x << 2) & 0x1249249249249249;
+    return x;
+}
 
-                }
+inline uint64_t EncodeMorton3(uint64_t x, uint64_t y, uint64_t z)
+{
+    return (LeftShift3(z) << 2) | (LeftShift3(y) << 1) | LeftShift3(x);
+}
+
+inline int CountLeadingZeros(uint64_t x)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    return _BitScanReverse64(&index, x) ? 63 - int(index) : 64;
+#else
+    return x == 0 ? 64 : __builtin_clzll(x);
+#endif
+}
+
+// Stable LSD radix sort of the Morton codes. Each pass counts digits per
+// chunk in parallel and scatters bucket-major, chunk-minor, so the result
+// is the same for any number of chunks.
+static void RadixSort(std::vector<MortonPrimitive>* v, int nBits)
+{
+    constexpr int bitsPerPass = 8;
+    constexpr int nBuckets = 1 << bitsPerPass;
+    int nPasses = (nBits + bitsPerPass - 1) / bitsPerPass;
+    int n = v->size();
+    int nChunks = max(1, min(4 * MaxThreadIndex(), (n + binningChunkSize - 1) / binningChunkSize));
+    int chunkSize = (n + nChunks - 1) / nChunks;
+
+    std::vector<MortonPrimitive> tempVector(n);
+    std::vector<int> offsets(nChunks * nBuckets);
+    for (int pass = 0; pass < nPasses; pass++) {
+        int lowBit = pass * bitsPerPass;
+        std::vector<MortonPrimitive>& in = (pass & 1) ? tempVector : *v;
+        std::vector<MortonPrimitive>& out = (pass & 1) ? *v : tempVector;
+
+        // Count the digits of each chunk
+        std::fill(offsets.begin(), offsets.end(), 0);
+        ParallelFor([&](int chunk) {
+            int* count = &offsets[chunk * nBuckets];
+            int end = min((chunk + 1) * chunkSize, n);
+            for (int i = chunk * chunkSize; i < end; i++) {
+                count[(in[i].mortonCode >> lowBit) & (nBuckets - 1)]++;
             }
+        }, nChunks);
+
+        // Turn counts into the first output slot of each chunk and bucket
+        int offset = 0;
+        for (int b = 0; b < nBuckets; b++) {
+            for (int chunk = 0; chunk < nChunks; chunk++) {
+                int count = offsets[chunk * nBuckets + b];
+                offsets[chunk * nBuckets + b] = offset;
+                offset += count;
+            }
+        }
+
+        ParallelFor([&](int chunk) {
+            int* offset = &offsets[chunk * nBuckets];
+            int end = min((chunk + 1) * chunkSize, n);
+            for (int i = chunk * chunkSize; i < end; i++) {
+                out[offset[(in[i].mortonCode >> lowBit) & (nBuckets - 1)]++] = in[i];
+            }
+        }, nChunks);
+    }
+    if (nPasses & 1)
+        v->swap(tempVector);
+}
+
+/**
+ * \brief Binary radix tree over a run of sorted Morton codes
+ *
+ * Internal node i covers the leaves [first[i], last[i]]. Children are
+ * internal node indices, or ~leaf for leaves. Following Karras 2012 every
+ * internal node is found independently, so they are emitted in parallel.
+ */
+struct RadixTree {
+    std::vector<int> children[2];
+    std::vector<int> first, last;
+};
+
+static void EmitRadixTree(
+    const MortonPrimitive* mortonPrims,
+    int n,
+    RadixTree* tree)
+{
+    tree->children[0].resize(n - 1);
+    tree->children[1].resize(n - 1);
+    tree->first.resize(n - 1);
+    tree->last.resize(n - 1);
+
+    // Length of the common prefix of two keys, equal codes fall back to
+    // their indices so that duplicates still form a valid tree
+    auto delta = [&](int i, int j) {
+        if (j < 0 || j >= n) return -1;
+        uint64_t a = mortonPrims[i].mortonCode, b = mortonPrims[j].mortonCode;
+        if (a == b) return 64 + CountLeadingZeros(uint64_t(i ^ j));
+        return CountLeadingZeros(a ^ b);
+    };
+
+    ParallelFor([&](int i) {
+        // Direction of the range covered by node i
+        int d = delta(i, i + 1) - delta(i, i - 1) > 0 ? 1 : -1;
+
+        // Upper bound and then exact length of the range
+        int deltaMin = delta(i, i - d);
+        int lMax = 2;
+        while (delta(i, i + lMax * d) > deltaMin) lMax *= 2;
+        int l = 0;
+        for (int t = lMax / 2; t >= 1; t /= 2) {
+            if (delta(i, i + (l + t) * d) > deltaMin) l += t;
+        }
+        int j = i + l * d;
+
+        // Split position, the last key sharing the node's longest prefix
+        int deltaNode = delta(i, j);
+        int s = 0;
+        for (int t = (l + 1) / 2; ; t = (t + 1) / 2) {
+            if (delta(i, i + (s + t) * d) > deltaNode) s += t;
+            if (t == 1) break;
+        }
+        int gamma = i + s * d + min(d, 0);
+
+        tree->first[i] = min(i, j);
+        tree->last[i] = max(i, j);
+        tree->children[0][i] = min(i, j) == gamma ? ~gamma : gamma;
+        tree->children[1][i] = max(i, j) == gamma + 1 ? ~(gamma + 1) : gamma + 1;
+    }, n - 1, 1024);
+}
+
+BVHBuildNode* BVHAccelerator::EmitRadixTreeNodes(
+    std::vector<MemoryArena>& arenas,
+    const std::vector<BVHPrimitiveInfo>& primitiveInfo,
+    const MortonPrimitive* mortonPrims,
+    int primOffset,
+    const RadixTree& tree,
+    int child,
+    unsigned int* totalNodes,
+    Float* cost,
+    std::vector<Primitive>& orderedPrims)
+{
+    BVHBuildNode* node = arenas[ThreadIndex()].Alloc<BVHBuildNode>();
+    (*totalNodes)++;
+    if (child < 0) {
+        // Create leaf node, its primitive keeps the sorted position
+        int leaf = ~child;
+        const BVHPrimitiveInfo& info = primitiveInfo[mortonPrims[leaf].primitiveIndex];
+        orderedPrims[primOffset + leaf] = m_primitives[info.idx];
+        node->InitLeaf(info.bounds, primOffset + leaf, 1);
+        *cost = 1;
+        return node;
+    }
+
+    BVHBuildNode* children[2];
+    unsigned int childNodes[2] = { 0, 0 };
+    Float childCost[2];
+    auto emitChild = [&](int i) {
+        children[i] = EmitRadixTreeNodes(arenas, primitiveInfo, mortonPrims, primOffset,
+            tree, tree.children[i][child], &childNodes[i], &childCost[i], orderedPrims);
+    };
+    int nPrimitives = tree.last[child] - tree.first[child] + 1;
+    if (nPrimitives > parallelBuildThreshold) {
+        TaskGroup group;
+        group.Run([&]() { emitChild(0); });
+        emitChild(1);
+        group.Wait();
+    }
+    else {
+        emitChild(0);
+        emitChild(1);
+    }
+
+    // Same costs as the SAH builder: a subtree that is cheaper to intersect
+    // primitive by primitive than to traverse becomes one leaf. Its primitives
+    // already sit next to each other in sorted order.
+    Bounds3f bounds = Union(children[0]->bounds, children[1]->bounds);
+    Float area = bounds.Area();
+    Float splitCost = area > 0 ?
+        1 + (childCost[0] * children[0]->bounds.Area() + childCost[1] * children[1]->bounds.Area()) / area :
+        Infinity;
+    if (nPrimitives <= m_maxPrimsInNode && nPrimitives <= splitCost) {
+        node->InitLeaf(bounds, primOffset + tree.first[child], nPrimitives);
+        *cost = nPrimitives;
+        return node;
+    }
+
+    // Split along the axis that separates the children the most
+    *totalNodes += childNodes[0] + childNodes[1];
+    *cost = splitCost;
+    int dim = Bounds3f(children[0]->bounds.Centroid(), children[1]->bounds.Centroid()).MaximumExtent();
+    node->InitInterior(bounds, children[0], children[1], dim);
+    return node;
+}
+
+BVHBuildNode* BVHAccelerator::HLBVHBuild(
+    std::vector<MemoryArena>& arenas,
+    const std::vector<BVHPrimitiveInfo>& primitiveInfo,
+    unsigned int* totalNodes,
+    std::vector<Primitive>& orderedPrims)
+{
+    int nPrimitives = primitiveInfo.size();
+    Bounds3f bounds, centroidBounds;
+    ComputeBounds(primitiveInfo, 0, nPrimitives, &bounds, &centroidBounds);
+
+    // Compute Morton codes of primitive centroids, 30 bits are enough to
+    // separate the primitives of small scenes and sort in half the passes
+    int bitsPerAxis = nPrimitives < (1 << 18) ? 10 : 21;
+    int mortonBits = 3 * bitsPerAxis;
+    Float mortonScale = Float(1 << bitsPerAxis);
+    uint64_t maxCoordinate = (uint64_t(1) << bitsPerAxis) - 1;
+    std::vector<MortonPrimitive> mortonPrims(nPrimitives);
+    ParallelFor([&](int i) {
+        Vector3f offset = centroidBounds.Offset(primitiveInfo[i].centroid) * mortonScale;
+        uint64_t x = min(uint64_t(max(offset.x, Float(0))), maxCoordinate);
+        uint64_t y = min(uint64_t(max(offset.y, Float(0))), maxCoordinate);
+        uint64_t z = min(uint64_t(max(offset.z, Float(0))), maxCoordinate);
+        mortonPrims[i].primitiveIndex = i;
+        mortonPrims[i].mortonCode = EncodeMorton3(x, y, z);
+    }, nPrimitives, binningChunkSize);
+
+    RadixSort(&mortonPrims, mortonBits);
+
+    // Find the runs of primitives that share their top bits, each run
+    // becomes a treelet. LBVH uses a single treelet for everything.
+    std::vector<std::pair<int, int>> treelets;
+    if (m_splitMethod == SplitMethod::HLBVH) {
+        constexpr int treeletBits = 12;
+        int shift = mortonBits - treeletBits;
+        for (int begin = 0, end = 1; end <= nPrimitives; end++) {
+            if (end == nPrimitives ||
+                (mortonPrims[begin].mortonCode >> shift) != (mortonPrims[end].mortonCode >> shift)) {
+                treelets.push_back(std::make_pair(begin, end));
+                begin = end;
             }
-            node->InitInterior(bounds,
-                RecursiveBuild(arena, primitiveInfo, begin, mid, totalNodes, orderedPrims),
-                RecursiveBuild(arena, primitiveInfo, mid, end, totalNodes, orderedPrims), dim);
         }
     }
+    else {
+        treelets.push_back(std::make_pair(0, nPrimitives));
+    }
 
+    // Emit a radix tree for each treelet
+    std::vector<BVHBuildNode*> treeletRoots(treelets.size());
+    std::vector<unsigned int> treeletNodes(treelets.size(), 0);
+    ParallelFor([&](int i) {
+        int begin = treelets[i].first;
+        int n = treelets[i].second - begin;
+        RadixTree tree;
+        if (n > 1) {
+            EmitRadixTree(&mortonPrims[begin], n, &tree);
+        }
+        Float cost;
+        treeletRoots[i] = EmitRadixTreeNodes(arenas, primitiveInfo, &mortonPrims[begin],
+            begin, tree, n > 1 ? 0 : ~0, &treeletNodes[i], &cost, orderedPrims);
+    }, treelets.size());
+    for (unsigned int n : treeletNodes) {
+        *totalNodes += n;
+    }
+
+    // Join the treelets with SAH
+    return BuildUpperSAH(arenas, treeletRoots, 0, treeletRoots.size(), totalNodes);
+}
+
+BVHBuildNode* BVHAccelerator::BuildUpperSAH(
+    std::vector<MemoryArena>& arenas,
+    std::vector<BVHBuildNode*>& treeletRoots,
+    int start,
+    int end,
+    unsigned int* totalNodes)
+{
+    int nNodes = end - start;
+    if (nNodes == 1)
+        return treeletRoots[start];
+
+    BVHBuildNode* node = arenas[ThreadIndex()].Alloc<BVHBuildNode>();
+    (*totalNodes)++;
+
+    // Compute bounds of all nodes under this HLBVH node
+    Bounds3f bounds, centroidBounds;
+    for (int i = start; i < end; i++) {
+        bounds = Union(bounds, treeletRoots[i]->bounds);
+        centroidBounds = Union(centroidBounds, treeletRoots[i]->bounds.Centroid());
+    }
+    int dim = centroidBounds.MaximumExtent();
+
+    // Allocate BucketInfo for SAH partition buckets
+    constexpr int nBuckets = 12;
+    BucketInfo buckets[nBuckets];
+    auto bucketOf = [&](const BVHBuildNode* root) {
+        int b = nBuckets * centroidBounds.Offset(root->bounds.Centroid())[dim];
+        return min(max(b, 0), nBuckets - 1);
+    };
+    for (int i = start; i < end; i++) {
+        int b = bucketOf(treeletRoots[i]);
+        buckets[b].count++;
+        buckets[b].bounds = Union(buckets[b].bounds, treeletRoots[i]->bounds);
+    }
+
+    // Find bucket to split at that minimizes SAH metric
+    Float minCost = std::numeric_limits<Float>::infinity();
+    int minCostSplitBucket = -1;
+    for (int i = 0; i < nBuckets - 1; i++) {
+        Bounds3f b0, b1;
+        int count0 = 0, count1 = 0;
+        for (int j = 0; j <= i; j++) {
+            b0 = Union(b0, buckets[j].bounds);
+            count0 += buckets[j].count;
+        }
+        for (int j = i + 1; j < nBuckets; j++) {
+            b1 = Union(b1, buckets[j].bounds);
+            count1 += buckets[j].count;
+        }
+        if (count0 == 0 || count1 == 0) continue;
+        Float cost = 1 + (count0 * b0.Area() + count1 * b1.Area()) / bounds.Area();
+        if (cost < minCost) {
+            minCost = cost;
+            minCostSplitBucket = i;
+        }
+    }
+
+    // Split at the selected bucket, or in the middle if the centroids coincide
+    int mid = (start + end) / 2;
+    if (minCostSplitBucket >= 0) {
+        BVHBuildNode** midPtr = std::partition(&treeletRoots[start], &treeletRoots[end - 1] + 1,
+            [&](const BVHBuildNode* root) {
+                return bucketOf(root) <= minCostSplitBucket;
+            });
+        mid = midPtr - &treeletRoots[0];
+    }
+
+    node->InitInterior(bounds,
+        BuildUpperSAH(arenas, treeletRoots, start, mid, totalNodes),
+        BuildUpperSAH(arenas, treeletRoots, mid, end, totalNodes), dim);
     return node;
 }
 
@@ -295,6 +815,24 @@ int BVHAccelerator::FlattenBVHTree(BVHBuildNode* node, int* offset) {
     return myOffset;
 }
 
+void BVHAccelerator::Release()
+{
+    FreeAligned(m_nodes);
+    m_nodes = nullptr;
+    m_totalNodes = 0;
+    std::vector<Primitive>().swap(m_primitives);
+    std::vector<TriangleRecord>().swap(m_triangleRecords);
+}
+
+void BVHAccelerator::BuildTriangleRecords(const std::vector<Triangle>& triangles)
+{
+    m_triangleRecords.resize(m_primitives.size());
+    ParallelFor([&](int i) {
+        int id = m_primitives[i].m_shapeID;
+        m_triangleRecords[i] = TriangleRecord(triangles[id], id);
+    }, m_primitives.size(), binningChunkSize);
+}
+
 bool BVHAccelerator::IntersectP(
     const Ray& ray, 
     Interaction* inter, 
@@ -302,23 +840,39 @@ bool BVHAccelerator::IntersectP(
 {
     if (!m_nodes) return false;
     bool hit = false;
+    int hitRecord = -1;
+    Float hitU, hitV;
     Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
     int dirIsNeg[3] = { invDir.x < 0,invDir.y < 0,invDir.z < 0 };
 
     int currentNodeIndex = 0, toVisitOffset = 0;
-    int nodesToVisit[64];
+    int nodesToVisit[maxBVHDepth];
     while (true) {
         LinearBVHNode* node = &m_nodes[currentNodeIndex];
         if (node->bounds.Intersect(ray, invDir, dirIsNeg)) {
             if (node->nPrimitives > 0) {
                 // Leaf node
-                for (int i = 0; i < node->nPrimitives; i++) {
-                    Float tHit;
-                    int id = m_primitives[node->primitivesOffset + i].m_shapeID;
-                    if (triangles[id].IntersectP(ray, &tHit, inter)) {
-                        ray.tMax = tHit;
-                        inter->m_primitiveID = id;
-                        hit = true;
+                if (!m_triangleRecords.empty()) {
+                    for (int i = 0; i < node->nPrimitives; i++) {
+                        Float tHit, u, v;
+                        if (m_triangleRecords[node->primitivesOffset + i].Intersect(ray, &tHit, &u, &v)) {
+                            ray.tMax = tHit;
+                            hitRecord = node->primitivesOffset + i;
+                            hitU = u;
+                            hitV = v;
+                            hit = true;
+                        }
+                    }
+                }
+                else {
+                    for (int i = 0; i < node->nPrimitives; i++) {
+                        Float tHit;
+                        int id = m_primitives[node->primitivesOffset + i].m_shapeID;
+                        if (triangles[id].IntersectP(ray, &tHit, inter)) {
+                            ray.tMax = tHit;
+                            inter->m_primitiveID = id;
+                            hit = true;
+                        }
                     }
                 }
                 if (toVisitOffset == 0) break;
@@ -341,6 +895,12 @@ bool BVHAccelerator::IntersectP(
             currentNodeIndex = nodesToVisit[--toVisitOffset];
         }
     }
+    // Hit attributes are only computed for the closest record
+    if (hitRecord >= 0) {
+        int id = m_triangleRecords[hitRecord].m_shapeID;
+        triangles[id].ComputeInteraction(ray, ray.tMax, hitU, hitV, inter);
+        inter->m_primitiveID = id;
+    }
     return hit;
 }
 
@@ -353,13 +913,20 @@ bool BVHAccelerator::Intersect(
     int dirIsNeg[3] = { invDir.x < 0,invDir.y < 0,invDir.z < 0 };
 
     int currentNodeIndex = 0, toVisitOffset = 0;
-    int nodesToVisit[64];
+    int nodesToVisit[maxBVHDepth];
     while (true) {
         LinearBVHNode* node = &m_nodes[currentNodeIndex];
         if (node->bounds.Intersect(ray, invDir, dirIsNeg)) {
             if (node->nPrimitives > 0) {
                 // Leaf node
                 for (int i = 0; i < node->nPrimitives; i++) {
+                    if (!m_triangleRecords.empty()) {
+                        Float tHit, u, v;
+                        if (m_triangleRecords[node->primitivesOffset + i].Intersect(ray, &tHit, &u, &v)) {
+                            return true;
+                        }
+                        continue;
+                    }
                     int id = m_primitives[node->primitivesOffset + i].m_shapeID;
                     if (triangles[id].Intersect(ray)) {
                         return true;
@@ -0,0 +1,152 @@
+#include "bvhcache.h"
+
+#include "renderer/core/mappedfile.h"
+#include "renderer/core/sampler.h"
+
+#include <cstring>
+
+struct BVHCacheHeader {
+    char magic[8];
+    uint32_t byteOrder;
+    int32_t nPrimitives;
+    int32_t totalNodes;
+    int32_t reserved;
+    uint64_t hash[2];
+    uint64_t checksum;      // of the nodes and the order
+};
+
+static const char BVHCacheMagic[8] = { 'G', 'R', 'B', 'V', 'H', '1', 0, 0 };
+static const uint32_t BVHCacheByteOrder = 0x01020304;
+// Part of the key, changes whenever Build makes other trees from the same input
+static constexpr uint64_t BVHBuildVersion = 2;
+// Nodes start on a cache line
+static constexpr size_t BVHCacheDataOffset = 64;
+
+static_assert(sizeof(BVHCacheHeader) <= BVHCacheDataOffset, "The header must fit before the nodes");
+static_assert(sizeof(Bounds3f) == 24 && sizeof(LinearBVHNode) == 32, "Bounds and nodes are hashed and stored as laid out");
+
+static std::string CacheFilename(const std::string& directory, const BVHCacheKey& key)
+{
+    return tfm::format("%s/bvh_%016llx%016llx.cache", directory,
+        (unsigned long long)key.hash[0], (unsigned long long)key.hash[1]);
+}
+
+BVHCacheKey HashBVHInput(
+    const std::vector<Bounds3f>& primitiveBounds,
+    BVHAccelerator::SplitMethod splitMethod,
+    int maxPrimsInNode)
+{
+    // Two independent lanes, so a collision needs both to collide
+    uint64_t h0 = 0x9e3779b97f4a7c15ull, h1 = 0x6a09e667f3bcc909ull;
+    auto add = [&](uint64_t word) {
+        h0 = MixBits(h0 ^ word);
+        h1 = MixBits(h1 + word * 0xbf58476d1ce4e5b9ull);
+    };
+    add(primitiveBounds.size());
+    add(splitMethod);
+    add(min(maxPrimsInNode, 255));
+    add(sizeof(LinearBVHNode));
+    add(BVHBuildVersion);
+
+    const char* data = (const char*)primitiveBounds.data();
+    size_t size = primitiveBounds.size() * sizeof(Bounds3f);
+    for (size_t i = 0; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        add(word);
+    }
+    return BVHCacheKey{ { h0, h1 } };
+}
+
+bool LoadCachedBVH(
+    const std::string& directory,
+    const BVHCacheKey& key,
+    const std::vector<Primitive>& primitives,
+    BVHAccelerator::SplitMethod splitMethod,
+    int maxPrimsInNode,
+    BVHAccelerator* bvh)
+{
+    std::string filename = CacheFilename(directory, key);
+    MappedFile file;
+    if (!file.Open(filename)) {
+        return false;
+    }
+
+    BVHCacheHeader header;
+    const char* data = file.Data();
+    size_t size = file.Size();
+    bool valid = size >= BVHCacheDataOffset;
+    if (valid) {
+        memcpy(&header, data, sizeof(header));
+        valid = memcmp(header.magic, BVHCacheMagic, sizeof(BVHCacheMagic)) == 0 &&
+            header.byteOrder == BVHCacheByteOrder &&
+            header.hash[0] == key.hash[0] && header.hash[1] == key.hash[1] &&
+            header.nPrimitives == primitives.size() && header.totalNodes > 0 &&
+            size == BVHCacheDataOffset + size_t(header.totalNodes) * sizeof(LinearBVHNode) +
+                size_t(header.nPrimitives) * sizeof(int);
+    }
+    const LinearBVHNode* nodes = (const LinearBVHNode*)(data + BVHCacheDataOffset);
+    const int* order = (const int*)(nodes + (valid ? header.totalNodes : 0));
+    valid = valid && Checksum(data + BVHCacheDataOffset, size - BVHCacheDataOffset) == header.checksum &&
+        ValidBVHNodes(nodes, header.totalNodes, order, header.nPrimitives);
+    if (!valid) {
+        printf("Warning : Ignoring the damaged BVH cache file %s\n", filename.c_str());
+        return false;
+    }
+
+    bvh->BuildFromNodes(primitives, splitMethod, maxPrimsInNode, nodes, header.totalNodes, order);
+    printf("BVH cache : read %s\n", filename.c_str());
+    return true;
+}
+
+void SaveCachedBVH(
+    const std::string& directory,
+    const BVHCacheKey& key,
+    const std::vector<Primitive>& primitives,
+    const BVHAccelerator& bvh)
+{
+    // Slots are matched back to primitives through their triangles
+    int maxShapeID = 0;
+    for (const Primitive& primitive : primitives) {
+        maxShapeID = max(maxShapeID, primitive.m_shapeID);
+    }
+    std::vector<int> primitiveOfShape(maxShapeID + 1, -1);
+    for (int i = 0; i < primitives.size(); i++) {
+        int& index = primitiveOfShape[primitives[i].m_shapeID];
+        if (index != -1) {
+            // Primitives sharing a triangle can't be told apart
+            return;
+        }
+        index = i;
+    }
+
+    BVHCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BVHCacheMagic, sizeof(BVHCacheMagic));
+    header.byteOrder = BVHCacheByteOrder;
+    header.nPrimitives = primitives.size();
+    header.totalNodes = bvh.m_totalNodes;
+    header.hash[0] = key.hash[0];
+    header.hash[1] = key.hash[1];
+
+    size_t nodeBytes = size_t(bvh.m_totalNodes) * sizeof(LinearBVHNode);
+    std::vector<char> data(BVHCacheDataOffset + nodeBytes + primitives.size() * sizeof(int));
+    memcpy(data.data() + BVHCacheDataOffset, bvh.m_nodes, nodeBytes);
+    int* order = (int*)(data.data() + BVHCacheDataOffset + nodeBytes);
+    for (int i = 0; i < bvh.m_primitives.size(); i++) {
+        order[i] = primitiveOfShape[bvh.m_primitives[i].m_shapeID];
+    }
+    header.checksum = Checksum(data.data() + BVHCacheDataOffset, data.size() - BVHCacheDataOffset);
+    memcpy(data.data(), &header, sizeof(header));
+
+    filesystem::path path(directory);
+    if (!path.is_directory()) {
+        filesystem::create_directory(path);
+    }
+    std::string filename = CacheFilename(directory, key);
+    if (!WriteFileAtomic(filename, data)) {
+        fprintf(stderr, "Can't write %s\n", filename.c_str());
+        return;
+    }
+    printf("BVH cache : wrote %s\n", filename.c_str());
+}
@@ -0,0 +1,44 @@
+#pragma once
+#ifndef __BVHCACHE_H
+#define __BVHCACHE_H
+
+#include "renderer/core/bvh.h"
+
+#include <cstdint>
+
+/**
+ * \brief Built BVHs kept in a directory between runs
+ *
+ * A build only depends on the bounds of the primitives, in their order, and
+ * on the split settings, so a hash of those names the cache file and camera
+ * or material changes keep hitting it. A file holds the flattened nodes and
+ * the primitive each slot of m_primitives came from, the primitives
+ * themselves are taken from the scene being loaded. Files are mapped,
+ * checked against their checksum and never removed.
+ */
+struct BVHCacheKey {
+    uint64_t hash[2];
+};
+
+BVHCacheKey HashBVHInput(
+    const std::vector<Bounds3f>& primitiveBounds,
+    BVHAccelerator::SplitMethod splitMethod,
+    int maxPrimsInNode);
+
+// Fills bvh from the cache, false if there is no usable file for key
+bool LoadCachedBVH(
+    const std::string& directory,
+    const BVHCacheKey& key,
+    const std::vector<Primitive>& primitives,
+    BVHAccelerator::SplitMethod splitMethod,
+    int maxPrimsInNode,
+    BVHAccelerator* bvh);
+
+// primitives are the ones bvh was built from
+void SaveCachedBVH(
+    const std::string& directory,
+    const BVHCacheKey& key,
+    const std::vector<Primitive>& primitives,
+    const BVHAccelerator& bvh);
+
+#endif // !__BVHCACHE_H
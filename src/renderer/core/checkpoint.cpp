@@ -0,0 +1,272 @@
+#include "checkpoint.h"
+
+#include "renderer/core/mappedfile.h"
+#include "renderer/core/renderer.h"
+
+#include <cstdio>
+#include <cstring>
+
+struct CheckpointHeader {
+    char magic[8];
+    uint64_t fingerprint;
+    int32_t width, height;
+    int32_t passes;
+    int32_t hasAOVs;
+    int32_t nTiles;
+    int32_t reserved;
+    uint64_t payloadSize;
+    uint64_t checksum;
+};
+
+static const char CheckpointMagic[8] = { 'G', 'R', 'C', 'K', 'P', 'T', '1', 0 };
+
+// Film buffers in file order, as (pointer, bytes) pairs
+static std::vector<std::pair<char*, size_t>> FilmSections(const Film& film)
+{
+    size_t nPixels = size_t(film.m_resolution.x) * film.m_resolution.y;
+    std::vector<std::pair<char*, size_t>> sections;
+    for (const FilmBuffer& buffer : film.AccumulationBuffers()) {
+        sections.push_back({ buffer.data, nPixels * buffer.components * 4 });
+    }
+    return sections;
+}
+
+Checkpoint::Checkpoint(const std::string& filename, Float interval, uint64_t fingerprint)
+    : m_filename(filename), m_interval(interval), m_fingerprint(fingerprint),
+    m_lastSave(std::chrono::steady_clock::now()),
+    m_writeIndex(0), m_pending(false), m_writing(false), m_exit(false)
+{
+    if (!m_filename.empty()) {
+        m_thread = std::thread(&Checkpoint::Run, this);
+    }
+}
+
+Checkpoint::~Checkpoint()
+{
+    if (m_filename.empty()) {
+        return;
+    }
+    Flush();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_exit = true;
+    }
+    m_condition.notify_all();
+    m_thread.join();
+}
+
+int Checkpoint::Load(Film& film, std::vector<unsigned char>& activeTiles) const
+{
+    if (m_filename.empty()) {
+        return 0;
+    }
+    FILE* file = fopen(m_filename.c_str(), "rb");
+    if (!file) {
+        fprintf(stderr, "No checkpoint %s, starting from the first pass\n", m_filename.c_str());
+        return 0;
+    }
+
+    CheckpointHeader header;
+    std::vector<char> payload;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+        memcmp(header.magic, CheckpointMagic, sizeof(CheckpointMagic)) == 0;
+    if (ok) {
+        payload.resize(header.payloadSize);
+        ok = fread(payload.data(), 1, payload.size(), file) == payload.size() &&
+            Checksum(payload.data(), payload.size()) == header.checksum;
+    }
+    fclose(file);
+    if (!ok) {
+        fprintf(stderr, "Checkpoint %s is damaged, starting from the first pass\n", m_filename.c_str());
+        return 0;
+    }
+
+    std::vector<std::pair<char*, size_t>> sections = FilmSections(film);
+    size_t size = activeTiles.size();
+    for (const auto& section : sections) {
+        size += section.second;
+    }
+    if (header.fingerprint != m_fingerprint || header.width != film.m_resolution.x ||
+        header.height != film.m_resolution.y || header.hasAOVs != film.HasAOVs() ||
+        header.nTiles != activeTiles.size() || header.payloadSize != size) {
+        fprintf(stderr, "Checkpoint %s was made with another scene or other settings, starting from the first pass\n", m_filename.c_str());
+        return 0;
+    }
+
+    const char* p = payload.data();
+    for (const auto& section : sections) {
+        memcpy(section.first, p, section.second);
+        p += section.second;
+    }
+    memcpy(activeTiles.data(), p, activeTiles.size());
+    fprintf(stderr, "Resuming after pass %d\n", header.passes);
+    return header.passes;
+}
+
+bool Checkpoint::Due() const
+{
+    return !m_filename.empty() &&
+        std::chrono::duration<Float>(std::chrono::steady_clock::now() - m_lastSave).count() >= m_interval;
+}
+
+void Checkpoint::Save(const Film& film, const std::vector<unsigned char>& activeTiles, int passes)
+{
+    if (m_filename.empty()) {
+        return;
+    }
+    m_lastSave = std::chrono::steady_clock::now();
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    // A snapshot which is still waiting is simply replaced by this newer one
+    m_pending = false;
+    std::vector<char>& buffer = m_buffers[1 - m_writeIndex];
+    lock.unlock();
+
+    std::vector<std::pair<char*, size_t>> sections = FilmSections(film);
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CheckpointMagic, sizeof(CheckpointMagic));
+    header.fingerprint = m_fingerprint;
+    header.width = film.m_resolution.x;
+    header.height = film.m_resolution.y;
+    header.passes = passes;
+    header.hasAOVs = film.HasAOVs();
+    header.nTiles = activeTiles.size();
+    header.payloadSize = activeTiles.size();
+    for (const auto& section : sections) {
+        header.payloadSize += section.second;
+    }
+
+    buffer.resize(sizeof(header) + header.payloadSize);
+    char* p = buffer.data() + sizeof(header);
+    for (const auto& section : sections) {
+        memcpy(p, section.first, section.second);
+        p += section.second;
+    }
+    memcpy(p, activeTiles.data(), activeTiles.size());
+    header.checksum = Checksum(buffer.data() + sizeof(header), header.payloadSize);
+    memcpy(buffer.data(), &header, sizeof(header));
+
+    lock.lock();
+    m_pending = true;
+    lock.unlock();
+    m_condition.notify_all();
+}
+
+void Checkpoint::Flush()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_condition.wait(lock, [&]() { return !m_pending && !m_writing; });
+}
+
+void Checkpoint::Run()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_condition.wait(lock, [&]() { return m_pending || m_exit; });
+        if (!m_pending) {
+            return;
+        }
+        m_writeIndex = 1 - m_writeIndex;
+        m_pending = false;
+        m_writing = true;
+        const std::vector<char>& buffer = m_buffers[m_writeIndex];
+
+        lock.unlock();
+        if (!WriteFileAtomic(m_filename, buffer)) {
+            fprintf(stderr, "Can't write checkpoint %s\n", m_filename.c_str());
+        }
+        lock.lock();
+
+        m_writing = false;
+        m_condition.notify_all();
+    }
+}
+
+// Folds size bytes of data into hash, eight at a time
+static uint64_t HashBytes(uint64_t hash, const void* data, size_t size)
+{
+    const char* p = (const char*)data;
+    for (size_t i = 0; i < size; i += 8) {
+        uint64_t word = 0;
+        memcpy(&word, p + i, min(size - i, (size_t)8));
+        hash = MixBits(hash ^ word) + 0x9e3779b97f4a7c15ull;
+    }
+    return hash;
+}
+
+template<typename T>
+static uint64_t HashValue(uint64_t hash, const T& value)
+{
+    return HashBytes(hash, &value, sizeof(T));
+}
+
+uint64_t SceneFingerprint(const Renderer& renderer)
+{
+    const Camera& camera = renderer.m_camera;
+    const Scene& scene = renderer.m_scene;
+    uint64_t hash = HashValue(0, camera.m_fov);
+    hash = HashValue(hash, camera.m_cameraToWorld.mat.m);
+
+    // Only the members of the BSDF a material uses are set
+    for (const Material& material : scene.m_materials) {
+        hash = HashValue(hash, material.m_type);
+        if (material.m_type == Material::DIFFUSE_REFLECT) {
+            hash = HashValue(hash, material.m_diffuseReflect.m_r);
+        }
+        else if (material.m_type == Material::GLOSSY_REFLECT) {
+            const GGXSmithReflectBSDF& bsdf = material.m_glossyReflect;
+            Spectrum values[] = { bsdf.m_r, bsdf.m_conductorEtaI, bsdf.m_conductorEtaT, bsdf.m_conductorK,
+                Spectrum(bsdf.m_distribution.m_alphax, bsdf.m_distribution.m_alphay, 0) };
+            hash = HashValue(hash, values);
+        }
+        else {
+            const FresnelSpecular& bsdf = material.m_fresnelSpecular;
+            Spectrum values[] = { bsdf.m_t, bsdf.m_r, Spectrum(bsdf.m_etaA, bsdf.m_etaB, 0) };
+            hash = HashValue(hash, values);
+        }
+    }
+    for (const Light& light : scene.m_lights) {
+        hash = HashValue(hash, light.m_shapeID);
+        hash = HashValue(hash, light.m_L);
+    }
+
+    hash = HashBytes(hash, scene.m_primitives.data(), scene.m_primitives.size() * sizeof(Primitive));
+    for (const TriangleMesh& mesh : scene.m_triangleMeshes) {
+        hash = HashBytes(hash, mesh.m_indices, 3 * sizeof(int) * mesh.m_triangleNum);
+        hash = HashBytes(hash, mesh.m_P, sizeof(Point3f) * mesh.m_vertexNum);
+        if (mesh.m_N) {
+            hash = HashBytes(hash, mesh.m_N, sizeof(Normal3f) * mesh.m_vertexNum);
+        }
+        if (mesh.m_UV) {
+            hash = HashBytes(hash, mesh.m_UV, sizeof(Point2f) * mesh.m_vertexNum);
+        }
+    }
+    for (const InstancedObject& object : scene.m_objects) {
+        hash = HashValue(hash, object.m_primitiveBegin);
+        hash = HashValue(hash, object.m_primitiveEnd);
+    }
+    for (const Instance& instance : scene.m_instances) {
+        hash = HashValue(hash, instance.m_objectID);
+        hash = HashValue(hash, instance.m_objToWorld.mat.m);
+    }
+    return hash;
+}
+
+uint64_t RenderFingerprint(const Renderer& renderer)
+{
+    const Sampler& sampler = renderer.m_sampler;
+    const Integrator& integrator = renderer.m_integrator;
+    const Film& film = renderer.m_camera.m_film;
+    uint64_t values[] = {
+        (uint64_t)film.m_resolution.x, (uint64_t)film.m_resolution.y,
+        (uint64_t)film.HasAOVs(), (uint64_t)film.m_denoise, (uint64_t)film.m_writeAOVs,
+        (uint64_t)sampler.m_type, (uint64_t)sampler.m_sampleNum, (uint64_t)sampler.m_seed,
+        (uint64_t)integrator.m_maxDepth, (uint64_t)integrator.m_nSample, (uint64_t)integrator.m_minSample,
+        (uint64_t)renderer.m_scene.m_lightSampler, SceneFingerprint(renderer) };
+    uint64_t hash = MixBits(integrator.m_maxError * 1e6);
+    for (uint64_t v : values) {
+        hash = MixBits(hash ^ v) + 0x9e3779b97f4a7c15ull;
+    }
+    return hash;
+}
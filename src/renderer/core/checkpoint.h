@@ -0,0 +1,57 @@
+#pragma once
+#ifndef __CHECKPOINT_H
+#define __CHECKPOINT_H
+
+#include "renderer/core/film.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+class Renderer;
+
+/**
+ * \brief Periodic snapshots of the film accumulation for resuming renders
+ *
+ * Samples only depend on the pixel and the pass, so continuing after the
+ * last completed pass gives the same image as an uninterrupted render.
+ * Save() copies the film on the calling thread and writes the copy in the
+ * background, first to a temporary file which then replaces the checkpoint,
+ * so a crash never leaves a torn file behind. An empty filename disables
+ * checkpointing.
+ */
+class Checkpoint {
+public:
+    Checkpoint(const std::string& filename, Float interval, uint64_t fingerprint);
+    ~Checkpoint();
+
+    // Restores the film and the adaptive tiles, returns the completed passes or 0
+    int Load(Film& film, std::vector<unsigned char>& activeTiles) const;
+    // True once the interval has passed since the last snapshot
+    bool Due() const;
+    void Save(const Film& film, const std::vector<unsigned char>& activeTiles, int passes);
+    void Flush();
+
+private:
+    void Run();
+
+    std::string m_filename;
+    Float m_interval;
+    uint64_t m_fingerprint;
+    std::chrono::steady_clock::time_point m_lastSave;
+
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::vector<char> m_buffers[2];
+    int m_writeIndex;
+    bool m_pending, m_writing, m_exit;
+};
+
+// Hash of the camera, materials, lights and geometry of the scene
+uint64_t SceneFingerprint(const Renderer& renderer);
+// Hash of the scene and settings a checkpoint has to agree with to be resumed
+uint64_t RenderFingerprint(const Renderer& renderer);
+
+#endif // !__CHECKPOINT_H
@@ -3,6 +3,8 @@
 #define __CPURENDERER_H
 
 #include "renderer/core/renderer.h"
+#include "renderer/core/parallel.h"
+#include "renderer/core/checkpoint.h"
 
 inline Point3f
 WorldToRaster(Camera* camera, Point3f p) {
@@ -14,7 +16,7 @@ WorldToRaster(Camera* camera, Point3f p) {
 	return pFilm1;
 }
 
-void DrawTransportLine(Point2i p, Renderer& renderer);
+inline void DrawTransportLine(Point2i p, Renderer& renderer);
 
 inline
 Float PowerHeuristic(int nf, Float fPdf, int ng, Float gPdf) {
@@ -23,7 +25,7 @@ Float PowerHeuristic(int nf, Float fPdf, int ng, Float gPdf) {
 }
 
 inline
-Spectrum NextEventEstimate(const Scene& scene, const Interaction& inter, unsigned int& seed, Point3f& pLight)
+Spectrum NextEventEstimate(const Scene& scene, const Interaction& inter, Sampler& sampler, Point3f& pLight)
 {
 	const Primitive& primitive = scene.m_primitives[inter.m_primitiveID];
 	const Material& material = scene.m_materials[primitive.m_materialID];
@@ -31,19 +33,22 @@ Spectrum NextEventEstimate(const Scene& scene, const Interaction& inter, unsigne
 	Spectrum est;
 
 	// Sample one of lights
-	int lightID = min(scene.m_lights.size() - 1, int(NextRandom(seed) * scene.m_lights.size()));
-	Float lightChoosePdf = Float(1) / scene.m_lights.size();
-	const Light& light = scene.m_lights[lightID];
+	Float lightChoosePdf;
+	int lightID = scene.SampleLight(inter.m_p, inter.m_shadingN, sampler.Get1D(), &lightChoosePdf);
+	Point2f uLight = sampler.Get2D();	// drawn anyway to keep later dimensions in place
+
+	// Light Sampling, no light may reach this point
+	if (lightID != -1) {
+		const Light& light = scene.m_lights[lightID];
 
-	// Light Sampling
-	{
 		// Light Sample Li
 		const Triangle& triangle = scene.m_triangles[light.m_shapeID];
 		Float lightSamplePdf;
-		Interaction lightSample = triangle.Sample(&lightSamplePdf, seed);
+		Interaction lightSample = triangle.Sample(&lightSamplePdf, uLight);
 		pLight = lightSample.m_p;
 		lightSamplePdf *= (lightSample.m_p - inter.m_p).SqrLength() /
 			AbsDot(-Normalize(lightSample.m_p - inter.m_p), lightSample.m_shadingN);
+		lightSamplePdf *= lightChoosePdf;
 
 		// Visibility test
 		Point3f origin = inter.m_p + (lightSample.m_p - inter.m_p) * Epsilon;
@@ -77,139 +82,216 @@ Spectrum NextEventEstimate(const Scene& scene, const Interaction& inter, unsigne
 		}
 	}
 
-	// BSDF Sampling
-	if (!light.isDelta()) {
+	// The BSDF sampling half of MIS is done by the continuation ray, see EmittedLight()
+	return est;
+}
 
-		// BSDF Sample
-		Normal3f n = inter.m_shadingN;
-		Float bsdfPdf;
-		Spectrum cosBSDF;
-		Vector3f wi;
-		cosBSDF = material.Sample(n, inter.m_wo, &wi, &bsdfPdf, seed);
+/**
+ * \brief Emission of the light hit by the continuation ray
+ *
+ * After a non-delta vertex the ray was BSDF sampled, so it is weighted against
+ * the chance of next event estimation choosing the same point on the light.
+ */
+inline
+Spectrum EmittedLight(const Scene& scene, const Interaction& inter, bool specular, Float bsdfPdf, const Point3f& prevP, const Normal3f& prevN)
+{
+	const Primitive& primitive = scene.m_primitives[inter.m_primitiveID];
+	int lightID = primitive.m_lightID;
+	if (lightID == -1 || Dot(inter.m_shadingN, inter.m_wo) <= 0) {
+		return Spectrum(0);
+	}
 
-		// Light Sample
-		const Triangle& triangle = scene.m_triangles[light.m_shapeID];
+	const Light& light = scene.m_lights[lightID];
+	if (specular) {
+		return light.m_L;
+	}
 
-		Point3f origin = inter.m_p + wi * Epsilon;
-		Ray testRay(origin, wi);
-		Interaction lightInter;
-		bool hit = scene.IntersectP(testRay, &lightInter);
+	const Triangle& triangle = scene.m_triangles[light.m_shapeID];
+	Float lightSamplePdf = (inter.m_p - prevP).SqrLength() /
+		(AbsDot(inter.m_wo, inter.m_shadingN) * triangle.Area()) * scene.LightPdf(prevP, prevN, lightID);
+	Float weight = PowerHeuristic(1, bsdfPdf, 1, lightSamplePdf);
+	return light.m_L * weight;
+}
 
-		if (hit && scene.m_primitives[lightInter.m_primitiveID].m_lightID != -1) {
-			Float lightSamplePdf;
-			lightSamplePdf = (lightInter.m_p - inter.m_p).SqrLength() /
-				(AbsDot(-wi, lightInter.m_shadingN) * triangle.Area());
-			pLight = lightInter.m_p;
+inline
+Spectrum SampleMaterial(const Scene& scene, Interaction& inter, Sampler& sampler, Float* bsdfPdf) {
+	const Primitive& primitive = scene.m_primitives[inter.m_primitiveID];
+	const Material& material = scene.m_materials[primitive.m_materialID];
 
-			// Get Le            
-			Spectrum Le(0.);
-			if (Dot(-wi, lightInter.m_shadingN) > 0) {
-				Le = light.m_L;
-			}
+	Normal3f n = inter.m_shadingN;
 
-			Float weight = PowerHeuristic(1, bsdfPdf, 1, lightSamplePdf);
-			est += Le * cosBSDF * weight / bsdfPdf;
-		}
+	Spectrum cosBSDF = material.Sample(n, inter.m_wo, &inter.m_wi, bsdfPdf, sampler.Get2D());
+	if (*bsdfPdf == 0) {
+		return Spectrum(0);
 	}
 
-	return est / lightChoosePdf;
+	return cosBSDF / *bsdfPdf;
 }
 
+/**
+ * Every non-delta vertex traces one shadow ray and one BSDF sampled ray. The
+ * latter both continues the path and finds the BSDF sampling half of MIS, so
+ * the loop runs one more time than m_maxDepth to look for emission only.
+ */
 inline
-Spectrum SampleMaterial(const Scene& scene, Interaction& inter, unsigned int& seed) {
-	const Primitive& primitive = scene.m_primitives[inter.m_primitiveID];
-	const Material& material = scene.m_materials[primitive.m_materialID];
+Spectrum Li(const Scene& scene, const Integrator& integrator, Ray ray, Sampler& sampler, AOVSample* aov = nullptr)
+{
+	Spectrum L(0);
+	Spectrum throughput(1);
+	bool specular = true;
+	Float bsdfPdf = 0;
+	Point3f prevP;
+	Normal3f prevN;
+	Float pathLength = 0;
+	for (int bounce = 0; ; bounce++) {
+
+		// find intersection with scene
+		Interaction interaction;
+		bool hit = scene.IntersectP(ray, &interaction);
+		if (!hit) {
+			break;
+		}
 
-	Normal3f n = inter.m_shadingN;
+		L += throughput * EmittedLight(scene, interaction, specular, bsdfPdf, prevP, prevN);
+		if (bounce == integrator.m_maxDepth) {
+			break;
+		}
+
+		const Primitive& primitive = scene.m_primitives[interaction.m_primitiveID];
+		const Material& material = scene.m_materials[primitive.m_materialID];
+
+		// denoiser features, taken through specular chains at the first non-specular hit
+		pathLength += (interaction.m_p - ray.o).Length();
+		if (aov && !material.isDelta()) {
+			aov->albedo = material.Albedo();
+			aov->normal = Faceforward(interaction.m_shadingN, interaction.m_wo);
+			aov->depth = pathLength;
+			aov = nullptr;
+		}
+
+		// direct light
+		Point3f pLight;
+		specular = material.isDelta();
+		if (!specular) {
+			L += throughput * NextEventEstimate(scene, interaction, sampler, pLight);
+		}
+
+		// calculate BSDF
+		throughput *= SampleMaterial(scene, interaction, sampler, &bsdfPdf);
+		if (throughput.isBlack()) {
+			break;
+		}
+		prevP = interaction.m_p;
+		prevN = interaction.m_shadingN;
+
+		// indirect light
+		if (throughput.Max() < 1 && bounce > 5) {
+			Float q = max((Float).05, 1 - throughput.Max());
+			if (sampler.Get1D() < q) break;
+			throughput /= 1 - q;
+		}
+
+		ray.o = interaction.m_p + interaction.m_wi * Epsilon;
+		ray.d = interaction.m_wi;
+		ray.tMax = Infinity;
+	}
+	return L;
+}
 
-	Float bsdfPdf;
-	Spectrum cosBSDF = material.Sample(n, inter.m_wo, &inter.m_wi, &bsdfPdf, seed);
+// Tiles of a pass, also the unit of adaptive sampling and of distributed work
+constexpr int renderTileSize = 16;
 
-	return cosBSDF / bsdfPdf;
+inline
+Point2i RenderTileCount(Point2i resolution)
+{
+	return Point2i((resolution.x + renderTileSize - 1) / renderTileSize,
+		(resolution.y + renderTileSize - 1) / renderTileSize);
+}
+
+/**
+ * Adds one sample of the given pass to every pixel of the active tiles,
+ * active holds one flag per tile in row order. Tiles are scheduled on the
+ * work-stealing pool. Samples only depend on the pixel and the pass, so the
+ * image does not depend on the number of threads.
+ */
+inline
+void RenderPass(Renderer& renderer, int pass, const unsigned char* active)
+{
+	const Integrator* integrator = &renderer.m_integrator;
+	const Camera* camera = &renderer.m_camera;
+	const Scene* scene = &renderer.m_scene;
+	Film* film = &renderer.m_camera.m_film;
+	Point2i resolution = film->m_resolution;
+	Point2i nTiles = RenderTileCount(resolution);
+
+	ParallelFor2D([&](Point2i tile) {
+		if (!active[tile.y * nTiles.x + tile.x]) {
+			return;
+		}
+		int x0 = tile.x * renderTileSize, x1 = min(x0 + renderTileSize, resolution.x);
+		int y0 = tile.y * renderTileSize, y1 = min(y0 + renderTileSize, resolution.y);
+		for (int y = y0; y < y1; y++) {
+			for (int x = x0; x < x1; x++) {
+				int index = y * resolution.x + x;
+				Sampler sampler = renderer.m_sampler;
+				sampler.StartPixelSample(index, pass);
+				Point2f u = sampler.Get2D();
+				Ray ray = camera->GenerateRay(Point2f(x + u.x, y + u.y));
+				AOVSample aov;
+				film->AddSample(x, y, Li(*scene, *integrator, ray, sampler, film->HasAOVs() ? &aov : nullptr));
+				if (film->HasAOVs()) {
+					film->AddAOVSample(x, y, aov);
+				}
+			}
+		}
+	}, nTiles);
 }
 
+/**
+ * With adaptive sampling, tiles whose error estimate is below the threshold
+ * are skipped by later passes, so the budget goes to the noisy ones.
+ */
 inline
 void render(std::shared_ptr<Renderer> renderer)
 {
 	Integrator* integrator = &renderer->m_integrator;
-	Camera* camera = &renderer->m_camera;
 	Scene* scene = &renderer->m_scene;
+	Film* film = &renderer->m_camera.m_film;
 	scene->Preprocess();
+
+	Point2i nTiles = RenderTileCount(film->m_resolution);
+	std::vector<unsigned char> active(nTiles.x * nTiles.y, 1);
+	int nActive = nTiles.x * nTiles.y;
+
+	Checkpoint checkpoint(renderer->m_checkpointFile, renderer->m_checkpointInterval, RenderFingerprint(*renderer));
+	int start = 0;
+	if (renderer->m_resume) {
+		start = checkpoint.Load(*film, active);
+		nActive = std::count(active.begin(), active.end(), 1);
+	}
+
 	int num = integrator->m_nSample;
-    for (int k = 0; k < num; k++) {
-        for (int x = 0; x < camera->m_film.m_resolution.x; x++) {
-            fprintf(stderr, "\r%f", Float(x) / camera->m_film.m_resolution.x);
-            for (int y = 0; y < camera->m_film.m_resolution.y; y++) {
-                int index = y * camera->m_film.m_resolution.x + x;
-                unsigned int seed = InitRandom(index, k);
-                Spectrum L(0);
-                Spectrum throughput(1);
-                int bounce;
-                bool specular = false;
-                Ray ray = camera->GenerateRay(Point2f(x + NextRandom(seed), y + NextRandom(seed)));
-                for (bounce = 0; bounce < integrator->m_maxDepth; bounce++) {
-
-                    // find intersection with scene
-                    Interaction interaction;
-                    bool hit = scene->IntersectP(ray, &interaction);
-                    if (!hit) {
-                        break;
-                    }
-
-                    const Primitive& primitive = scene->m_primitives[interaction.m_primitiveID];
-                    const Material& material = scene->m_materials[primitive.m_materialID];
-                    if (bounce == 0 || specular) {
-                        if (primitive.m_lightID != -1) {
-                            int lightID = primitive.m_lightID;
-                            const Light& light = scene->m_lights[lightID];
-                            if (Dot(interaction.m_shadingN, interaction.m_wo) > 0) {
-                                L += throughput * light.m_L;
-                            }
-                        }
-                    }
-
-                    // render normal
-                    //L = Spectrum(interaction.m_geometryN);
-                    //break;
-
-                    if (throughput.isBlack()) {
-                        break;
-                    }
-
-                    // direct light
-                    Point3f pLight;
-                    if (!material.isDelta()) {
-                        L += throughput * NextEventEstimate(*scene, interaction, seed, pLight);
-                        specular = false;
-                    }
-                    else {
-                        specular = true;
-                    }
-
-                    // calculate BSDF
-                    throughput *= SampleMaterial(*scene, interaction, seed);
-
-                    // indirect light                    
-                    if (throughput.Max() < 1 && bounce > 5) {
-                        Float q = max((Float).05, 1 - throughput.Max());
-                        if (NextRandom(seed) < q) break;
-                        throughput /= 1 - q;
-                    }
-
-                    ray.o = interaction.m_p + interaction.m_wi * Epsilon;
-                    ray.d = interaction.m_wi;
-                    ray.tMax = Infinity;
-                }
-                camera->m_film.AddSample(x, y, L);
-            }
-        }
-        camera->m_film.Output();
-    }
+	for (int k = start; k < num && nActive > 0; k++) {
+		fprintf(stderr, "\rPass %d/%d, %d tiles", k + 1, num, nActive);
+		RenderPass(*renderer, k, active.data());
+		if (integrator->m_maxError > 0 && k + 1 >= integrator->m_minSample) {
+			nActive = film->UpdateActiveTiles(renderTileSize, integrator->m_maxError, active.data());
+		}
+		if (checkpoint.Due()) {
+			checkpoint.Save(*film, active, k + 1);
+		}
+		film->OutputPass();
+	}
+	checkpoint.Save(*film, active, num);
+	checkpoint.Flush();
+	film->OutputDenoised();
 
 	DrawTransportLine(Point2i(783, 458), *renderer);
-    camera->m_film.Output();
+	film->Output();
+	film->WaitForOutput();
 }
 
+inline
 void DrawTransportLine(Point2i p, Renderer& renderer) {
 	Integrator* integrator = &renderer.m_integrator;
 	Camera* camera = &renderer.m_camera;
@@ -219,13 +301,18 @@ void DrawTransportLine(Point2i p, Renderer& renderer) {
 	int index = p.y * camera->m_film.m_resolution.x + p.x;
 	std::vector<Point3f> vertex;
 
-	unsigned int seed = InitRandom(index, 0);
+	Sampler sampler = renderer.m_sampler;
+	sampler.StartPixelSample(index, 0);
     Spectrum L(0);
     Spectrum throughput(1);
     int bounce;
-    bool specular = false;
-    Ray ray = camera->GenerateRay(Point2f(p.x + NextRandom(seed), p.y + NextRandom(seed)));
-    for (bounce = 0; bounce < integrator->m_maxDepth; bounce++) {
+    bool specular = true;
+    Float bsdfPdf = 0;
+    Point3f prevP;
+    Normal3f prevN;
+    Point2f u = sampler.Get2D();
+    Ray ray = camera->GenerateRay(Point2f(p.x + u.x, p.y + u.y));
+    for (bounce = 0; ; bounce++) {
 
         // find intersection with scene
         Interaction interaction;
@@ -236,47 +323,41 @@ void DrawTransportLine(Point2i p, Renderer& renderer) {
 
         vertex.push_back(interaction.m_p);
 
+        L += throughput * EmittedLight(*scene, interaction, specular, bsdfPdf, prevP, prevN);
+        if (bounce == integrator->m_maxDepth) {
+            break;
+        }
+
         const Primitive& primitive = scene->m_primitives[interaction.m_primitiveID];
         const Material& material = scene->m_materials[primitive.m_materialID];
-        if (bounce == 0 || specular) {
-            if (primitive.m_lightID != -1) {
-                int lightID = primitive.m_lightID;
-                const Light& light = scene->m_lights[lightID];
-                if (Dot(interaction.m_shadingN, interaction.m_wo) > 0) {
-                    L += throughput * light.m_L;
-                }
-            }
-        }
 
         // render normal
         //L = Spectrum(interaction.m_geometryN);
         //break;
 
-        if (throughput.isBlack()) {
-            break;
-        }
-
         // direct light
         Point3f pLight;
-        if (!material.isDelta()) {
-            Spectrum neeVal = NextEventEstimate(*scene, interaction, seed, pLight);            
+        specular = material.isDelta();
+        if (!specular) {
+            Spectrum neeVal = NextEventEstimate(*scene, interaction, sampler, pLight);            
             L += throughput * neeVal;
-            specular = false;
             if (!neeVal.isBlack()) {
                 film->DrawLine(Point2f(WorldToRaster(camera, interaction.m_p)), Point2f(WorldToRaster(camera, pLight)), Spectrum(1, 1, 0));
             }
         }
-        else {
-            specular = true;
-        }
 
         // calculate BSDF
-        throughput *= SampleMaterial(*scene, interaction, seed);
+        throughput *= SampleMaterial(*scene, interaction, sampler, &bsdfPdf);
+        if (throughput.isBlack()) {
+            break;
+        }
+        prevP = interaction.m_p;
+        prevN = interaction.m_shadingN;
 
         // indirect light                    
         if (throughput.Max() < 1 && bounce > 5) {
             Float q = max((Float).05, 1 - throughput.Max());
-            if (NextRandom(seed) < q) break;
+            if (sampler.Get1D() < q) break;
             throughput /= 1 - q;
         }
 
@@ -288,7 +369,7 @@ void DrawTransportLine(Point2i p, Renderer& renderer) {
 	for (int i = 1; i < vertex.size(); i++) {
 		film->DrawLine(Point2f(WorldToRaster(camera, vertex[i - 1])), Point2f(WorldToRaster(camera, vertex[i])), Spectrum(0, 1, 0));
 		Point2f s(WorldToRaster(camera, vertex[i - 1]));
-		film->SetVal(s.x, s.y, Spectrum(1, 0, 0));
+		film->DrawLine(s, s, Spectrum(1, 0, 0));
 	}
 }
 
@@ -0,0 +1,93 @@
+#include "denoiser.h"
+
+#include "renderer/core/parallel.h"
+
+void Denoiser::Denoise(const Film& film, Spectrum* output) const
+{
+    int width = film.m_resolution.x, height = film.m_resolution.y;
+    int nPixels = width * height;
+
+    // Pixel averages, the variance is the one of the mean
+    std::vector<Spectrum> color(nPixels), albedo(nPixels);
+    std::vector<Normal3f> normal(nPixels);
+    std::vector<Float> depth(nPixels), variance(nPixels);
+    for (int i = 0; i < nPixels; i++) {
+        unsigned int n = film.m_sampleNum[i];
+        Float invN = n > 0 ? (Float)1 / n : 0;
+        color[i] = Spectrum(film.m_bitmap[i * 3], film.m_bitmap[i * 3 + 1], film.m_bitmap[i * 3 + 2]) * invN;
+        albedo[i] = Spectrum(film.m_albedo[i * 3], film.m_albedo[i * 3 + 1], film.m_albedo[i * 3 + 2]) * invN;
+        normal[i] = Normal3f(film.m_normal[i * 3], film.m_normal[i * 3 + 1], film.m_normal[i * 3 + 2]);
+        if (normal[i].Length() > 0) {
+            normal[i] = Normalize(normal[i]);
+        }
+        depth[i] = film.m_depth[i] * invN;
+        Float mean = color[i].Luminance();
+        variance[i] = n > 1 ? max((Float)0, film.m_sqrSum[i] * invN - mean * mean) / (n - 1) : 0;
+    }
+
+    // Screen space depth gradient, so that slanted planes are not taken for edges
+    std::vector<Float> depthGradient(nPixels);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            int x0 = max(x - 1, 0), x1 = min(x + 1, width - 1);
+            int y0 = max(y - 1, 0), y1 = min(y + 1, height - 1);
+            Float dx = std::abs(depth[y * width + x1] - depth[y * width + x0]) / max(x1 - x0, 1);
+            Float dy = std::abs(depth[y1 * width + x] - depth[y0 * width + x]) / max(y1 - y0, 1);
+            depthGradient[y * width + x] = max(dx, dy);
+        }
+    }
+
+    static const Float kernel[3] = { 3.f / 8, 1.f / 4, 1.f / 16 };
+    std::vector<Spectrum> nextColor(nPixels);
+    std::vector<Float> nextVariance(nPixels);
+    for (int iteration = 0; iteration < m_iterations; iteration++) {
+        int step = 1 << iteration;
+        ParallelFor([&](int y) {
+            for (int x = 0; x < width; x++) {
+                int p = y * width + x;
+                Float lp = color[p].Luminance();
+                Float sigmaL = m_sigmaLuminance * std::sqrt(variance[p]) + 1e-4f;
+                bool hasNormal = normal[p].Length() > 0;
+
+                Spectrum sum(0);
+                Float weightSum = 0, varianceSum = 0;
+                for (int dy = -2; dy <= 2; dy++) {
+                    int qy = y + dy * step;
+                    if (qy < 0 || qy >= height) continue;
+                    for (int dx = -2; dx <= 2; dx++) {
+                        int qx = x + dx * step;
+                        if (qx < 0 || qx >= width) continue;
+                        int q = qy * width + qx;
+
+                        Float wL = std::exp(-std::abs(lp - color[q].Luminance()) / sigmaL);
+                        Float wN = 1;
+                        if (hasNormal || normal[q].Length() > 0) {
+                            Float cosN = normal[p].x * normal[q].x + normal[p].y * normal[q].y + normal[p].z * normal[q].z;
+                            wN = std::pow(max((Float)0, cosN), m_sigmaNormal);
+                        }
+                        Float offset = step * (Float)max(std::abs(dx), std::abs(dy));
+                        Float wZ = std::exp(-std::abs(depth[p] - depth[q]) /
+                            (m_sigmaDepth * depthGradient[p] * offset + 1e-4f));
+                        Spectrum da = albedo[p] - albedo[q];
+                        Float wA = std::exp(-(da.r * da.r + da.g * da.g + da.b * da.b) / (m_sigmaAlbedo * m_sigmaAlbedo));
+
+                        Float w = kernel[std::abs(dx)] * kernel[std::abs(dy)] * wL * wN * wZ * wA;
+                        sum += color[q] * w;
+                        weightSum += w;
+                        varianceSum += w * w * variance[q];
+                    }
+                }
+
+                // The center tap always has a positive weight
+                nextColor[p] = sum / weightSum;
+                nextVariance[p] = varianceSum / (weightSum * weightSum);
+            }
+        }, height);
+        std::swap(color, nextColor);
+        std::swap(variance, nextVariance);
+    }
+
+    for (int i = 0; i < nPixels; i++) {
+        output[i] = color[i];
+    }
+}
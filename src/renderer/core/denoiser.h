@@ -0,0 +1,30 @@
+#pragma once
+#ifndef __DENOISER_H
+#define __DENOISER_H
+
+#include "renderer/core/film.h"
+
+/**
+ * \brief Edge-avoiding a-trous wavelet denoiser
+ *
+ * Every iteration applies a 5x5 B3-spline kernel whose taps are 2^i pixels
+ * apart (Dammertz et al. 2010). Taps are weighted by how similar their albedo,
+ * normal and depth AOVs are, and by a luminance difference scaled with the
+ * standard error of the pixel as in SVGF, so flat converged regions are left
+ * sharp while noisy ones are smoothed.
+ */
+class Denoiser {
+public:
+    Denoiser(int iterations = 5) : m_iterations(iterations) {}
+
+    // output receives one color per pixel of the film
+    void Denoise(const Film& film, Spectrum* output) const;
+
+    int m_iterations;
+    Float m_sigmaLuminance = 4;
+    Float m_sigmaNormal = 128;      // exponent of the normal cosine
+    Float m_sigmaDepth = 1;
+    Float m_sigmaAlbedo = 0.1f;
+};
+
+#endif // !__DENOISER_H
@@ -0,0 +1,275 @@
+#include "distributed.h"
+
+#include "renderer/core/checkpoint.h"
+#include "renderer/core/cpurender.h"
+
+#include <cinttypes>
+#include <cstring>
+#include <sstream>
+#include <thread>
+
+/**
+ * Calls f(buffer, row, bytes) for every row of every buffer inside
+ * [p0, p1), in the order the data of a unit is sent in.
+ */
+template<typename Function>
+static void ForEachRow(const Film& film, Point2i p0, Point2i p1, Function f)
+{
+    for (const FilmBuffer& buffer : film.AccumulationBuffers()) {
+        size_t pixelBytes = buffer.components * 4;
+        for (int y = p0.y; y < p1.y; y++) {
+            char* row = buffer.data + (size_t(y) * film.m_resolution.x + p0.x) * pixelBytes;
+            f(buffer, row, (p1.x - p0.x) * pixelBytes);
+        }
+    }
+}
+
+static size_t UnitBytes(const Film& film, Point2i p0, Point2i p1)
+{
+    size_t size = 0;
+    ForEachRow(film, p0, p1, [&](const FilmBuffer&, char*, size_t bytes) { size += bytes; });
+    return size;
+}
+
+Coordinator::Coordinator(std::shared_ptr<Renderer> renderer, int port, int unitSize, Float reissueAfter)
+    : m_renderer(renderer), m_port(port), m_reissueAfter(reissueAfter),
+    m_fingerprint(RenderFingerprint(*renderer))
+{
+    ASSERT(unitSize % renderTileSize == 0, "Work units must be made of whole render tiles");
+    Point2i resolution = renderer->m_camera.m_film.m_resolution;
+    for (int y = 0; y < resolution.y; y += unitSize) {
+        for (int x = 0; x < resolution.x; x += unitSize) {
+            WorkUnit unit;
+            unit.p0 = Point2i(x, y);
+            unit.p1 = Point2i(min(x + unitSize, resolution.x), min(y + unitSize, resolution.y));
+            m_queue.push_back(m_units.size());
+            m_units.push_back(unit);
+        }
+    }
+    m_remaining = m_units.size();
+}
+
+void Coordinator::Run()
+{
+    ASSERT(SocketInit(), "Can't initialize sockets");
+    SocketHandle listener = ListenTCP(m_port);
+    ASSERT(listener != InvalidSocket, "Can't listen on the coordinator port");
+    fprintf(stderr, "Coordinating %d units on port %d\n", (int)m_units.size(), m_port);
+
+    std::vector<std::thread> connections;
+    while (!Finished()) {
+        if (WaitReadable(listener, 200)) {
+            SocketHandle connection = Accept(listener);
+            if (connection != InvalidSocket) {
+                connections.emplace_back(&Coordinator::Serve, this, connection);
+            }
+        }
+    }
+    for (std::thread& connection : connections) {
+        connection.join();
+    }
+    CloseSocket(listener);
+
+    Film& film = m_renderer->m_camera.m_film;
+    film.Output();
+    film.OutputDenoised();
+    film.WaitForOutput();
+}
+
+void Coordinator::Serve(SocketHandle connection)
+{
+    std::vector<int> assigned;
+    std::string line;
+    while (true) {
+        // Workers still busy with a copy of a merged unit are not waited for
+        bool readable = false;
+        while (!(readable = WaitReadable(connection, 200)) && !Finished()) {}
+        if (!readable || !RecvLine(connection, &line)) {
+            break;
+        }
+
+        std::istringstream request(line);
+        std::string command, reply;
+        request >> command;
+        if (command == "next") {
+            uint64_t fingerprint = 0;
+            request >> std::hex >> fingerprint;
+            reply = fingerprint == m_fingerprint ? NextUnit(assigned) : "error the worker renders with other settings";
+        }
+        else if (command == "result") {
+            int id = -1;
+            size_t bytes = 0;
+            request >> id >> bytes;
+            const Film& film = m_renderer->m_camera.m_film;
+            if (id < 0 || id >= m_units.size() || bytes != UnitBytes(film, m_units[id].p0, m_units[id].p1)) {
+                // The data is read first so the worker gets the reply instead of a reset connection
+                std::vector<char> data(bytes);
+                if (bytes <= UnitBytes(film, Point2i(0, 0), film.m_resolution) &&
+                    RecvAll(connection, data.data(), bytes)) {
+                    SendLine(connection, "error the result doesn't match the units of the coordinator");
+                }
+                break;
+            }
+            std::vector<char> data(bytes);
+            if (!RecvAll(connection, data.data(), bytes)) {
+                break;
+            }
+            Merge(id, data);
+            assigned.erase(std::remove(assigned.begin(), assigned.end(), id), assigned.end());
+            reply = "ok";
+        }
+        else {
+            SendLine(connection, "error unknown request " + command);
+            break;
+        }
+        if (!SendLine(connection, reply)) {
+            break;
+        }
+    }
+    CloseSocket(connection);
+
+    // Whatever the worker still held goes back to the queue
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (int id : assigned) {
+        if (!m_units[id].done) {
+            m_queue.push_front(id);
+        }
+    }
+}
+
+std::string Coordinator::NextUnit(std::vector<int>& assigned)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_remaining == 0) {
+        return "done";
+    }
+    auto now = std::chrono::steady_clock::now();
+    int id = -1;
+    while (!m_queue.empty() && id == -1) {
+        id = m_queue.front();
+        m_queue.pop_front();
+        if (m_units[id].done) {
+            id = -1;
+        }
+    }
+    if (id == -1) {
+        // Hand out the unit which has been out longest, a stalled worker may never return it
+        for (int i = 0; i < m_units.size(); i++) {
+            const WorkUnit& unit = m_units[i];
+            if (!unit.done && unit.issued &&
+                std::find(assigned.begin(), assigned.end(), i) == assigned.end() &&
+                std::chrono::duration<Float>(now - unit.issueTime).count() >= m_reissueAfter &&
+                (id == -1 || unit.issueTime < m_units[id].issueTime)) {
+                id = i;
+            }
+        }
+    }
+    if (id == -1) {
+        return "wait";
+    }
+
+    WorkUnit& unit = m_units[id];
+    unit.issued = true;
+    unit.issueTime = now;
+    assigned.push_back(id);
+    return tfm::format("unit %d %d %d %d %d", id, unit.p0.x, unit.p0.y, unit.p1.x, unit.p1.y);
+}
+
+void Coordinator::Merge(int id, const std::vector<char>& data)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    WorkUnit& unit = m_units[id];
+    if (unit.done) {
+        return;
+    }
+    const char* p = data.data();
+    ForEachRow(m_renderer->m_camera.m_film, unit.p0, unit.p1, [&](const FilmBuffer& buffer, char* row, size_t bytes) {
+        for (size_t i = 0; i < bytes; i += 4, p += 4) {
+            if (buffer.isUint) {
+                unsigned int a, b;
+                memcpy(&a, row + i, 4);
+                memcpy(&b, p, 4);
+                a += b;
+                memcpy(row + i, &a, 4);
+            }
+            else {
+                Float a, b;
+                memcpy(&a, row + i, 4);
+                memcpy(&b, p, 4);
+                a += b;
+                memcpy(row + i, &a, 4);
+            }
+        }
+    });
+    unit.done = true;
+    m_remaining--;
+    fprintf(stderr, "\rUnits %d/%d", (int)m_units.size() - m_remaining, (int)m_units.size());
+}
+
+bool Coordinator::Finished()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_remaining == 0;
+}
+
+void RunWorker(std::shared_ptr<Renderer> renderer, const std::string& host, int port)
+{
+    renderer->m_scene.Preprocess();
+    Integrator& integrator = renderer->m_integrator;
+    Film& film = renderer->m_camera.m_film;
+    Point2i nTiles = RenderTileCount(film.m_resolution);
+    std::string next = tfm::format("next %" PRIx64, RenderFingerprint(*renderer));
+
+    ASSERT(SocketInit(), "Can't initialize sockets");
+    SocketHandle connection = ConnectTCP(host, port);
+    ASSERT(connection != InvalidSocket, "Can't connect to the coordinator");
+
+    std::string reply;
+    std::vector<unsigned char> active(nTiles.x * nTiles.y);
+    std::vector<char> data;
+    while (SendLine(connection, next) && RecvLine(connection, &reply)) {
+        if (reply == "wait") {
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            continue;
+        }
+        int id;
+        Point2i p0, p1;
+        if (sscanf(reply.c_str(), "unit %d %d %d %d %d", &id, &p0.x, &p0.y, &p1.x, &p1.y) != 5) {
+            break;
+        }
+
+        // Only the tiles of the unit are rendered, from an empty film
+        ForEachRow(film, p0, p1, [](const FilmBuffer&, char* row, size_t bytes) { memset(row, 0, bytes); });
+        int nActive = 0;
+        for (int ty = 0; ty < nTiles.y; ty++) {
+            for (int tx = 0; tx < nTiles.x; tx++) {
+                int x = tx * renderTileSize, y = ty * renderTileSize;
+                active[ty * nTiles.x + tx] = x >= p0.x && x < p1.x && y >= p0.y && y < p1.y;
+                nActive += active[ty * nTiles.x + tx];
+            }
+        }
+        for (int k = 0; k < integrator.m_nSample && nActive > 0; k++) {
+            RenderPass(*renderer, k, active.data());
+            if (integrator.m_maxError > 0 && k + 1 >= integrator.m_minSample) {
+                nActive = film.UpdateActiveTiles(renderTileSize, integrator.m_maxError, active.data());
+            }
+        }
+
+        data.clear();
+        ForEachRow(film, p0, p1, [&](const FilmBuffer&, char* row, size_t bytes) {
+            data.insert(data.end(), row, row + bytes);
+        });
+        if (!SendLine(connection, tfm::format("result %d %d", id, (int)data.size())) ||
+            !SendAll(connection, data.data(), data.size()) || !RecvLine(connection, &reply) || reply != "ok") {
+            break;
+        }
+        fprintf(stderr, "Rendered unit %d\n", id);
+    }
+    CloseSocket(connection);
+    if (reply.compare(0, 5, "error") == 0) {
+        fprintf(stderr, "Coordinator refused the worker: %s\n", reply.c_str());
+    }
+    else if (reply != "done") {
+        fprintf(stderr, "Lost the connection to the coordinator\n");
+    }
+}
@@ -0,0 +1,70 @@
+#pragma once
+#ifndef __DISTRIBUTED_H
+#define __DISTRIBUTED_H
+
+#include "renderer/core/renderer.h"
+#include "renderer/core/socketio.h"
+
+#include <chrono>
+#include <deque>
+#include <mutex>
+
+/**
+ * \brief Renders one frame with worker processes pulling units from a coordinator
+ *
+ * The film is split into square units made of whole render tiles. Each worker
+ * loads the scene itself, renders all passes of a unit, adaptive sampling
+ * included, and sends back the accumulation buffers of the unit, which the
+ * coordinator adds into its film. Pixels do not depend on the process that
+ * rendered them, so the merged image is the one a single process renders.
+ *
+ * Units of a worker whose connection drops go back to the queue. Once the
+ * queue is empty, units which have been out for longer than reissueAfter
+ * seconds are handed to idle workers again, the first result to come back
+ * is kept. Requests and replies are lines over TCP:
+ *
+ *   next <fingerprint>          unit <id> <x0> <y0> <x1> <y1> | wait | done | error <reason>
+ *   result <id> <bytes> <data>  ok | error <reason>
+ *
+ * The fingerprint covers the scene, the sampling settings and the layout of
+ * the film buffers, a worker that doesn't match is refused with an error
+ * and stops instead of being handed units it can't return.
+ *
+ * Buffers are sent in the byte order of the host, workers and coordinator
+ * are expected to share it.
+ */
+class Coordinator {
+public:
+    Coordinator(std::shared_ptr<Renderer> renderer, int port, int unitSize = 64, Float reissueAfter = 60);
+
+    // Returns once every unit is merged and the image is written
+    void Run();
+
+private:
+    struct WorkUnit {
+        Point2i p0, p1;
+        bool done = false;
+        bool issued = false;
+        std::chrono::steady_clock::time_point issueTime;
+    };
+
+    void Serve(SocketHandle connection);
+    std::string NextUnit(std::vector<int>& assigned);
+    void Merge(int id, const std::vector<char>& data);
+    bool Finished();
+
+    std::shared_ptr<Renderer> m_renderer;
+    int m_port;
+    Float m_reissueAfter;
+    uint64_t m_fingerprint;
+
+    std::mutex m_mutex;
+    std::vector<WorkUnit> m_units;
+    std::deque<int> m_queue;
+    int m_remaining;
+};
+
+// Renders units handed out by the coordinator until it reports the frame done
+void RunWorker(std::shared_ptr<Renderer> renderer, const std::string& host, int port);
+
+#endif // !__DISTRIBUTED_H
@@ -0,0 +1,46 @@
+#include "distribution.h"
+
+void BuildAliasTable(const std::vector<Float>& weights, std::vector<AliasEntry>* table)
+{
+    int n = weights.size();
+    table->resize(n);
+    if (n == 0) return;
+
+    double sum = 0;
+    for (Float w : weights) {
+        ASSERT(w >= 0, "Alias table weights must be non-negative");
+        sum += w;
+    }
+
+    // Vose's method, scaled weights below 1 are topped up by ones above 1
+    std::vector<double> scaled(n);
+    std::vector<int> small, large;
+    for (int i = 0; i < n; i++) {
+        double pdf = sum > 0 ? weights[i] / sum : 1.0 / n;
+        (*table)[i].m_pdf = Float(pdf);
+        scaled[i] = pdf * n;
+        if (scaled[i] < 1) small.push_back(i);
+        else large.push_back(i);
+    }
+    while (!small.empty() && !large.empty()) {
+        int s = small.back(), l = large.back();
+        small.pop_back();
+        (*table)[s].m_q = Float(scaled[s]);
+        (*table)[s].m_alias = l;
+        scaled[l] -= 1 - scaled[s];
+        if (scaled[l] < 1) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+
+    // Whatever is left is 1 up to rounding
+    for (int i : small) {
+        (*table)[i].m_q = 1;
+        (*table)[i].m_alias = i;
+    }
+    for (int i : large) {
+        (*table)[i].m_q = 1;
+        (*table)[i].m_alias = i;
+    }
+}
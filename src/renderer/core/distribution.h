@@ -0,0 +1,35 @@
+#pragma once
+#ifndef __DISTRIBUTION_H
+#define __DISTRIBUTION_H
+
+#include "renderer/core/fwd.h"
+
+#include <vector>
+
+// One bucket of an alias table, keeps itself with probability m_q
+struct AliasEntry {
+    Float m_q;
+    int m_alias;
+    Float m_pdf;    // probability of choosing this bucket's own index
+};
+
+/**
+ * \brief Build an alias table over non-negative weights
+ *
+ * Sampling takes one lookup whatever the number of entries. If every weight
+ * is zero the table falls back to a uniform distribution.
+ */
+void BuildAliasTable(const std::vector<Float>& weights, std::vector<AliasEntry>* table);
+
+// Sample an index of the table with u in [0, 1)
+inline __device__ __host__
+int SampleAliasTable(const AliasEntry* table, int n, Float u, Float* pdf)
+{
+    Float x = u * n;
+    int i = min(int(x), n - 1);
+    int index = (x - i) < table[i].m_q ? i : table[i].m_alias;
+    *pdf = table[index].m_pdf;
+    return index;
+}
+
+#endif // !__DISTRIBUTION_H
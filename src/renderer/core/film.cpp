@@ -1,32 +1,265 @@
 #include "film.h"
+#include "renderer/core/denoiser.h"
+#include "renderer/core/hdrimage.h"
+#include "renderer/core/imagewriter.h"
+#include "renderer/core/parallel.h"
+
+#include <algorithm>
 
 #ifndef STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_IMPLEMENTATION
 #include "ext/stb_image/stb_image.h"
 #endif // !STB_IMAGE_IMPLEMENTATION
 
-#ifndef STB_IMAGE_WRITE_IMPLEMENTATION
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "ext/stb_image/stb_image_write.h"
-#endif // !STB_IMAGE_WRITE_IMPLEMENTATION
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define FILM_SSE
+#include <immintrin.h>
+#endif
+
+// Entries of the sRGB table, enough to stay within one step of the exact curve
+static constexpr int TonemapTableSize = 1 << 14;
+
+static const unsigned char* TonemapTable()
+{
+    static const std::vector<unsigned char> table = []() {
+        std::vector<unsigned char> t(TonemapTableSize);
+        for (int i = 0; i < TonemapTableSize; i++) {
+            Float v = GammaCorrect(i / Float(TonemapTableSize - 1));
+            t[i] = (unsigned char)Clamp(255.f * v + 0.5f, 0.f, 255.f);
+        }
+        return t;
+    }();
+    return table.data();
+}
+
+// name.ext -> name_suffix.ext
+static std::string SuffixedFilename(const std::string& filename, const std::string& suffix)
+{
+    size_t dot = filename.find_last_of('.');
+    if (dot == std::string::npos) {
+        return filename + "_" + suffix;
+    }
+    return filename.substr(0, dot) + "_" + suffix + filename.substr(dot);
+}
+
+static std::string Extension(const std::string& filename)
+{
+    size_t dot = filename.find_last_of('.');
+    std::string ext = dot == std::string::npos ? "" : filename.substr(dot + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext;
+}
+
+/**
+ * \brief Scales, clamps and sRGB encodes n pixels of rgb values
+ *
+ * scale holds a factor per pixel, the reciprocal sample count for the film.
+ */
+static void TonemapPixels(const Float* rgb, const Float* scale, int n, unsigned char* output, int channels)
+{
+    const unsigned char* table = TonemapTable();
+    int i = 0;
+#ifdef FILM_SSE
+    if (channels == 3) {
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 maxIndex = _mm_set1_ps(TonemapTableSize - 1);
+        alignas(16) int index[12];
+        for (; i + 4 <= n; i += 4) {
+            // Four pixels fill three registers as rgbr gbrg brgb, spread the scales alike
+            __m128 s = _mm_loadu_ps(scale + i);
+            __m128 spread[3] = {
+                _mm_shuffle_ps(s, s, _MM_SHUFFLE(1, 0, 0, 0)),
+                _mm_shuffle_ps(s, s, _MM_SHUFFLE(2, 2, 1, 1)),
+                _mm_shuffle_ps(s, s, _MM_SHUFFLE(3, 3, 3, 2)) };
+            for (int k = 0; k < 3; k++) {
+                __m128 v = _mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(rgb + i * 3 + k * 4), spread[k]), maxIndex);
+                v = _mm_min_ps(_mm_max_ps(v, zero), maxIndex);
+                _mm_store_si128((__m128i*)(index + k * 4), _mm_cvtps_epi32(v));
+            }
+            for (int k = 0; k < 12; k++) {
+                output[i * 3 + k] = table[index[k]];
+            }
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        for (int c = 0; c < 3; c++) {
+            Float v = Clamp(rgb[i * 3 + c] * scale[i] * (TonemapTableSize - 1), 0.f, Float(TonemapTableSize - 1));
+            output[i * channels + c] = table[int(v + 0.5f)];
+        }
+        if (channels == 4) {
+            output[i * channels + 3] = 255;
+        }
+    }
+}
 
 Film::Film(
     Point2i resolution,
-    std::string filename)
-    : m_resolution(resolution), m_filename(filename), m_channels(3)
+    std::string filename,
+    bool denoise,
+    bool writeAOVs)
+    : m_resolution(resolution), m_filename(filename), m_channels(3), m_denoise(denoise),
+    m_writeAOVs(writeAOVs)
 {    
     m_bitmap = new  Float[m_resolution.x * m_resolution.y * 3];
     m_sampleNum = new unsigned int[m_resolution.x * m_resolution.y];
+    m_sqrSum = new Float[m_resolution.x * m_resolution.y];
     memset(m_bitmap, 0, sizeof(Float) * m_resolution.x * m_resolution.y * 3);
     memset(m_sampleNum, 0, sizeof(unsigned int) * m_resolution.x * m_resolution.y);    
+    memset(m_sqrSum, 0, sizeof(Float) * m_resolution.x * m_resolution.y);
+    if (m_denoise || m_writeAOVs) {
+        m_albedo = new Float[m_resolution.x * m_resolution.y * 3];
+        m_normal = new Float[m_resolution.x * m_resolution.y * 3];
+        m_depth = new Float[m_resolution.x * m_resolution.y];
+        memset(m_albedo, 0, sizeof(Float) * m_resolution.x * m_resolution.y * 3);
+        memset(m_normal, 0, sizeof(Float) * m_resolution.x * m_resolution.y * 3);
+        memset(m_depth, 0, sizeof(Float) * m_resolution.x * m_resolution.y);
+    }
+}
+
+// Files which keep linear radiance instead of 8-bit sRGB
+static bool IsHDR(const std::string& filename)
+{
+    return Extension(filename) == "pfm" || Extension(filename) == "exr";
 }
 
 void Film::Output()
 {
-    printf("Output\n");
-    ExportToUnsignedChar();
-    stbi_write_png(m_filename.c_str(), m_resolution.x, m_resolution.y, m_channels, m_bitmapOutput, 0);
-    printf("Done\n");
+    if (IsHDR(m_filename)) {
+        WriteHDR(m_filename, m_bitmap, m_sampleNum);
+        return;
+    }
+    if (!m_writer) {
+        m_writer = std::make_shared<ImageWriter>();
+    }
+    unsigned char* output = m_writer->Acquire(m_filename, m_resolution.x, m_resolution.y, m_channels);
+    ExportToUnsignedChar(output);
+    m_writer->Submit();
+}
+
+void Film::OutputPass()
+{
+    if (!IsHDR(m_filename)) {
+        Output();
+    }
+}
+
+void Film::WaitForOutput()
+{
+    if (m_writer) {
+        m_writer->Flush();
+    }
+}
+
+std::vector<FilmBuffer> Film::AccumulationBuffers() const
+{
+    static_assert(sizeof(Float) == 4 && sizeof(unsigned int) == 4, "Film buffers hold 32 bit values");
+    std::vector<FilmBuffer> buffers = {
+        { (char*)m_bitmap, 3, false },
+        { (char*)m_sampleNum, 1, true },
+        { (char*)m_sqrSum, 1, false } };
+    if (HasAOVs()) {
+        buffers.push_back({ (char*)m_albedo, 3, false });
+        buffers.push_back({ (char*)m_normal, 3, false });
+        buffers.push_back({ (char*)m_depth, 1, false });
+    }
+    return buffers;
+}
+
+void Film::Release()
+{
+    WaitForOutput();
+    for (Float** buffer : { &m_bitmap, &m_sqrSum, &m_albedo, &m_normal, &m_depth }) {
+        delete[] *buffer;
+        *buffer = nullptr;
+    }
+    delete[] m_sampleNum;
+    m_sampleNum = nullptr;
+}
+
+// Writes <name>_denoised.png next to the noisy image, after the final pass
+void Film::OutputDenoised()
+{
+    if (!m_denoise) {
+        return;
+    }
+    int nPixels = m_resolution.x * m_resolution.y;
+    std::vector<Spectrum> denoised(nPixels);
+    Denoiser().Denoise(*this, denoised.data());
+
+    std::vector<Float> rgb(nPixels * 3), scale(nPixels, 1);
+    for (int i = 0; i < nPixels; i++) {
+        for (int c = 0; c < 3; c++) {
+            rgb[i * 3 + c] = denoised[i][c];
+        }
+    }
+    std::string filename = SuffixedFilename(m_filename, "denoised");
+    if (IsHDR(m_filename)) {
+        WriteHDR(filename, rgb.data(), nullptr);
+        return;
+    }
+    if (!m_writer) {
+        m_writer = std::make_shared<ImageWriter>();
+    }
+    unsigned char* output = m_writer->Acquire(filename, m_resolution.x, m_resolution.y, m_channels);
+    TonemapPixels(rgb.data(), scale.data(), nPixels, output, m_channels);
+    m_writer->Submit();
+}
+
+/**
+ * \brief Writes linear radiance to a PFM or OpenEXR file
+ *
+ * Scanlines are converted straight from rgb, averaged by sampleNum if it is
+ * set. For the film itself the AOVs and sample counts are added as extra
+ * OpenEXR channels, or as separate PFM files since PFM holds a single layer.
+ */
+void Film::WriteHDR(const std::string& filename, const Float* rgb, const unsigned int* sampleNum) const
+{
+    ImageChannel::Type type = m_halfFloat ? ImageChannel::Half : ImageChannel::Float32;
+    auto makeChannel = [&](const std::string& name, ImageChannel::Type type,
+        const Float* data, int stride, const unsigned int* sampleNum) {
+        ImageChannel channel;
+        channel.name = name;
+        channel.type = type;
+        channel.data = data;
+        channel.stride = stride;
+        channel.sampleNum = sampleNum;
+        return channel;
+    };
+    std::vector<ImageChannel> color = {
+        makeChannel("R", type, rgb, 3, sampleNum),
+        makeChannel("G", type, rgb + 1, 3, sampleNum),
+        makeChannel("B", type, rgb + 2, 3, sampleNum) };
+
+    // Extra layers only exist for the film's own samples
+    std::vector<std::pair<std::string, std::vector<ImageChannel>>> layers;
+    if (m_writeAOVs && rgb == m_bitmap) {
+        layers.push_back({ "albedo", {
+            makeChannel("albedo.R", type, m_albedo, 3, m_sampleNum),
+            makeChannel("albedo.G", type, m_albedo + 1, 3, m_sampleNum),
+            makeChannel("albedo.B", type, m_albedo + 2, 3, m_sampleNum) } });
+        layers.push_back({ "normal", {
+            makeChannel("N.X", type, m_normal, 3, m_sampleNum),
+            makeChannel("N.Y", type, m_normal + 1, 3, m_sampleNum),
+            makeChannel("N.Z", type, m_normal + 2, 3, m_sampleNum) } });
+        layers.push_back({ "depth", { makeChannel("Z", ImageChannel::Float32, m_depth, 1, m_sampleNum) } });
+        ImageChannel count = makeChannel("sampleCount", ImageChannel::Uint, nullptr, 1, nullptr);
+        count.uintData = m_sampleNum;
+        layers.push_back({ "samples", { count } });
+    }
+
+    if (Extension(filename) == "pfm") {
+        WritePFM(filename, m_resolution.x, m_resolution.y, color);
+        for (const auto& layer : layers) {
+            WritePFM(SuffixedFilename(filename, layer.first), m_resolution.x, m_resolution.y, layer.second);
+        }
+    }
+    else {
+        for (const auto& layer : layers) {
+            color.insert(color.end(), layer.second.begin(), layer.second.end());
+        }
+        WriteEXR(filename, m_resolution.x, m_resolution.y, color, m_rle);
+    }
 }
 
 void Film::DrawLine(
@@ -40,26 +273,87 @@ void Film::DrawLine(
     int dy = abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
     int err = (dx > dy ? dx : -dy) / 2;
 
-    while (SetVal(x0, y0, col), x0 != x1 || y0 != y1) {
+    // Pixels off the film are skipped, a long running process must not write past the buffers
+    while (true) {
+        if (x0 >= 0 && x0 < m_resolution.x && y0 >= 0 && y0 < m_resolution.y) {
+            SetVal(x0, y0, col);
+        }
+        if (x0 == x1 && y0 == y1) {
+            break;
+        }
         int e2 = err;
         if (e2 > -dx) { err -= dy; x0 += sx; }
         if (e2 < dy) { err += dx; y0 += sy; }
     }
 }
 
-void Film::ExportToUnsignedChar() 
+/**
+ * \brief Mean relative standard error of the pixels in [x0, x1) x [y0, y1)
+ *
+ * The error of a pixel is the standard error of its mean luminance, relative
+ * to that mean. A small offset keeps nearly black pixels from never converging.
+ */
+Float Film::RelativeError(int x0, int y0, int x1, int y1) const
 {
-    m_bitmapOutput = new unsigned char[m_resolution.x * m_resolution.y * m_channels];
-    for (int x = 0; x < m_resolution.x; x++) {
-        for (int y = 0; y < m_resolution.y; y++) {
+    Float error = 0;
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
             int index = y * m_resolution.x + x;
-            Spectrum v(m_bitmap[index * 3], m_bitmap[index * 3 + 1], m_bitmap[index * 3 + 2]);
-            if (m_sampleNum[index] != 0) {
-                v /= m_sampleNum[index];
+            unsigned int n = m_sampleNum[index];
+            if (n < 2) {
+                return Infinity;
             }
-            SpectrumToUnsignedChar(v, &m_bitmapOutput[index * m_channels], m_channels);
+            Float mean = Spectrum(m_bitmap[index * 3], m_bitmap[index * 3 + 1], m_bitmap[index * 3 + 2]).Luminance() / n;
+            Float variance = max((Float)0, m_sqrSum[index] / n - mean * mean) * n / (n - 1);
+            error += std::sqrt(variance / n) / (mean + (Float)0.01);
         }
     }
+    return error / ((x1 - x0) * (y1 - y0));
+}
+
+/**
+ * \brief Clears the tiles whose relative error dropped below maxError
+ *
+ * active holds one flag per tile in row order. Returns the number of tiles
+ * which still need samples.
+ */
+int Film::UpdateActiveTiles(int tileSize, Float maxError, unsigned char* active) const
+{
+    int nTilesX = (m_resolution.x + tileSize - 1) / tileSize;
+    int nTilesY = (m_resolution.y + tileSize - 1) / tileSize;
+    int nActive = 0;
+    for (int ty = 0; ty < nTilesY; ty++) {
+        for (int tx = 0; tx < nTilesX; tx++) {
+            unsigned char& tileActive = active[ty * nTilesX + tx];
+            if (!tileActive) {
+                continue;
+            }
+            int x0 = tx * tileSize, x1 = min(x0 + tileSize, m_resolution.x);
+            int y0 = ty * tileSize, y1 = min(y0 + tileSize, m_resolution.y);
+            tileActive = RelativeError(x0, y0, x1, y1) > maxError;
+            nActive += tileActive;
+        }
+    }
+    return nActive;
+}
+
+// Row-major, a few rows per task
+void Film::ExportToUnsignedChar(unsigned char* output) const
+{
+    int width = m_resolution.x;
+    ParallelFor([&](int y) {
+        constexpr int chunkSize = 64;
+        Float scale[chunkSize];
+        for (int x0 = 0; x0 < width; x0 += chunkSize) {
+            int n = min(chunkSize, width - x0);
+            int index = y * width + x0;
+            for (int i = 0; i < n; i++) {
+                unsigned int sampleNum = m_sampleNum[index + i];
+                scale[i] = sampleNum != 0 ? (Float)1 / sampleNum : 1;
+            }
+            TonemapPixels(&m_bitmap[index * 3], scale, n, &output[index * m_channels], m_channels);
+        }
+    }, m_resolution.y, 16);
 }
 
 std::shared_ptr<Film>
@@ -68,5 +362,16 @@ CreateFilm(
 {
     Point2i resolution(param.GetInt("xresolution"), param.GetInt("yresolution"));
     std::string filename(param.GetString("filename"));
-    return std::shared_ptr<Film>(new Film(resolution, filename));
+    bool denoise = param.GetBool("denoise", false);
+    bool writeAOVs = param.GetBool("writeaovs", false);
+    std::shared_ptr<Film> film(new Film(resolution, filename, denoise, writeAOVs));
+
+    // OpenEXR output
+    std::string pixelType = param.GetString("pixeltype", "half");
+    ASSERT(pixelType == "half" || pixelType == "float", "Can't support pixel type " + pixelType);
+    film->m_halfFloat = pixelType == "half";
+    std::string compression = param.GetString("compression", "rle");
+    ASSERT(compression == "none" || compression == "rle", "Can't support compression " + compression);
+    film->m_rle = compression == "rle";
+    return film;
 }
@@ -6,25 +6,67 @@
 #include "renderer/core/parameterset.h"
 #include "renderer/core/spectrum.h"
 
+class ImageWriter;
+
+// Features of one sample at its first non-specular hit, zero if there is none
+struct AOVSample {
+    Spectrum albedo;
+    Normal3f normal;
+    Float depth = 0;
+};
+
+// An accumulation buffer of a film with the number of 32 bit values per pixel
+struct FilmBuffer {
+    char* data;
+    int components;
+    bool isUint;    // sample counts, the other buffers hold Float sums
+};
+
 class Film {
 public:
     Film() {}
-    Film(Point2i resolution, std::string filename);
+    Film(Point2i resolution, std::string filename, bool denoise = false, bool writeAOVs = false);
 
     __host__ __device__ void SetVal(int x, int y, Spectrum v);
     __host__ __device__ void AddSample(int x, int y, Spectrum v);
+    __host__ __device__ void AddAOVSample(int x, int y, const AOVSample& aov);
     __host__ __device__ Spectrum GetPixelSpectrum(int x, int y)const;
     __host__ __device__ Spectrum GetPixelSpectrum(int index)const;
     void DrawLine(const Point2f& s, const Point2f& t, const Spectrum& col);
-    void ExportToUnsignedChar();
+    Float RelativeError(int x0, int y0, int x1, int y1) const;
+    int UpdateActiveTiles(int tileSize, Float maxError, unsigned char* active) const;
+    void ExportToUnsignedChar(unsigned char* output) const;
+    // Hands 8-bit images to the background writer, WaitForOutput() blocks until they are written
     void Output();
+    // Progressive output after a pass, HDR files are only written by Output() once the render is done
+    void OutputPass();
+    void OutputDenoised();
+    void WaitForOutput();
+    // Films are shallow copies, so the buffers are only freed on request
+    void Release();
+    void WriteHDR(const std::string& filename, const Float* rgb, const unsigned int* sampleNum) const;
+    // Every buffer samples are summed into, in the order checkpoints and workers store them
+    std::vector<FilmBuffer> AccumulationBuffers() const;
+    __host__ __device__ bool HasAOVs() const { return m_albedo != nullptr; }
 
     std::string m_filename; 
     Point2i m_resolution;
     int m_channels;
     Float* m_bitmap = nullptr;
-    unsigned char* m_bitmapOutput = nullptr;
     unsigned int* m_sampleNum = nullptr;
+    Float* m_sqrSum = nullptr;      // sum of squared sample luminance, for the variance
+
+    // AOV sums, only allocated for the denoiser or HDR output of the AOVs
+    bool m_denoise = false;
+    bool m_writeAOVs = false;
+    Float* m_albedo = nullptr;
+    Float* m_normal = nullptr;
+    Float* m_depth = nullptr;
+
+    // Output files with a .pfm or .exr extension keep linear radiance
+    bool m_halfFloat = true;
+    bool m_rle = true;
+    std::shared_ptr<ImageWriter> m_writer;
 };
 
 std::shared_ptr<Film>
@@ -39,6 +81,7 @@ void Film::SetVal(int x, int y, Spectrum v)
         m_bitmap[index * 3 + i] = v[i];
     }    
     m_sampleNum[index] = 1;
+    m_sqrSum[index] = v.Luminance() * v.Luminance();
 }
 
 inline __host__ __device__ 
@@ -49,6 +92,20 @@ void Film::AddSample(int x, int y, Spectrum v)
         m_bitmap[index * 3 + i] += v[i];
     }
     m_sampleNum[index]++;
+    m_sqrSum[index] += v.Luminance() * v.Luminance();
+}
+
+inline __host__ __device__
+void Film::AddAOVSample(int x, int y, const AOVSample& aov)
+{
+    int index = y * m_resolution.x + x;
+    for (int i = 0; i < 3; i++) {
+        m_albedo[index * 3 + i] += aov.albedo[i];
+    }
+    m_normal[index * 3] += aov.normal.x;
+    m_normal[index * 3 + 1] += aov.normal.y;
+    m_normal[index * 3 + 2] += aov.normal.z;
+    m_depth[index] += aov.depth;
 }
 
 inline __host__ __device__
@@ -55,6 +55,7 @@ class Primitive;
 class Material;
 class Medium;
 class Spectrum;
+class TriangleMesh;
 
 inline __device__ __host__
 Float Radians(Float ang) {
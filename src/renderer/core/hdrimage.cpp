@@ -0,0 +1,282 @@
+#include "hdrimage.h"
+#include "renderer/core/mappedfile.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+// Round to nearest even, overflow goes to infinity and tiny values to subnormals
+unsigned short FloatToHalf(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(float));
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t absx = x & 0x7fffffff;
+
+    if (absx >= 0x7f800000) {
+        return sign | 0x7c00 | (absx > 0x7f800000 ? 0x200 : 0);
+    }
+    if (absx >= 0x477ff000) {
+        return sign | 0x7c00;
+    }
+    if (absx < 0x38800000) {
+        if (absx < 0x33000000) {
+            return sign;
+        }
+        uint32_t mantissa = (absx & 0x7fffff) | 0x800000;
+        int shift = 126 - (int)(absx >> 23);
+        uint32_t h = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (h & 1))) {
+            h++;
+        }
+        return sign | h;
+    }
+    uint32_t h = (absx - 0x38000000) >> 13;
+    uint32_t rest = absx & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (h & 1))) {
+        h++;
+    }
+    return sign | h;
+}
+
+static Float ChannelValue(const ImageChannel& channel, int index)
+{
+    if (channel.type == ImageChannel::Uint) {
+        return channel.uintData[index];
+    }
+    Float v = channel.data[index * channel.stride];
+    if (channel.sampleNum && channel.sampleNum[index] != 0) {
+        v /= channel.sampleNum[index];
+    }
+    return v;
+}
+
+bool WritePFM(
+    const std::string& filename,
+    int width,
+    int height,
+    const std::vector<ImageChannel>& channels)
+{
+    int nChannels = channels.size();
+    ASSERT(nChannels == 1 || nChannels == 3, "PFM only holds 1 or 3 channels");
+    std::string temporary = TemporaryFilename(filename);
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (!file) {
+        fprintf(stderr, "Can't write %s\n", filename.c_str());
+        return false;
+    }
+
+    // Negative scale means little endian, scanlines go from bottom to top
+    fprintf(file, "%s\n%d %d\n-1.0\n", nChannels == 3 ? "PF" : "Pf", width, height);
+    std::vector<float> row(width * nChannels);
+    for (int y = height - 1; y >= 0; y--) {
+        for (int x = 0; x < width; x++) {
+            for (int c = 0; c < nChannels; c++) {
+                row[x * nChannels + c] = ChannelValue(channels[c], y * width + x);
+            }
+        }
+        fwrite(row.data(), sizeof(float), row.size(), file);
+    }
+    if (!CommitTemporary(file, temporary, filename)) {
+        fprintf(stderr, "Can't write %s\n", filename.c_str());
+        return false;
+    }
+    return true;
+}
+
+static void PutBytes(std::vector<char>& buffer, const void* data, size_t size)
+{
+    const char* bytes = (const char*)data;
+    buffer.insert(buffer.end(), bytes, bytes + size);
+}
+
+static void PutString(std::vector<char>& buffer, const std::string& s)
+{
+    PutBytes(buffer, s.c_str(), s.size() + 1);
+}
+
+template<typename T>
+static void PutValue(std::vector<char>& buffer, T value)
+{
+    PutBytes(buffer, &value, sizeof(T));
+}
+
+static void PutAttribute(std::vector<char>& buffer, const std::string& name,
+    const std::string& type, const std::vector<char>& value)
+{
+    PutString(buffer, name);
+    PutString(buffer, type);
+    PutValue<int32_t>(buffer, value.size());
+    PutBytes(buffer, value.data(), value.size());
+}
+
+/**
+ * OpenEXR RLE: bytes are split into even and odd halves, delta encoded and
+ * then run length encoded. Returns the compressed size.
+ */
+static int CompressRLE(const char* in, int size, char* scratch, char* out)
+{
+    char* t1 = scratch;
+    char* t2 = scratch + (size + 1) / 2;
+    for (int i = 0; i < size; i++) {
+        if (i % 2 == 0) {
+            *t1++ = in[i];
+        }
+        else {
+            *t2++ = in[i];
+        }
+    }
+    int previous = (unsigned char)scratch[0];
+    for (int i = 1; i < size; i++) {
+        int current = (unsigned char)scratch[i];
+        scratch[i] = (char)(current - previous + 128 + 256);
+        previous = current;
+    }
+
+    constexpr int minRun = 3, maxRun = 127;
+    const char* end = scratch + size;
+    const char* runStart = scratch;
+    const char* runEnd = scratch + 1;
+    char* write = out;
+    while (runStart < end) {
+        while (runEnd < end && *runStart == *runEnd && runEnd - runStart - 1 < maxRun) {
+            ++runEnd;
+        }
+        if (runEnd - runStart >= minRun) {
+            *write++ = (char)((runEnd - runStart) - 1);
+            *write++ = *runStart;
+            runStart = runEnd;
+        }
+        else {
+            while (runEnd < end &&
+                ((runEnd + 1 >= end || *runEnd != *(runEnd + 1)) ||
+                (runEnd + 2 >= end || *(runEnd + 1) != *(runEnd + 2))) &&
+                runEnd - runStart < maxRun) {
+                ++runEnd;
+            }
+            *write++ = (char)(runStart - runEnd);
+            while (runStart < runEnd) {
+                *write++ = *runStart++;
+            }
+        }
+        ++runEnd;
+    }
+    return write - out;
+}
+
+bool WriteEXR(
+    const std::string& filename,
+    int width,
+    int height,
+    std::vector<ImageChannel> channels,
+    bool rle)
+{
+    // Readers expect the channel list, and so the scanline layout, sorted by name
+    std::sort(channels.begin(), channels.end(),
+        [](const ImageChannel& a, const ImageChannel& b) { return a.name < b.name; });
+
+    std::vector<char> header, value;
+    PutValue<int32_t>(header, 20000630);    // magic number
+    PutValue<int32_t>(header, 2);           // version 2, single part scanline file
+
+    for (const ImageChannel& channel : channels) {
+        PutString(value, channel.name);
+        PutValue<int32_t>(value, channel.type);
+        PutValue<int32_t>(value, 0);        // pLinear and reserved
+        PutValue<int32_t>(value, 1);        // x sampling
+        PutValue<int32_t>(value, 1);        // y sampling
+    }
+    value.push_back(0);
+    PutAttribute(header, "channels", "chlist", value);
+
+    value.assign(1, rle ? 1 : 0);
+    PutAttribute(header, "compression", "compression", value);
+    value.clear();
+    for (int32_t v : { 0, 0, width - 1, height - 1 }) {
+        PutValue(value, v);
+    }
+    PutAttribute(header, "dataWindow", "box2i", value);
+    PutAttribute(header, "displayWindow", "box2i", value);
+    value.assign(1, 0);                     // increasing y
+    PutAttribute(header, "lineOrder", "lineOrder", value);
+    value.clear();
+    PutValue(value, 1.f);
+    PutAttribute(header, "pixelAspectRatio", "float", value);
+    value.clear();
+    PutValue(value, 0.f);
+    PutValue(value, 0.f);
+    PutAttribute(header, "screenWindowCenter", "v2f", value);
+    value.clear();
+    PutValue(value, 1.f);
+    PutAttribute(header, "screenWindowWidth", "float", value);
+    header.push_back(0);
+
+    std::string temporary = TemporaryFilename(filename);
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (!file) {
+        fprintf(stderr, "Can't write %s\n", filename.c_str());
+        return false;
+    }
+    fwrite(header.data(), 1, header.size(), file);
+
+    // The offset table is filled in once the chunk sizes are known
+    std::vector<uint64_t> offsets(height);
+    uint64_t offset = header.size() + sizeof(uint64_t) * height;
+    fseek(file, sizeof(uint64_t) * height, SEEK_CUR);
+
+    int lineSize = 0;
+    for (const ImageChannel& channel : channels) {
+        lineSize += width * (channel.type == ImageChannel::Half ? 2 : 4);
+    }
+    std::vector<char> line(lineSize), scratch(lineSize), compressed(lineSize * 3 / 2 + 16);
+    for (int y = 0; y < height; y++) {
+        char* p = line.data();
+        for (const ImageChannel& channel : channels) {
+            for (int x = 0; x < width; x++) {
+                int index = y * width + x;
+                if (channel.type == ImageChannel::Uint) {
+                    uint32_t v = channel.uintData[index];
+                    memcpy(p, &v, 4);
+                    p += 4;
+                }
+                else if (channel.type == ImageChannel::Half) {
+                    unsigned short v = FloatToHalf(ChannelValue(channel, index));
+                    memcpy(p, &v, 2);
+                    p += 2;
+                }
+                else {
+                    float v = ChannelValue(channel, index);
+                    memcpy(p, &v, 4);
+                    p += 4;
+                }
+            }
+        }
+
+        // Chunks which do not shrink are stored as they are
+        const char* data = line.data();
+        int32_t dataSize = lineSize;
+        if (rle) {
+            int size = CompressRLE(line.data(), lineSize, scratch.data(), compressed.data());
+            if (size < lineSize) {
+                data = compressed.data();
+                dataSize = size;
+            }
+        }
+        int32_t lineY = y;
+        fwrite(&lineY, sizeof(int32_t), 1, file);
+        fwrite(&dataSize, sizeof(int32_t), 1, file);
+        fwrite(data, 1, dataSize, file);
+        offsets[y] = offset;
+        offset += 2 * sizeof(int32_t) + dataSize;
+    }
+
+    fseek(file, header.size(), SEEK_SET);
+    fwrite(offsets.data(), sizeof(uint64_t), height, file);
+    if (!CommitTemporary(file, temporary, filename)) {
+        fprintf(stderr, "Can't write %s\n", filename.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#ifndef __HDRIMAGE_H
+#define __HDRIMAGE_H
+
+#include "renderer/core/fwd.h"
+
+/**
+ * \brief A channel of an HDR image, read in place from a film buffer
+ *
+ * Pixel i is data[i * stride], divided by sampleNum[i] if sampleNum is set.
+ * Uint channels take their values from uintData instead.
+ */
+struct ImageChannel {
+    // Same values as the OpenEXR pixel types
+    enum Type {
+        Uint = 0,
+        Half = 1,
+        Float32 = 2,
+    };
+
+    std::string name;
+    Type type = Half;
+    const Float* data = nullptr;
+    int stride = 1;
+    const unsigned int* sampleNum = nullptr;
+    const unsigned int* uintData = nullptr;
+};
+
+unsigned short FloatToHalf(float f);
+
+/**
+ * Both writers stream one scanline at a time, so no copy of the image is
+ * built. PFM holds 1 or 3 float channels, OpenEXR any number of channels,
+ * uncompressed or RLE compressed. The image is written to a temporary file
+ * that replaces filename once it is complete.
+ */
+bool WritePFM(
+    const std::string& filename,
+    int width,
+    int height,
+    const std::vector<ImageChannel>& channels);
+
+bool WriteEXR(
+    const std::string& filename,
+    int width,
+    int height,
+    std::vector<ImageChannel> channels,
+    bool rle);
+
+#endif // !__HDRIMAGE_H
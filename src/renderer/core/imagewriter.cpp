@@ -0,0 +1,84 @@
+#include "imagewriter.h"
+
+#ifndef STB_IMAGE_WRITE_IMPLEMENTATION
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "ext/stb_image/stb_image_write.h"
+#endif // !STB_IMAGE_WRITE_IMPLEMENTATION
+
+ImageWriter::ImageWriter()
+    : m_writeIndex(0), m_pending(false), m_writing(false), m_exit(false),
+    m_width(0), m_height(0), m_channels(0)
+{
+    m_thread = std::thread(&ImageWriter::Run, this);
+}
+
+ImageWriter::~ImageWriter()
+{
+    Flush();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_exit = true;
+    }
+    m_condition.notify_all();
+    m_thread.join();
+}
+
+unsigned char* ImageWriter::Acquire(const std::string& filename, int width, int height, int channels)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    // A newer frame of the same image replaces the pending one, other images must not be lost
+    m_condition.wait(lock, [&]() { return !m_pending || m_filename == filename; });
+    m_pending = false;
+
+    m_filename = filename;
+    m_width = width;
+    m_height = height;
+    m_channels = channels;
+    std::vector<unsigned char>& buffer = m_buffers[1 - m_writeIndex];
+    buffer.resize(size_t(width) * height * channels);
+    return buffer.data();
+}
+
+void ImageWriter::Submit()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending = true;
+    }
+    m_condition.notify_all();
+}
+
+void ImageWriter::Flush()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_condition.wait(lock, [&]() { return !m_pending && !m_writing; });
+}
+
+void ImageWriter::Run()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_condition.wait(lock, [&]() { return m_pending || m_exit; });
+        if (!m_pending) {
+            return;
+        }
+
+        // Take over the filled buffer, the renderer gets the other one
+        m_writeIndex = 1 - m_writeIndex;
+        m_pending = false;
+        m_writing = true;
+        std::string filename = m_filename;
+        int width = m_width, height = m_height, channels = m_channels;
+        const unsigned char* data = m_buffers[m_writeIndex].data();
+
+        lock.unlock();
+        m_condition.notify_all();
+        if (!stbi_write_png(filename.c_str(), width, height, channels, data, 0)) {
+            fprintf(stderr, "Can't write %s\n", filename.c_str());
+        }
+        lock.lock();
+
+        m_writing = false;
+        m_condition.notify_all();
+    }
+}
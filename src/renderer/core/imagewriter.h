@@ -0,0 +1,47 @@
+#pragma once
+#ifndef __IMAGEWRITER_H
+#define __IMAGEWRITER_H
+
+#include "renderer/core/fwd.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+/**
+ * \brief Compresses and writes 8-bit images on a background thread
+ *
+ * Two buffers are reused: the renderer fills one between Acquire() and
+ * Submit() while the other one is being written. A frame which is still
+ * pending when the next frame of the same file is acquired is dropped, so
+ * progressive output never makes the render wait for PNG compression.
+ */
+class ImageWriter {
+public:
+    ImageWriter();
+    ~ImageWriter();
+
+    // Buffer for the next frame, valid until Submit()
+    unsigned char* Acquire(const std::string& filename, int width, int height, int channels);
+    void Submit();
+    // Block until every submitted frame is on disk
+    void Flush();
+
+private:
+    void Run();
+
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+
+    std::vector<unsigned char> m_buffers[2];
+    int m_writeIndex;       // buffer owned by the writer thread
+    bool m_pending;         // the other buffer holds a frame to write
+    bool m_writing;
+    bool m_exit;
+
+    std::string m_filename;
+    int m_width, m_height, m_channels;
+};
+
+#endif // !__IMAGEWRITER_H
@@ -0,0 +1,214 @@
+#include "instance.h"
+
+#include "renderer/core/primitive.h"
+#include "renderer/core/triangle.h"
+#include "renderer/core/interaction.h"
+#include "renderer/core/parallel.h"
+
+// Bounds of the eight transformed corners of b
+static Bounds3f TransformBounds(const Transform& t, const Bounds3f& b)
+{
+    Bounds3f ret;
+    for (int corner = 0; corner < 8; corner++) {
+        Point3f p((corner & 1) ? b.pMax.x : b.pMin.x,
+            (corner & 2) ? b.pMax.y : b.pMin.y,
+            (corner & 4) ? b.pMax.z : b.pMin.z);
+        ret = Union(ret, t(p));
+    }
+    return ret;
+}
+
+void InstancedObject::Build(
+    const std::vector<Primitive>& primitives,
+    const std::vector<Triangle>& triangles,
+    BVHAccelerator::SplitMethod splitMethod,
+    int maxPrimsInNode,
+    int bvhWidth,
+    bool precomputeTriangles,
+    const std::string& cacheDirectory)
+{
+    std::vector<Primitive> objectPrimitives(
+        primitives.begin() + m_primitiveBegin, primitives.begin() + m_primitiveEnd);
+    m_bounds = Bounds3f();
+    for (const Primitive& primitive : objectPrimitives) {
+        m_bounds = Union(m_bounds, triangles[primitive.m_shapeID].WorldBounds());
+    }
+
+    m_bvhWidth = bvhWidth;
+    m_bvh = std::make_shared<BVHAccelerator>();
+    m_bvh->m_cacheDirectory = cacheDirectory;
+    m_bvh->Build(objectPrimitives, triangles, splitMethod, maxPrimsInNode);
+    if (m_bvhWidth > 2) {
+        m_wideBvh = std::make_shared<WideBVHAccelerator>();
+        m_wideBvh->Build(*m_bvh, m_bvhWidth, precomputeTriangles);
+        if (precomputeTriangles)
+            m_wideBvh->BuildTriangleBlocks(triangles);
+    }
+    else if (precomputeTriangles) {
+        m_bvh->BuildTriangleRecords(triangles);
+    }
+}
+
+size_t InstancedObject::NodeBytes() const
+{
+    size_t bytes = m_bvh->m_totalNodes * sizeof(LinearBVHNode);
+    if (m_bvhWidth > 2) {
+        bytes += m_wideBvh->m_nodes4.size() * sizeof(WideBVHNode<4>) +
+            m_wideBvh->m_nodes8.size() * sizeof(WideBVHNode<8>);
+    }
+    return bytes;
+}
+
+size_t InstancedObject::TriangleRecordBytes() const
+{
+    if (m_bvhWidth > 2)
+        return m_wideBvh->TriangleBlockBytes();
+    return m_bvh->m_triangleRecords.size() * sizeof(TriangleRecord);
+}
+
+bool InstancedObject::IntersectP(
+    const Ray& ray,
+    Interaction* inter,
+    const Triangle* triangles) const
+{
+    if (m_bvhWidth > 2)
+        return m_wideBvh->IntersectP(ray, inter, triangles);
+    return m_bvh->IntersectP(ray, inter, triangles);
+}
+
+bool InstancedObject::Intersect(
+    const Ray& ray,
+    const Triangle* triangles) const
+{
+    if (m_bvhWidth > 2)
+        return m_wideBvh->Intersect(ray, triangles);
+    return m_bvh->Intersect(ray, triangles);
+}
+
+void InstanceAccelerator::Build(
+    const std::vector<InstancedObject>& objects,
+    const std::vector<Instance>& instances,
+    const std::vector<Primitive>& primitives,
+    const std::vector<Triangle>& triangles,
+    BVHAccelerator::SplitMethod splitMethod,
+    int maxPrimsInNode,
+    int bvhWidth,
+    bool precomputeTriangles,
+    const std::string& cacheDirectory)
+{
+    m_objects = objects;
+    m_instances = instances;
+
+    // Bottom level, built once per object however often it is instanced
+    ParallelFor([&](int i) {
+        m_objects[i].Build(primitives, triangles, splitMethod, maxPrimsInNode, bvhWidth, precomputeTriangles, cacheDirectory);
+    }, m_objects.size());
+
+    // Top level over the world bounds of the instances
+    std::vector<Primitive> instancePrimitives(m_instances.size());
+    std::vector<Bounds3f> instanceBounds(m_instances.size());
+    for (int i = 0; i < m_instances.size(); i++) {
+        const Instance& instance = m_instances[i];
+        instancePrimitives[i] = Primitive(i, -1, -1);
+        instanceBounds[i] = TransformBounds(instance.m_objToWorld, m_objects[instance.m_objectID].m_bounds);
+    }
+    m_bvh.Build(instancePrimitives, instanceBounds, splitMethod, maxPrimsInNode);
+}
+
+bool InstanceAccelerator::IntersectP(
+    const Ray& ray,
+    Interaction* inter,
+    const Triangle* triangles) const
+{
+    if (!m_bvh.m_nodes) return false;
+    bool hit = false;
+    Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+    int dirIsNeg[3] = { invDir.x < 0,invDir.y < 0,invDir.z < 0 };
+
+    int currentNodeIndex = 0, toVisitOffset = 0;
+    int nodesToVisit[maxBVHDepth];
+    while (true) {
+        const LinearBVHNode* node = &m_bvh.m_nodes[currentNodeIndex];
+        if (node->bounds.Intersect(ray, invDir, dirIsNeg)) {
+            if (node->nPrimitives > 0) {
+                // Leaf node, trace the instances in object space
+                for (int i = 0; i < node->nPrimitives; i++) {
+                    const Instance& instance = m_instances[m_bvh.m_primitives[node->primitivesOffset + i].m_shapeID];
+                    Ray objRay = instance.m_worldToObj(ray);
+                    if (m_objects[instance.m_objectID].IntersectP(objRay, inter, triangles)) {
+                        ray.tMax = objRay.tMax;
+                        hit = true;
+
+                        // Move the interaction back to world space
+                        inter->m_p = ray(ray.tMax);
+                        inter->m_wo = -ray.d;
+                        inter->m_geometryN = Normalize(instance.m_objToWorld(inter->m_geometryN));
+                        inter->m_shadingN = Normalize(instance.m_objToWorld(inter->m_shadingN));
+                    }
+                }
+                if (toVisitOffset == 0) break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            }
+            else {
+                // Interior node
+                if (dirIsNeg[node->axis]) {
+                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                    currentNodeIndex = node->rightChildOffset;
+                }
+                else {
+                    nodesToVisit[toVisitOffset++] = node->rightChildOffset;
+                    currentNodeIndex = currentNodeIndex + 1;
+                }
+            }
+        }
+        else {
+            if (toVisitOffset == 0) break;
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
+    }
+    return hit;
+}
+
+bool InstanceAccelerator::Intersect(
+    const Ray& ray,
+    const Triangle* triangles) const
+{
+    if (!m_bvh.m_nodes) return false;
+    Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+    int dirIsNeg[3] = { invDir.x < 0,invDir.y < 0,invDir.z < 0 };
+
+    int currentNodeIndex = 0, toVisitOffset = 0;
+    int nodesToVisit[maxBVHDepth];
+    while (true) {
+        const LinearBVHNode* node = &m_bvh.m_nodes[currentNodeIndex];
+        if (node->bounds.Intersect(ray, invDir, dirIsNeg)) {
+            if (node->nPrimitives > 0) {
+                // Leaf node
+                for (int i = 0; i < node->nPrimitives; i++) {
+                    const Instance& instance = m_instances[m_bvh.m_primitives[node->primitivesOffset + i].m_shapeID];
+                    if (m_objects[instance.m_objectID].Intersect(instance.m_worldToObj(ray), triangles)) {
+                        return true;
+                    }
+                }
+                if (toVisitOffset == 0) break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            }
+            else {
+                // Interior node
+                if (dirIsNeg[node->axis]) {
+                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                    currentNodeIndex = node->rightChildOffset;
+                }
+                else {
+                    nodesToVisit[toVisitOffset++] = node->rightChildOffset;
+                    currentNodeIndex = currentNodeIndex + 1;
+                }
+            }
+        }
+        else {
+            if (toVisitOffset == 0) break;
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
+    }
+    return false;
+}
@@ -0,0 +1,104 @@
+#pragma once
+#ifndef __INSTANCE_H
+#define __INSTANCE_H
+
+#include "renderer/core/fwd.h"
+#include "renderer/core/geometry.h"
+#include "renderer/core/transform.h"
+#include "renderer/core/bvh.h"
+#include "renderer/core/widebvh.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * \brief Geometry defined between ObjectBegin and ObjectEnd
+ *
+ * Its primitives [m_primitiveBegin, m_primitiveEnd) stay in the scene's
+ * primitive array, in object space, and get a bottom-level BVH of their own
+ * that every instance of the object shares.
+ */
+class InstancedObject {
+public:
+    InstancedObject() {}
+    InstancedObject(int primitiveBegin, int primitiveEnd)
+        : m_primitiveBegin(primitiveBegin), m_primitiveEnd(primitiveEnd) {}
+
+    void Build(
+        const std::vector<Primitive>& primitives,
+        const std::vector<Triangle>& triangles,
+        BVHAccelerator::SplitMethod splitMethod,
+        int maxPrimsInNode,
+        int bvhWidth,
+        bool precomputeTriangles,
+        const std::string& cacheDirectory);
+
+    bool IntersectP(
+        const Ray& ray,
+        Interaction* inter,
+        const Triangle* triangles) const;
+    bool Intersect(
+        const Ray& ray,
+        const Triangle* triangles) const;
+
+    // Bytes of BVH nodes and triangle records
+    size_t NodeBytes() const;
+    size_t TriangleRecordBytes() const;
+
+    int m_primitiveBegin;
+    int m_primitiveEnd;
+    Bounds3f m_bounds;      // object space
+    int m_bvhWidth;
+    std::shared_ptr<BVHAccelerator> m_bvh;
+    std::shared_ptr<WideBVHAccelerator> m_wideBvh;
+};
+
+// One placement of an InstancedObject in the world
+class Instance {
+public:
+    Instance() {}
+    Instance(int objectID, const Transform& objToWorld)
+        : m_objectID(objectID), m_objToWorld(objToWorld), m_worldToObj(Inverse(objToWorld)) {}
+
+    int m_objectID;
+    Transform m_objToWorld;
+    Transform m_worldToObj;
+};
+
+/**
+ * \brief Top-level BVH over instances
+ *
+ * Rays are moved into object space of each instance they reach and traced
+ * through the object's bottom-level BVH. The transformed direction is not
+ * normalized, so hit distances are the same in both spaces.
+ */
+class InstanceAccelerator {
+public:
+    InstanceAccelerator() {}
+
+    void Build(
+        const std::vector<InstancedObject>& objects,
+        const std::vector<Instance>& instances,
+        const std::vector<Primitive>& primitives,
+        const std::vector<Triangle>& triangles,
+        BVHAccelerator::SplitMethod splitMethod,
+        int maxPrimsInNode,
+        int bvhWidth,
+        bool precomputeTriangles,
+        const std::string& cacheDirectory);
+
+    bool IntersectP(
+        const Ray& ray,
+        Interaction* inter,
+        const Triangle* triangles) const;
+    bool Intersect(
+        const Ray& ray,
+        const Triangle* triangles) const;
+
+    std::vector<InstancedObject> m_objects;
+    std::vector<Instance> m_instances;
+    BVHAccelerator m_bvh;   // primitive i of the BVH is instance i
+};
+
+#endif // !__INSTANCE_H
@@ -11,6 +11,9 @@ CreateIntegrator(
     const ParameterSet& param)
 {
     int maxDepth = param.GetInt("maxdepth", 5);
-    return std::make_shared<Integrator>(maxDepth);
+    std::shared_ptr<Integrator> integrator = std::make_shared<Integrator>(maxDepth);
+    integrator->m_maxError = param.GetFloat("maxerror", 0);
+    integrator->m_minSample = param.GetInt("minsamples", 8);
+    return integrator;
 }
 
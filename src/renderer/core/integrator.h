@@ -12,6 +12,11 @@ public:
 
     int m_maxDepth;
     int m_nSample;
+
+    // Adaptive sampling: tiles stop once their relative error is below
+    // m_maxError, but not before m_minSample samples. 0 disables it.
+    Float m_maxError = 0;
+    int m_minSample = 8;
 };
 
 std::shared_ptr<Integrator>
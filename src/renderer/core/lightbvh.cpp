@@ -0,0 +1,224 @@
+#include "lightbvh.h"
+
+#include <algorithm>
+
+// Bounds of one light or a group of lights, before they become a node
+struct LightBounds {
+    Bounds3f bounds;
+    Vector3f w;
+    Float phi = 0;
+    Float cosTheta_o = 1;
+    Float cosTheta_e = 1;
+};
+
+// Smallest cone containing the cones (wa, cosThetaA) and (wb, cosThetaB)
+static void UnionCone(
+    const Vector3f& wa, Float cosThetaA,
+    const Vector3f& wb, Float cosThetaB,
+    Vector3f* w, Float* cosTheta)
+{
+    Float thetaA = std::acos(Clamp(cosThetaA, -1.f, 1.f));
+    Float thetaB = std::acos(Clamp(cosThetaB, -1.f, 1.f));
+    Float thetaD = std::acos(Clamp(Dot(wa, wb), -1.f, 1.f));
+    if (std::min(thetaD + thetaB, Pi) <= thetaA) {
+        *w = wa;
+        *cosTheta = cosThetaA;
+        return;
+    }
+    if (std::min(thetaD + thetaA, Pi) <= thetaB) {
+        *w = wb;
+        *cosTheta = cosThetaB;
+        return;
+    }
+
+    Float thetaO = (thetaA + thetaD + thetaB) / 2;
+    Vector3f axis = Cross(wa, wb);
+    if (thetaO >= Pi || axis.SqrLength() == 0) {
+        *w = wa;
+        *cosTheta = -1;
+        return;
+    }
+
+    // Rotate wa towards wb by thetaO - thetaA (Rodrigues' formula)
+    axis = Normalize(axis);
+    Float thetaR = thetaO - thetaA;
+    Float cosR = std::cos(thetaR), sinR = std::sin(thetaR);
+    *w = Normalize(wa * cosR + Cross(axis, wa) * sinR + axis * (Dot(axis, wa) * (1 - cosR)));
+    *cosTheta = std::cos(thetaO);
+}
+
+static LightBounds Union(const LightBounds& a, const LightBounds& b)
+{
+    if (a.phi == 0) return b;
+    if (b.phi == 0) return a;
+    LightBounds ret;
+    ret.bounds = Union(a.bounds, b.bounds);
+    UnionCone(a.w, a.cosTheta_o, b.w, b.cosTheta_o, &ret.w, &ret.cosTheta_o);
+    ret.phi = a.phi + b.phi;
+    ret.cosTheta_e = std::min(a.cosTheta_e, b.cosTheta_e);
+    return ret;
+}
+
+/*
+ * Cost of a group of lights for the split heuristic, power times the solid
+ * angle measure of its cone times its surface area
+ */
+static Float EvaluateCost(const LightBounds& b, const Bounds3f& bounds, int dim)
+{
+    Float thetaO = std::acos(Clamp(b.cosTheta_o, -1.f, 1.f));
+    Float thetaE = std::acos(Clamp(b.cosTheta_e, -1.f, 1.f));
+    Float thetaW = std::min(thetaO + thetaE, Pi);
+    Float sinThetaO = LightBVHSafeSqrt(1 - b.cosTheta_o * b.cosTheta_o);
+    Float mOmega = 2 * Pi * (1 - b.cosTheta_o) +
+        Pi / 2 * (2 * thetaW * sinThetaO - std::cos(thetaO - 2 * thetaW) -
+            2 * thetaO * sinThetaO + b.cosTheta_o);
+
+    // Discourage long thin nodes
+    Vector3f d = bounds.Diagonal();
+    Float maxExtent = std::max(d.x, std::max(d.y, d.z));
+    Float kr = d[dim] > 0 ? maxExtent / d[dim] : 1;
+    return b.phi * mOmega * kr * b.bounds.Area();
+}
+
+static LightBounds TriangleLightBounds(const Light& light, const Triangle& triangle)
+{
+    const TriangleMesh* mesh = triangle.m_triangleMeshPtr;
+    const int* indices = &mesh->m_indices[triangle.m_index * 3];
+    Point3f p[3] = { mesh->m_P[indices[0]], mesh->m_P[indices[1]], mesh->m_P[indices[2]] };
+
+    LightBounds lb;
+    lb.bounds = Union(Bounds3f(p[0], p[1]), p[2]);
+    lb.phi = light.m_L.Luminance() * triangle.Area() * Pi;
+    lb.cosTheta_e = 0;
+
+    // Emission follows the shading normal, which stays within the cone
+    // spanned by the vertex normals
+    Vector3f n = Cross(p[1] - p[0], p[2] - p[0]);
+    if (n.SqrLength() == 0) {
+        lb.phi = 0;
+        return lb;
+    }
+    lb.w = Normalize(n);
+    lb.cosTheta_o = 1;
+    if (mesh->m_N) {
+        Vector3f sum;
+        for (int i = 0; i < 3; i++) {
+            const Normal3f& vn = mesh->m_N[indices[i]];
+            sum = sum + Normalize(Vector3f(vn.x, vn.y, vn.z));
+        }
+        if (sum.SqrLength() > 0) {
+            lb.w = Normalize(sum);
+            for (int i = 0; i < 3; i++) {
+                const Normal3f& vn = mesh->m_N[indices[i]];
+                lb.cosTheta_o = std::min(lb.cosTheta_o, Dot(lb.w, Normalize(Vector3f(vn.x, vn.y, vn.z))));
+            }
+        }
+    }
+    return lb;
+}
+
+static void BuildRecursive(
+    std::vector<std::pair<int, LightBounds>>& lights,
+    int begin, int end,
+    unsigned long long bitTrail, int depth,
+    std::vector<LightBVHNode>& nodes,
+    std::vector<unsigned long long>& bitTrails)
+{
+    ASSERT(depth < 64, "Light BVH is too deep for its bit trails");
+    auto emitNode = [&](const LightBounds& lb) {
+        LightBVHNode node;
+        node.bounds = lb.bounds;
+        node.w = lb.w;
+        node.phi = lb.phi;
+        node.cosTheta_o = lb.cosTheta_o;
+        node.cosTheta_e = lb.cosTheta_e;
+        node.childOrLightIndex = -1;
+        node.isLeaf = 0;
+        nodes.push_back(node);
+        return int(nodes.size()) - 1;
+    };
+
+    if (end - begin == 1) {
+        int nodeIndex = emitNode(lights[begin].second);
+        nodes[nodeIndex].childOrLightIndex = lights[begin].first;
+        nodes[nodeIndex].isLeaf = 1;
+        bitTrails[lights[begin].first] = bitTrail;
+        return;
+    }
+
+    Bounds3f bounds, centroidBounds;
+    LightBounds total;
+    for (int i = begin; i < end; i++) {
+        const LightBounds& lb = lights[i].second;
+        bounds = Union(bounds, lb.bounds);
+        centroidBounds = Union(centroidBounds, lb.bounds.Centroid());
+        total = Union(total, lb);
+    }
+
+    // Bucketed split along every axis with the lowest cost
+    constexpr int nBuckets = 12;
+    Float minCost = Infinity;
+    int minCostSplitBucket = -1, minCostSplitDim = -1;
+    for (int dim = 0; dim < 3; dim++) {
+        if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) continue;
+
+        LightBounds bucketLightBounds[nBuckets];
+        for (int i = begin; i < end; i++) {
+            Point3f pc = lights[i].second.bounds.Centroid();
+            int b = nBuckets * centroidBounds.Offset(pc)[dim];
+            if (b == nBuckets) b = nBuckets - 1;
+            bucketLightBounds[b] = Union(bucketLightBounds[b], lights[i].second);
+        }
+
+        for (int i = 0; i < nBuckets - 1; i++) {
+            LightBounds b0, b1;
+            for (int j = 0; j <= i; j++) b0 = Union(b0, bucketLightBounds[j]);
+            for (int j = i + 1; j < nBuckets; j++) b1 = Union(b1, bucketLightBounds[j]);
+            Float cost = EvaluateCost(b0, bounds, dim) + EvaluateCost(b1, bounds, dim);
+            if (cost > 0 && cost < minCost) {
+                minCost = cost;
+                minCostSplitBucket = i;
+                minCostSplitDim = dim;
+            }
+        }
+    }
+
+    int mid;
+    if (minCostSplitDim == -1) {
+        mid = (begin + end) / 2;
+    }
+    else {
+        auto pmid = std::partition(lights.begin() + begin, lights.begin() + end,
+            [=](const std::pair<int, LightBounds>& l) {
+                int b = nBuckets * centroidBounds.Offset(l.second.bounds.Centroid())[minCostSplitDim];
+                if (b == nBuckets) b = nBuckets - 1;
+                return b <= minCostSplitBucket;
+            });
+        mid = pmid - lights.begin();
+        if (mid == begin || mid == end) mid = (begin + end) / 2;
+    }
+
+    int nodeIndex = emitNode(total);
+    BuildRecursive(lights, begin, mid, bitTrail, depth + 1, nodes, bitTrails);
+    int secondChild = nodes.size();
+    BuildRecursive(lights, mid, end, bitTrail | (1ull << depth), depth + 1, nodes, bitTrails);
+    nodes[nodeIndex].childOrLightIndex = secondChild;
+}
+
+void LightBVH::Build(const std::vector<Light>& lights, const std::vector<Triangle>& triangles)
+{
+    m_nodes.clear();
+    m_bitTrails.assign(lights.size(), ~0ull);
+
+    std::vector<std::pair<int, LightBounds>> bvhLights;
+    for (int i = 0; i < lights.size(); i++) {
+        LightBounds lb = TriangleLightBounds(lights[i], triangles[lights[i].m_shapeID]);
+        if (lb.phi > 0) {
+            bvhLights.push_back(std::make_pair(i, lb));
+        }
+    }
+    if (bvhLights.empty()) return;
+
+    m_nodes.reserve(2 * bvhLights.size() - 1);
+    BuildRecursive(bvhLights, 0, bvhLights.size(), 0, 0, m_nodes, m_bitTrails);
+}
@@ -0,0 +1,159 @@
+#pragma once
+#ifndef __LIGHTBVH_H
+#define __LIGHTBVH_H
+
+#include "renderer/core/fwd.h"
+#include "renderer/core/geometry.h"
+#include "renderer/core/light.h"
+#include "renderer/core/triangle.h"
+
+#include <vector>
+
+/**
+ * \brief Node of a light BVH
+ *
+ * Bounds the lights below it in space, in emitted power and in direction:
+ * every normal lies within acos(cosTheta_o) of w, and each surface emits up
+ * to acos(cosTheta_e) away from its normal.
+ */
+struct LightBVHNode {
+    Bounds3f bounds;
+    Vector3f w;
+    Float phi;
+    Float cosTheta_o;
+    Float cosTheta_e;
+    int childOrLightIndex;  // Interior  the offset of the second child
+                            // Leaf      the index in the scene's light array
+    int isLeaf;
+};
+
+inline __device__ __host__
+Float LightBVHSafeSqrt(Float x)
+{
+    return sqrt(max(x, Float(0)));
+}
+
+/*
+ * Conservative estimate of the light a node sends towards a shading point,
+ * n may be zero for points without an orientation
+ */
+inline __device__ __host__
+Float LightBVHImportance(const LightBVHNode& node, const Point3f& p, const Normal3f& n)
+{
+    // cos(a - b) and sin(a - b) clamped to a >= b
+    auto cosSubClamped = [](Float sinA, Float cosA, Float sinB, Float cosB) -> Float {
+        if (cosA > cosB) return 1;
+        return cosA * cosB + sinA * sinB;
+    };
+    auto sinSubClamped = [](Float sinA, Float cosA, Float sinB, Float cosB) -> Float {
+        if (cosA > cosB) return 0;
+        return sinA * cosB - cosA * sinB;
+    };
+
+    Point3f pc = node.bounds.Centroid();
+    Float d2 = (p - pc).SqrLength();
+    d2 = max(d2, node.bounds.Diagonal().Length() / 2);
+    Vector3f wi = Normalize(p - pc);
+    Float cosTheta_w = Dot(node.w, wi);
+    Float sinTheta_w = LightBVHSafeSqrt(1 - cosTheta_w * cosTheta_w);
+
+    // Directions from p covered by the bounding sphere of the node
+    Float radius2 = node.bounds.Diagonal().SqrLength() / 4;
+    Float cosTheta_b = (p - pc).SqrLength() < radius2 ? -1 :
+        LightBVHSafeSqrt(1 - radius2 / (p - pc).SqrLength());
+    Float sinTheta_b = LightBVHSafeSqrt(1 - cosTheta_b * cosTheta_b);
+
+    // Smallest angle between wi and the normal cone, minus the subtended angle
+    Float sinTheta_o = LightBVHSafeSqrt(1 - node.cosTheta_o * node.cosTheta_o);
+    Float cosTheta_x = cosSubClamped(sinTheta_w, cosTheta_w, sinTheta_o, node.cosTheta_o);
+    Float sinTheta_x = sinSubClamped(sinTheta_w, cosTheta_w, sinTheta_o, node.cosTheta_o);
+    Float cosThetap = cosSubClamped(sinTheta_x, cosTheta_x, sinTheta_b, cosTheta_b);
+    if (cosThetap <= node.cosTheta_e) return 0;
+
+    Float importance = node.phi * cosThetap / d2;
+    if (n.x != 0 || n.y != 0 || n.z != 0) {
+        Float cosTheta_i = std::fabs(Dot(wi, n));
+        Float sinTheta_i = LightBVHSafeSqrt(1 - cosTheta_i * cosTheta_i);
+        importance *= cosSubClamped(sinTheta_i, cosTheta_i, sinTheta_b, cosTheta_b);
+    }
+    return max(importance, Float(0));
+}
+
+/*
+ * Walk down from the root choosing children in proportion to importance,
+ * returns -1 if no light can reach p
+ */
+inline __device__ __host__
+int SampleLightBVH(const LightBVHNode* nodes, int nodeNum,
+    const Point3f& p, const Normal3f& n, Float u, Float* pmf)
+{
+    *pmf = 0;
+    if (nodeNum == 0) return -1;
+    int nodeIndex = 0;
+    Float nodePmf = 1;
+    while (!nodes[nodeIndex].isLeaf) {
+        const LightBVHNode& node = nodes[nodeIndex];
+        Float ci0 = LightBVHImportance(nodes[nodeIndex + 1], p, n);
+        Float ci1 = LightBVHImportance(nodes[node.childOrLightIndex], p, n);
+        if (ci0 == 0 && ci1 == 0) return -1;
+
+        Float p0 = ci0 / (ci0 + ci1);
+        if (u < p0) {
+            u = min(u / p0, Float(0.99999994));
+            nodePmf *= p0;
+            nodeIndex = nodeIndex + 1;
+        }
+        else {
+            u = min((u - p0) / (1 - p0), Float(0.99999994));
+            nodePmf *= 1 - p0;
+            nodeIndex = node.childOrLightIndex;
+        }
+    }
+    if (nodeIndex == 0 && LightBVHImportance(nodes[0], p, n) == 0) return -1;
+    *pmf = nodePmf;
+    return nodes[nodeIndex].childOrLightIndex;
+}
+
+// Probability of SampleLightBVH choosing the light with the given bit trail
+inline __device__ __host__
+Float LightBVHPmf(const LightBVHNode* nodes, int nodeNum, unsigned long long bitTrail,
+    const Point3f& p, const Normal3f& n)
+{
+    if (nodeNum == 0 || bitTrail == ~0ull) return 0;
+    int nodeIndex = 0;
+    Float pmf = 1;
+    while (!nodes[nodeIndex].isLeaf) {
+        const LightBVHNode& node = nodes[nodeIndex];
+        Float ci0 = LightBVHImportance(nodes[nodeIndex + 1], p, n);
+        Float ci1 = LightBVHImportance(nodes[node.childOrLightIndex], p, n);
+        if (ci0 == 0 && ci1 == 0) return 0;
+        if (bitTrail & 1) {
+            pmf *= ci1 / (ci0 + ci1);
+            nodeIndex = node.childOrLightIndex;
+        }
+        else {
+            pmf *= ci0 / (ci0 + ci1);
+            nodeIndex = nodeIndex + 1;
+        }
+        bitTrail >>= 1;
+    }
+    if (nodeIndex == 0 && LightBVHImportance(nodes[0], p, n) == 0) return 0;
+    return pmf;
+}
+
+/**
+ * \brief Hierarchy over the area lights for importance sampling them
+ *
+ * Lights that emit nothing are left out and are never chosen.
+ */
+class LightBVH {
+public:
+    LightBVH() {}
+
+    void Build(const std::vector<Light>& lights, const std::vector<Triangle>& triangles);
+
+    std::vector<LightBVHNode> m_nodes;
+    std::vector<unsigned long long> m_bitTrails;    // per light, ~0 if not in the tree
+};
+
+#endif // !__LIGHTBVH_H
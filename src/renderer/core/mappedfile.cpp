@@ -0,0 +1,158 @@
+#include "mappedfile.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+#include <io.h>
+#include <process.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+bool MappedFile::Open(const std::string& filename)
+{
+    Close();
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+        OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER size;
+    GetFileSizeEx(file, &size);
+    m_size = size.QuadPart;
+    HANDLE mapping = m_size > 0 ? CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+    void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    if (view) {
+        m_file = file;
+        m_mapping = mapping;
+        m_data = (const char*)view;
+        m_mapped = true;
+        return true;
+    }
+    if (mapping) {
+        CloseHandle(mapping);
+    }
+    CloseHandle(file);
+#else
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        m_size = info.st_size;
+        void* view = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (view != MAP_FAILED) {
+            // Parsers read front to back
+            madvise(view, m_size, MADV_SEQUENTIAL);
+            close(fd);
+            m_data = (const char*)view;
+            m_mapped = true;
+            return true;
+        }
+    }
+    close(fd);
+#endif
+
+    FILE* f = fopen(filename.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+    fseek(f, 0, SEEK_END);
+    m_buffer.resize(ftell(f));
+    fseek(f, 0, SEEK_SET);
+    bool ok = fread(m_buffer.data(), 1, m_buffer.size(), f) == m_buffer.size();
+    fclose(f);
+    m_data = m_buffer.data();
+    m_size = m_buffer.size();
+    return ok;
+}
+
+void MappedFile::Close()
+{
+    if (m_mapped) {
+#ifdef _WIN32
+        UnmapViewOfFile(m_data);
+        CloseHandle(m_mapping);
+        CloseHandle(m_file);
+#else
+        munmap((void*)m_data, m_size);
+#endif
+    }
+    m_buffer.clear();
+    m_data = nullptr;
+    m_size = 0;
+    m_mapped = false;
+}
+
+std::string TemporaryFilename(const std::string& filename)
+{
+    // Threads and processes writing the same file at once each get their own
+    static std::atomic<unsigned int> counter(0);
+#ifdef _WIN32
+    int pid = _getpid();
+#else
+    int pid = getpid();
+#endif
+    return tfm::format("%s.%d.%u.tmp", filename, pid, counter++);
+}
+
+bool CommitTemporary(FILE* file, const std::string& temporary, const std::string& filename)
+{
+    bool ok = !ferror(file) && fflush(file) == 0;
+#ifdef _WIN32
+    ok = ok && _commit(_fileno(file)) == 0;
+#else
+    ok = ok && fsync(fileno(file)) == 0;
+#endif
+    ok = fclose(file) == 0 && ok;
+    if (ok) {
+#ifdef _WIN32
+        ok = MoveFileExA(temporary.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+        ok = rename(temporary.c_str(), filename.c_str()) == 0;
+#endif
+    }
+    if (!ok) {
+        remove(temporary.c_str());
+    }
+    return ok;
+}
+
+bool WriteFileAtomic(const std::string& filename, const std::vector<char>& data)
+{
+    std::string temporary = TemporaryFilename(filename);
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    fwrite(data.data(), 1, data.size(), file);
+    return CommitTemporary(file, temporary, filename);
+}
+
+uint64_t Checksum(const char* data, size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 0x100000001b3ull;
+    }
+    for (; i < size; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
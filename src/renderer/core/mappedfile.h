@@ -0,0 +1,57 @@
+#pragma once
+#ifndef __MAPPEDFILE_H
+#define __MAPPEDFILE_H
+
+#include "renderer/core/fwd.h"
+
+#include <cstdint>
+#include <cstdio>
+
+/**
+ * \brief Read only view of a whole file, memory mapped where possible
+ *
+ * Pages are only read in when touched, so large scene files are neither
+ * copied nor allocated up front. Falls back to reading the file into memory
+ * if it can't be mapped.
+ */
+class MappedFile {
+public:
+    MappedFile() {}
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool Open(const std::string& filename);
+    void Close();
+
+    const char* Data() const { return m_data; }
+    size_t Size() const { return m_size; }
+
+private:
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+    bool m_mapped = false;
+    std::vector<char> m_buffer;
+#ifdef _WIN32
+    void* m_file = nullptr;
+    void* m_mapping = nullptr;
+#endif
+};
+
+// filename.<pid>.<count>.tmp, unique among the writers of this and other processes
+std::string TemporaryFilename(const std::string& filename);
+
+/**
+ * Syncs and closes a file written to temporary and renames it over filename,
+ * so readers never see a partial file. The temporary is removed if any step
+ * fails.
+ */
+bool CommitTemporary(FILE* file, const std::string& temporary, const std::string& filename);
+
+// Writes to a temporary file first and renames it over filename once it is on disk
+bool WriteFileAtomic(const std::string& filename, const std::vector<char>& data);
+
+// FNV-1a over 64-bit words, only meant to catch torn or damaged files
+uint64_t Checksum(const char* data, size_t size);
+
+#endif // !__MAPPEDFILE_H
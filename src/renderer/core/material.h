@@ -48,8 +48,9 @@ public:
     */
    
     bool isDelta() const;
+    Spectrum Albedo() const;
 
-    Spectrum Sample(const Normal3f& n, const Vector3f& worldWo, Vector3f* worldWi, Float* pdf, unsigned int& seed) const;
+    Spectrum Sample(const Normal3f& n, const Vector3f& worldWo, Vector3f* worldWi, Float* pdf, const Point2f& u) const;
     Spectrum F(const Normal3f& n, const Vector3f& worldWo, const Vector3f& worldWi) const;
     Spectrum F(const Normal3f& n, const Vector3f& worldWo, const Vector3f& worldWi, Float* pdf) const;    
 
@@ -83,6 +84,19 @@ bool Material::isDelta() const
            (m_type & SPECULAR_TRANSMISSION);
 }
 
+// Reflectance of the dominant lobe, used as a feature by the denoiser
+inline __device__ __host__
+Spectrum Material::Albedo() const
+{
+    if (m_type == DIFFUSE_REFLECT) {
+        return m_diffuseReflect.m_r;
+    }
+    else if (m_type == GLOSSY_REFLECT) {
+        return m_glossyReflect.m_r;
+    }
+    return m_fresnelSpecular.m_r;
+}
+
 inline __device__ __host__
 Spectrum Material::F(
     const Normal3f& n,
@@ -142,23 +156,22 @@ Spectrum Material::Sample(
     const Vector3f& worldWo,
     Vector3f* worldWi,
     Float* pdf,
-    unsigned int& seed) const
+    const Point2f& u) const
 {
     Vector3f s, t;
     CoordinateSystem(n, &s, &t);
     Vector3f localWo = WorldToLocal(worldWo, n, s, t);
     Vector3f localWi;
-    Spectrum cosBSDF(0);        
-    //Point2f u(NextRandom(seed), NextRandom(seed));    
+    Spectrum cosBSDF(0);
 
     if (m_type == DIFFUSE_REFLECT) {
-        cosBSDF = m_diffuseReflect.Sample(localWo, &localWi, pdf, seed);
+        cosBSDF = m_diffuseReflect.Sample(localWo, &localWi, pdf, u);
     }
     else if (m_type == GLOSSY_REFLECT) {
-        cosBSDF = m_glossyReflect.Sample(localWo, &localWi, pdf, seed);
+        cosBSDF = m_glossyReflect.Sample(localWo, &localWi, pdf, u);
     }
     else if (m_type == (SPECULAR_REFLECT | SPECULAR_TRANSMISSION)) {        
-        cosBSDF = m_fresnelSpecular.Sample(localWo, &localWi, pdf, seed);
+        cosBSDF = m_fresnelSpecular.Sample(localWo, &localWi, pdf, u);
     }
 
     *worldWi = LocalToWorld(localWi, n, s, t);
@@ -15,7 +15,7 @@ public:
         const Vector3f& wh) const;
     Vector3f Sample_wh(
         const Vector3f& wo, 
-        unsigned int& seed) const;
+        const Point2f& u) const;
     Float Pdf(
         const Vector3f& wo,
         const Vector3f& wh) const;
@@ -67,14 +67,14 @@ Float GGXDistribution::D(const Vector3f& wh) const
 }
 
 inline __host__ __device__
-Vector3f GGXDistribution::Sample_wh(const Vector3f& wo, unsigned int& seed) const
+Vector3f GGXDistribution::Sample_wh(const Vector3f& wo, const Point2f& u) const
 {
     Vector3f wh;
     bool flip = wo.z < 0;
     Vector3f wi;
     if (flip) wi = -wo;
     else wi = wo;
-    wh = GGXSample(wi, m_alphax, m_alphay, NextRandom(seed), NextRandom(seed));    
+    wh = GGXSample(wi, m_alphax, m_alphay, u.x, u.y);    
     if (flip) wh = -wh;
     return wh;
 }
@@ -0,0 +1,230 @@
+#include "parallel.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct Task {
+    std::function<void()> func;
+    TaskGroup* group;
+};
+
+class WorkStealingPool {
+public:
+    WorkStealingPool(int nThreads);
+    ~WorkStealingPool();
+
+    void Push(Task task, int queueIndex);
+    void Wake(bool all);
+    bool RunOne(int index);
+
+private:
+    void WorkerLoop(int index);
+    bool Pop(int index, Task* task);
+    bool Steal(int index, Task* task);
+
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<WorkerQueue>> m_queues;
+    std::vector<std::thread> m_threads;
+    std::mutex m_sleepMutex;
+    std::condition_variable m_sleepCondition;
+    std::atomic<int> m_queuedTasks;
+    bool m_shutdown;
+};
+
+static thread_local int threadIndex = 0;
+static int nPoolThreads = 1;
+static std::unique_ptr<WorkStealingPool> pool;
+
+WorkStealingPool::WorkStealingPool(int nThreads)
+    : m_queuedTasks(0), m_shutdown(false)
+{
+    for (int i = 0; i < nThreads; i++) {
+        m_queues.emplace_back(new WorkerQueue());
+    }
+    // Queue 0 belongs to the main thread, which helps out in TaskGroup::Wait
+    for (int i = 1; i < nThreads; i++) {
+        m_threads.emplace_back([this, i]() {
+            threadIndex = i;
+            WorkerLoop(i);
+        });
+    }
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_sleepMutex);
+        m_shutdown = true;
+    }
+    m_sleepCondition.notify_all();
+    for (std::thread& thread : m_threads) {
+        thread.join();
+    }
+}
+
+void WorkStealingPool::Push(Task task, int queueIndex)
+{
+    WorkerQueue& queue = *m_queues[queueIndex % m_queues.size()];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+    m_queuedTasks++;
+}
+
+void WorkStealingPool::Wake(bool all)
+{
+    // Taking the lock orders the wakeup after a sleeper's predicate check
+    {
+        std::lock_guard<std::mutex> lock(m_sleepMutex);
+    }
+    if (all) m_sleepCondition.notify_all();
+    else m_sleepCondition.notify_one();
+}
+
+bool WorkStealingPool::Pop(int index, Task* task)
+{
+    // Own queue is used as a stack to keep the most recent work cache-hot
+    WorkerQueue& queue = *m_queues[index];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty()) return false;
+    *task = std::move(queue.tasks.back());
+    queue.tasks.pop_back();
+    m_queuedTasks--;
+    return true;
+}
+
+bool WorkStealingPool::Steal(int index, Task* task)
+{
+    // Victims are robbed from the front, where the oldest and largest work is
+    int nQueues = m_queues.size();
+    for (int i = 1; i < nQueues; i++) {
+        WorkerQueue& queue = *m_queues[(index + i) % nQueues];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) continue;
+        *task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+        m_queuedTasks--;
+        return true;
+    }
+    return false;
+}
+
+bool WorkStealingPool::RunOne(int index)
+{
+    Task task;
+    if (!Pop(index, &task) && !Steal(index, &task)) {
+        return false;
+    }
+    task.func();
+    task.group->m_pending--;
+    return true;
+}
+
+void WorkStealingPool::WorkerLoop(int index)
+{
+    while (true) {
+        if (RunOne(index)) continue;
+
+        std::unique_lock<std::mutex> lock(m_sleepMutex);
+        m_sleepCondition.wait(lock, [this]() { return m_shutdown || m_queuedTasks > 0; });
+        if (m_shutdown) return;
+    }
+}
+
+void ParallelInit(int nThreads)
+{
+    if (nThreads <= 0) {
+        nThreads = NumSystemCores();
+    }
+    nPoolThreads = nThreads;
+    if (nThreads > 1) {
+        pool.reset(new WorkStealingPool(nThreads));
+    }
+}
+
+void ParallelCleanup()
+{
+    pool.reset();
+    nPoolThreads = 1;
+}
+
+int NumSystemCores()
+{
+    return max(1, int(std::thread::hardware_concurrency()));
+}
+
+int MaxThreadIndex()
+{
+    return nPoolThreads;
+}
+
+int ThreadIndex()
+{
+    return threadIndex;
+}
+
+void TaskGroup::Run(std::function<void()> func)
+{
+    if (!pool) {
+        func();
+        return;
+    }
+    m_pending++;
+    pool->Push(Task{ std::move(func), this }, ThreadIndex());
+    pool->Wake(false);
+}
+
+void TaskGroup::Wait()
+{
+    while (m_pending > 0) {
+        if (!pool->RunOne(ThreadIndex())) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void ParallelFor(
+    const std::function<void(int)>& func,
+    int count,
+    int chunkSize)
+{
+    if (!pool || count <= chunkSize) {
+        for (int i = 0; i < count; i++) {
+            func(i);
+        }
+        return;
+    }
+
+    // Deal the chunks out round-robin, stealing evens out the rest
+    TaskGroup group;
+    int nChunks = (count + chunkSize - 1) / chunkSize;
+    group.m_pending += nChunks;
+    for (int chunk = 0; chunk < nChunks; chunk++) {
+        int begin = chunk * chunkSize;
+        int end = min(begin + chunkSize, count);
+        pool->Push(Task{ [&func, begin, end]() {
+            for (int i = begin; i < end; i++) {
+                func(i);
+            }
+        }, &group }, chunk);
+    }
+    pool->Wake(true);
+    group.Wait();
+}
+
+void ParallelFor2D(
+    const std::function<void(Point2i)>& func,
+    const Point2i& count)
+{
+    ParallelFor([&](int i) {
+        func(Point2i(i % count.x, i / count.x));
+    }, count.x * count.y);
+}
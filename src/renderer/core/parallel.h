@@ -0,0 +1,53 @@
+#pragma once
+#ifndef __PARALLEL_H
+#define __PARALLEL_H
+
+#include "renderer/core/fwd.h"
+#include "renderer/core/geometry.h"
+
+#include <atomic>
+#include <functional>
+
+/**
+ * \brief Start the worker threads of the work-stealing pool
+ *
+ * nThreads <= 0 uses every hardware thread of the machine. The calling
+ * thread is counted as one of the workers and runs tasks while it waits.
+ */
+void ParallelInit(int nThreads = 0);
+void ParallelCleanup();
+
+int NumSystemCores();
+// Number of threads that may run tasks, including the main thread
+int MaxThreadIndex();
+// Index of the calling thread in [0, MaxThreadIndex())
+int ThreadIndex();
+
+/**
+ * \brief A set of tasks that can be waited on together
+ *
+ * Tasks are pushed to the deque of the spawning thread and are stolen by
+ * idle workers. Wait() keeps executing queued tasks instead of blocking,
+ * so tasks may spawn and wait on nested groups.
+ */
+class TaskGroup {
+public:
+    TaskGroup() : m_pending(0) {}
+    ~TaskGroup() { Wait(); }
+
+    void Run(std::function<void()> func);
+    void Wait();
+
+    std::atomic<int> m_pending;
+};
+
+void ParallelFor(
+    const std::function<void(int)>& func,
+    int count,
+    int chunkSize = 1);
+
+void ParallelFor2D(
+    const std::function<void(Point2i)>& func,
+    const Point2i& count);
+
+#endif // !__PARALLEL_H
@@ -9,37 +9,37 @@ void ParameterSet::AddBool(const std::string& name, bool val)
 void ParameterSet::AddInt(const std::string& name, std::vector<int> val)
 {
     ASSERT(m_ints.count(name) == 0, "Add an exist attribute " + name);
-    m_ints[name] = val;
+    m_ints[name] = std::move(val);
 }
 
 void ParameterSet::AddFloat(const std::string& name, std::vector<Float> val)
 {
     ASSERT(m_ints.count(name) == 0, "Add an exist attribute " + name);
-    m_floats[name] = val;
+    m_floats[name] = std::move(val);
 }
 
 void ParameterSet::AddString(const std::string& name, std::vector<std::string> val)
 {
     ASSERT(m_ints.count(name) == 0, "Add an exist attribute " + name);
-    m_strings[name] = val;
+    m_strings[name] = std::move(val);
 }
 
 void ParameterSet::AddPoint(const std::string& name, std::vector<Point3f> val)
 {
     ASSERT(m_ints.count(name) == 0, "Add an exist attribute " + name);
-    m_points[name] = val;
+    m_points[name] = std::move(val);
 }
 
 void ParameterSet::AddNormal(const std::string& name, std::vector<Normal3f> val)
 {
     ASSERT(m_ints.count(name) == 0, "Add an exist attribute " + name);
-    m_normals[name] = val;
+    m_normals[name] = std::move(val);
 }
 
 void ParameterSet::AddSpectrum(const std::string& name, std::vector<Float> val)
 {
     ASSERT(m_ints.count(name) == 0, "Add an exist attribute " + name);
-    m_spectrums[name] = val;
+    m_spectrums[name] = std::move(val);
 }
 
 bool ParameterSet::GetBool(const std::string& name) const
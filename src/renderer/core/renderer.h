@@ -5,6 +5,7 @@
 #include "renderer/core/scene.h"
 #include "renderer/core/camera.h"
 #include "renderer/core/integrator.h"
+#include "renderer/core/sampler.h"
 
 class Renderer {
 public:
@@ -13,6 +14,12 @@ public:
     Scene m_scene;
     Camera m_camera;
     Integrator m_integrator;
+    Sampler m_sampler;
+
+    // Checkpointing is off while the filename is empty
+    std::string m_checkpointFile;
+    Float m_checkpointInterval = 60;
+    bool m_resume = false;
 };
 
 #endif // !__RENDERER_H
@@ -0,0 +1,244 @@
+#include "renderserver.h"
+
+#include "renderer/core/cpurender.h"
+#include "renderer/core/wavefront.h"
+#include "renderer/loader/sceneloader.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <sstream>
+
+#ifdef __linux__
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+// A client gets this long to send its request line
+static const int RequestTimeout = 10000;
+
+/**
+ * Loaders abort the process on malformed input, so on Linux a scene is
+ * first loaded by a child running "renderer --check-scene". Elsewhere the
+ * scene is loaded right away.
+ */
+static bool SceneLoads(const std::string& filename)
+{
+#ifdef __linux__
+    pid_t pid = fork();
+    if (pid < 0) {
+        return false;
+    }
+    if (pid == 0) {
+        execl("/proc/self/exe", "renderer", "--check-scene", filename.c_str(), (char*)nullptr);
+        _exit(127);
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#else
+    return true;
+#endif
+}
+
+static bool ParseVector(const std::string& s, Float v[3])
+{
+    const char* p = s.c_str();
+    for (int i = 0; i < 3; i++) {
+        char* end;
+        v[i] = strtod(p, &end);
+        if (end == p || (i < 2 && *end != ',') || (i == 2 && *end != '\0')) {
+            return false;
+        }
+        p = end + 1;
+    }
+    return true;
+}
+
+RenderServer::RenderServer(const std::string& socketPath)
+    : m_socketPath(socketPath), m_listener(InvalidSocket)
+{
+    ASSERT(SocketInit(), "Can't initialize sockets");
+    m_listener = ListenLocal(m_socketPath);
+    ASSERT(m_listener != InvalidSocket, "Can't listen on the server socket");
+}
+
+RenderServer::~RenderServer()
+{
+    CloseSocket(m_listener);
+    remove(m_socketPath.c_str());
+}
+
+void RenderServer::Run()
+{
+    fprintf(stderr, "Listening on %s\n", m_socketPath.c_str());
+    bool shutdown = false;
+    while (!shutdown) {
+        SocketHandle connection = Accept(m_listener);
+        if (connection == InvalidSocket) {
+            continue;
+        }
+        // A client that sends nothing must not hold up the jobs behind it
+        std::string line;
+        if (SetRecvTimeout(connection, RequestTimeout) && RecvLine(connection, &line)) {
+            SendLine(connection, HandleRequest(line, &shutdown));
+        }
+        CloseSocket(connection);
+    }
+}
+
+std::string RenderServer::HandleRequest(const std::string& line, bool* shutdown)
+{
+    std::istringstream stream(line);
+    std::string command, token;
+    stream >> command;
+    std::map<std::string, std::string> args;
+    while (stream >> token) {
+        size_t split = token.find('=');
+        if (split == std::string::npos) {
+            return "error expected key=value, got " + token;
+        }
+        args[token.substr(0, split)] = token.substr(split + 1);
+    }
+
+    if (command == "render") {
+        return Render(args);
+    }
+    else if (command == "unload") {
+        auto it = m_scenes.find(args["scene"]);
+        if (it == m_scenes.end()) {
+            return "error scene is not loaded";
+        }
+        it->second.renderer->m_scene.Release();
+        m_scenes.erase(it);
+#ifdef __GLIBC__
+        // Hand the freed heap back to the system instead of keeping it for the next scene
+        malloc_trim(0);
+#endif
+        return "ok 0";
+    }
+    else if (command == "shutdown") {
+        *shutdown = true;
+        return "ok 0";
+    }
+    return "error unknown command " + command;
+}
+
+std::string RenderServer::Render(const std::map<std::string, std::string>& args)
+{
+    auto get = [&](const std::string& key) {
+        auto it = args.find(key);
+        return it == args.end() ? std::string() : it->second;
+    };
+    auto start = std::chrono::steady_clock::now();
+
+    std::string output = get("output");
+    if (output.empty()) {
+        return "error no output";
+    }
+    std::string error;
+    ResidentScene* scene = GetScene(get("scene"), &error);
+    if (!scene) {
+        return "error " + error;
+    }
+
+    // Every job starts from the settings of the scene file
+    const Camera& camera = scene->camera;
+    Point2i resolution = camera.m_film.m_resolution;
+    Float fov = camera.m_fov;
+    Transform cameraToWorld = camera.m_cameraToWorld, worldToCamera = camera.m_worldToCamera;
+    Integrator integrator = scene->integrator;
+    Sampler sampler = scene->sampler;
+
+    if (!get("width").empty() || !get("height").empty()) {
+        resolution = Point2i(atoi(get("width").c_str()), atoi(get("height").c_str()));
+        if (resolution.x <= 0 || resolution.y <= 0) {
+            return "error width and height must both be positive";
+        }
+    }
+    if (!get("fov").empty()) {
+        fov = atof(get("fov").c_str());
+    }
+    if (!get("eye").empty()) {
+        Float eye[3], target[3], up[3] = { 0, 1, 0 };
+        if (!ParseVector(get("eye"), eye) || !ParseVector(get("target"), target) ||
+            (!get("up").empty() && !ParseVector(get("up"), up))) {
+            return "error eye, target and up are x,y,z";
+        }
+        worldToCamera = LookAt(Point3f(eye[0], eye[1], eye[2]),
+            Point3f(target[0], target[1], target[2]), Vector3f(up[0], up[1], up[2]));
+        cameraToWorld = Inverse(worldToCamera);
+    }
+    if (!get("spp").empty()) {
+        integrator.m_nSample = sampler.m_sampleNum = atoi(get("spp").c_str());
+        if (integrator.m_nSample <= 0) {
+            return "error spp must be positive";
+        }
+    }
+    if (!get("maxdepth").empty()) {
+        integrator.m_maxDepth = atoi(get("maxdepth").c_str());
+    }
+
+    Film film(resolution, output, camera.m_film.m_denoise, camera.m_film.m_writeAOVs);
+    film.m_halfFloat = camera.m_film.m_halfFloat;
+    film.m_rle = camera.m_film.m_rle;
+    Renderer& renderer = *scene->renderer;
+    renderer.m_camera = Camera(fov, film, cameraToWorld, worldToCamera);
+    renderer.m_integrator = integrator;
+    renderer.m_sampler = sampler;
+
+    if (get("wavefront") == "1") {
+        WavefrontRender(scene->renderer);
+    }
+    else {
+        render(scene->renderer);
+    }
+    renderer.m_camera.m_film.Release();
+
+    Float seconds = std::chrono::duration<Float>(std::chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "\nRendered %s in %.3f s\n", output.c_str(), seconds);
+    return tfm::format("ok %.3f", seconds);
+}
+
+RenderServer::ResidentScene* RenderServer::GetScene(const std::string& filename, std::string* error)
+{
+    auto it = m_scenes.find(filename);
+    if (it != m_scenes.end()) {
+        return &it->second;
+    }
+
+    // The loader aborts on errors, so catch what is cheap to check up front
+    filesystem::path path(filename);
+    std::shared_ptr<SceneLoader> loader = CreateSceneLoader(filename);
+    FILE* file = fopen(filename.c_str(), "r");
+    if (!file || !loader) {
+        if (file) {
+            fclose(file);
+        }
+        *error = "can't open scene " + filename;
+        return nullptr;
+    }
+    fclose(file);
+    if (!SceneLoads(filename)) {
+        *error = "can't load scene " + filename;
+        return nullptr;
+    }
+
+    getFileResolver()->prepend(path.parent_path());
+    ResidentScene scene;
+    scene.renderer = loader->Load();
+    scene.renderer->m_scene.Preprocess();
+    // Jobs bring their own films, only the settings of this one are kept
+    scene.renderer->m_camera.m_film.Release();
+    scene.camera = scene.renderer->m_camera;
+    scene.integrator = scene.renderer->m_integrator;
+    scene.sampler = scene.renderer->m_sampler;
+    return &(m_scenes[filename] = scene);
+}
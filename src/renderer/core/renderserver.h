@@ -0,0 +1,58 @@
+#pragma once
+#ifndef __RENDERSERVER_H
+#define __RENDERSERVER_H
+
+#include "renderer/core/renderer.h"
+#include "renderer/core/socketio.h"
+
+#include <map>
+
+/**
+ * \brief Long running renderer that keeps loaded scenes and their BVHs resident
+ *
+ * Listens on a local socket, one request line per connection, answered with
+ * "ok <seconds>" or "error <reason>" once the job is done:
+ *
+ *   render scene=<file.pbrt|file.obj> output=<image> [spp=n] [width=w] [height=h]
+ *          [fov=deg] [eye=x,y,z target=x,y,z up=x,y,z] [maxdepth=n] [wavefront=1]
+ *   unload scene=<file.pbrt|file.obj>
+ *   shutdown
+ *
+ * Unloading frees the accelerators and meshes of a scene and unmaps its
+ * mesh files.
+ *
+ * A scene is parsed and its accelerators are built by the first job that
+ * names it. Later jobs only replace the camera, film and sample count, which
+ * start from the values in the scene file. Jobs run one at a time, each on
+ * all worker threads, and a client has 10 seconds to send its request.
+ *
+ * On Linux a new scene is loaded once in a child process first, so a
+ * malformed file fails the job instead of the server. On other platforms
+ * the loaders still abort the whole server on such a file.
+ */
+class RenderServer {
+public:
+    RenderServer(const std::string& socketPath);
+    ~RenderServer();
+
+    // Serves requests until a shutdown request arrives
+    void Run();
+
+private:
+    struct ResidentScene {
+        std::shared_ptr<Renderer> renderer;
+        Camera camera;
+        Integrator integrator;
+        Sampler sampler;
+    };
+
+    std::string HandleRequest(const std::string& line, bool* shutdown);
+    std::string Render(const std::map<std::string, std::string>& args);
+    ResidentScene* GetScene(const std::string& filename, std::string* error);
+
+    std::string m_socketPath;
+    SocketHandle m_listener;
+    std::map<std::string, ResidentScene> m_scenes;
+};
+
+#endif // !__RENDERSERVER_H
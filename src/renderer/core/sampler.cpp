@@ -0,0 +1,20 @@
+#include "sampler.h"
+
+std::shared_ptr<Sampler>
+CreateSampler(
+    const ParameterSet& param,
+    int type)
+{
+    int sampleNum;
+    if (type == Sampler::Stratified) {
+        int xSamples = param.GetInt("xsamples", 4);
+        int ySamples = param.GetInt("ysamples", 4);
+        sampleNum = param.GetInt("pixelsamples", xSamples * ySamples);
+    }
+    else {
+        sampleNum = param.GetInt("pixelsamples", 16);
+    }
+    ASSERT(sampleNum > 0, "Sampler needs at least one pixel sample");
+    int seed = param.GetInt("seed", 0);
+    return std::make_shared<Sampler>(type, sampleNum, seed);
+}
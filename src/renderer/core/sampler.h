@@ -3,21 +3,290 @@
 #define __SAMPLER_H
 
 #include "renderer/core/fwd.h"
+#include "renderer/core/geometry.h"
 #include "renderer/core/parameterset.h"
+#include "renderer/core/sampling.h"
 
+#define OneMinusEpsilon 0.99999994f
 
+inline __device__ __host__
+unsigned long long MixBits(unsigned long long v)
+{
+    v ^= (v >> 31);
+    v *= 0x7fb5d329728ea185ull;
+    v ^= (v >> 27);
+    v *= 0x81dadef4bc2dd44dull;
+    v ^= (v >> 33);
+    return v;
+}
+
+// Element i of a random permutation of [0, n) chosen by p (Kensler)
+inline __device__ __host__
+unsigned int PermutationElement(unsigned int i, unsigned int n, unsigned int p)
+{
+    unsigned int w = n - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= p;
+        i *= 0xe170893d;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8;
+        i *= 0x0929eb3f;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | p >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3df;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= n);
+    return (i + p) % n;
+}
+
+// Uniform value in [0, 1) hashed from i and p (Kensler)
+inline __device__ __host__
+Float HashFloat(unsigned int i, unsigned int p)
+{
+    i ^= p;
+    i ^= i >> 17;
+    i ^= i >> 10;
+    i *= 0xb36534e5;
+    i ^= i >> 12;
+    i ^= i >> 21;
+    i *= 0x93fc4795;
+    i ^= 0xdf6e307f;
+    i ^= i >> 17;
+    i *= 1 | p >> 18;
+    return min(Float(i * 2.3283064365386963e-10f), OneMinusEpsilon);
+}
+
+inline __device__ __host__
+unsigned int ReverseBits32(unsigned int v)
+{
+    v = (v << 16) | (v >> 16);
+    v = ((v & 0x00ff00ff) << 8) | ((v & 0xff00ff00) >> 8);
+    v = ((v & 0x0f0f0f0f) << 4) | ((v & 0xf0f0f0f0) >> 4);
+    v = ((v & 0x33333333) << 2) | ((v & 0xcccccccc) >> 2);
+    v = ((v & 0x55555555) << 1) | ((v & 0xaaaaaaaa) >> 1);
+    return v;
+}
+
+/*
+ * Owen scrambling of a 32 bit fraction, most significant bit first: each
+ * bit is flipped depending on all bits above it (Laine-Karras hash as
+ * used by Burley)
+ */
+inline __device__ __host__
+unsigned int NestedUniformScramble(unsigned int v, unsigned int seed)
+{
+    v = ReverseBits32(v);
+    v += seed;
+    v ^= v * 0x6c50b47cu;
+    v ^= v * 0xb82f1e52u;
+    v ^= v * 0xc7afe638u;
+    v ^= v * 0x8d22f6e6u;
+    return ReverseBits32(v);
+}
+
+// First two dimensions of the Sobol sequence as 32 bit fractions
+inline __device__ __host__
+unsigned int SobolSample(unsigned int index, int dimension)
+{
+    if (dimension == 0) return ReverseBits32(index);
+    unsigned int result = 0;
+    for (unsigned int v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+        if (index & 1) result ^= v;
+    }
+    return result;
+}
+
+inline __device__ __host__
+Float OwenScrambledSobol(unsigned int index, int dimension, unsigned int seed)
+{
+    unsigned int v = NestedUniformScramble(SobolSample(index, dimension), seed);
+    return min(Float(v * 2.3283064365386963e-10f), OneMinusEpsilon);
+}
+
+#define HaltonMaxDimension 64
+
+inline __device__ __host__
+int HaltonPrime(int dimension)
+{
+    const int primes[HaltonMaxDimension] = {
+        2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+        59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131,
+        137, 139, 149, 151, 157, 163, 167, 173, 179, 181, 191, 193, 197, 199, 211, 223,
+        227, 229, 233, 239, 241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311 };
+    return primes[dimension];
+}
+
+// Radical inverse of a in the given base with every digit permuted by hash
+inline __device__ __host__
+Float OwenScrambledRadicalInverse(int base, unsigned long long a, unsigned long long hash)
+{
+    Float invBase = Float(1) / base, invBaseM = 1;
+    unsigned long long reversedDigits = 0;
+    int digitIndex = 0;
+    while (a > 0 && 1 - (base - 1) * invBaseM < 1) {
+        unsigned long long next = a / base;
+        int digitValue = int(a - next * base);
+        // The permutation of a digit depends on its position and all digits
+        // before it, leading zeros included
+        unsigned int digitHash = (unsigned int)MixBits((hash ^ reversedDigits) +
+            digitIndex * 0x9e3779b97f4a7c15ull);
+        digitValue = PermutationElement(digitValue, base, digitHash);
+        reversedDigits = reversedDigits * base + digitValue;
+        invBaseM *= invBase;
+        digitIndex++;
+        a = next;
+    }
+
+    // Scrambled leading zeros are uniform, so the rest is filled in at once
+    unsigned int restHash = (unsigned int)MixBits((hash ^ reversedDigits) + digitIndex * 0x9e3779b97f4a7c15ull);
+    return min((reversedDigits + HashFloat(digitIndex, restHash)) * invBaseM, OneMinusEpsilon);
+}
+
+/**
+ * \brief Sample values for one pixel sample at a time
+ *
+ * StartPixelSample() selects the pixel and sample index, after which each
+ * Get1D() or Get2D() moves on to the next dimension, so the integrators
+ * have to draw values in the same order for every sample.
+ *
+ *   Random      Philox numbers indexed by pixel, sample and dimension
+ *   Stratified  jittered strata in 1D, correlated multi-jittered in 2D
+ *   Halton      Owen scrambled Halton, random past HaltonMaxDimension
+ *   Sobol       Owen scrambled Sobol, shuffled per dimension pair
+ *
+ * All but random decorrelate pixels and dimensions with hashed scrambles,
+ * so samples may be taken in any order and from any thread.
+ */
 class Sampler {
 public:
-    __device__ __host__ Sampler(int sampleNum = 0) :m_sampleNum(sampleNum) {}
+    enum Type { Random, Stratified, Halton, Sobol };
 
-    __device__ __host__ virtual void Init(
-        unsigned int v0, 
-        unsigned int v1, 
-        unsigned int backoff = 16) = 0;
+    __device__ __host__ Sampler(int type = Random, int sampleNum = 1, unsigned int seed = 0)
+        : m_type(type), m_sampleNum(sampleNum), m_seed(seed),
+        m_pixel(0), m_pixelHash(0), m_sampleIndex(0), m_dimension(0) {}
 
-    __device__ __host__ virtual Float Next() = 0;
+    __device__ __host__ void StartPixelSample(int pixel, int sampleIndex);
+    __device__ __host__ Float Get1D();
+    __device__ __host__ Point2f Get2D();
 
+    int m_type;
     int m_sampleNum;
+    unsigned int m_seed;
+
+    // Current pixel sample
+    unsigned int m_pixel;
+    unsigned int m_pixelHash;
+    int m_sampleIndex;
+    int m_dimension;
+
+private:
+    __device__ __host__ unsigned int DimensionHash() const;
 };
 
+std::shared_ptr<Sampler>
+CreateSampler(
+    const ParameterSet& param,
+    int type);
+
+inline __device__ __host__
+void Sampler::StartPixelSample(int pixel, int sampleIndex)
+{
+    m_pixelHash = (unsigned int)MixBits(((unsigned long long)(unsigned int)pixel ^
+        ((unsigned long long)m_seed << 32)) + 0x9e3779b97f4a7c15ull);
+    m_pixel = pixel;
+    m_sampleIndex = sampleIndex;
+    m_dimension = 0;
+}
+
+inline __device__ __host__
+unsigned int Sampler::DimensionHash() const
+{
+    return (unsigned int)MixBits(((unsigned long long)m_pixelHash << 32) | (unsigned int)m_dimension);
+}
+
+inline __device__ __host__
+Float Sampler::Get1D()
+{
+    Float u;
+    unsigned int hash = DimensionHash();
+    if (m_type == Stratified) {
+        // Samples past the pattern start a new one with other permutations
+        unsigned int pattern = hash ^ (unsigned int)MixBits(m_sampleIndex / m_sampleNum);
+        unsigned int index = m_sampleIndex % m_sampleNum;
+        unsigned int stratum = PermutationElement(index, m_sampleNum, pattern);
+        u = min((stratum + HashFloat(index, pattern * 0x68bc21ebu)) / m_sampleNum, OneMinusEpsilon);
+    }
+    else if (m_type == Halton) {
+        u = m_dimension < HaltonMaxDimension ?
+            OwenScrambledRadicalInverse(HaltonPrime(m_dimension), m_sampleIndex, hash) :
+            HashFloat(m_sampleIndex, hash);
+    }
+    else if (m_type == Sobol) {
+        unsigned int index = NestedUniformScramble(m_sampleIndex, hash);
+        u = OwenScrambledSobol(index, 0, hash * 0x02e5be93u);
+    }
+    else {
+        unsigned int r[4];
+        PhiloxRandom(m_pixel, m_sampleIndex, m_dimension, m_seed, r);
+        u = UniformFloat(r[0]);
+    }
+    m_dimension++;
+    return u;
+}
+
+inline __device__ __host__
+Point2f Sampler::Get2D()
+{
+    Point2f u;
+    unsigned int hash = DimensionHash();
+    if (m_type == Stratified) {
+        // Correlated multi-jittered sampling (Kensler), m x n strata
+        unsigned int pattern = hash ^ (unsigned int)MixBits(m_sampleIndex / m_sampleNum);
+        unsigned int N = m_sampleNum;
+        unsigned int m = (unsigned int)sqrt(Float(N)), n = (N + m - 1) / m;
+        unsigned int s = PermutationElement(m_sampleIndex % N, N, pattern * 0x51633e2du);
+        unsigned int sx = PermutationElement(s % m, m, pattern * 0x68bc21ebu);
+        unsigned int sy = PermutationElement(s / m, n, pattern * 0x02e5be93u);
+        Float jx = HashFloat(s, pattern * 0x967a889bu);
+        Float jy = HashFloat(s, pattern * 0x368cc8b7u);
+        u = Point2f(min((sx + (sy + jx) / n) / m, OneMinusEpsilon),
+            min((s + jy) / N, OneMinusEpsilon));
+    }
+    else if (m_type == Halton) {
+        if (m_dimension + 1 < HaltonMaxDimension) {
+            u = Point2f(OwenScrambledRadicalInverse(HaltonPrime(m_dimension), m_sampleIndex, hash),
+                OwenScrambledRadicalInverse(HaltonPrime(m_dimension + 1), m_sampleIndex, MixBits(hash)));
+        }
+        else {
+            u = Point2f(HashFloat(m_sampleIndex, hash), HashFloat(m_sampleIndex, hash * 0x967a889bu));
+        }
+    }
+    else if (m_type == Sobol) {
+        unsigned int index = NestedUniformScramble(m_sampleIndex, hash);
+        u = Point2f(OwenScrambledSobol(index, 0, hash * 0x02e5be93u),
+            OwenScrambledSobol(index, 1, hash * 0x967a889bu));
+    }
+    else {
+        unsigned int r[4];
+        PhiloxRandom(m_pixel, m_sampleIndex, m_dimension, m_seed, r);
+        u = Point2f(UniformFloat(r[0]), UniformFloat(r[1]));
+    }
+    m_dimension += 2;
+    return u;
+}
+
 #endif // !__SAMPLER_H
@@ -4,29 +4,50 @@
 
 #include "renderer/core/geometry.h"
 
-inline __device__ __host__
-unsigned int InitRandom(
-    unsigned int val0, 
-    unsigned int val1, 
-    unsigned int backoff = 16)
+/*
+ * Philox4x32-10 (Salmon et al.), a counter-based generator: the output is a
+ * pure function of the counter and the key, so any random number can be
+ * drawn directly without stepping a state through the ones before it, and
+ * every lane or thread computes its numbers independently.
+ */
+inline __device__ __host__
+void Philox4x32(unsigned int counter[4], unsigned int key0, unsigned int key1)
 {
-    unsigned int v0 = val0, v1 = val1, s0 = 0;
-
-    for (unsigned int n = 0; n < backoff; n++)
-    {
-        s0 += 0x9e3779b9;
-        v0 += ((v1 << 4) + 0xa341316c) ^ (v1 + s0) ^ ((v1 >> 5) + 0xc8013ea4);
-        v1 += ((v0 << 4) + 0xad90777d) ^ (v0 + s0) ^ ((v0 >> 5) + 0x7e95761e);
+    for (int round = 0; round < 10; round++) {
+        unsigned long long p0 = (unsigned long long)0xD2511F53u * counter[0];
+        unsigned long long p1 = (unsigned long long)0xCD9E8D57u * counter[2];
+        unsigned int c0 = (unsigned int)(p1 >> 32) ^ counter[1] ^ key0;
+        unsigned int c2 = (unsigned int)(p0 >> 32) ^ counter[3] ^ key1;
+        counter[0] = c0;
+        counter[1] = (unsigned int)p1;
+        counter[2] = c2;
+        counter[3] = (unsigned int)p0;
+        key0 += 0x9E3779B9u;
+        key1 += 0xBB67AE85u;
     }
-    return v0;
 }
 
+// Four random 32 bit values for one (pixel, sample, dimension)
+inline __device__ __host__
+void PhiloxRandom(
+    unsigned int pixel,
+    unsigned int sample,
+    unsigned int dimension,
+    unsigned int seed,
+    unsigned int r[4])
+{
+    r[0] = dimension;
+    r[1] = sample;
+    r[2] = pixel;
+    r[3] = 0;
+    Philox4x32(r, seed, 0x5bd1e995u);
+}
+
+// Uniform value in [0, 1) from the top 24 bits, which a float holds exactly
 inline __device__ __host__
-Float NextRandom(
-    unsigned int& seed)
+Float UniformFloat(unsigned int r)
 {
-    seed = (1664525u * seed + 1013904223u);
-    return float(seed & 0x00FFFFFF) / float(0x01000000);
+    return (r >> 8) * (Float(1) / Float(1 << 24));
 }
 
 inline __device__ __host__
@@ -105,12 +126,11 @@ bool SameHemisphere(const Vector3f& w, const Normal3f& wp) {
 
 
 inline __device__ __host__
-Vector3f UniformSampleHemisphere(unsigned int& seed)
+Vector3f UniformSampleHemisphere(const Point2f& u)
 {
-    Float u = NextRandom(seed), v = NextRandom(seed);    
-    Float a = sqrt(max((Float)0, 1 - u * u));
-    Float b = Pi * 2 * v;
-    return Vector3f(a * cos(b), a * sin(b), u);
+    Float a = sqrt(max((Float)0, 1 - u.x * u.x));
+    Float b = Pi * 2 * u.y;
+    return Vector3f(a * cos(b), a * sin(b), u.x);
 }
 
 inline __device__ __host__
@@ -120,12 +140,11 @@ Float UniformSampleHemispherePdf()
 }
 
 inline __device__ __host__
-Vector3f CosineSampleHemisphere(unsigned int& seed)
+Vector3f CosineSampleHemisphere(const Point2f& u)
 {
-    Float u = NextRandom(seed), v = NextRandom(seed);
-    Float a = sqrt(u);
-    Float b = Pi * 2 * v;
-    Float z = sqrt(max(Float(0), 1 - u));
+    Float a = sqrt(u.x);
+    Float b = Pi * 2 * u.y;
+    Float z = sqrt(max(Float(0), 1 - u.x));
     return Vector3f(a * cos(b), a * sin(b), z);
 }
 
@@ -136,10 +155,9 @@ Float CosineSampleHemispherePdf(Float cosTheta)
 }
 
 inline __device__ __host__
-Point2f UniformSampleTriangle(unsigned int& seed) {
-    Float u = NextRandom(seed), v = NextRandom(seed);
-    Float a = sqrt(u);
-    return Point2f(1 - a, v * a);
+Point2f UniformSampleTriangle(const Point2f& u) {
+    Float a = sqrt(u.x);
+    return Point2f(1 - a, u.y * a);
 }
 
 #endif // __SAMPLING_H
\ No newline at end of file
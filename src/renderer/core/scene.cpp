@@ -1,8 +1,100 @@
 #include "scene.h"
 
+#include <set>
+
 void Scene::Preprocess()
 {
-    m_shapeBvh->Build(m_primitives, m_triangles);
+    if (m_preprocessed) {
+        return;
+    }
+    m_preprocessed = true;
+    BuildLightDistribution();
+
+
+    // Primitives of instanced objects are only reachable through instances
+    std::vector<Primitive> worldPrimitives;
+    int primitiveBegin = 0;
+    for (const InstancedObject& object : m_objects) {
+        worldPrimitives.insert(worldPrimitives.end(),
+            m_primitives.begin() + primitiveBegin, m_primitives.begin() + object.m_primitiveBegin);
+        primitiveBegin = object.m_primitiveEnd;
+    }
+    worldPrimitives.insert(worldPrimitives.end(), m_primitives.begin() + primitiveBegin, m_primitives.end());
+
+    m_shapeBvh->m_cacheDirectory = m_bvhCacheDirectory;
+    m_shapeBvh->Build(worldPrimitives, m_triangles, m_splitMethod, m_maxPrimsInNode);
+    if (m_bvhWidth > 2) {
+        m_wideBvh->Build(*m_shapeBvh, m_bvhWidth, m_precomputeTriangles);
+    }
+    if (m_precomputeTriangles) {
+        // Only the accelerator that is traversed needs the records
+        if (m_bvhWidth > 2)
+            m_wideBvh->BuildTriangleBlocks(m_triangles);
+        else
+            m_shapeBvh->BuildTriangleRecords(m_triangles);
+    }
+    if (!m_instances.empty()) {
+        m_instanceBvh->Build(m_objects, m_instances, m_primitives, m_triangles,
+            m_splitMethod, m_maxPrimsInNode, m_bvhWidth, m_precomputeTriangles, m_bvhCacheDirectory);
+    }
+
+    size_t nodeBytes = m_shapeBvh->m_totalNodes * sizeof(LinearBVHNode) +
+        m_wideBvh->m_nodes4.size() * sizeof(WideBVHNode<4>) +
+        m_wideBvh->m_nodes8.size() * sizeof(WideBVHNode<8>);
+    size_t recordBytes = m_shapeBvh->m_triangleRecords.size() * sizeof(TriangleRecord) +
+        m_wideBvh->TriangleBlockBytes();
+    for (const InstancedObject& object : m_instanceBvh->m_objects) {
+        nodeBytes += object.NodeBytes();
+        recordBytes += object.TriangleRecordBytes();
+    }
+    printf("BVH memory : nodes %.1f MB, triangle records %.1f MB\n",
+        nodeBytes / (1024.f * 1024.f), recordBytes / (1024.f * 1024.f));
+}
+
+void Scene::Release()
+{
+    // Copies in m_triangleMeshes share the arrays of the meshes the triangles point to
+    std::set<TriangleMesh*> meshes;
+    for (const Triangle& triangle : m_triangles) {
+        meshes.insert(triangle.m_triangleMeshPtr);
+    }
+    for (TriangleMesh* mesh : meshes) {
+        ReleaseTriangleMesh(mesh);
+        delete mesh;
+    }
+    std::vector<TriangleMesh>().swap(m_triangleMeshes);
+    std::vector<Triangle>().swap(m_triangles);
+    std::vector<Primitive>().swap(m_primitives);
+
+    // The accelerators are owned through raw pointers
+    m_shapeBvh->Release();
+    for (InstancedObject& object : m_instanceBvh->m_objects) {
+        if (object.m_bvh) {
+            object.m_bvh->Release();
+        }
+    }
+    m_instanceBvh->m_bvh.Release();
+    delete m_shapeBvh;
+    delete m_wideBvh;
+    delete m_instanceBvh;
+    m_shapeBvh = nullptr;
+    m_wideBvh = nullptr;
+    m_instanceBvh = nullptr;
+}
+
+void Scene::BuildLightDistribution()
+{
+    if (m_lightSampler == BVH) {
+        m_lightBvh.Build(m_lights, m_triangles);
+        return;
+    }
+
+    // Power of an area light is its radiance times its area
+    std::vector<Float> lightPower(m_lights.size(), 1);
+    for (int i = 0; m_lightSampler == Power && i < m_lights.size(); i++) {
+        lightPower[i] = m_lights[i].m_L.Luminance() * m_triangles[m_lights[i].m_shapeID].Area();
+    }
+    BuildAliasTable(lightPower, &m_lightDistribution);
 }
 
 int Scene::AddTriangleMesh(TriangleMesh triangleMesh)
@@ -15,6 +107,10 @@ int Scene::AddTriangleMesh(TriangleMesh triangleMesh)
 std::pair<int, int>
 Scene::AddTriangles(std::vector<std::shared_ptr<Triangle>> triangles)
 {
+    // Shapes that failed to load add nothing
+    if (triangles.empty()) {
+        return std::pair<int, int>(m_triangles.size(), m_triangles.size());
+    }
     int meshID = AddTriangleMesh(*triangles[0]->m_triangleMeshPtr);
     std::pair<int, int> interval(m_triangles.size(), m_triangles.size() + triangles.size());
     for (int i = 0; i < triangles.size(); i++) {
@@ -24,6 +120,21 @@ Scene::AddTriangles(std::vector<std::shared_ptr<Triangle>> triangles)
     return interval;
 }
 
+std::pair<int, int>
+Scene::AddTriangles(TriangleMesh* mesh)
+{
+    if (!mesh || mesh->m_triangleNum == 0) {
+        return std::pair<int, int>(m_triangles.size(), m_triangles.size());
+    }
+    int meshID = AddTriangleMesh(*mesh);
+    std::pair<int, int> interval(m_triangles.size(), m_triangles.size() + mesh->m_triangleNum);
+    for (int i = 0; i < mesh->m_triangleNum; i++) {
+        m_triangles.emplace_back(mesh, i);
+        m_triangles.back().m_triangleMeshID = meshID;
+    }
+    return interval;
+}
+
 int Scene::AddMaterial(std::shared_ptr<Material> material)
 {
     int ID = m_materials.size();
@@ -42,4 +153,16 @@ int Scene::AddLight(std::shared_ptr<Light> light)
 void Scene::AddPrimitive(Primitive p)
 {
     m_primitives.push_back(p);
-}
\ No newline at end of file
+}
+
+int Scene::AddObject(InstancedObject object)
+{
+    int ID = m_objects.size();
+    m_objects.push_back(object);
+    return ID;
+}
+
+void Scene::AddInstance(Instance instance)
+{
+    m_instances.push_back(instance);
+}
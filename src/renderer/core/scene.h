@@ -7,31 +7,93 @@
 #include "renderer/core/primitive.h"
 #include "renderer/core/interaction.h"
 #include "renderer/core/bvh.h"
+#include "renderer/core/widebvh.h"
+#include "renderer/core/instance.h"
+#include "renderer/core/distribution.h"
+#include "renderer/core/lightbvh.h"
 #include <vector>
 
 class Scene {
 public:
-    Scene():m_shapeBvh(new BVHAccelerator()) {}
+    enum LightSampler { Uniform, Power, BVH };
 
+    Scene():m_shapeBvh(new BVHAccelerator()), m_wideBvh(new WideBVHAccelerator()),
+        m_instanceBvh(new InstanceAccelerator()),
+        m_splitMethod(BVHAccelerator::SAH), m_maxPrimsInNode(255),
+        m_bvhWidth(WideBVHAccelerator::DefaultWidth()), m_precomputeTriangles(true),
+        m_lightSampler(BVH), m_preprocessed(false) {}
+
+    // Builds the accelerators once, later calls keep them
     void Preprocess();
+    // Frees the accelerators and the meshes, the scene can't be used afterwards
+    void Release();
+    void BuildLightDistribution();
 
     bool Intersect(const Ray& ray) const;
     bool IntersectP(const Ray& ray, Interaction* interaction) const;
 
+    // Choose a light for a shading point, -1 if none can reach it
+    int SampleLight(const Point3f& p, const Normal3f& n, Float u, Float* pdf) const;
+    Float LightPdf(const Point3f& p, const Normal3f& n, int lightID) const;
+
     int AddTriangleMesh(TriangleMesh triangleMesh);
     std::pair<int, int> AddTriangles(std::vector<std::shared_ptr<Triangle>> triangles);
+    // Adds every triangle of mesh, nothing for nullptr
+    std::pair<int, int> AddTriangles(TriangleMesh* mesh);
     int AddMaterial(std::shared_ptr<Material> material);
     int AddLight(std::shared_ptr<Light> light);
     void AddPrimitive(Primitive p);
+    int AddObject(InstancedObject object);
+    void AddInstance(Instance instance);
     
     std::vector<TriangleMesh> m_triangleMeshes;
     std::vector<Triangle> m_triangles;
     std::vector<Material> m_materials;
     std::vector<Light> m_lights;
+    std::vector<AliasEntry> m_lightDistribution;    // Uniform and Power, built by Preprocess
+    LightBVH m_lightBvh;                            // BVH, built by Preprocess
     std::vector<Primitive> m_primitives;
+    std::vector<InstancedObject> m_objects;
+    std::vector<Instance> m_instances;
     BVHAccelerator* m_shapeBvh;
+    WideBVHAccelerator* m_wideBvh;
+    InstanceAccelerator* m_instanceBvh;
+
+    // BVH build options, set by the Accelerator directive
+    BVHAccelerator::SplitMethod m_splitMethod;
+    int m_maxPrimsInNode;
+    int m_bvhWidth;         // 2 traverses the binary BVH directly
+    bool m_precomputeTriangles;     // copy triangles into BVH leaf order
+    std::string m_bvhCacheDirectory;    // keeps built BVHs on disk unless empty
+
+    // Set by the lightsampler parameter of the Integrator
+    LightSampler m_lightSampler;
+
+    bool m_preprocessed;
 };
 
+inline
+int Scene::SampleLight(const Point3f& p, const Normal3f& n, Float u, Float* pdf) const
+{
+    if (m_lightSampler == BVH) {
+        return SampleLightBVH(m_lightBvh.m_nodes.data(), m_lightBvh.m_nodes.size(), p, n, u, pdf);
+    }
+    if (m_lightDistribution.empty()) {
+        return -1;
+    }
+    return SampleAliasTable(&m_lightDistribution[0], m_lightDistribution.size(), u, pdf);
+}
+
+inline
+Float Scene::LightPdf(const Point3f& p, const Normal3f& n, int lightID) const
+{
+    if (m_lightSampler == BVH) {
+        return LightBVHPmf(m_lightBvh.m_nodes.data(), m_lightBvh.m_nodes.size(),
+            m_lightBvh.m_bitTrails[lightID], p, n);
+    }
+    return m_lightDistribution[lightID].m_pdf;
+}
+
 inline
 bool Scene::Intersect(const Ray& ray) const
 {
@@ -46,7 +108,17 @@ bool Scene::Intersect(const Ray& ray) const
     return false;
     */
     //return m_shapeBvh->Intersect(ray);
-    return m_shapeBvh->Intersect(ray, &m_triangles[0]);
+    bool hit;
+    if (m_bvhWidth > 2) {
+        hit = m_wideBvh->Intersect(ray, &m_triangles[0]);
+    }
+    else {
+        hit = m_shapeBvh->Intersect(ray, &m_triangles[0]);
+    }
+    if (!hit && !m_instances.empty()) {
+        hit = m_instanceBvh->Intersect(ray, &m_triangles[0]);
+    }
+    return hit;
 }
 
 inline
@@ -67,7 +139,18 @@ bool Scene::IntersectP(const Ray& ray, Interaction* interaction) const
     return ret_hit;
     */
     //return m_shapeBvh->IntersectP(ray, interaction);
-    return m_shapeBvh->IntersectP(ray, interaction, &m_triangles[0]);
+    bool hit;
+    if (m_bvhWidth > 2) {
+        hit = m_wideBvh->IntersectP(ray, interaction, &m_triangles[0]);
+    }
+    else {
+        hit = m_shapeBvh->IntersectP(ray, interaction, &m_triangles[0]);
+    }
+    // The base hit has shortened ray.tMax, so instances behind it are culled
+    if (!m_instances.empty() && m_instanceBvh->IntersectP(ray, interaction, &m_triangles[0])) {
+        hit = true;
+    }
+    return hit;
 }
 
 #endif // !__SCENE_H
@@ -0,0 +1,245 @@
+#include "socketio.h"
+
+#include <cstring>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <afunix.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// A peer that went away must not raise SIGPIPE in a long running process
+#ifdef MSG_NOSIGNAL
+static const int SendFlags = MSG_NOSIGNAL;
+#else
+static const int SendFlags = 0;
+#endif
+
+bool SocketInit()
+{
+#ifdef _WIN32
+    WSADATA data;
+    return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+#else
+    return true;
+#endif
+}
+
+void CloseSocket(SocketHandle socket)
+{
+#ifdef _WIN32
+    closesocket(socket);
+#else
+    close(socket);
+#endif
+}
+
+static bool LocalAddress(const std::string& path, sockaddr_un* address)
+{
+    memset(address, 0, sizeof(sockaddr_un));
+    address->sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address->sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", path.c_str());
+        return false;
+    }
+    memcpy(address->sun_path, path.c_str(), path.size());
+    return true;
+}
+
+// Removes a socket file left behind by an earlier server, which blocks bind.
+// False if something other than a socket is at path, that is never removed.
+static bool RemoveStaleSocket(const std::string& path)
+{
+#ifdef _WIN32
+    // Unix sockets show up as reparse points
+    DWORD attributes = GetFileAttributesA(path.c_str());
+    if (attributes == INVALID_FILE_ATTRIBUTES) {
+        return true;
+    }
+    if (!(attributes & FILE_ATTRIBUTE_REPARSE_POINT)) {
+        return false;
+    }
+#else
+    struct stat status;
+    if (lstat(path.c_str(), &status) != 0) {
+        return true;
+    }
+    if (!S_ISSOCK(status.st_mode)) {
+        return false;
+    }
+#endif
+    remove(path.c_str());
+    return true;
+}
+
+SocketHandle ListenLocal(const std::string& path)
+{
+    sockaddr_un address;
+    if (!LocalAddress(path, &address)) {
+        return InvalidSocket;
+    }
+    if (!RemoveStaleSocket(path)) {
+        fprintf(stderr, "%s exists and isn't a socket\n", path.c_str());
+        return InvalidSocket;
+    }
+    SocketHandle listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener == InvalidSocket) {
+        return InvalidSocket;
+    }
+    if (bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 16) != 0) {
+        CloseSocket(listener);
+        return InvalidSocket;
+    }
+    return listener;
+}
+
+SocketHandle ConnectLocal(const std::string& path)
+{
+    sockaddr_un address;
+    if (!LocalAddress(path, &address)) {
+        return InvalidSocket;
+    }
+    SocketHandle connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connection == InvalidSocket) {
+        return InvalidSocket;
+    }
+    if (connect(connection, (sockaddr*)&address, sizeof(address)) != 0) {
+        CloseSocket(connection);
+        return InvalidSocket;
+    }
+    return connection;
+}
+
+SocketHandle ListenTCP(int port)
+{
+    SocketHandle listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener == InvalidSocket) {
+        return InvalidSocket;
+    }
+    int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if (bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 64) != 0) {
+        CloseSocket(listener);
+        return InvalidSocket;
+    }
+    return listener;
+}
+
+SocketHandle ConnectTCP(const std::string& host, int port)
+{
+    addrinfo hints, *addresses;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0) {
+        return InvalidSocket;
+    }
+    SocketHandle connection = InvalidSocket;
+    for (addrinfo* a = addresses; a && connection == InvalidSocket; a = a->ai_next) {
+        connection = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (connection != InvalidSocket && connect(connection, a->ai_addr, (int)a->ai_addrlen) != 0) {
+            CloseSocket(connection);
+            connection = InvalidSocket;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (connection != InvalidSocket) {
+        // Requests are short lines answered right away
+        int noDelay = 1;
+        setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+    }
+    return connection;
+}
+
+SocketHandle Accept(SocketHandle listener)
+{
+    return accept(listener, nullptr, nullptr);
+}
+
+bool WaitReadable(SocketHandle socket, int milliseconds)
+{
+    fd_set set;
+    FD_ZERO(&set);
+    FD_SET(socket, &set);
+    timeval timeout;
+    timeout.tv_sec = milliseconds / 1000;
+    timeout.tv_usec = (milliseconds % 1000) * 1000;
+    return select((int)socket + 1, &set, nullptr, nullptr, &timeout) > 0;
+}
+
+bool SetRecvTimeout(SocketHandle socket, int milliseconds)
+{
+#ifdef _WIN32
+    DWORD timeout = milliseconds;
+#else
+    timeval timeout;
+    timeout.tv_sec = milliseconds / 1000;
+    timeout.tv_usec = (milliseconds % 1000) * 1000;
+#endif
+    return setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout)) == 0;
+}
+
+bool SendAll(SocketHandle socket, const void* data, size_t size)
+{
+    const char* p = (const char*)data;
+    while (size > 0) {
+        int n = send(socket, p, (int)min(size, (size_t)1 << 30), SendFlags);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool RecvAll(SocketHandle socket, void* data, size_t size)
+{
+    char* p = (char*)data;
+    while (size > 0) {
+        int n = recv(socket, p, (int)min(size, (size_t)1 << 30), 0);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool SendLine(SocketHandle socket, const std::string& line)
+{
+    std::string message = line + "\n";
+    return SendAll(socket, message.c_str(), message.size());
+}
+
+// Reads byte by byte, so nothing after the line is consumed
+bool RecvLine(SocketHandle socket, std::string* line)
+{
+    line->clear();
+    char ch;
+    while (recv(socket, &ch, 1, 0) == 1) {
+        if (ch == '\n') {
+            return true;
+        }
+        if (ch != '\r') {
+            line->push_back(ch);
+        }
+    }
+    return false;
+}
@@ -0,0 +1,42 @@
+#pragma once
+#ifndef __SOCKETIO_H
+#define __SOCKETIO_H
+
+#include "renderer/core/fwd.h"
+
+#include <cstdint>
+
+#ifdef _WIN32
+typedef uintptr_t SocketHandle;
+#else
+typedef int SocketHandle;
+#endif
+
+static const SocketHandle InvalidSocket = (SocketHandle)-1;
+
+/**
+ * \brief Thin wrappers over BSD sockets and Winsock
+ *
+ * Control messages are single lines of text. Everything returns false or
+ * InvalidSocket on failure and never aborts, so a broken connection only
+ * ends that connection.
+ */
+bool SocketInit();
+void CloseSocket(SocketHandle socket);
+
+SocketHandle ListenLocal(const std::string& path);
+SocketHandle ConnectLocal(const std::string& path);
+SocketHandle ListenTCP(int port);
+SocketHandle ConnectTCP(const std::string& host, int port);
+SocketHandle Accept(SocketHandle listener);
+// True once data or a connection can be read without blocking
+bool WaitReadable(SocketHandle socket, int milliseconds);
+// Receives on socket fail instead of waiting longer than milliseconds
+bool SetRecvTimeout(SocketHandle socket, int milliseconds);
+
+bool SendAll(SocketHandle socket, const void* data, size_t size);
+bool RecvAll(SocketHandle socket, void* data, size_t size);
+bool SendLine(SocketHandle socket, const std::string& line);
+bool RecvLine(SocketHandle socket, std::string* line);
+
+#endif // !__SOCKETIO_H
@@ -23,6 +23,7 @@ public:
     __device__ __host__ Spectrum& operator /= (const Float v);
 
     __device__ __host__ Float Max() const;
+    __device__ __host__ Float Luminance() const;
     __device__ __host__ bool isBlack() const;
 
     Float r, g, b;
@@ -118,6 +119,12 @@ Float Spectrum::Max() const
     return max(max(r, g), b);
 }
 
+inline __device__ __host__
+Float Spectrum::Luminance() const
+{
+    return 0.212671f * r + 0.715160f * g + 0.072169f * b;
+}
+
 inline __device__ __host__ 
 bool Spectrum::isBlack() const
 {
@@ -56,6 +56,8 @@ __host__ __device__ inline
 Transform Translate(Float x, Float y, Float z);
 __host__ __device__ inline
 Transform Perspective(Float fov, Float near, Float far);
+__host__ __device__ inline
+Transform LookAt(const Point3f& eye, const Point3f& target, const Vector3f& up);
 
 
 inline __device__ __host__
@@ -297,6 +299,19 @@ Transform Perspective(Float fov, Float n, Float f)
     return Transform(perspective);
 }
 
-
+// World to camera transform of a camera at eye looking at target, as in pbrt
+inline __host__ __device__
+Transform LookAt(const Point3f& eye, const Point3f& target, const Vector3f& up)
+{
+    Vector3f dir = Normalize(target - eye);
+    Vector3f right = Normalize(Cross(Normalize(up), dir));
+    Vector3f newUp = Cross(dir, right);
+    Matrix4x4 cameraToWorld(
+        right.x, newUp.x, dir.x, eye.x,
+        right.y, newUp.y, dir.y, eye.y,
+        right.z, newUp.z, dir.z, eye.z,
+        0, 0, 0, 1);
+    return Transform(Inverse(cameraToWorld), cameraToWorld);
+}
 
 #endif // __TRANSFORM_H
\ No newline at end of file
@@ -1,6 +1,9 @@
 #include "ext/rply/rply.h"
 
 #include "triangle.h"
+#include "renderer/loader/binarymesh.h"
+#include "renderer/loader/objloader.h"
+#include "renderer/loader/plyloader.h"
 
 TriangleMesh::TriangleMesh(
     Transform objToWorld,
@@ -26,12 +29,28 @@ TriangleMesh::TriangleMesh(
     }
     if (uv.size() != 0) {
         m_UV = new Point2f[m_vertexNum];
-        for (int i = 0; i < m_vertexNum; i += 2) {
-            m_UV[i] = Point2f(uv[i], uv[i + 1]);
+        for (int i = 0; i < m_vertexNum; i++) {
+            m_UV[i] = Point2f(uv[2 * i], uv[2 * i + 1]);
         }
     }
 }
 
+void ReleaseTriangleMesh(TriangleMesh* mesh)
+{
+    // Arrays inside a mapped file go with the mapping, the others come from new[]
+    auto owned = [&](const void* p) { return p && !InBinaryMesh(mesh->m_mapping, p); };
+    if (owned(mesh->m_indices)) delete[] mesh->m_indices;
+    if (owned(mesh->m_P)) delete[] mesh->m_P;
+    if (owned(mesh->m_N)) delete[] mesh->m_N;
+    if (owned(mesh->m_UV)) delete[] mesh->m_UV;
+    ReleaseBinaryMesh(mesh->m_mapping);
+    mesh->m_indices = nullptr;
+    mesh->m_P = nullptr;
+    mesh->m_N = nullptr;
+    mesh->m_UV = nullptr;
+    mesh->m_bvh = nullptr;
+    mesh->m_mapping = nullptr;
+}
 
 Triangle::Triangle(
     TriangleMesh* triangleMeshPtr, int index)
@@ -215,10 +234,6 @@ int rply_face_callback(p_ply_argument argument) {
         else if (value_index < 0) {
             return 1;
         }
-        if (length == 4) {
-            ASSERT(0, "Can't support quad");
-        }
-
         if (value_index >= 0) {
             int value = (int)ply_get_argument_value(argument);
             if (value < 0 || value >= context->vertexCount) {
@@ -255,6 +270,16 @@ std::vector<std::shared_ptr<Triangle>> CreatePLYMeshShape(
 {    
     const std::string filename = params.GetString("filename", "");
     filesystem::path path = getFileResolver()->resolve(filename);
+    TriangleMesh* mesh = nullptr;
+    if (LoadBinaryPLY(path.str(), o2w, &mesh)) {
+        std::vector<std::shared_ptr<Triangle>> triangles;
+        for (int i = 0; mesh && i < mesh->m_triangleNum; i++) {
+            triangles.push_back(std::make_shared<Triangle>(mesh, i));
+        }
+        return triangles;
+    }
+
+    // ASCII files go through rply
     p_ply ply = ply_open(path.str().c_str(), rply_message_callback, 0, nullptr);
     if (!ply) {        
         return std::vector<std::shared_ptr<Triangle>>();
@@ -367,3 +392,28 @@ std::vector<std::shared_ptr<Triangle>> CreatePLYMeshShape(
     pa.AddFloat("uv", uv);
     return CreateTriangleMeshShape(pa, o2w, w2o);
 }
+
+std::vector<std::shared_ptr<Triangle>> CreateBinaryMeshShape(
+    const ParameterSet& params,
+    const Transform& o2w,
+    const Transform& w2o)
+{
+    const std::string filename = params.GetString("filename", "");
+    filesystem::path path = getFileResolver()->resolve(filename);
+    TriangleMesh* mesh = LoadBinaryMesh(path.str(), o2w);
+    std::vector<std::shared_ptr<Triangle>> triangles;
+    for (int i = 0; mesh && i < mesh->m_triangleNum; i++) {
+        triangles.push_back(std::make_shared<Triangle>(mesh, i));
+    }
+    return triangles;
+}
+
+TriangleMesh* CreateOBJMeshShape(
+    const ParameterSet& params,
+    const Transform& o2w,
+    const Transform& w2o)
+{
+    const std::string filename = params.GetString("filename", "");
+    filesystem::path path = getFileResolver()->resolve(filename);
+    return LoadOBJMesh(path.str(), o2w);
+}
@@ -9,6 +9,9 @@
 #include "renderer/core/sampling.h"
 
 
+struct MeshBVH;
+struct MappedMesh;
+
 /**
  * counter clock-wise is the normal direction
  */
@@ -37,8 +40,17 @@ public:
     Point3f* m_P = nullptr;
     Normal3f* m_N = nullptr;
     Point2f* m_UV = nullptr;
+    const MeshBVH* m_bvh = nullptr;     // set for mesh files that carry one
+    MappedMesh* m_mapping = nullptr;    // mesh file the arrays may point into
 };
 
+/**
+ * Frees the arrays of a mesh and unmaps the mesh file they were read from.
+ * Meshes are shallow copies, so this is only done on request, once, for a
+ * mesh nothing refers to anymore.
+ */
+void ReleaseTriangleMesh(TriangleMesh* mesh);
+
 class Triangle {
 public:
     Triangle(
@@ -55,7 +67,15 @@ public:
 
     Interaction Sample(
         Float* pdf, 
-        unsigned int& seed) const;
+        const Point2f& u) const;
+
+    // Fill the hit attributes from the barycentrics found by an intersection
+    void ComputeInteraction(
+        const Ray& ray,
+        Float t,
+        Float u,
+        Float v,
+        Interaction* interaction) const;
 
     Point3f Centroid() const;
     Float Area() const;
@@ -68,6 +88,28 @@ public:
     int m_triangleMeshID;
 };
 
+/**
+ * \brief Vertex and edges of a triangle, copied out of its mesh
+ *
+ * Accelerators keep these in leaf order, so testing a leaf is a sequential
+ * read instead of following the triangle to its mesh and indices.
+ */
+class TriangleRecord {
+public:
+    TriangleRecord() {}
+    TriangleRecord(const Triangle& triangle, int shapeID);
+
+    bool Intersect(
+        const Ray& ray,
+        Float* tHit,
+        Float* u,
+        Float* v) const;
+
+    Point3f m_p0;
+    Vector3f m_e1, m_e2;
+    int m_shapeID;
+};
+
 std::vector<std::shared_ptr<Triangle>>
 CreateTriangleMeshShape(
     const ParameterSet& params,
@@ -80,6 +122,19 @@ CreatePLYMeshShape(
     const Transform& o2w,
     const Transform& w2o);
 
+std::vector<std::shared_ptr<Triangle>>
+CreateBinaryMeshShape(
+    const ParameterSet& params,
+    const Transform& o2w,
+    const Transform& w2o);
+
+// Meshes of OBJ files are added whole, see Scene::AddTriangles(TriangleMesh*)
+TriangleMesh*
+CreateOBJMeshShape(
+    const ParameterSet& params,
+    const Transform& o2w,
+    const Transform& w2o);
+
 std::vector<std::shared_ptr<Triangle>>
 CreateSphereShape(
     const ParameterSet& params,
@@ -159,6 +214,25 @@ bool Triangle::IntersectP(const Ray& ray, Float* tHit, Interaction* interaction)
         return false;
     }
     *tHit = t;
+    ComputeInteraction(ray, t, u, v, interaction);
+    return true;
+}
+
+inline __device__ __host__
+void Triangle::ComputeInteraction(
+    const Ray& ray,
+    Float t,
+    Float u,
+    Float v,
+    Interaction* interaction) const
+{
+    int* indices = &m_triangleMeshPtr->m_indices[m_index * 3];
+    const Point3f& p0 = m_triangleMeshPtr->m_P[indices[0]];
+    const Point3f& p1 = m_triangleMeshPtr->m_P[indices[1]];
+    const Point3f& p2 = m_triangleMeshPtr->m_P[indices[2]];
+    Vector3f E1 = p1 - p0;
+    Vector3f E2 = p2 - p0;
+
     interaction->m_wo = -ray.d;
     interaction->m_p = ray(t);
     interaction->m_geometryN = Normal3f(Normalize(Cross(E1, E2)));
@@ -178,13 +252,12 @@ bool Triangle::IntersectP(const Ray& ray, Float* tHit, Interaction* interaction)
         const Point2f& uv2 = m_triangleMeshPtr->m_UV[indices[2]];
         interaction->m_uv = uv0 * (1 - u - v) + uv1 * u + uv2 * v;
     }
-    return true;
 }
 
 inline __device__ __host__
-Interaction Triangle::Sample(Float* pdf, unsigned int& seed) const
+Interaction Triangle::Sample(Float* pdf, const Point2f& uSample) const
 {
-    Point2f u = UniformSampleTriangle(seed);
+    Point2f u = UniformSampleTriangle(uSample);
     int* indices = &m_triangleMeshPtr->m_indices[m_index * 3];
     const Point3f& p0 = m_triangleMeshPtr->m_P[indices[0]];
     const Point3f& p1 = m_triangleMeshPtr->m_P[indices[1]];
@@ -236,4 +309,45 @@ Bounds3f Triangle::WorldBounds() const
 }
 
 
+inline __device__ __host__
+TriangleRecord::TriangleRecord(const Triangle& triangle, int shapeID)
+    : m_shapeID(shapeID)
+{
+    int* indices = &triangle.m_triangleMeshPtr->m_indices[triangle.m_index * 3];
+    m_p0 = triangle.m_triangleMeshPtr->m_P[indices[0]];
+    m_e1 = triangle.m_triangleMeshPtr->m_P[indices[1]] - m_p0;
+    m_e2 = triangle.m_triangleMeshPtr->m_P[indices[2]] - m_p0;
+}
+
+/*
+ * Moller-Trumbore algorithm, the same arithmetic as Triangle::IntersectP
+ */
+inline __device__ __host__
+bool TriangleRecord::Intersect(const Ray& ray, Float* tHit, Float* u, Float* v) const
+{
+    const Vector3f& D = ray.d;
+    Vector3f P = Cross(D, m_e2);
+    Float det = Dot(P, m_e1);
+    if (std::fabs(det) < Epsilon) {
+        return false;
+    }
+    Float invDet = 1 / det;
+    Vector3f T = ray.o - m_p0;
+    *u = Dot(P, T) * invDet;
+    if (*u < 0 || *u > 1) {
+        return false;
+    }
+    Vector3f Q = Cross(T, m_e1);
+    *v = Dot(Q, D) * invDet;
+    if (*v < 0 || *u + *v > 1) {
+        return false;
+    }
+    Float t = Dot(Q, m_e2) * invDet;
+    if (t < Epsilon || t > ray.tMax) {
+        return false;
+    }
+    *tHit = t;
+    return true;
+}
+
 #endif // !__TRIANGLEMESH_H
@@ -0,0 +1,387 @@
+#include "wavefront.h"
+
+#include "renderer/core/checkpoint.h"
+#include "renderer/core/cpurender.h"
+#include "renderer/core/parallel.h"
+
+#include <algorithm>
+
+// Number of queue entries a task processes at once
+static constexpr int queueChunkSize = 1024;
+
+void RayQueue::Resize(int capacity)
+{
+    m_ox.resize(capacity);
+    m_oy.resize(capacity);
+    m_oz.resize(capacity);
+    m_dx.resize(capacity);
+    m_dy.resize(capacity);
+    m_dz.resize(capacity);
+    m_tMax.resize(capacity);
+    m_pathIndex.resize(capacity);
+    m_size = 0;
+}
+
+int RayQueue::Push(const Ray& ray, int pathIndex)
+{
+    int index = m_size++;
+    m_ox[index] = ray.o.x;
+    m_oy[index] = ray.o.y;
+    m_oz[index] = ray.o.z;
+    m_dx[index] = ray.d.x;
+    m_dy[index] = ray.d.y;
+    m_dz[index] = ray.d.z;
+    m_tMax[index] = ray.tMax;
+    m_pathIndex[index] = pathIndex;
+    return index;
+}
+
+Ray RayQueue::GetRay(int index) const
+{
+    return Ray(Point3f(m_ox[index], m_oy[index], m_oz[index]),
+        Vector3f(m_dx[index], m_dy[index], m_dz[index]), m_tMax[index]);
+}
+
+void ShadowRayQueue::Resize(int capacity)
+{
+    RayQueue::Resize(capacity);
+    m_LdR.resize(capacity);
+    m_LdG.resize(capacity);
+    m_LdB.resize(capacity);
+}
+
+int ShadowRayQueue::Push(const Ray& ray, int pathIndex, const Spectrum& Ld)
+{
+    int index = RayQueue::Push(ray, pathIndex);
+    m_LdR[index] = Ld.r;
+    m_LdG[index] = Ld.g;
+    m_LdB[index] = Ld.b;
+    return index;
+}
+
+void HitQueue::Resize(int capacity)
+{
+    m_interactions.resize(capacity);
+    m_pathIndex.resize(capacity);
+    m_size = 0;
+}
+
+int HitQueue::Push(const Interaction& interaction, int pathIndex)
+{
+    int index = m_size++;
+    m_interactions[index] = interaction;
+    m_pathIndex[index] = pathIndex;
+    return index;
+}
+
+void PathStates::Resize(int capacity)
+{
+    m_pixel.resize(capacity);
+    m_sampler.resize(capacity);
+    m_betaR.resize(capacity);
+    m_betaG.resize(capacity);
+    m_betaB.resize(capacity);
+    m_LR.resize(capacity);
+    m_LG.resize(capacity);
+    m_LB.resize(capacity);
+    m_specular.resize(capacity);
+    m_px.resize(capacity);
+    m_py.resize(capacity);
+    m_pz.resize(capacity);
+    m_nx.resize(capacity);
+    m_ny.resize(capacity);
+    m_nz.resize(capacity);
+    m_bsdfPdf.resize(capacity);
+    m_pathLength.resize(capacity);
+    m_aovDone.resize(capacity);
+}
+
+Spectrum PathStates::GetThroughput(int index) const
+{
+    return Spectrum(m_betaR[index], m_betaG[index], m_betaB[index]);
+}
+
+void PathStates::SetThroughput(int index, const Spectrum& beta)
+{
+    m_betaR[index] = beta.r;
+    m_betaG[index] = beta.g;
+    m_betaB[index] = beta.b;
+}
+
+void PathStates::AddRadiance(int index, const Spectrum& L)
+{
+    m_LR[index] += L.r;
+    m_LG[index] += L.g;
+    m_LB[index] += L.b;
+}
+
+Point3f PathStates::GetPrevP(int index) const
+{
+    return Point3f(m_px[index], m_py[index], m_pz[index]);
+}
+
+Normal3f PathStates::GetPrevN(int index) const
+{
+    return Normal3f(m_nx[index], m_ny[index], m_nz[index]);
+}
+
+void PathStates::SetPrevVertex(int index, const Point3f& p, const Normal3f& n, Float bsdfPdf)
+{
+    m_px[index] = p.x;
+    m_py[index] = p.y;
+    m_pz[index] = p.z;
+    m_nx[index] = n.x;
+    m_ny[index] = n.y;
+    m_nz[index] = n.z;
+    m_bsdfPdf[index] = bsdfPdf;
+}
+
+WavefrontPathIntegrator::WavefrontPathIntegrator(
+    std::shared_ptr<Renderer> renderer,
+    int maxBatchSize)
+    : m_renderer(renderer), m_scene(&renderer->m_scene), m_camera(&renderer->m_camera),
+    m_integrator(&renderer->m_integrator), m_maxBatchSize(maxBatchSize),
+    m_currentRays(&m_rayQueues[0]), m_nextRays(&m_rayQueues[1])
+{
+}
+
+void WavefrontPathIntegrator::GenerateCameraRays(int begin, int end, int pass)
+{
+    int width = m_camera->m_film.m_resolution.x;
+    int nPaths = end - begin;
+
+    // Paths are laid out in pixel order so that camera rays stay coherent
+    m_currentRays->m_size = nPaths;
+    ParallelFor([&](int i) {
+        int pixel = m_activePixels[begin + i];
+        int x = pixel % width, y = pixel / width;
+        Sampler& sampler = m_paths.m_sampler[i];
+        sampler = m_renderer->m_sampler;
+        sampler.StartPixelSample(pixel, pass);
+        Point2f u = sampler.Get2D();
+        Ray ray = m_camera->GenerateRay(Point2f(x + u.x, y + u.y));
+
+        m_paths.m_pixel[i] = pixel;
+        m_paths.SetThroughput(i, Spectrum(1));
+        m_paths.m_LR[i] = m_paths.m_LG[i] = m_paths.m_LB[i] = 0;
+        m_paths.m_specular[i] = true;
+        m_paths.SetPrevVertex(i, ray.o, Normal3f(), 0);
+        m_paths.m_pathLength[i] = 0;
+        m_paths.m_aovDone[i] = !m_camera->m_film.HasAOVs();
+
+        m_currentRays->m_ox[i] = ray.o.x;
+        m_currentRays->m_oy[i] = ray.o.y;
+        m_currentRays->m_oz[i] = ray.o.z;
+        m_currentRays->m_dx[i] = ray.d.x;
+        m_currentRays->m_dy[i] = ray.d.y;
+        m_currentRays->m_dz[i] = ray.d.z;
+        m_currentRays->m_tMax[i] = ray.tMax;
+        m_currentRays->m_pathIndex[i] = i;
+    }, nPaths, queueChunkSize);
+}
+
+void WavefrontPathIntegrator::ExtendRays()
+{
+    m_hits.Clear();
+    ParallelFor([&](int i) {
+        Ray ray = m_currentRays->GetRay(i);
+        Interaction interaction;
+        if (m_scene->IntersectP(ray, &interaction)) {
+            int path = m_currentRays->m_pathIndex[i];
+            // measured from the offset origin like the recursive renderer does
+            if (!m_paths.m_aovDone[path]) {
+                m_paths.m_pathLength[path] += (interaction.m_p - ray.o).Length();
+            }
+            m_hits.Push(interaction, path);
+        }
+    }, m_currentRays->Size(), queueChunkSize);
+}
+
+void WavefrontPathIntegrator::ShadeHits(int bounce)
+{
+    const Scene& scene = *m_scene;
+    m_nextRays->Clear();
+    m_shadowRays.Clear();
+
+    ParallelFor([&](int i) {
+        Interaction& inter = m_hits.m_interactions[i];
+        int path = m_hits.m_pathIndex[i];
+        Sampler& sampler = m_paths.m_sampler[path];
+        Spectrum throughput = m_paths.GetThroughput(path);
+
+        m_paths.AddRadiance(path, throughput * EmittedLight(scene, inter, m_paths.m_specular[path],
+            m_paths.m_bsdfPdf[path], m_paths.GetPrevP(path), m_paths.GetPrevN(path)));
+        if (bounce == m_integrator->m_maxDepth) {
+            return;
+        }
+
+        const Primitive& primitive = scene.m_primitives[inter.m_primitiveID];
+        const Material& material = scene.m_materials[primitive.m_materialID];
+
+        // denoiser features, every pixel has one path per batch so the film is not contended
+        if (!m_paths.m_aovDone[path] && !material.isDelta()) {
+            AOVSample aov;
+            aov.albedo = material.Albedo();
+            aov.normal = Faceforward(inter.m_shadingN, inter.m_wo);
+            aov.depth = m_paths.m_pathLength[path];
+            int pixel = m_paths.m_pixel[path];
+            int width = m_camera->m_film.m_resolution.x;
+            m_renderer->m_camera.m_film.AddAOVSample(pixel % width, pixel / width, aov);
+            m_paths.m_aovDone[path] = true;
+        }
+
+        // direct light, the rays are traced by the shadow stage
+        if (!material.isDelta() && !scene.m_lights.empty()) {
+            Float lightChoosePdf;
+            int lightID = scene.SampleLight(inter.m_p, inter.m_shadingN, sampler.Get1D(), &lightChoosePdf);
+            Point2f uLight = sampler.Get2D();
+
+            // Light Sampling, no light may reach this point
+            if (lightID != -1) {
+                const Light& light = scene.m_lights[lightID];
+                const Triangle& triangle = scene.m_triangles[light.m_shapeID];
+
+                Float lightSamplePdf;
+                Interaction lightSample = triangle.Sample(&lightSamplePdf, uLight);
+                lightSamplePdf *= (lightSample.m_p - inter.m_p).SqrLength() /
+                    AbsDot(-Normalize(lightSample.m_p - inter.m_p), lightSample.m_shadingN);
+                lightSamplePdf *= lightChoosePdf;
+
+                Vector3f wi = Normalize(lightSample.m_p - inter.m_p);
+                Spectrum Le(0.);
+                if (Dot(-wi, lightSample.m_shadingN) > 0) {
+                    Le = light.m_L;
+                }
+                Float bsdfPdf;
+                Spectrum cosBSDF = material.F(inter.m_shadingN, inter.m_wo, wi, &bsdfPdf);
+                Spectrum Ld;
+                if (light.isDelta()) {
+                    Ld = Le * cosBSDF / lightSamplePdf;
+                }
+                else {
+                    Float weight = PowerHeuristic(1, lightSamplePdf, 1, bsdfPdf);
+                    Ld = Le * cosBSDF * weight / lightSamplePdf;
+                }
+                if (!Ld.isBlack()) {
+                    Point3f origin = inter.m_p + (lightSample.m_p - inter.m_p) * Epsilon;
+                    Point3f target = lightSample.m_p + (origin - lightSample.m_p) * Epsilon;
+                    Vector3f d = target - origin;
+                    Ray shadowRay(origin, Normalize(d), d.Length() - Epsilon);
+                    m_shadowRays.Push(shadowRay, path, throughput * Ld);
+                }
+            }
+        }
+        m_paths.m_specular[path] = material.isDelta();
+
+        // calculate BSDF, the continuation ray also finds the BSDF sampling half of MIS
+        Float bsdfPdf;
+        throughput *= SampleMaterial(scene, inter, sampler, &bsdfPdf);
+        if (throughput.isBlack()) {
+            return;
+        }
+        m_paths.SetPrevVertex(path, inter.m_p, inter.m_shadingN, bsdfPdf);
+
+        // indirect light
+        if (throughput.Max() < 1 && bounce > 5) {
+            Float q = max((Float).05, 1 - throughput.Max());
+            if (sampler.Get1D() < q) return;
+            throughput /= 1 - q;
+        }
+        m_paths.SetThroughput(path, throughput);
+
+        // Terminated paths are never pushed, which compacts the next queue
+        m_nextRays->Push(Ray(inter.m_p + inter.m_wi * Epsilon, inter.m_wi), path);
+    }, m_hits.Size(), queueChunkSize);
+}
+
+void WavefrontPathIntegrator::TraceShadowRays()
+{
+    ParallelFor([&](int i) {
+        Ray ray = m_shadowRays.GetRay(i);
+        if (!m_scene->Intersect(ray)) {
+            m_paths.AddRadiance(m_shadowRays.m_pathIndex[i],
+                Spectrum(m_shadowRays.m_LdR[i], m_shadowRays.m_LdG[i], m_shadowRays.m_LdB[i]));
+        }
+    }, m_shadowRays.Size(), queueChunkSize);
+}
+
+void WavefrontPathIntegrator::AccumulateSamples(int nPaths)
+{
+    Film& film = m_renderer->m_camera.m_film;
+    int width = film.m_resolution.x;
+    ParallelFor([&](int i) {
+        int pixel = m_paths.m_pixel[i];
+        film.AddSample(pixel % width, pixel / width,
+            Spectrum(m_paths.m_LR[i], m_paths.m_LG[i], m_paths.m_LB[i]));
+    }, nPaths, queueChunkSize);
+}
+
+void WavefrontPathIntegrator::Render()
+{
+    m_renderer->m_scene.Preprocess();
+    Film& film = m_renderer->m_camera.m_film;
+    int nPixels = film.m_resolution.x * film.m_resolution.y;
+    int batchSize = min(m_maxBatchSize, nPixels);
+
+    m_paths.Resize(batchSize);
+    m_rayQueues[0].Resize(batchSize);
+    m_rayQueues[1].Resize(batchSize);
+    m_hits.Resize(batchSize);
+    m_shadowRays.Resize(batchSize);
+
+    Point2i nTiles = RenderTileCount(film.m_resolution);
+    std::vector<unsigned char> active(nTiles.x * nTiles.y, 1);
+    m_activePixels.resize(nPixels);
+    for (int i = 0; i < nPixels; i++) {
+        m_activePixels[i] = i;
+    }
+    auto removeInactivePixels = [&]() {
+        m_activePixels.erase(std::remove_if(m_activePixels.begin(), m_activePixels.end(), [&](int pixel) {
+            int x = pixel % film.m_resolution.x, y = pixel / film.m_resolution.x;
+            return !active[y / renderTileSize * nTiles.x + x / renderTileSize];
+        }), m_activePixels.end());
+    };
+
+    Checkpoint checkpoint(m_renderer->m_checkpointFile, m_renderer->m_checkpointInterval, RenderFingerprint(*m_renderer));
+    int start = 0;
+    if (m_renderer->m_resume) {
+        start = checkpoint.Load(film, active);
+        removeInactivePixels();
+    }
+
+    int num = m_integrator->m_nSample;
+    for (int k = start; k < num && !m_activePixels.empty(); k++) {
+        fprintf(stderr, "\rPass %d/%d, %d pixels", k + 1, num, (int)m_activePixels.size());
+        int nActive = m_activePixels.size();
+        for (int begin = 0; begin < nActive; begin += batchSize) {
+            int end = min(begin + batchSize, nActive);
+            GenerateCameraRays(begin, end, k);
+            for (int bounce = 0; bounce <= m_integrator->m_maxDepth && m_currentRays->Size() > 0; bounce++) {
+                ExtendRays();
+                ShadeHits(bounce);
+                TraceShadowRays();
+                std::swap(m_currentRays, m_nextRays);
+            }
+            AccumulateSamples(end - begin);
+        }
+        if (m_integrator->m_maxError > 0 && k + 1 >= m_integrator->m_minSample) {
+            film.UpdateActiveTiles(renderTileSize, m_integrator->m_maxError, active.data());
+            removeInactivePixels();
+        }
+        if (checkpoint.Due()) {
+            checkpoint.Save(film, active, k + 1);
+        }
+        film.OutputPass();
+    }
+    checkpoint.Save(film, active, num);
+    checkpoint.Flush();
+    film.Output();
+    film.OutputDenoised();
+    film.WaitForOutput();
+}
+
+void WavefrontRender(std::shared_ptr<Renderer> renderer)
+{
+    WavefrontPathIntegrator integrator(renderer);
+    integrator.Render();
+}
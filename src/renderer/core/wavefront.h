@@ -0,0 +1,125 @@
+#pragma once
+#ifndef __WAVEFRONT_H
+#define __WAVEFRONT_H
+
+#include "renderer/core/renderer.h"
+
+#include <atomic>
+
+/**
+ * \brief Rays waiting for the same stage, stored as structure of arrays
+ *
+ * Stages push from many threads at once, so Push() only reserves a slot.
+ */
+class RayQueue {
+public:
+    RayQueue() : m_size(0) {}
+
+    void Resize(int capacity);
+    void Clear() { m_size = 0; }
+    int Size() const { return m_size; }
+
+    int Push(const Ray& ray, int pathIndex);
+    Ray GetRay(int index) const;
+
+    std::vector<Float> m_ox, m_oy, m_oz;
+    std::vector<Float> m_dx, m_dy, m_dz;
+    std::vector<Float> m_tMax;
+    std::vector<int> m_pathIndex;
+    std::atomic<int> m_size;
+};
+
+// Light samples waiting for a visibility test
+class ShadowRayQueue : public RayQueue {
+public:
+    void Resize(int capacity);
+    int Push(const Ray& ray, int pathIndex, const Spectrum& Ld);
+
+    std::vector<Float> m_LdR, m_LdG, m_LdB;
+};
+
+// Intersections found by the extend stage
+class HitQueue {
+public:
+    HitQueue() : m_size(0) {}
+
+    void Resize(int capacity);
+    void Clear() { m_size = 0; }
+    int Size() const { return m_size; }
+    int Push(const Interaction& interaction, int pathIndex);
+
+    std::vector<Interaction> m_interactions;
+    std::vector<int> m_pathIndex;
+    std::atomic<int> m_size;
+};
+
+// Per-path state, indexed by path slot
+class PathStates {
+public:
+    void Resize(int capacity);
+
+    Spectrum GetThroughput(int index) const;
+    void SetThroughput(int index, const Spectrum& beta);
+    void AddRadiance(int index, const Spectrum& L);
+    Point3f GetPrevP(int index) const;
+    Normal3f GetPrevN(int index) const;
+    void SetPrevVertex(int index, const Point3f& p, const Normal3f& n, Float bsdfPdf);
+
+    std::vector<int> m_pixel;
+    std::vector<Sampler> m_sampler;
+    std::vector<Float> m_betaR, m_betaG, m_betaB;
+    std::vector<Float> m_LR, m_LG, m_LB;
+    std::vector<uint8_t> m_specular;
+    // Vertex the current ray was BSDF sampled from, to weight emission it hits
+    std::vector<Float> m_px, m_py, m_pz;
+    std::vector<Float> m_nx, m_ny, m_nz;
+    std::vector<Float> m_bsdfPdf;
+    // Distance travelled from each ray origin until the denoiser features are taken
+    std::vector<Float> m_pathLength;
+    std::vector<uint8_t> m_aovDone;
+};
+
+/**
+ * \brief Wavefront (stream) path tracer
+ *
+ * Instead of following one path to the end, every stage runs over a whole
+ * batch of paths before the next one starts:
+ *   Generate -> Extend -> Shade -> Shadow -> (next bounce) -> Accumulate
+ * Terminated paths are compacted away because the shade stage only pushes
+ * surviving paths to the next ray queue.
+ */
+class WavefrontPathIntegrator {
+public:
+    WavefrontPathIntegrator(
+        std::shared_ptr<Renderer> renderer,
+        int maxBatchSize = 1 << 18);
+
+    void Render();
+
+private:
+    void GenerateCameraRays(int begin, int end, int pass);
+    void ExtendRays();
+    void ShadeHits(int bounce);
+    void TraceShadowRays();
+    void AccumulateSamples(int nPaths);
+
+    std::shared_ptr<Renderer> m_renderer;
+    const Scene* m_scene;
+    const Camera* m_camera;
+    const Integrator* m_integrator;
+    int m_maxBatchSize;
+
+    // Pixels of the tiles adaptive sampling has not stopped yet
+    std::vector<int> m_activePixels;
+
+    PathStates m_paths;
+    RayQueue m_rayQueues[2];
+    RayQueue* m_currentRays;
+    RayQueue* m_nextRays;
+    HitQueue m_hits;
+    ShadowRayQueue m_shadowRays;
+};
+
+void WavefrontRender(std::shared_ptr<Renderer> renderer);
+
+#endif // !__WAVEFRONT_H
@@ -0,0 +1,523 @@
+#include "widebvh.h"
+
+#include "renderer/core/triangle.h"
+#include "renderer/core/interaction.h"
+#include "renderer/core/parallel.h"
+
+#include <limits>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define WIDEBVH_SSE
+#include <immintrin.h>
+#endif
+
+int WideBVHAccelerator::DefaultWidth()
+{
+#if defined(__AVX__)
+    return 8;
+#else
+    return 4;
+#endif
+}
+
+// Primitive range of every binary subtree. Subtrees with at most Width
+// primitives may become one leaf, so triangle blocks are filled.
+struct SubtreeRange {
+    int primitivesOffset;
+    int nPrimitives;
+};
+
+// Emit the wide node covering the binary subtree rooted at binaryIndex and
+// return its offset in the wide node array
+template <int Width>
+static int CollapseNode(
+    const LinearBVHNode* binaryNodes,
+    const std::vector<SubtreeRange>& ranges,
+    int binaryIndex,
+    std::vector<WideBVHNode<Width>>& wideNodes)
+{
+    auto isLeaf = [&](int index) {
+        return binaryNodes[index].nPrimitives > 0 || ranges[index].nPrimitives <= Width;
+    };
+
+    int children[Width];
+    int nChildren = 0;
+    const LinearBVHNode& root = binaryNodes[binaryIndex];
+    if (isLeaf(binaryIndex)) {
+        children[nChildren++] = binaryIndex;
+    }
+    else {
+        children[nChildren++] = binaryIndex + 1;
+        children[nChildren++] = root.rightChildOffset;
+    }
+
+    // Open up the interior child with the largest surface area until full
+    while (nChildren < Width) {
+        int best = -1;
+        Float bestArea = -1;
+        for (int i = 0; i < nChildren; i++) {
+            const LinearBVHNode& child = binaryNodes[children[i]];
+            if (!isLeaf(children[i]) && child.bounds.Area() > bestArea) {
+                best = i;
+                bestArea = child.bounds.Area();
+            }
+        }
+        if (best == -1) break;
+        int opened = children[best];
+        children[best] = opened + 1;
+        children[nChildren++] = binaryNodes[opened].rightChildOffset;
+    }
+
+    int wideIndex = wideNodes.size();
+    wideNodes.emplace_back();
+    for (int i = 0; i < Width; i++) {
+        WideBVHNode<Width>& node = wideNodes[wideIndex];
+        if (i >= nChildren) {
+            for (int axis = 0; axis < 3; axis++) {
+                node.bounds[0][axis][i] = std::numeric_limits<Float>::infinity();
+                node.bounds[1][axis][i] = -std::numeric_limits<Float>::infinity();
+            }
+            node.children[i] = -1;
+            node.nPrimitives[i] = 0;
+            continue;
+        }
+
+        const LinearBVHNode& child = binaryNodes[children[i]];
+        for (int axis = 0; axis < 3; axis++) {
+            node.bounds[0][axis][i] = child.bounds.pMin[axis];
+            node.bounds[1][axis][i] = child.bounds.pMax[axis];
+        }
+        if (isLeaf(children[i])) {
+            node.children[i] = ranges[children[i]].primitivesOffset;
+            node.nPrimitives[i] = ranges[children[i]].nPrimitives;
+        }
+        else {
+            node.nPrimitives[i] = 0;
+            // Recursion may grow wideNodes, so index it again afterwards
+            int childIndex = CollapseNode(binaryNodes, ranges, children[i], wideNodes);
+            wideNodes[wideIndex].children[i] = childIndex;
+        }
+    }
+    return wideIndex;
+}
+
+void WideBVHAccelerator::Build(const BVHAccelerator& bvh, int width, bool mergeLeaves)
+{
+    m_width = width;
+    m_nodes4.clear();
+    m_nodes8.clear();
+    m_blocks4.clear();
+    m_blocks8.clear();
+    m_shapeIDs.resize(bvh.m_primitives.size());
+    for (int i = 0; i < bvh.m_primitives.size(); i++) {
+        m_shapeIDs[i] = bvh.m_primitives[i].m_shapeID;
+    }
+
+    if (!bvh.m_nodes)
+        return;
+
+    // Children follow their parent in the depth-first layout, so one
+    // backwards pass sees both children before the parent
+    std::vector<SubtreeRange> ranges(bvh.m_totalNodes);
+    for (int i = bvh.m_totalNodes - 1; i >= 0; i--) {
+        const LinearBVHNode& node = bvh.m_nodes[i];
+        if (node.nPrimitives > 0) {
+            ranges[i] = { node.primitivesOffset, node.nPrimitives };
+        }
+        else if (!mergeLeaves) {
+            ranges[i] = { 0, std::numeric_limits<int>::max() };
+        }
+        else {
+            // Only contiguous ranges can be merged into one leaf
+            const SubtreeRange& left = ranges[i + 1];
+            const SubtreeRange& right = ranges[node.rightChildOffset];
+            if (left.nPrimitives > (1 << 16) || right.nPrimitives > (1 << 16))
+                ranges[i] = { 0, std::numeric_limits<int>::max() };
+            else if (left.primitivesOffset + left.nPrimitives == right.primitivesOffset)
+                ranges[i] = { left.primitivesOffset, left.nPrimitives + right.nPrimitives };
+            else if (right.primitivesOffset + right.nPrimitives == left.primitivesOffset)
+                ranges[i] = { right.primitivesOffset, left.nPrimitives + right.nPrimitives };
+            else
+                ranges[i] = { 0, std::numeric_limits<int>::max() };
+        }
+    }
+
+    if (m_width == 8) {
+        CollapseNode(bvh.m_nodes, ranges, 0, m_nodes8);
+    }
+    else {
+        m_width = 4;
+        CollapseNode(bvh.m_nodes, ranges, 0, m_nodes4);
+    }
+}
+
+template <int Width>
+void WideBVHAccelerator::PackLeaves(
+    std::vector<WideBVHNode<Width>>& nodes,
+    std::vector<TriangleBlock<Width>>& blocks,
+    const std::vector<Triangle>& triangles) const
+{
+    // Give every leaf child its run of blocks, then fill them in parallel
+    struct Leaf {
+        int primitiveOffset;
+        int nPrimitives;
+        int blockOffset;
+    };
+    std::vector<Leaf> leaves;
+    int nBlocks = 0;
+    for (WideBVHNode<Width>& node : nodes) {
+        for (int i = 0; i < Width; i++) {
+            if (node.nPrimitives[i] == 0) continue;
+            leaves.push_back({ node.children[i], node.nPrimitives[i], nBlocks });
+            node.children[i] = nBlocks;
+            nBlocks += (node.nPrimitives[i] + Width - 1) / Width;
+        }
+    }
+
+    blocks.resize(nBlocks);
+    ParallelFor([&](int l) {
+        const Leaf& leaf = leaves[l];
+        for (int i = 0; i < (leaf.nPrimitives + Width - 1) / Width * Width; i++) {
+            TriangleBlock<Width>& block = blocks[leaf.blockOffset + i / Width];
+            int lane = i % Width;
+            TriangleRecord record;
+            record.m_p0 = Point3f(0, 0, 0);
+            record.m_e1 = record.m_e2 = Vector3f(0, 0, 0);
+            record.m_shapeID = -1;
+            if (i < leaf.nPrimitives) {
+                int id = m_shapeIDs[leaf.primitiveOffset + i];
+                record = TriangleRecord(triangles[id], id);
+            }
+            for (int axis = 0; axis < 3; axis++) {
+                block.p0[axis][lane] = record.m_p0[axis];
+                block.e1[axis][lane] = record.m_e1[axis];
+                block.e2[axis][lane] = record.m_e2[axis];
+            }
+            block.shapeIDs[lane] = record.m_shapeID;
+        }
+    }, leaves.size(), 256);
+}
+
+void WideBVHAccelerator::BuildTriangleBlocks(const std::vector<Triangle>& triangles)
+{
+    if (!m_blocks4.empty() || !m_blocks8.empty())
+        return;
+    if (m_width == 8)
+        PackLeaves(m_nodes8, m_blocks8, triangles);
+    else
+        PackLeaves(m_nodes4, m_blocks4, triangles);
+}
+
+size_t WideBVHAccelerator::TriangleBlockBytes() const
+{
+    return m_blocks4.size() * sizeof(TriangleBlock<4>) + m_blocks8.size() * sizeof(TriangleBlock<8>);
+}
+
+// Ray data shared by every slab test of one traversal
+struct WideRay {
+    Float o[3];
+    Float d[3];
+    Float invDir[3];
+    int dirIsNeg[3];
+};
+
+// Slab test against all children of a node, returns the mask of hit children
+template <int Width>
+static inline int IntersectChildren(
+    const WideBVHNode<Width>& node,
+    const WideRay& ray,
+    Float tMax,
+    Float tNear[Width])
+{
+    int mask = 0;
+#if defined(WIDEBVH_SSE)
+    for (int group = 0; group < Width; group += 4) {
+        // NaN slabs (ray origin on an axis-parallel plane) are ignored,
+        // since max/min return their second operand for NaN
+        __m128 t0 = _mm_setzero_ps();
+        __m128 t1 = _mm_set1_ps(tMax);
+        for (int axis = 0; axis < 3; axis++) {
+            __m128 pNear = _mm_load_ps(&node.bounds[ray.dirIsNeg[axis]][axis][group]);
+            __m128 pFar = _mm_load_ps(&node.bounds[1 - ray.dirIsNeg[axis]][axis][group]);
+            __m128 o = _mm_set1_ps(ray.o[axis]);
+            __m128 invDir = _mm_set1_ps(ray.invDir[axis]);
+            t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(pNear, o), invDir), t0);
+            t1 = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(pFar, o), invDir), t1);
+        }
+        _mm_storeu_ps(&tNear[group], t0);
+        mask |= _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << group;
+    }
+#else
+    for (int i = 0; i < Width; i++) {
+        Float t0 = 0, t1 = tMax;
+        for (int axis = 0; axis < 3; axis++) {
+            Float tSlabNear = (node.bounds[ray.dirIsNeg[axis]][axis][i] - ray.o[axis]) * ray.invDir[axis];
+            Float tSlabFar = (node.bounds[1 - ray.dirIsNeg[axis]][axis][i] - ray.o[axis]) * ray.invDir[axis];
+            t0 = tSlabNear > t0 ? tSlabNear : t0;
+            t1 = tSlabFar < t1 ? tSlabFar : t1;
+        }
+        tNear[i] = t0;
+        if (t0 <= t1) mask |= 1 << i;
+    }
+#endif
+    return mask;
+}
+
+#if defined(__AVX__)
+template <>
+inline int IntersectChildren<8>(
+    const WideBVHNode<8>& node,
+    const WideRay& ray,
+    Float tMax,
+    Float tNear[8])
+{
+    __m256 t0 = _mm256_setzero_ps();
+    __m256 t1 = _mm256_set1_ps(tMax);
+    for (int axis = 0; axis < 3; axis++) {
+        __m256 pNear = _mm256_load_ps(node.bounds[ray.dirIsNeg[axis]][axis]);
+        __m256 pFar = _mm256_load_ps(node.bounds[1 - ray.dirIsNeg[axis]][axis]);
+        __m256 o = _mm256_set1_ps(ray.o[axis]);
+        __m256 invDir = _mm256_set1_ps(ray.invDir[axis]);
+        t0 = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(pNear, o), invDir), t0);
+        t1 = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(pFar, o), invDir), t1);
+    }
+    _mm256_storeu_ps(tNear, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+}
+#endif
+
+// Moller-Trumbore against every lane of a block, in the same order of
+// operations as TriangleRecord::Intersect. Returns the mask of hit lanes.
+template <int Width>
+static inline int IntersectBlock(
+    const TriangleBlock<Width>& block,
+    const WideRay& ray,
+    Float tMax,
+    Float t[Width],
+    Float u[Width],
+    Float v[Width])
+{
+    int mask = 0;
+#if defined(WIDEBVH_SSE)
+    const __m128 signMask = _mm_set1_ps(-0.f);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 eps = _mm_set1_ps(Epsilon);
+    __m128 D[3], O[3];
+    for (int axis = 0; axis < 3; axis++) {
+        D[axis] = _mm_set1_ps(ray.d[axis]);
+        O[axis] = _mm_set1_ps(ray.o[axis]);
+    }
+    for (int group = 0; group < Width; group += 4) {
+        __m128 e1[3], e2[3], T[3];
+        for (int axis = 0; axis < 3; axis++) {
+            e1[axis] = _mm_load_ps(&block.e1[axis][group]);
+            e2[axis] = _mm_load_ps(&block.e2[axis][group]);
+            T[axis] = _mm_sub_ps(O[axis], _mm_load_ps(&block.p0[axis][group]));
+        }
+        __m128 P[3] = {
+            _mm_sub_ps(_mm_mul_ps(D[1], e2[2]), _mm_mul_ps(D[2], e2[1])),
+            _mm_sub_ps(_mm_mul_ps(D[2], e2[0]), _mm_mul_ps(D[0], e2[2])),
+            _mm_sub_ps(_mm_mul_ps(D[0], e2[1]), _mm_mul_ps(D[1], e2[0])) };
+        __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(P[0], e1[0]), _mm_mul_ps(P[1], e1[1])), _mm_mul_ps(P[2], e1[2]));
+        __m128 valid = _mm_cmpge_ps(_mm_andnot_ps(signMask, det), eps);
+        __m128 invDet = _mm_div_ps(one, det);
+
+        __m128 U = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(P[0], T[0]), _mm_mul_ps(P[1], T[1])), _mm_mul_ps(P[2], T[2])), invDet);
+        valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(U, zero), _mm_cmple_ps(U, one)));
+
+        __m128 Q[3] = {
+            _mm_sub_ps(_mm_mul_ps(T[1], e1[2]), _mm_mul_ps(T[2], e1[1])),
+            _mm_sub_ps(_mm_mul_ps(T[2], e1[0]), _mm_mul_ps(T[0], e1[2])),
+            _mm_sub_ps(_mm_mul_ps(T[0], e1[1]), _mm_mul_ps(T[1], e1[0])) };
+        __m128 V = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(Q[0], D[0]), _mm_mul_ps(Q[1], D[1])), _mm_mul_ps(Q[2], D[2])), invDet);
+        valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(V, zero), _mm_cmple_ps(_mm_add_ps(U, V), one)));
+
+        __m128 tHit = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(Q[0], e2[0]), _mm_mul_ps(Q[1], e2[1])), _mm_mul_ps(Q[2], e2[2])), invDet);
+        valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(tHit, eps), _mm_cmple_ps(tHit, _mm_set1_ps(tMax))));
+
+        _mm_store_ps(&t[group], tHit);
+        _mm_store_ps(&u[group], U);
+        _mm_store_ps(&v[group], V);
+        mask |= _mm_movemask_ps(valid) << group;
+    }
+#else
+    for (int i = 0; i < Width; i++) {
+        TriangleRecord record;
+        record.m_p0 = Point3f(block.p0[0][i], block.p0[1][i], block.p0[2][i]);
+        record.m_e1 = Vector3f(block.e1[0][i], block.e1[1][i], block.e1[2][i]);
+        record.m_e2 = Vector3f(block.e2[0][i], block.e2[1][i], block.e2[2][i]);
+        Ray laneRay(Point3f(ray.o[0], ray.o[1], ray.o[2]), Vector3f(ray.d[0], ray.d[1], ray.d[2]), tMax);
+        if (record.Intersect(laneRay, &t[i], &u[i], &v[i])) mask |= 1 << i;
+    }
+#endif
+    return mask;
+}
+
+#if defined(__AVX__)
+template <>
+inline int IntersectBlock<8>(
+    const TriangleBlock<8>& block,
+    const WideRay& ray,
+    Float tMax,
+    Float t[8],
+    Float u[8],
+    Float v[8])
+{
+    const __m256 signMask = _mm256_set1_ps(-0.f);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.f);
+    const __m256 eps = _mm256_set1_ps(Epsilon);
+    __m256 D[3], e1[3], e2[3], T[3];
+    for (int axis = 0; axis < 3; axis++) {
+        D[axis] = _mm256_set1_ps(ray.d[axis]);
+        e1[axis] = _mm256_load_ps(block.e1[axis]);
+        e2[axis] = _mm256_load_ps(block.e2[axis]);
+        T[axis] = _mm256_sub_ps(_mm256_set1_ps(ray.o[axis]), _mm256_load_ps(block.p0[axis]));
+    }
+    __m256 P[3] = {
+        _mm256_sub_ps(_mm256_mul_ps(D[1], e2[2]), _mm256_mul_ps(D[2], e2[1])),
+        _mm256_sub_ps(_mm256_mul_ps(D[2], e2[0]), _mm256_mul_ps(D[0], e2[2])),
+        _mm256_sub_ps(_mm256_mul_ps(D[0], e2[1]), _mm256_mul_ps(D[1], e2[0])) };
+    __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(P[0], e1[0]), _mm256_mul_ps(P[1], e1[1])), _mm256_mul_ps(P[2], e1[2]));
+    __m256 valid = _mm256_cmp_ps(_mm256_andnot_ps(signMask, det), eps, _CMP_GE_OQ);
+    __m256 invDet = _mm256_div_ps(one, det);
+
+    __m256 U = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(P[0], T[0]), _mm256_mul_ps(P[1], T[1])), _mm256_mul_ps(P[2], T[2])), invDet);
+    valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(U, zero, _CMP_GE_OQ), _mm256_cmp_ps(U, one, _CMP_LE_OQ)));
+
+    __m256 Q[3] = {
+        _mm256_sub_ps(_mm256_mul_ps(T[1], e1[2]), _mm256_mul_ps(T[2], e1[1])),
+        _mm256_sub_ps(_mm256_mul_ps(T[2], e1[0]), _mm256_mul_ps(T[0], e1[2])),
+        _mm256_sub_ps(_mm256_mul_ps(T[0], e1[1]), _mm256_mul_ps(T[1], e1[0])) };
+    __m256 V = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(Q[0], D[0]), _mm256_mul_ps(Q[1], D[1])), _mm256_mul_ps(Q[2], D[2])), invDet);
+    valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(V, zero, _CMP_GE_OQ), _mm256_cmp_ps(_mm256_add_ps(U, V), one, _CMP_LE_OQ)));
+
+    __m256 tHit = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(Q[0], e2[0]), _mm256_mul_ps(Q[1], e2[1])), _mm256_mul_ps(Q[2], e2[2])), invDet);
+    valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(tHit, eps, _CMP_GE_OQ), _mm256_cmp_ps(tHit, _mm256_set1_ps(tMax), _CMP_LE_OQ)));
+
+    _mm256_store_ps(t, tHit);
+    _mm256_store_ps(u, U);
+    _mm256_store_ps(v, V);
+    return _mm256_movemask_ps(valid);
+}
+#endif
+
+template <int Width>
+bool WideBVHAccelerator::Traverse(
+    const std::vector<WideBVHNode<Width>>& nodes,
+    const std::vector<TriangleBlock<Width>>& blocks,
+    const Ray& ray,
+    Interaction* inter,
+    const Triangle* triangles,
+    bool anyHit) const
+{
+    if (nodes.empty()) return false;
+    WideRay wideRay;
+    for (int axis = 0; axis < 3; axis++) {
+        wideRay.o[axis] = ray.o[axis];
+        wideRay.d[axis] = ray.d[axis];
+        wideRay.invDir[axis] = 1 / ray.d[axis];
+        wideRay.dirIsNeg[axis] = wideRay.invDir[axis] < 0;
+    }
+
+    // Leaves are pushed like nodes, so they are also visited front to back
+    struct StackEntry {
+        int offset;
+        int nPrimitives;
+        Float tNear;
+    };
+    StackEntry stack[256];
+    int stackSize = 0;
+    stack[stackSize++] = { 0, 0, 0 };
+
+    bool hit = false;
+    int hitBlock = -1, hitLane = 0;
+    Float hitU, hitV;
+    while (stackSize > 0) {
+        StackEntry entry = stack[--stackSize];
+        if (entry.tNear > ray.tMax) continue;
+
+        if (entry.nPrimitives > 0) {
+            // Leaf node
+            if (!blocks.empty()) {
+                int nBlocks = (entry.nPrimitives + Width - 1) / Width;
+                for (int b = 0; b < nBlocks; b++) {
+                    alignas(32) Float t[Width], u[Width], v[Width];
+                    int mask = IntersectBlock<Width>(blocks[entry.offset + b], wideRay, ray.tMax, t, u, v);
+                    if (mask && anyHit) return true;
+                    // Lanes in order, so ties resolve like the scalar loop
+                    for (int i = 0; i < Width; i++) {
+                        if (!(mask & (1 << i)) || t[i] > ray.tMax) continue;
+                        ray.tMax = t[i];
+                        hitBlock = entry.offset + b;
+                        hitLane = i;
+                        hitU = u[i];
+                        hitV = v[i];
+                        hit = true;
+                    }
+                }
+                continue;
+            }
+            for (int i = 0; i < entry.nPrimitives; i++) {
+                int id = m_shapeIDs[entry.offset + i];
+                if (anyHit) {
+                    if (triangles[id].Intersect(ray)) {
+                        return true;
+                    }
+                    continue;
+                }
+                Float tHit;
+                if (triangles[id].IntersectP(ray, &tHit, inter)) {
+                    ray.tMax = tHit;
+                    inter->m_primitiveID = id;
+                    hit = true;
+                }
+            }
+            continue;
+        }
+
+        // Interior node, push hit children far to near
+        const WideBVHNode<Width>& node = nodes[entry.offset];
+        alignas(32) Float tNear[Width];
+        int mask = IntersectChildren<Width>(node, wideRay, ray.tMax, tNear);
+        int first = stackSize;
+        for (int i = 0; i < Width; i++) {
+            if (!(mask & (1 << i))) continue;
+            StackEntry child = { node.children[i], node.nPrimitives[i], tNear[i] };
+            int j = stackSize++;
+            while (j > first && stack[j - 1].tNear < child.tNear) {
+                stack[j] = stack[j - 1];
+                j--;
+            }
+            stack[j] = child;
+        }
+    }
+
+    // Hit attributes are only computed for the closest triangle
+    if (hitBlock >= 0) {
+        int id = blocks[hitBlock].shapeIDs[hitLane];
+        triangles[id].ComputeInteraction(ray, ray.tMax, hitU, hitV, inter);
+        inter->m_primitiveID = id;
+    }
+    return hit;
+}
+
+bool WideBVHAccelerator::IntersectP(
+    const Ray& ray,
+    Interaction* inter,
+    const Triangle* triangles) const
+{
+    if (m_width == 8)
+        return Traverse(m_nodes8, m_blocks8, ray, inter, triangles, false);
+    return Traverse(m_nodes4, m_blocks4, ray, inter, triangles, false);
+}
+
+bool WideBVHAccelerator::Intersect(
+    const Ray& ray,
+    const Triangle* triangles) const
+{
+    if (m_width == 8)
+        return Traverse(m_nodes8, m_blocks8, ray, nullptr, triangles, true);
+    return Traverse(m_nodes4, m_blocks4, ray, nullptr, triangles, true);
+}
@@ -0,0 +1,87 @@
+#pragma once
+#ifndef __WIDEBVH_H
+#define __WIDEBVH_H
+
+#include "renderer/core/fwd.h"
+#include "renderer/core/geometry.h"
+#include "renderer/core/bvh.h"
+
+#include <vector>
+
+/**
+ * \brief Node of a BVH with up to Width children
+ *
+ * Child bounds are stored as structure of arrays, so one slab test covers
+ * all children. Unused slots have empty bounds and are never hit.
+ */
+template <int Width>
+struct alignas(32) WideBVHNode {
+    Float bounds[2][3][Width];      // [pMin / pMax][axis][child]
+    int children[Width];            // Interior  the offset in node array
+                                    // Leaf      the offset in primitive array
+    uint16_t nPrimitives[Width];    // 0 for interior children
+};
+
+/**
+ * \brief Up to Width triangles of one leaf, stored as structure of arrays
+ *
+ * A leaf with more triangles than Width takes several consecutive blocks.
+ * Unused lanes have zero edges, so their determinant always fails the test.
+ */
+template <int Width>
+struct alignas(32) TriangleBlock {
+    Float p0[3][Width];     // [axis][triangle]
+    Float e1[3][Width];
+    Float e2[3][Width];
+    int shapeIDs[Width];
+};
+
+class WideBVHAccelerator {
+public:
+    WideBVHAccelerator() {}
+
+    // Widest node supported by the instruction set the renderer is built for
+    static int DefaultWidth();
+
+    // Collapse a built binary BVH into 4-wide or 8-wide nodes. With
+    // mergeLeaves, subtrees of at most width primitives become one leaf.
+    void Build(const BVHAccelerator& bvh, int width, bool mergeLeaves = false);
+
+    // Pack the triangles of each leaf into blocks, leaf children then
+    // point at their first block instead of into m_shapeIDs
+    void BuildTriangleBlocks(const std::vector<Triangle>& triangles);
+    size_t TriangleBlockBytes() const;
+
+    bool IntersectP(
+        const Ray& ray,
+        Interaction* inter,
+        const Triangle* triangles) const;
+    bool Intersect(
+        const Ray& ray,
+        const Triangle* triangles) const;
+
+    int m_width = 0;
+    std::vector<int> m_shapeIDs;    // shape of each primitive in leaf order
+    std::vector<WideBVHNode<4>> m_nodes4;
+    std::vector<WideBVHNode<8>> m_nodes8;
+    std::vector<TriangleBlock<4>> m_blocks4;    // empty unless precomputed
+    std::vector<TriangleBlock<8>> m_blocks8;
+
+private:
+    template <int Width>
+    void PackLeaves(
+        std::vector<WideBVHNode<Width>>& nodes,
+        std::vector<TriangleBlock<Width>>& blocks,
+        const std::vector<Triangle>& triangles) const;
+
+    template <int Width>
+    bool Traverse(
+        const std::vector<WideBVHNode<Width>>& nodes,
+        const std::vector<TriangleBlock<Width>>& blocks,
+        const Ray& ray,
+        Interaction* inter,
+        const Triangle* triangles,
+        bool anyHit) const;
+};
+
+#endif // !__WIDEBVH_H
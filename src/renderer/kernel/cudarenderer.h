@@ -10,12 +10,15 @@ public:
     CUDARenderer(
         Integrator* integrator,
         Camera* camera,
-        CUDAScene* scene) 
-        : m_camera(camera), m_integrator(integrator), m_scene(scene) {}
+        CUDAScene* scene,
+        const Sampler& sampler) 
+        : m_camera(camera), m_integrator(integrator), m_scene(scene), m_sampler(sampler) {}
 
     Camera* m_camera;
     Integrator* m_integrator;
     CUDAScene* m_scene;
+    Sampler m_sampler;      // copied by every thread before its pixel sample
+    unsigned char* m_activeTiles = nullptr;     // one flag per thread block, null renders every pixel
 };
 
 #endif // !__CUDARENDERER_H
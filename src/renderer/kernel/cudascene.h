@@ -15,6 +15,10 @@ public:
     bool Intersect(const Ray& ray) const;
     __device__ __host__
     bool IntersectP(const Ray& ray, Interaction* interaction) const;
+    __device__ __host__
+    int SampleLight(const Point3f& p, const Normal3f& n, Float u, Float* pdf) const;
+    __device__ __host__
+    Float LightPdf(const Point3f& p, const Normal3f& n, int lightID) const;
 
     TriangleMesh* m_triangleMeshes;
     int m_triangleMeshNum;
@@ -26,6 +30,11 @@ public:
     int m_primitiveNum;
     Light* m_lights;
     int m_lightNum;
+    Scene::LightSampler m_lightSampler;
+    AliasEntry* m_lightDistribution;
+    LightBVHNode* m_lightBvhNodes;
+    int m_lightBvhNodeNum;
+    unsigned long long* m_lightBitTrails;
 };
 
 inline __device__ __host__
@@ -41,6 +50,11 @@ CUDAScene::CUDAScene()
     m_primitiveNum = 0;
     m_lights = nullptr;
     m_lightNum = 0;
+    m_lightSampler = Scene::BVH;
+    m_lightDistribution = nullptr;
+    m_lightBvhNodes = nullptr;
+    m_lightBvhNodeNum = 0;
+    m_lightBitTrails = nullptr;
 }
 
 inline __device__ __host__
@@ -60,11 +74,34 @@ CUDAScene::CUDAScene(Scene* scene) {
 
     // Move Light Data
     m_lightNum = scene->m_lights.size();
+    m_lightSampler = scene->m_lightSampler;
+    m_lightBvhNodeNum = scene->m_lightBvh.m_nodes.size();
 
     // Move Primitive Data
     m_primitiveNum = scene->m_primitives.size();
 }
 
+inline __device__ __host__
+int CUDAScene::SampleLight(const Point3f& p, const Normal3f& n, Float u, Float* pdf) const
+{
+    if (m_lightSampler == Scene::BVH) {
+        return SampleLightBVH(m_lightBvhNodes, m_lightBvhNodeNum, p, n, u, pdf);
+    }
+    if (m_lightNum == 0) {
+        return -1;
+    }
+    return SampleAliasTable(m_lightDistribution, m_lightNum, u, pdf);
+}
+
+inline __device__ __host__
+Float CUDAScene::LightPdf(const Point3f& p, const Normal3f& n, int lightID) const
+{
+    if (m_lightSampler == Scene::BVH) {
+        return LightBVHPmf(m_lightBvhNodes, m_lightBvhNodeNum, m_lightBitTrails[lightID], p, n);
+    }
+    return m_lightDistribution[lightID].m_pdf;
+}
+
 inline __device__ __host__
 bool CUDAScene::Intersect(const Ray& ray) const
 {
@@ -18,6 +18,7 @@
 #include "renderer/core/sampling.h"
 #include "renderer/core/camera.h"
 #include "renderer/core/geometry.h"
+#include "renderer/core/checkpoint.h"
 
 #include "renderer/kernel/cudascene.h"
 #include "renderer/kernel/cudarenderer.h"
@@ -37,6 +38,8 @@ extern "C"
 void cudaInit(std::shared_ptr<Renderer> renderer) {
     // Move Scene Data
     Scene* scene = &(renderer->m_scene);
+    ASSERT(scene->m_instances.empty(), "Object instancing is not supported by the CUDA renderer");
+    scene->BuildLightDistribution();
     hst_scene = new CUDAScene(scene);
 
     // Move TriangleMesh Data
@@ -90,6 +93,20 @@ void cudaInit(std::shared_ptr<Renderer> renderer) {
     cudaMalloc(&hst_scene->m_lights, sizeof(Light) * lightNum);
     cudaMemcpy(hst_scene->m_lights, scene->m_lights.data(),
         sizeof(Light) * lightNum, cudaMemcpyHostToDevice);
+    if (scene->m_lightSampler == Scene::BVH) {
+        int nodeNum = scene->m_lightBvh.m_nodes.size();
+        cudaMalloc(&hst_scene->m_lightBvhNodes, sizeof(LightBVHNode) * nodeNum);
+        cudaMemcpy(hst_scene->m_lightBvhNodes, scene->m_lightBvh.m_nodes.data(),
+            sizeof(LightBVHNode) * nodeNum, cudaMemcpyHostToDevice);
+        cudaMalloc(&hst_scene->m_lightBitTrails, sizeof(unsigned long long) * lightNum);
+        cudaMemcpy(hst_scene->m_lightBitTrails, scene->m_lightBvh.m_bitTrails.data(),
+            sizeof(unsigned long long) * lightNum, cudaMemcpyHostToDevice);
+    }
+    else {
+        cudaMalloc(&hst_scene->m_lightDistribution, sizeof(AliasEntry) * lightNum);
+        cudaMemcpy(hst_scene->m_lightDistribution, scene->m_lightDistribution.data(),
+            sizeof(AliasEntry) * lightNum, cudaMemcpyHostToDevice);
+    }
 
     // Move Primitive Data
     int primitiveNum = scene->m_primitives.size();
@@ -108,6 +125,16 @@ void cudaInit(std::shared_ptr<Renderer> renderer) {
     cudaMemset(film.m_bitmap, 0, film.m_resolution.x * film.m_resolution.y * 3 * sizeof(Float));
     cudaMalloc(&film.m_sampleNum, film.m_resolution.x * film.m_resolution.y * sizeof(unsigned int));
     cudaMemset(film.m_sampleNum, 0, film.m_resolution.x * film.m_resolution.y * sizeof(unsigned int));
+    cudaMalloc(&film.m_sqrSum, film.m_resolution.x * film.m_resolution.y * sizeof(Float));
+    cudaMemset(film.m_sqrSum, 0, film.m_resolution.x * film.m_resolution.y * sizeof(Float));
+    if (film.HasAOVs()) {
+        cudaMalloc(&film.m_albedo, film.m_resolution.x * film.m_resolution.y * 3 * sizeof(Float));
+        cudaMemset(film.m_albedo, 0, film.m_resolution.x * film.m_resolution.y * 3 * sizeof(Float));
+        cudaMalloc(&film.m_normal, film.m_resolution.x * film.m_resolution.y * 3 * sizeof(Float));
+        cudaMemset(film.m_normal, 0, film.m_resolution.x * film.m_resolution.y * 3 * sizeof(Float));
+        cudaMalloc(&film.m_depth, film.m_resolution.x * film.m_resolution.y * sizeof(Float));
+        cudaMemset(film.m_depth, 0, film.m_resolution.x * film.m_resolution.y * sizeof(Float));
+    }
     cudaMalloc(&dev_camera, sizeof(Camera));
     checkCudaErrors(cudaMemcpy(dev_camera, hst_camera, sizeof(Camera), cudaMemcpyHostToDevice));
 
@@ -116,7 +143,7 @@ void cudaInit(std::shared_ptr<Renderer> renderer) {
     cudaMalloc(&dev_integrator, sizeof(Integrator));
     cudaMemcpy(dev_integrator, hst_integrator, sizeof(Integrator), cudaMemcpyHostToDevice);
 
-    hst_renderer = new CUDARenderer(dev_integrator, dev_camera, dev_scene);
+    hst_renderer = new CUDARenderer(dev_integrator, dev_camera, dev_scene, renderer->m_sampler);
     cudaMalloc(&dev_renderer, sizeof(CUDARenderer));
     checkCudaErrors(cudaMemcpy(dev_renderer, hst_renderer, sizeof(CUDARenderer), cudaMemcpyHostToDevice));
 
@@ -137,7 +164,7 @@ Float PowerHeuristic(int nf, Float fPdf, int ng, Float gPdf) {
 }
 
 inline __device__
-Spectrum NextEventEstimate(const CUDAScene& scene, const Interaction& inter, unsigned int& seed, Point3f& pLight) 
+Spectrum NextEventEstimate(const CUDAScene& scene, const Interaction& inter, Sampler& sampler, Point3f& pLight) 
 {    
     const Primitive& primitive = scene.m_primitives[inter.m_primitiveID];
     const Material& material = scene.m_materials[primitive.m_materialID];
@@ -145,19 +172,22 @@ Spectrum NextEventEstimate(const CUDAScene& scene, const Interaction& inter, uns
     Spectrum est;
     
     // Sample one of lights
-    int lightID = min(scene.m_lightNum - 1, int(NextRandom(seed) * scene.m_lightNum));
-    Float lightChoosePdf = Float(1) / scene.m_lightNum;
-    const Light& light = scene.m_lights[lightID];
+    Float lightChoosePdf;
+    int lightID = scene.SampleLight(inter.m_p, inter.m_shadingN, sampler.Get1D(), &lightChoosePdf);
+    Point2f uLight = sampler.Get2D();
+
+    // Light Sampling, no light may reach this point
+    if (lightID != -1) {
+        const Light& light = scene.m_lights[lightID];
 
-    // Light Sampling
-    {
         // Light Sample Li
         const Triangle& triangle = scene.m_triangles[light.m_shapeID];
         Float lightSamplePdf;
-        Interaction lightSample = triangle.Sample(&lightSamplePdf, seed);
+        Interaction lightSample = triangle.Sample(&lightSamplePdf, uLight);
         pLight = lightSample.m_p;
         lightSamplePdf *= (lightSample.m_p - inter.m_p).SqrLength() / 
             AbsDot(-Normalize(lightSample.m_p - inter.m_p), lightSample.m_shadingN);
+        lightSamplePdf *= lightChoosePdf;
 
         // Visibility test
         Point3f origin = inter.m_p + Normalize(lightSample.m_p - inter.m_p) * Epsilon;
@@ -191,57 +221,47 @@ Spectrum NextEventEstimate(const CUDAScene& scene, const Interaction& inter, uns
         }
     }
 
-    // BSDF Sampling
-    if (!light.isDelta()) {
-
-        // BSDF Sample
-        Normal3f n = inter.m_shadingN;
-        Float bsdfPdf;
-        Spectrum cosBSDF;
-        Vector3f wi;
-        cosBSDF = material.Sample(n, inter.m_wo, &wi, &bsdfPdf, seed);
-
-        // Light Sample
-        const Triangle& triangle = scene.m_triangles[light.m_shapeID];
-
-        Point3f origin = inter.m_p + wi * Epsilon;
-        Ray testRay(origin, wi);
-        Interaction lightInter;
-        bool hit = scene.IntersectP(testRay, &lightInter);
-
-        if (hit && scene.m_primitives[lightInter.m_primitiveID].m_lightID != -1)
-        {
-            Float lightSamplePdf;
-            lightSamplePdf = (lightInter.m_p - inter.m_p).SqrLength() /
-                (AbsDot(-wi, lightInter.m_shadingN) * triangle.Area());
-            pLight = lightInter.m_p;
+    // The BSDF sampling half of MIS is done by the continuation ray, see EmittedLight()
+    return est;
+}
 
-            // Get Le            
-            Spectrum Le(0.);
-            if (Dot(-wi, lightInter.m_shadingN) > 0) {
-                Le = scene.m_lights[scene.m_primitives[lightInter.m_primitiveID].m_lightID].m_L;
-            }
+// Emission of the light hit by the continuation ray, weighted against light sampling
+inline __device__
+Spectrum EmittedLight(const CUDAScene& scene, const Interaction& inter, bool specular,
+    Float bsdfPdf, const Point3f& prevP, const Normal3f& prevN)
+{
+    const Primitive& primitive = scene.m_primitives[inter.m_primitiveID];
+    int lightID = primitive.m_lightID;
+    if (lightID == -1 || Dot(inter.m_shadingN, inter.m_wo) <= 0) {
+        return Spectrum(0);
+    }
 
-            Float weight = PowerHeuristic(1, bsdfPdf, 1, lightSamplePdf);
-            est += Le * cosBSDF * weight / bsdfPdf;            
-        }
+    const Light& light = scene.m_lights[lightID];
+    if (specular) {
+        return light.m_L;
     }
 
-    return est / lightChoosePdf;
+    const Triangle& triangle = scene.m_triangles[light.m_shapeID];
+    Float lightSamplePdf = (inter.m_p - prevP).SqrLength() /
+        (AbsDot(inter.m_wo, inter.m_shadingN) * triangle.Area()) * scene.LightPdf(prevP, prevN, lightID);
+    Float weight = PowerHeuristic(1, bsdfPdf, 1, lightSamplePdf);
+    return light.m_L * weight;
 }
 
 inline __device__
-Spectrum SampleMaterial(const CUDAScene& scene, Interaction& inter, unsigned int& seed) {
+Spectrum SampleMaterial(const CUDAScene& scene, Interaction& inter, Sampler& sampler, Float* bsdfPdf) {
     Spectrum cosBSDF;
     const Primitive& primitive = scene.m_primitives[inter.m_primitiveID];
     const Material& material = scene.m_materials[primitive.m_materialID];
     
     Normal3f n = inter.m_shadingN;
 
-    Float bsdfPdf;
-    cosBSDF = material.Sample(n, inter.m_wo, &inter.m_wi, &bsdfPdf, seed);
+    cosBSDF = material.Sample(n, inter.m_wo, &inter.m_wi, bsdfPdf, sampler.Get2D());
+    if (*bsdfPdf == 0) {
+        return Spectrum(0);
+    }
 
-    return cosBSDF / bsdfPdf;
+    return cosBSDF / *bsdfPdf;
 }
 
 __global__ void
@@ -259,13 +279,24 @@ d_render(uint* d_output, uint imageW, uint imageH, unsigned int frame, CUDARende
 
     uint index = y * imageW + x;
     if ((x >= imageW) || (y >= imageH)) return;
+    if (renderer->m_activeTiles && !renderer->m_activeTiles[blockIdx.y * gridDim.x + blockIdx.x]) return;
 
     Spectrum L(0);    
-    uint seed = InitRandom(index, frame);
+    Sampler sampler = renderer->m_sampler;
+    sampler.StartPixelSample(index, frame);
     Spectrum throughput(1);
-    Ray ray = camera->GenerateRay(Point2f(x + NextRandom(seed), y + NextRandom(seed)));
+    Point2f u = sampler.Get2D();
+    Ray ray = camera->GenerateRay(Point2f(x + u.x, y + u.y));
+    // The BSDF sampled ray continues the path and also finds the BSDF half of MIS,
+    // so the last iteration only looks for emission
+    bool specular = true;
+    Float bsdfPdf = 0;
+    Point3f prevP;
+    Normal3f prevN;
+    bool aovDone = !camera->m_film.HasAOVs();
+    AOVSample aov;
     int bounce;
-    for (bounce = 0; bounce < integrator->m_maxDepth; bounce++) {
+    for (bounce = 0; ; bounce++) {
 
         // find intersection with scene
         Interaction interaction;
@@ -275,12 +306,21 @@ d_render(uint* d_output, uint imageW, uint imageH, unsigned int frame, CUDARende
             break;
         }
 
+        L += throughput * EmittedLight(*scene, interaction, specular, bsdfPdf, prevP, prevN);
+        if (bounce == integrator->m_maxDepth) {
+            break;
+        }
+
         const Primitive& primitive = scene->m_primitives[interaction.m_primitiveID];
-        if (bounce == 0 && primitive.m_lightID != -1) {
-            int lightID = primitive.m_lightID;
-            const Light& light = scene->m_lights[lightID];
-            if (Dot(interaction.m_shadingN, interaction.m_wo) > 0) {
-                L += throughput * light.m_L;
+        const Material& material = scene->m_materials[primitive.m_materialID];
+
+        // denoiser features at the first non-specular hit
+        if (!aovDone) {
+            aov.depth += (interaction.m_p - ray.o).Length();
+            if (!material.isDelta()) {
+                aov.albedo = material.Albedo();
+                aov.normal = Faceforward(interaction.m_shadingN, interaction.m_wo);
+                aovDone = true;
             }
         }
 
@@ -288,21 +328,25 @@ d_render(uint* d_output, uint imageW, uint imageH, unsigned int frame, CUDARende
         //L = Spectrum(interaction.m_geometryN);
         //break;
 
-        if (throughput.isBlack()) {
-            break;
-        }
-
         // direct light
         Point3f pLight;
-        L += throughput * NextEventEstimate(*scene, interaction, seed, pLight);
+        specular = material.isDelta();
+        if (!specular) {
+            L += throughput * NextEventEstimate(*scene, interaction, sampler, pLight);
+        }
 
         // calculate BSDF
-        throughput *= SampleMaterial(*scene, interaction, seed);
+        throughput *= SampleMaterial(*scene, interaction, sampler, &bsdfPdf);
+        if (throughput.isBlack()) {
+            break;
+        }
+        prevP = interaction.m_p;
+        prevN = interaction.m_shadingN;
 
         // indirect light                    
         if (throughput.Max() < 1 && bounce > 3) {
             Float q = max((Float).05, 1 - throughput.Max());
-            if (NextRandom(seed) < q) break;
+            if (sampler.Get1D() < q) break;
             throughput /= 1 - q;
         }
 
@@ -311,6 +355,10 @@ d_render(uint* d_output, uint imageW, uint imageH, unsigned int frame, CUDARende
         ray.tMax = Infinity;
     }
     camera->m_film.AddSample(x, y, L);
+    if (camera->m_film.HasAOVs()) {
+        // paths without a non-specular hit contribute no features
+        camera->m_film.AddAOVSample(x, y, aovDone ? aov : AOVSample());
+    }
     L = camera->m_film.GetPixelSpectrum(index);
 
     // write output color
@@ -356,21 +404,80 @@ void gpu_render(std::shared_ptr<Renderer> renderer) {
     Camera* camera = &renderer->m_camera;
     Film film = camera->m_film;
     
+    int nPixels = film.m_resolution.x * film.m_resolution.y;
+    film.m_bitmap = new Float[nPixels * 3];
+    film.m_sampleNum = new unsigned int[nPixels];
+    film.m_sqrSum = new Float[nPixels];
+    if (film.HasAOVs()) {
+        film.m_albedo = new Float[nPixels * 3];
+        film.m_normal = new Float[nPixels * 3];
+        film.m_depth = new Float[nPixels];
+    }
+    auto copyFilm = [&](bool aovs, cudaMemcpyKind kind) {
+        Film& device = hst_camera->m_film;
+        auto copy = [&](void* host, void* dev, size_t size) {
+            if (kind == cudaMemcpyDeviceToHost) {
+                checkCudaErrors(cudaMemcpy(host, dev, size, kind));
+            }
+            else {
+                checkCudaErrors(cudaMemcpy(dev, host, size, kind));
+            }
+        };
+        copy(film.m_bitmap, device.m_bitmap, sizeof(Float) * nPixels * 3);
+        copy(film.m_sampleNum, device.m_sampleNum, sizeof(unsigned int) * nPixels);
+        copy(film.m_sqrSum, device.m_sqrSum, sizeof(Float) * nPixels);
+        if (aovs && film.HasAOVs()) {
+            copy(film.m_albedo, device.m_albedo, sizeof(Float) * nPixels * 3);
+            copy(film.m_normal, device.m_normal, sizeof(Float) * nPixels * 3);
+            copy(film.m_depth, device.m_depth, sizeof(Float) * nPixels);
+        }
+    };
+
+    // Thread blocks double as the tiles of adaptive sampling
     dim3 blockSize{ 16, 16 };
     dim3 gridSize{ iDivUp(width, blockSize.x), iDivUp(height, blockSize.y) };
-    for (unsigned int i = 0; i < renderer->m_integrator.m_nSample; i++) {
+    Integrator& integrator = renderer->m_integrator;
+    std::vector<unsigned char> active(gridSize.x * gridSize.y, 1);
+
+    Checkpoint checkpoint(renderer->m_checkpointFile, renderer->m_checkpointInterval, RenderFingerprint(*renderer));
+    unsigned int start = 0;
+    if (renderer->m_resume) {
+        start = checkpoint.Load(film, active);
+        if (start > 0) {
+            copyFilm(true, cudaMemcpyHostToDevice);
+        }
+    }
+    if (integrator.m_maxError > 0) {
+        cudaMalloc(&hst_renderer->m_activeTiles, active.size());
+        cudaMemcpy(hst_renderer->m_activeTiles, active.data(), active.size(), cudaMemcpyHostToDevice);
+        checkCudaErrors(cudaMemcpy(dev_renderer, hst_renderer, sizeof(CUDARenderer), cudaMemcpyHostToDevice));
+    }
+
+    // Reading the film back stalls the device, so the error is only checked every few passes
+    constexpr int adaptiveInterval = 8;
+    for (unsigned int i = start; i < integrator.m_nSample; i++) {
         d_render << <gridSize, blockSize >> > (NULL, width, height, i, dev_renderer);
+        if (integrator.m_maxError > 0 && i + 1 >= integrator.m_minSample && (i + 1) % adaptiveInterval == 0) {
+            copyFilm(false, cudaMemcpyDeviceToHost);
+            if (film.UpdateActiveTiles(blockSize.x, integrator.m_maxError, active.data()) == 0) {
+                break;
+            }
+            cudaMemcpy(hst_renderer->m_activeTiles, active.data(), active.size(), cudaMemcpyHostToDevice);
+        }
+        if (checkpoint.Due()) {
+            copyFilm(true, cudaMemcpyDeviceToHost);
+            checkpoint.Save(film, active, i + 1);
+        }
     }
     checkCudaErrors(cudaDeviceSynchronize());
 
-    film.m_bitmap = new Float[film.m_resolution.x * film.m_resolution.y * 3];
-    film.m_sampleNum = new unsigned int[film.m_resolution.x * film.m_resolution.y];
-    memset(film.m_bitmap, 0, sizeof(Float) * film.m_resolution.x * film.m_resolution.y * 3);
-    memset(film.m_sampleNum, 0, sizeof(unsigned int) * film.m_resolution.x * film.m_resolution.y);    
-    checkCudaErrors(cudaMemcpy(film.m_bitmap, hst_camera->m_film.m_bitmap, sizeof(Float) * film.m_resolution.x * film.m_resolution.y * 3, cudaMemcpyDeviceToHost));
-    checkCudaErrors(cudaMemcpy(film.m_sampleNum, hst_camera->m_film.m_sampleNum, sizeof(unsigned int) * film.m_resolution.x * film.m_resolution.y, cudaMemcpyDeviceToHost));
+    copyFilm(true, cudaMemcpyDeviceToHost);
+    checkpoint.Save(film, active, integrator.m_nSample);
+    checkpoint.Flush();
     //cudaDeviceSynchronize();
     film.Output();     
+    film.OutputDenoised();
+    film.WaitForOutput();
 }
 
 #endif // #ifndef _VOLUMERENDER_KERNEL_CU_
@@ -0,0 +1,262 @@
+#include "binarymesh.h"
+#include "renderer/core/bvh.h"
+#include "renderer/core/mappedfile.h"
+#include "renderer/core/scene.h"
+#include "renderer/loader/pbrtloader.h"
+
+#include <cstdint>
+#include <cstring>
+
+struct BinaryMeshHeader {
+    char magic[8];
+    uint32_t byteOrder;
+    int32_t vertexNum;
+    int32_t triangleNum;
+    int32_t bvhTotalNodes;      // 0 without a BVH
+    int32_t bvhSplitMethod;
+    int32_t bvhMaxPrimsInNode;
+    uint64_t indexOffset;
+    uint64_t positionOffset;
+    uint64_t normalOffset;      // 0 without normals
+    uint64_t uvOffset;          // 0 without uvs
+    uint64_t bvhNodeOffset;
+    uint64_t bvhOrderOffset;
+};
+
+static const char BinaryMeshMagic[8] = { 'G', 'R', 'M', 'E', 'S', 'H', '1', 0 };
+// Reads back as another value on a host of the other byte order
+static const uint32_t BinaryMeshByteOrder = 0x01020304;
+static constexpr size_t BinaryMeshAlignment = 64;
+
+static_assert(sizeof(Point3f) == 12 && sizeof(Normal3f) == 12 && sizeof(Point2f) == 8 &&
+    sizeof(LinearBVHNode) == 32, "Mesh blocks are stored the way the arrays are laid out");
+
+// A mapped file and the BVH the mesh placed from it points to
+struct MappedMesh {
+    MappedFile file;
+    MeshBVH bvh;
+};
+
+static bool IsIdentity(const Transform& t)
+{
+    for (int r = 0; r < 4; r++) {
+        for (int c = 0; c < 4; c++) {
+            if (t.mat.m[r][c] != (r == c ? 1 : 0)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// True if count values of T at offset lie inside the file, aligned for T
+template<typename T>
+static bool ValidBlock(uint64_t offset, uint64_t count, size_t fileSize)
+{
+    return offset != 0 && offset % alignof(T) == 0 && offset <= fileSize &&
+        count <= (fileSize - offset) / sizeof(T);
+}
+
+TriangleMesh* LoadBinaryMesh(
+    const std::string& filename,
+    const Transform& objToWorld)
+{
+    std::unique_ptr<MappedMesh> mapped(new MappedMesh());
+    const MappedFile& file = mapped->file;
+    BinaryMeshHeader header;
+    if (!mapped->file.Open(filename) || file.Size() < sizeof(header)) {
+        printf("Warning : Can't read %s\n", filename.c_str());
+        return nullptr;
+    }
+    memcpy(&header, file.Data(), sizeof(header));
+    if (memcmp(header.magic, BinaryMeshMagic, sizeof(BinaryMeshMagic)) != 0) {
+        printf("Warning : Can't read %s, it isn't a mesh file\n", filename.c_str());
+        return nullptr;
+    }
+    if (header.byteOrder != BinaryMeshByteOrder) {
+        printf("Warning : Can't read %s, it was written with the other byte order\n", filename.c_str());
+        return nullptr;
+    }
+    size_t size = file.Size();
+    int vertexNum = header.vertexNum, triangleNum = header.triangleNum;
+    if (vertexNum <= 0 || triangleNum <= 0 ||
+        !ValidBlock<int>(header.indexOffset, 3 * uint64_t(triangleNum), size) ||
+        !ValidBlock<Point3f>(header.positionOffset, vertexNum, size) ||
+        (header.normalOffset && !ValidBlock<Normal3f>(header.normalOffset, vertexNum, size)) ||
+        (header.uvOffset && !ValidBlock<Point2f>(header.uvOffset, vertexNum, size)) ||
+        (header.bvhTotalNodes && (!ValidBlock<LinearBVHNode>(header.bvhNodeOffset, header.bvhTotalNodes, size) ||
+            !ValidBlock<int>(header.bvhOrderOffset, triangleNum, size)))) {
+        printf("Warning : Can't read %s, the file is truncated\n", filename.c_str());
+        return nullptr;
+    }
+
+    // The index and BVH blocks are checked before anything dereferences them
+    const char* data = file.Data();
+    const int* indices = (const int*)(data + header.indexOffset);
+    for (size_t i = 0; i < 3 * size_t(triangleNum); i++) {
+        if (indices[i] < 0 || indices[i] >= vertexNum) {
+            printf("Warning : Can't read %s, faces refer to missing vertices\n", filename.c_str());
+            return nullptr;
+        }
+    }
+    bool hasBvh = header.bvhTotalNodes > 0;
+    if (hasBvh) {
+        hasBvh = ValidBVHNodes((const LinearBVHNode*)(data + header.bvhNodeOffset), header.bvhTotalNodes,
+            (const int*)(data + header.bvhOrderOffset), triangleNum);
+        if (!hasBvh) {
+            printf("Warning : Ignoring the damaged BVH of %s\n", filename.c_str());
+        }
+    }
+
+    TriangleMesh* mesh = new TriangleMesh();
+    mesh->m_vertexNum = vertexNum;
+    mesh->m_triangleNum = triangleNum;
+    mesh->m_indices = (int*)indices;
+    mesh->m_P = (Point3f*)(data + header.positionOffset);
+    mesh->m_N = header.normalOffset ? (Normal3f*)(data + header.normalOffset) : nullptr;
+    mesh->m_UV = header.uvOffset ? (Point2f*)(data + header.uvOffset) : nullptr;
+    if (!IsIdentity(objToWorld)) {
+        // Placed meshes need their own positions, and the stored BVH no longer fits them
+        Point3f* p = new Point3f[vertexNum];
+        for (int i = 0; i < vertexNum; i++) {
+            p[i] = objToWorld(mesh->m_P[i]);
+        }
+        mesh->m_P = p;
+        if (mesh->m_N) {
+            Normal3f* n = new Normal3f[vertexNum];
+            for (int i = 0; i < vertexNum; i++) {
+                n[i] = objToWorld(mesh->m_N[i]);
+            }
+            mesh->m_N = n;
+        }
+        hasBvh = false;
+    }
+    if (hasBvh) {
+        MeshBVH& bvh = mapped->bvh;
+        bvh.splitMethod = header.bvhSplitMethod;
+        bvh.maxPrimsInNode = header.bvhMaxPrimsInNode;
+        bvh.totalNodes = header.bvhTotalNodes;
+        bvh.nodes = (const LinearBVHNode*)(data + header.bvhNodeOffset);
+        bvh.order = (const int*)(data + header.bvhOrderOffset);
+        mesh->m_bvh = &bvh;
+    }
+    mesh->m_mapping = mapped.release();
+    return mesh;
+}
+
+bool InBinaryMesh(const MappedMesh* mapping, const void* p)
+{
+    if (!mapping) {
+        return false;
+    }
+    const char* data = mapping->file.Data();
+    return (const char*)p >= data && (const char*)p < data + mapping->file.Size();
+}
+
+void ReleaseBinaryMesh(MappedMesh* mapping)
+{
+    delete mapping;
+}
+
+bool WriteBinaryMesh(
+    const std::string& filename,
+    const TriangleMesh& mesh,
+    bool buildBVH)
+{
+    BinaryMeshHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BinaryMeshMagic, sizeof(BinaryMeshMagic));
+    header.byteOrder = BinaryMeshByteOrder;
+    header.vertexNum = mesh.m_vertexNum;
+    header.triangleNum = mesh.m_triangleNum;
+
+    std::vector<char> data(sizeof(header));
+    auto appendBlock = [&](const void* block, size_t bytes) {
+        data.resize((data.size() + BinaryMeshAlignment - 1) / BinaryMeshAlignment * BinaryMeshAlignment);
+        uint64_t offset = data.size();
+        data.insert(data.end(), (const char*)block, (const char*)block + bytes);
+        return offset;
+    };
+    header.indexOffset = appendBlock(mesh.m_indices, 3 * sizeof(int) * mesh.m_triangleNum);
+    header.positionOffset = appendBlock(mesh.m_P, sizeof(Point3f) * mesh.m_vertexNum);
+    if (mesh.m_N) {
+        header.normalOffset = appendBlock(mesh.m_N, sizeof(Normal3f) * mesh.m_vertexNum);
+    }
+    if (mesh.m_UV) {
+        header.uvOffset = appendBlock(mesh.m_UV, sizeof(Point2f) * mesh.m_vertexNum);
+    }
+
+    if (buildBVH) {
+        // Built like Scene::Preprocess would with the default Accelerator
+        TriangleMesh meshCopy = mesh;
+        meshCopy.m_bvh = nullptr;
+        std::vector<Triangle> triangles;
+        std::vector<Primitive> primitives;
+        for (int i = 0; i < mesh.m_triangleNum; i++) {
+            triangles.emplace_back(&meshCopy, i);
+            primitives.emplace_back(i, 0, -1);
+        }
+        BVHAccelerator bvh;
+        bvh.Build(primitives, triangles, BVHAccelerator::SAH, 255);
+        std::vector<int> order(mesh.m_triangleNum);
+        for (int i = 0; i < mesh.m_triangleNum; i++) {
+            order[i] = bvh.m_primitives[i].m_shapeID;
+        }
+        header.bvhTotalNodes = bvh.m_totalNodes;
+        header.bvhSplitMethod = bvh.m_splitMethod;
+        header.bvhMaxPrimsInNode = bvh.m_maxPrimsInNode;
+        header.bvhNodeOffset = appendBlock(bvh.m_nodes, sizeof(LinearBVHNode) * bvh.m_totalNodes);
+        header.bvhOrderOffset = appendBlock(order.data(), sizeof(int) * order.size());
+        FreeAligned(bvh.m_nodes);
+    }
+    memcpy(data.data(), &header, sizeof(header));
+
+    if (!WriteFileAtomic(filename, data)) {
+        fprintf(stderr, "Can't write %s\n", filename.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool ConvertToBinaryMeshes(
+    const std::string& input,
+    const std::string& output,
+    bool buildBVH)
+{
+    filesystem::path path(input);
+    getFileResolver()->prepend(path.parent_path());
+    std::vector<TriangleMesh> meshes;
+    if (path.extension() == "ply") {
+        ParameterSet params;
+        params.AddString("filename", { path.filename() });
+        Transform identity;
+        identity.Identity();
+        std::vector<std::shared_ptr<Triangle>> triangles = CreatePLYMeshShape(params, identity, identity);
+        if (!triangles.empty()) {
+            meshes.push_back(*triangles[0]->m_triangleMeshPtr);
+        }
+    }
+    else {
+        PBRTLoader loader(input);
+        std::shared_ptr<Renderer> renderer = loader.Load();
+        ASSERT(renderer, "Can't load " + input);
+        meshes = renderer->m_scene.m_triangleMeshes;
+    }
+    if (meshes.empty()) {
+        fprintf(stderr, "Can't find a mesh in %s\n", input.c_str());
+        return false;
+    }
+
+    // name.ext -> name_1.ext, name_2.ext ... for scenes with several meshes
+    size_t dot = output.find_last_of('.');
+    std::string stem = dot == std::string::npos ? output : output.substr(0, dot);
+    std::string ext = dot == std::string::npos ? "" : output.substr(dot);
+    for (int i = 0; i < meshes.size(); i++) {
+        std::string filename = meshes.size() == 1 ? output : tfm::format("%s_%d%s", stem, i + 1, ext);
+        if (!WriteBinaryMesh(filename, meshes[i], buildBVH)) {
+            return false;
+        }
+        printf("%s : %d triangles, %d vertices\n", filename.c_str(), meshes[i].m_triangleNum, meshes[i].m_vertexNum);
+    }
+    return true;
+}
@@ -0,0 +1,44 @@
+#pragma once
+#ifndef __BINARYMESH_H
+#define __BINARYMESH_H
+
+#include "renderer/core/triangle.h"
+
+/**
+ * \brief Native mesh files which are mapped and used in place
+ *
+ * A header is followed by the index, position, normal and uv blocks, each
+ * 64 byte aligned, and optionally by a SAH BVH over the triangles. The
+ * blocks have the layout of the TriangleMesh arrays on a little endian
+ * host, so a mesh placed with an identity transform points straight into
+ * the mapping and only pages that are touched get read. Other transforms
+ * copy the positions and normals. The mapping belongs to the mesh and is
+ * kept until ReleaseTriangleMesh, like the arrays of every other mesh.
+ */
+TriangleMesh* LoadBinaryMesh(
+    const std::string& filename,
+    const Transform& objToWorld);
+
+// True if p points into the file of mapping, false for nullptr mappings
+bool InBinaryMesh(const MappedMesh* mapping, const void* p);
+
+// Unmaps a mesh file, nothing for nullptr
+void ReleaseBinaryMesh(MappedMesh* mapping);
+
+// Writes the arrays of mesh as they are, with a BVH if buildBVH is set
+bool WriteBinaryMesh(
+    const std::string& filename,
+    const TriangleMesh& mesh,
+    bool buildBVH);
+
+/**
+ * Writes the mesh of a PLY file, or every mesh of a pbrt scene in world
+ * space, as mesh files. Scenes with several meshes give output_1.ext,
+ * output_2.ext and so on.
+ */
+bool ConvertToBinaryMeshes(
+    const std::string& input,
+    const std::string& output,
+    bool buildBVH);
+
+#endif // !__BINARYMESH_H
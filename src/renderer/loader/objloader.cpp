@@ -0,0 +1,527 @@
+#include "objloader.h"
+#include "renderer/core/api.h"
+#include "renderer/core/mappedfile.h"
+#include "renderer/core/parallel.h"
+
+#include "ext/tinyobjloader/tiny_obj_loader.h"
+
+#include <algorithm>
+#include <charconv>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string_view>
+
+// Files smaller than this are parsed by one task
+static constexpr size_t OBJChunkSize = 1 << 20;
+// Index of an attribute a corner leaves out
+static constexpr int OBJMissing = INT_MIN;
+
+// Position, uv and normal indices of a face corner, from 0
+struct OBJCorner {
+    int p, uv, n;
+};
+
+// Faces from firstTriangle on use material
+struct OBJRun {
+    int firstTriangle;
+    std::string material;
+};
+
+/**
+ * What one chunk of lines defines. Negative indices count back from the
+ * vertices read so far, which are only known for the chunk itself, so they
+ * are kept relative to its first vertex and flagged until the counts of the
+ * earlier chunks are summed up.
+ */
+struct OBJChunk {
+    std::vector<Point3f> p;
+    std::vector<Normal3f> n;
+    std::vector<Point2f> uv;
+    std::vector<OBJCorner> corners;         // three per triangle
+    std::vector<unsigned char> relative;    // per corner, bit 0 p, bit 1 uv, bit 2 n
+    std::vector<OBJRun> runs;
+    std::vector<std::string> materialLibraries;
+    const char* error = nullptr;            // first line that can't be read
+    bool missingVertex = false;
+};
+
+// Triangles [begin, end) of a chunk
+struct OBJSegment {
+    int chunk, begin, end;
+};
+
+static inline bool IsSpace(char ch)
+{
+    return ch == ' ' || ch == '\t' || ch == '\r';
+}
+
+static inline void SkipSpace(const char** pos, const char* end)
+{
+    while (*pos < end && IsSpace(**pos)) {
+        (*pos)++;
+    }
+}
+
+static std::string_view NextWord(const char** pos, const char* end)
+{
+    SkipSpace(pos, end);
+    const char* begin = *pos;
+    while (*pos < end && !IsSpace(**pos)) {
+        (*pos)++;
+    }
+    return std::string_view(begin, *pos - begin);
+}
+
+// The rest of the line without surrounding spaces, names may hold spaces
+static std::string_view RestOfLine(const char** pos, const char* end)
+{
+    SkipSpace(pos, end);
+    const char* last = end;
+    while (last > *pos && IsSpace(last[-1])) {
+        last--;
+    }
+    std::string_view rest(*pos, last - *pos);
+    *pos = end;
+    return rest;
+}
+
+template<typename T>
+static bool ParseNumber(const char** pos, const char* end, T* value)
+{
+    SkipSpace(pos, end);
+    // from_chars takes no leading '+'
+    if (*pos < end && **pos == '+') {
+        (*pos)++;
+    }
+    std::from_chars_result result = std::from_chars(*pos, end, *value);
+    *pos = result.ptr;
+    return result.ec == std::errc();
+}
+
+// OBJ counts from 1, negative indices count back from the last vertex
+static bool ParseIndex(const char** pos, const char* end, int count, int* index, bool* relative)
+{
+    int value;
+    std::from_chars_result result = std::from_chars(*pos, end, value);
+    if (result.ec != std::errc() || value == 0) {
+        return false;
+    }
+    *pos = result.ptr;
+    *relative = value < 0;
+    *index = value < 0 ? count + value : value - 1;
+    return true;
+}
+
+// v, v/vt, v//vn or v/vt/vn
+static bool ParseCorner(
+    const char** pos,
+    const char* end,
+    const OBJChunk& chunk,
+    OBJCorner* corner,
+    unsigned char* relative)
+{
+    bool isRelative;
+    corner->uv = corner->n = OBJMissing;
+    if (!ParseIndex(pos, end, chunk.p.size(), &corner->p, &isRelative)) {
+        return false;
+    }
+    *relative = isRelative ? 1 : 0;
+    if (*pos < end && **pos == '/') {
+        (*pos)++;
+        if (*pos < end && **pos != '/') {
+            if (!ParseIndex(pos, end, chunk.uv.size(), &corner->uv, &isRelative)) {
+                return false;
+            }
+            *relative |= isRelative ? 2 : 0;
+        }
+        if (*pos < end && **pos == '/') {
+            (*pos)++;
+            if (!ParseIndex(pos, end, chunk.n.size(), &corner->n, &isRelative)) {
+                return false;
+            }
+            *relative |= isRelative ? 4 : 0;
+        }
+    }
+    return *pos == end || IsSpace(**pos);
+}
+
+static void ParseChunk(const char* begin, const char* end, OBJChunk* chunk)
+{
+    std::vector<OBJCorner> face;
+    std::vector<unsigned char> faceRelative;
+    for (const char* line = begin; line < end && !chunk->error; ) {
+        const char* lineEnd = (const char*)memchr(line, '\n', end - line);
+        lineEnd = lineEnd ? lineEnd : end;
+        const char* pos = line;
+        std::string_view keyword = NextWord(&pos, lineEnd);
+        bool valid = true;
+        if (keyword == "v") {
+            Float x, y, z;
+            valid = ParseNumber(&pos, lineEnd, &x) && ParseNumber(&pos, lineEnd, &y) &&
+                ParseNumber(&pos, lineEnd, &z);
+            chunk->p.push_back(Point3f(x, y, z));
+        }
+        else if (keyword == "vn") {
+            Float x, y, z;
+            valid = ParseNumber(&pos, lineEnd, &x) && ParseNumber(&pos, lineEnd, &y) &&
+                ParseNumber(&pos, lineEnd, &z);
+            chunk->n.push_back(Normal3f(x, y, z));
+        }
+        else if (keyword == "vt") {
+            // v may be left out
+            Float u, v;
+            valid = ParseNumber(&pos, lineEnd, &u);
+            if (!ParseNumber(&pos, lineEnd, &v)) {
+                v = 0;
+            }
+            chunk->uv.push_back(Point2f(u, v));
+        }
+        else if (keyword == "f") {
+            face.clear();
+            faceRelative.clear();
+            while (true) {
+                SkipSpace(&pos, lineEnd);
+                if (pos == lineEnd || *pos == '#') {
+                    break;
+                }
+                OBJCorner corner;
+                unsigned char relative;
+                if (!ParseCorner(&pos, lineEnd, *chunk, &corner, &relative)) {
+                    valid = false;
+                    break;
+                }
+                face.push_back(corner);
+                faceRelative.push_back(relative);
+            }
+            // Faces with less than three corners are skipped
+            for (int i = 2; valid && i < face.size(); i++) {
+                chunk->corners.insert(chunk->corners.end(), { face[0], face[i - 1], face[i] });
+                chunk->relative.insert(chunk->relative.end(), { faceRelative[0], faceRelative[i - 1], faceRelative[i] });
+            }
+        }
+        else if (keyword == "usemtl") {
+            chunk->runs.push_back(OBJRun{ int(chunk->corners.size() / 3), std::string(RestOfLine(&pos, lineEnd)) });
+        }
+        else if (keyword == "mtllib") {
+            for (std::string_view name = NextWord(&pos, lineEnd); !name.empty(); name = NextWord(&pos, lineEnd)) {
+                chunk->materialLibraries.emplace_back(name);
+            }
+        }
+        // Comments, groups, smoothing groups, lines and points add nothing
+        if (!valid) {
+            chunk->error = line;
+        }
+        line = lineEnd + 1;
+    }
+}
+
+/**
+ * One mesh of the triangles of segments. Vertices are chained per position
+ * so finding the vertex of a corner only compares the few that share its
+ * position. firstVertex holds -1 for every position and is left that way.
+ */
+static TriangleMesh* BuildMesh(
+    const std::vector<OBJChunk>& chunks,
+    const std::vector<OBJSegment>& segments,
+    const std::vector<Point3f>& p,
+    const std::vector<Normal3f>& n,
+    const std::vector<Point2f>& uv,
+    std::vector<int>& firstVertex)
+{
+    std::vector<OBJCorner> vertices;
+    std::vector<int> nextVertex;
+    std::vector<int> indices;
+    bool hasN = true, hasUV = true;
+    for (const OBJSegment& segment : segments) {
+        const OBJCorner* corners = chunks[segment.chunk].corners.data();
+        for (int i = 3 * segment.begin; i < 3 * segment.end; i++) {
+            const OBJCorner& corner = corners[i];
+            int vertex = firstVertex[corner.p];
+            while (vertex != -1 && (vertices[vertex].uv != corner.uv || vertices[vertex].n != corner.n)) {
+                vertex = nextVertex[vertex];
+            }
+            if (vertex == -1) {
+                vertex = vertices.size();
+                vertices.push_back(corner);
+                nextVertex.push_back(firstVertex[corner.p]);
+                firstVertex[corner.p] = vertex;
+                hasN = hasN && corner.n != OBJMissing;
+                hasUV = hasUV && corner.uv != OBJMissing;
+            }
+            indices.push_back(vertex);
+        }
+    }
+    for (const OBJCorner& vertex : vertices) {
+        firstVertex[vertex.p] = -1;
+    }
+
+    TriangleMesh* mesh = new TriangleMesh();
+    mesh->m_triangleNum = indices.size() / 3;
+    mesh->m_vertexNum = vertices.size();
+    mesh->m_indices = new int[indices.size()];
+    memcpy(mesh->m_indices, indices.data(), indices.size() * sizeof(int));
+    mesh->m_P = new Point3f[mesh->m_vertexNum];
+    mesh->m_N = hasN ? new Normal3f[mesh->m_vertexNum] : nullptr;
+    mesh->m_UV = hasUV ? new Point2f[mesh->m_vertexNum] : nullptr;
+    ParallelFor([&](int i) {
+        const OBJCorner& vertex = vertices[i];
+        mesh->m_P[i] = p[vertex.p];
+        if (hasN) {
+            mesh->m_N[i] = n[vertex.n];
+        }
+        if (hasUV) {
+            mesh->m_UV[i] = uv[vertex.uv];
+        }
+    }, mesh->m_vertexNum, 4096);
+    return mesh;
+}
+
+static bool ReadOBJ(
+    const std::string& filename,
+    const Transform& objToWorld,
+    bool byMaterial,
+    std::vector<OBJGroup>* groups,
+    std::vector<std::string>* materialLibraries)
+{
+    MappedFile file;
+    if (!file.Open(filename)) {
+        printf("Warning : Can't read %s\n", filename.c_str());
+        return false;
+    }
+    const char* data = file.Data();
+    size_t size = file.Size();
+
+    // A few chunks per thread, each starting at a line
+    int nChunks = (int)std::max<size_t>(1, std::min<size_t>(size / OBJChunkSize, 4 * MaxThreadIndex()));
+    std::vector<const char*> starts(nChunks + 1, data + size);
+    starts[0] = data;
+    for (int i = 1; i < nChunks; i++) {
+        const char* from = data + size / nChunks * i - 1;
+        const char* newline = (const char*)memchr(from, '\n', data + size - from);
+        starts[i] = newline ? newline + 1 : data + size;
+    }
+    std::vector<OBJChunk> chunks(nChunks);
+    ParallelFor([&](int i) {
+        ParseChunk(starts[i], starts[i + 1], &chunks[i]);
+    }, nChunks);
+    for (const OBJChunk& chunk : chunks) {
+        if (chunk.error) {
+            printf("Warning : Can't read %s, line %d is broken\n", filename.c_str(),
+                int(std::count(data, chunk.error, '\n')) + 1);
+            return false;
+        }
+    }
+
+    // Vertices of the earlier chunks come first
+    std::vector<int> pBase(nChunks + 1, 0), nBase(nChunks + 1, 0), uvBase(nChunks + 1, 0);
+    for (int i = 0; i < nChunks; i++) {
+        pBase[i + 1] = pBase[i] + chunks[i].p.size();
+        nBase[i + 1] = nBase[i] + chunks[i].n.size();
+        uvBase[i + 1] = uvBase[i] + chunks[i].uv.size();
+    }
+    std::vector<Point3f> p(pBase[nChunks]);
+    std::vector<Normal3f> n(nBase[nChunks]);
+    std::vector<Point2f> uv(uvBase[nChunks]);
+    ParallelFor([&](int i) {
+        OBJChunk& chunk = chunks[i];
+        for (int j = 0; j < chunk.p.size(); j++) {
+            p[pBase[i] + j] = objToWorld(chunk.p[j]);
+        }
+        for (int j = 0; j < chunk.n.size(); j++) {
+            n[nBase[i] + j] = objToWorld(chunk.n[j]);
+        }
+        std::copy(chunk.uv.begin(), chunk.uv.end(), uv.begin() + uvBase[i]);
+        std::vector<Point3f>().swap(chunk.p);
+        std::vector<Normal3f>().swap(chunk.n);
+        std::vector<Point2f>().swap(chunk.uv);
+
+        for (int j = 0; j < chunk.corners.size(); j++) {
+            OBJCorner& corner = chunk.corners[j];
+            unsigned char relative = chunk.relative[j];
+            corner.p += (relative & 1) ? pBase[i] : 0;
+            corner.uv += (relative & 2) ? uvBase[i] : 0;
+            corner.n += (relative & 4) ? nBase[i] : 0;
+            if (corner.p < 0 || corner.p >= p.size() ||
+                (corner.uv != OBJMissing && (corner.uv < 0 || corner.uv >= uv.size())) ||
+                (corner.n != OBJMissing && (corner.n < 0 || corner.n >= n.size()))) {
+                chunk.missingVertex = true;
+            }
+        }
+        std::vector<unsigned char>().swap(chunk.relative);
+    }, nChunks);
+    for (const OBJChunk& chunk : chunks) {
+        if (chunk.missingVertex) {
+            printf("Warning : Can't read %s, faces refer to missing vertices\n", filename.c_str());
+            return false;
+        }
+    }
+
+    // Segments of each material, in the order materials are first used
+    std::map<std::string, int> groupOfMaterial;
+    std::vector<std::string> materials;
+    std::vector<std::vector<OBJSegment>> segments;
+    std::string material;
+    for (int i = 0; i < nChunks; i++) {
+        const OBJChunk& chunk = chunks[i];
+        int begin = 0;
+        auto addSegment = [&](int end) {
+            if (end > begin) {
+                auto inserted = groupOfMaterial.emplace(byMaterial ? material : "", segments.size());
+                if (inserted.second) {
+                    materials.push_back(inserted.first->first);
+                    segments.emplace_back();
+                }
+                segments[inserted.first->second].push_back(OBJSegment{ i, begin, end });
+            }
+            begin = end;
+        };
+        for (const OBJRun& run : chunk.runs) {
+            addSegment(run.firstTriangle);
+            material = run.material;
+        }
+        addSegment(chunk.corners.size() / 3);
+        materialLibraries->insert(materialLibraries->end(),
+            chunk.materialLibraries.begin(), chunk.materialLibraries.end());
+    }
+
+    // Without faces there is nothing to render and no bounds to place the camera by
+    if (segments.empty()) {
+        printf("Warning : Can't read %s, it has no faces\n", filename.c_str());
+        return false;
+    }
+
+    std::vector<int> firstVertex(p.size(), -1);
+    for (int i = 0; i < segments.size(); i++) {
+        groups->push_back(OBJGroup{ materials[i], BuildMesh(chunks, segments[i], p, n, uv, firstVertex) });
+    }
+    return true;
+}
+
+bool LoadOBJ(
+    const std::string& filename,
+    const Transform& objToWorld,
+    std::vector<OBJGroup>* groups,
+    std::vector<std::string>* materialLibraries)
+{
+    return ReadOBJ(filename, objToWorld, true, groups, materialLibraries);
+}
+
+TriangleMesh* LoadOBJMesh(
+    const std::string& filename,
+    const Transform& objToWorld)
+{
+    std::vector<OBJGroup> groups;
+    std::vector<std::string> materialLibraries;
+    if (!ReadOBJ(filename, objToWorld, false, &groups, &materialLibraries)) {
+        return nullptr;
+    }
+    return groups[0].mesh;
+}
+
+// Matte, or glass for transparent entries
+static ParameterSet OBJMaterialParameters(const tinyobj::material_t& material)
+{
+    ParameterSet params;
+    bool transparent = material.dissolve < 1 || material.illum == 4 || material.illum == 6 ||
+        material.illum == 7 || material.illum == 9;
+    if (transparent) {
+        params.AddString("type", { "glass" });
+        params.AddFloat("index", { material.ior > 1 ? material.ior : 1.5f });
+    }
+    else {
+        params.AddString("type", { "matte" });
+        params.AddSpectrum("Kd", { material.diffuse[0], material.diffuse[1], material.diffuse[2] });
+    }
+    return params;
+}
+
+std::shared_ptr<Renderer>
+OBJLoader::Load()
+{
+    ASSERT(m_filepath.extension() == "obj", "The extension of scene is not .obj");
+    Transform identity;
+    identity.Identity();
+    std::vector<OBJGroup> groups;
+    std::vector<std::string> materialLibraries;
+    ASSERT(LoadOBJ(m_filepath.str(), identity, &groups, &materialLibraries), "Can't load " + m_filepath.str());
+
+    std::map<std::string, int> materialMap;
+    std::vector<tinyobj::material_t> materials;
+    for (const std::string& library : materialLibraries) {
+        std::ifstream stream(getFileResolver()->resolve(library).str());
+        if (!stream) {
+            printf("Warning : Can't read material library %s\n", library.c_str());
+            continue;
+        }
+        std::string warning, error;
+        tinyobj::LoadMtl(&materialMap, &materials, &stream, &warning, &error);
+    }
+
+    Bounds3f bounds;
+    for (const OBJGroup& group : groups) {
+        for (int i = 0; i < group.mesh->m_vertexNum; i++) {
+            bounds = Union(bounds, group.mesh->m_P[i]);
+        }
+    }
+
+    apiInit();
+    // Far enough back for the bounding sphere to fit the vertical field of
+    // view. OBJ files are right handed, the flip keeps +x on the right.
+    Float fov = 40;
+    Point3f center = bounds.pMin + bounds.Diagonal() * 0.5f;
+    Float distance = bounds.Diagonal().Length() * 0.5f / std::sin(Radians(fov / 2));
+    Transform worldToCamera = Scale(-1, 1, 1) *
+        LookAt(center + Vector3f(0, 0, distance), center, Vector3f(0, 1, 0));
+    // apiTransform takes the matrix column by column, like pbrt files
+    Float m[16];
+    for (int r = 0; r < 4; r++) {
+        for (int c = 0; c < 4; c++) {
+            m[4 * c + r] = worldToCamera.mat.m[r][c];
+        }
+    }
+    apiTransform(m);
+    ParameterSet camera;
+    camera.AddFloat("fov", { fov });
+    apiCamera("perspective", camera);
+    std::string output = m_filepath.filename();
+    ParameterSet film;
+    film.AddInt("xresolution", { 1024 });
+    film.AddInt("yresolution", { 768 });
+    film.AddString("filename", { output.substr(0, output.find_last_of('.')) + ".png" });
+    apiFilm("image", film);
+    apiIntegrator("path", ParameterSet());
+    apiWorldBegin();
+
+    bool hasLight = false;
+    for (int i = 0; i < groups.size(); i++) {
+        ParameterSet params;
+        auto it = materialMap.find(groups[i].material);
+        if (it != materialMap.end()) {
+            const tinyobj::material_t& material = materials[it->second];
+            params = OBJMaterialParameters(material);
+            if (material.emission[0] > 0 || material.emission[1] > 0 || material.emission[2] > 0) {
+                ParameterSet light;
+                light.AddSpectrum("L", { material.emission[0], material.emission[1], material.emission[2] });
+                apiAreaLightSource("diffuse", light);
+                hasLight = true;
+            }
+        }
+        else {
+            if (!groups[i].material.empty()) {
+                printf("Warning : Can't find material %s, it is grey\n", groups[i].material.c_str());
+            }
+            params.AddString("type", { "matte" });
+            params.AddSpectrum("Kd", { 0.5f, 0.5f, 0.5f });
+        }
+        std::string name = tfm::format("obj_%d", i);
+        apiMakeNamedMaterial(name, params);
+        apiNamedMaterial(name, ParameterSet());
+        apiTriangleMesh(groups[i].mesh);
+    }
+    if (!hasLight) {
+        printf("Warning : %s has no emissive material, nothing lights it\n", m_filepath.filename().c_str());
+    }
+    return apiWorldEnd();
+}
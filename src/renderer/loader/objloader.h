@@ -2,6 +2,48 @@
 #ifndef __OBJLOADER_H
 #define __OBJLOADER_H
 
+#include "renderer/loader/sceneloader.h"
+#include "renderer/core/triangle.h"
 
+/**
+ * \brief Renders an OBJ file on its own
+ *
+ * The faces of every material become one mesh with a material made from
+ * its .mtl entry, emissive entries become area lights. The camera looks
+ * down -z at the whole model.
+ */
+class OBJLoader : public SceneLoader {
+public:
+    OBJLoader(std::string filepath) :SceneLoader(filepath) {}
+
+    // Inherited via SceneLoader
+    std::shared_ptr<Renderer> Load() override;
+};
+
+// Faces of an OBJ file that use one material
+struct OBJGroup {
+    std::string material;       // empty before the first usemtl
+    TriangleMesh* mesh;
+};
+
+/**
+ * \brief Reads an OBJ file into one TriangleMesh per material
+ *
+ * The file is mapped and cut at line starts into chunks that are parsed in
+ * parallel, relative indices are resolved once the vertex counts of the
+ * earlier chunks are known. Corners with the same position, uv and normal
+ * indices share a vertex, polygons are split into fans. Returns false if
+ * the file can't be read or has no faces.
+ */
+bool LoadOBJ(
+    const std::string& filename,
+    const Transform& objToWorld,
+    std::vector<OBJGroup>* groups,
+    std::vector<std::string>* materialLibraries);
+
+// Every face of the file in one mesh, nullptr if it can't be read
+TriangleMesh* LoadOBJMesh(
+    const std::string& filename,
+    const Transform& objToWorld);
 
 #endif // !__OBJLOADER_H
@@ -1,6 +1,7 @@
 #include "pbrtloader.h"
 #include "renderer/core/api.h"
 
+#include <charconv>
 #include <functional>
 #include <vector>
 
@@ -12,101 +13,93 @@ PBRTLoader::Load()
 {
     ASSERT(m_filepath.extension() == "pbrt", "The extension of scene is not .pbrt");
     std::unique_ptr<Tokenizer> tokenizer = Tokenizer::CreateFromFile(m_filepath.str());
+    apiInit();
     return Parse(std::move(tokenizer));
 }
 
 std::unique_ptr<Tokenizer> Tokenizer::CreateFromFile(const std::string filename)
 {
-    FILE* f = fopen(filename.c_str(), "r");
-    ASSERT(f, "Can't open file " + filename);
-
-    std::string str;
-    int ch;
-    while ((ch = fgetc(f)) != EOF) {
-        str.push_back(char(ch));
-    }
-
-    return std::unique_ptr<Tokenizer>(new Tokenizer(std::move(str)));
+    std::unique_ptr<Tokenizer> tokenizer(new Tokenizer());
+    ASSERT(tokenizer->m_file.Open(filename), "Can't open file " + filename);
+    tokenizer->m_pos = tokenizer->m_file.Data();
+    tokenizer->m_end = tokenizer->m_pos + tokenizer->m_file.Size();
+    return tokenizer;
 }
 
+static inline bool IsSpace(char ch)
+{
+    return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r';
+}
 
-std::string_view Tokenizer::Next()
+void Tokenizer::SkipSpaceAndComments()
 {
-    while (true) {
-        const char* startPos = m_pos;
-        int ch = GetChar();
-        if (ch == EOF) {
-            return std::string_view(startPos, 0);
+    while (m_pos < m_end) {
+        if (IsSpace(*m_pos)) {
+            m_pos++;
         }
-        else if (ch == '#') {
-            while ((ch = GetChar()) != EOF) {
-                if (ch == '\n') {
-
-                    break;
-                }
+        else if (*m_pos == '#') {
+            while (m_pos < m_end && *m_pos != '\n') {
+                m_pos++;
             }
-            return std::string_view(startPos, m_pos - startPos);
-        }
-        else if (ch == '"') {
-            while ((ch = GetChar()) != '"') {}
-            return std::string_view(startPos, m_pos - startPos);
-        }
-        else if (ch == '[' || ch == ']') {
-            return std::string_view(startPos, m_pos - startPos);
-        }
-        else if (ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r') {            
-
         }
         else {
-            while ((ch = GetChar()) != EOF) {
-                if (ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r' || 
-                    ch == '"' || ch == '[' || ch == ']') {                    
-                    UngetChar();
-                    break;
-                }
-            }
-            return std::string_view(startPos, m_pos - startPos);
+            break;
         }
     }
 }
 
-Tokenizer::Tokenizer(std::string str)
-    :m_content(std::move(str))
-{
-    m_pos = m_content.data();
-    m_end = m_pos + m_content.size();
-}
-
-int Tokenizer::GetChar()
+std::string_view Tokenizer::Next()
 {
+    SkipSpaceAndComments();
     if (m_pos == m_end) {
-        return EOF;
+        return std::string_view(m_end, 0);
     }
-    int ch = *m_pos++;
-    if (ch == '\n') {
-        m_loc.m_line++;
-        m_loc.m_column = 0;
-    } else {
-        m_loc.m_column++;
+    const char* startPos = m_pos++;
+    if (*startPos == '"') {
+        while (m_pos < m_end && *m_pos != '"') {
+            m_pos++;
+        }
+        ASSERT(m_pos < m_end, "Unterminated string");
+        m_pos++;
+    }
+    else if (*startPos != '[' && *startPos != ']') {
+        while (m_pos < m_end && !IsSpace(*m_pos) && *m_pos != '"' && *m_pos != '[' && *m_pos != ']') {
+            m_pos++;
+        }
     }
-    return ch;
+    return std::string_view(startPos, m_pos - startPos);
 }
 
-void Tokenizer::UngetChar()
+template<typename T>
+static bool ParseNumber(const char* begin, const char* end, T* value, const char** next)
 {
-    m_pos--;
-    if (*m_pos == '\n') {
-        m_loc.m_line--;
+    // from_chars takes no leading '+'
+    if (begin < end && *begin == '+') {
+        begin++;
     }
+    std::from_chars_result result = std::from_chars(begin, end, *value);
+    *next = result.ptr;
+    return result.ec == std::errc();
 }
 
-struct ParameterItem {
-    std::string m_name;
-    std::vector<std::string> m_val;
-};
+template<typename T>
+void Tokenizer::ReadNumbers(std::vector<T>* values)
+{
+    while (true) {
+        SkipSpaceAndComments();
+        ASSERT(m_pos < m_end, "Expected ']'");
+        if (*m_pos == ']') {
+            m_pos++;
+            return;
+        }
+        T value;
+        ASSERT(ParseNumber(m_pos, m_end, &value, &m_pos), "Expected a number");
+        values->push_back(value);
+    }
+}
 
 bool isQuotedString(const std::string_view& str) {
-    return str.front() == '"' && str.back() == '"';
+    return str.size() >= 2 && str.front() == '"' && str.back() == '"';
 }
 
 void dequotedString(std::string_view& str) {
@@ -123,119 +116,63 @@ enum {
     TYPE_POINT,
     TYPE_NORMAL,
     TYPE_RGB,
+    TYPE_UNKNOWN,
 };
 
-
-void lookUpTypeAndName(const std::string& str,std::string& name, int& type) {
-    auto skipSpace = [&](std::string::const_iterator iter) {
-        while (iter != str.end() && (*iter == ' ' || *iter == '\t')) ++iter;
-        return iter;
+void lookUpTypeAndName(std::string_view str, std::string& name, int& type) {
+    auto skipSpace = [&](size_t i) {
+        while (i < str.size() && (str[i] == ' ' || str[i] == '\t')) ++i;
+        return i;
     };
 
-    auto skipToSpace = [&](std::string::const_iterator iter) {
-        while (iter != str.end() && (*iter != ' ' && *iter != '\t')) ++iter;
-        return iter;
+    auto skipToSpace = [&](size_t i) {
+        while (i < str.size() && (str[i] != ' ' && str[i] != '\t')) ++i;
+        return i;
     };
 
-    std::string::const_iterator typeBegin = skipSpace(str.begin());
-    std::string::const_iterator typeEnd = skipToSpace(typeBegin);
-    std::string_view typeStr(&(*typeBegin), typeEnd - typeBegin);    
+    size_t typeBegin = skipSpace(0);
+    size_t typeEnd = skipToSpace(typeBegin);
+    std::string_view typeStr = str.substr(typeBegin, typeEnd - typeBegin);
     if (typeStr == "bool") {
         type = TYPE_BOOL;
     }
     else if (typeStr == "integer") {
         type = TYPE_INTEGER;
     }
-    else if (typeStr == "float") {
+    else if (typeStr == "float" || typeStr == "point2") {
+        // 2D points are read as flat float arrays, like "float uv"
         type = TYPE_FLOAT;
     }
-    else if (typeStr == "string") {
+    else if (typeStr == "string" || typeStr == "texture") {
         type = TYPE_STRING;
     } 
-    else if (typeStr == "rgb") {
+    else if (typeStr == "rgb" || typeStr == "color") {
         type = TYPE_RGB;
     }
-    else if (typeStr == "point") {
+    else if (typeStr == "point" || typeStr == "point3") {
         type = TYPE_POINT;
     } 
-    else if (typeStr == "normal") {
+    else if (typeStr == "normal" || typeStr == "normal3") {
         type = TYPE_NORMAL;
     }
     else {
-        ASSERT(0, "Can't support type " + std::string(typeStr));
+        type = TYPE_UNKNOWN;
     }
 
-    std::string::const_iterator nameBegin = skipSpace(typeEnd);
-    std::string::const_iterator nameEnd = skipToSpace(nameBegin);
-    name = std::string(nameBegin, nameEnd);
+    size_t nameBegin = skipSpace(typeEnd);
+    size_t nameEnd = skipToSpace(nameBegin);
+    name = std::string(str.substr(nameBegin, nameEnd - nameBegin));
 }
 
-void AddParameters(ParameterSet& params, const ParameterItem& item) {
-    std::string attributeName;
-    int attributeType;
-    lookUpTypeAndName(item.m_name, attributeName, attributeType);
-    if (attributeType == TYPE_BOOL) {
-        if (item.m_val[0] == "false") {
-            params.AddBool(attributeName, false);
-        }
-        else {
-            params.AddBool(attributeName, true);
-        }
-    }
-    else if (attributeType == TYPE_INTEGER) {
-        std::vector<int> attributeVal;
-        char* endPtr;
-        for (const std::string& v : item.m_val) {
-            attributeVal.push_back(strtol(v.c_str(), &endPtr, 10));
-        }
-        params.AddInt(attributeName, std::move(attributeVal));
-    }
-    else if (attributeType == TYPE_FLOAT) {
-        std::vector<Float> attributeVal;
-        char* endPtr;
-        for (const std::string& v : item.m_val) {
-            attributeVal.push_back(strtof(v.c_str(), &endPtr));
-        }
-        params.AddFloat(attributeName, std::move(attributeVal));
-    }
-    else if (attributeType == TYPE_STRING) {
-        params.AddString(attributeName, std::move(item.m_val));
-    }
-    else if (attributeType == TYPE_POINT) {
-        std::vector<Point3f> attributeVal;
-        const std::vector<std::string>& val = item.m_val;
-        ASSERT(val.size() % 3 == 0, "The number of value is not a multiple of 3");
-        char* endPtr;
-        for (int i = 0; i < val.size(); i += 3) {            
-            attributeVal.push_back(Point3f(strtof(val[i].c_str(), &endPtr),
-                strtof(val[i + 1].c_str(), &endPtr), strtof(val[i + 2].c_str(), &endPtr)));
-        }
-        params.AddPoint(attributeName, std::move(attributeVal));
-    }
-    else if (attributeType == TYPE_NORMAL) {
-        std::vector<Normal3f> attributeVal;
-        const std::vector<std::string>& val = item.m_val;
-        ASSERT(val.size() % 3 == 0, "The number of value is not a multiple of 3");
-        char* endPtr;
-        for (int i = 0; i < val.size(); i += 3) {
-            attributeVal.push_back(Normal3f(strtof(val[i].c_str(), &endPtr),
-                strtof(val[i + 1].c_str(), &endPtr), strtof(val[i + 2].c_str(), &endPtr)));
-        }
-        params.AddNormal(attributeName, std::move(attributeVal));
-    }
-    else if (attributeType == TYPE_RGB) {
-        std::vector<Float> attributeVal;
-        const std::vector<std::string>& val = item.m_val;
-        ASSERT(val.size() % 3 == 0, "The number of value is not a multiple of 3");
-        char* endPtr;
-        for (int i = 0; i < val.size(); i ++) {
-            attributeVal.push_back(strtof(val[i].c_str(), &endPtr));
-        }
-        params.AddSpectrum(attributeName, std::move(attributeVal));
-    }
-    else {
-        ASSERT(0, "Can't support type " + std::to_string(attributeType));
+template<typename T>
+std::vector<T> ToTriples(const std::vector<Float>& val)
+{
+    ASSERT(val.size() % 3 == 0, "The number of value is not a multiple of 3");
+    std::vector<T> triples(val.size() / 3);
+    for (size_t i = 0; i < triples.size(); i++) {
+        triples[i] = T(val[3 * i], val[3 * i + 1], val[3 * i + 2]);
     }
+    return triples;
 }
 
 std::shared_ptr<Renderer>
@@ -245,16 +182,9 @@ Parse(std::unique_ptr<Tokenizer> tokenizer) {
     bool ungetTokenSet = false;
     std::string_view ungetTokenValue;
 
-    std::function<std::string_view()>
-        nextToken = [&]() -> std::string_view {
-        std::string_view token = tokenizer->Next();
-        if (token.empty()) {
-            return token;
-        }
-        if (token[0] == '#') {
-            return nextToken();
-        }
-        return token;
+    // Comments are dropped by the tokenizer
+    auto nextToken = [&]() -> std::string_view {
+        return tokenizer->Next();
     };
 
     std::function<void(const std::string_view&)>
@@ -266,36 +196,84 @@ Parse(std::unique_ptr<Tokenizer> tokenizer) {
     std::function<ParameterSet()>
         parseParameters = [&]() {
 
-        auto addVal = [&](ParameterItem& item, std::string_view& token) {
-            if (isQuotedString(token)) {
-                dequotedString(token);
-                item.m_val.emplace_back(token);
+        // Values are either a bracketed list or a single unbracketed value
+        auto readNumbers = [&](auto* values) {
+            std::string_view token = nextToken();
+            if (token == "[") {
+                tokenizer->ReadNumbers(values);
+                return;
             }
-            else {
-                item.m_val.emplace_back(token);
+            typename std::remove_reference_t<decltype(*values)>::value_type value;
+            const char* next;
+            ASSERT(ParseNumber(token.data(), token.data() + token.size(), &value, &next), "Expected a number");
+            values->push_back(value);
+        };
+        auto readStrings = [&]() {
+            std::vector<std::string> values;
+            std::string_view token = nextToken();
+            bool bracketed = token == "[";
+            if (bracketed) {
+                token = nextToken();
+            }
+            while (!token.empty() && token != "]") {
+                if (isQuotedString(token)) {
+                    dequotedString(token);
+                }
+                values.emplace_back(token);
+                if (!bracketed) {
+                    break;
+                }
+                token = nextToken();
             }
+            return values;
         };
 
         ParameterSet params;
         while (true) {
             std::string_view token = nextToken();
-            ParameterItem item;
             if (!isQuotedString(token)) {
                 ungetToken(token);
                 break;
             }
+            dequotedString(token);
+            std::string name;
+            int type;
+            lookUpTypeAndName(token, name, type);
+
+            if (type == TYPE_BOOL) {
+                std::vector<std::string> val = readStrings();
+                ASSERT(!val.empty(), "Expected a bool value");
+                params.AddBool(name, val[0] != "false");
+            }
+            else if (type == TYPE_INTEGER) {
+                std::vector<int> val;
+                readNumbers(&val);
+                params.AddInt(name, std::move(val));
+            }
+            else if (type == TYPE_STRING) {
+                params.AddString(name, readStrings());
+            }
+            else if (type == TYPE_UNKNOWN) {
+                printf("Warning : parameter \"%s\" is not supported\n", std::string(token).c_str());
+                readStrings();
+            }
             else {
-                dequotedString(token);
-                item.m_name = std::string(token);
-                token = nextToken();
-                ASSERT(token[0] == '[', "Expected '\"'");
-                token = nextToken();
-                while (token[0] != ']') {
-                    addVal(item, token);
-                    token = nextToken();
+                std::vector<Float> val;
+                readNumbers(&val);
+                if (type == TYPE_FLOAT) {
+                    params.AddFloat(name, std::move(val));
+                }
+                else if (type == TYPE_POINT) {
+                    params.AddPoint(name, ToTriples<Point3f>(val));
+                }
+                else if (type == TYPE_NORMAL) {
+                    params.AddNormal(name, ToTriples<Normal3f>(val));
+                }
+                else {
+                    ASSERT(val.size() % 3 == 0, "The number of value is not a multiple of 3");
+                    params.AddSpectrum(name, std::move(val));
                 }
             }
-            AddParameters(params, item);
         }
         return params;
     };
@@ -309,7 +287,7 @@ Parse(std::unique_ptr<Tokenizer> tokenizer) {
 
         ParameterSet params = parseParameters();
 
-        apiFunc(type, params);
+        apiFunc(type, std::move(params));
     };
 
     while (true) {
@@ -335,6 +313,9 @@ Parse(std::unique_ptr<Tokenizer> tokenizer) {
             else if (token == "AreaLightSource") {
                 parseParameterList(apiAreaLightSource);
             }
+            else if (token == "Accelerator") {
+                parseParameterList(apiAccelerator);
+            }
             break;
         case 'C' :
             if (token == "Camera") {
@@ -361,6 +342,17 @@ Parse(std::unique_ptr<Tokenizer> tokenizer) {
                 parseParameterList(apiNamedMaterial);
             }
             break;
+        case 'O':
+            if (token == "ObjectBegin") {
+                parseParameterList(apiObjectBegin);
+            }
+            else if (token == "ObjectEnd") {
+                apiObjectEnd();
+            }
+            else if (token == "ObjectInstance") {
+                parseParameterList(apiObjectInstance);
+            }
+            break;
         case 'P' :
             if (token == "PixelFilter") {
                 parseParameterList(apiFilter);
@@ -377,13 +369,11 @@ Parse(std::unique_ptr<Tokenizer> tokenizer) {
         case 'T' :
             if (token == "Transform") {
                 token = nextToken();
-                char* endPtr;
-                Float m[16];
-                for (int i = 0; i < 16; i++) {
-                    token = nextToken();
-                    m[i] = strtof(token.data(), &endPtr);
-                }
-                apiTransform(m);
+                ASSERT(token == "[", "Expected '['");
+                std::vector<Float> m;
+                tokenizer->ReadNumbers(&m);
+                ASSERT(m.size() == 16, "Transform needs 16 values");
+                apiTransform(m.data());
             }
             else if (token == "TransformBegin") {
                 apiTransformBegin();
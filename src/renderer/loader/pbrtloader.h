@@ -3,6 +3,7 @@
 #define __PBRTLOADER_H
 
 #include "renderer/loader/sceneloader.h"
+#include "renderer/core/mappedfile.h"
 
 #include <string_view>
 
@@ -15,13 +16,12 @@ public:
     std::shared_ptr<Renderer> Load() override;
 };
 
-class Loc {
-public:
-    Loc() :m_line(1), m_column(0) {};
-
-    int m_line, m_column;
-};
-
+/**
+ * \brief Splits a memory mapped scene file into tokens
+ *
+ * Tokens are views into the mapping, nothing is copied. Numeric arrays are
+ * converted in place with from_chars by ReadNumbers().
+ */
 class Tokenizer {
 public:
     static std::unique_ptr<Tokenizer> CreateFromFile(
@@ -29,15 +29,17 @@ public:
 
     std::string_view Next();
 
+    // Reads numbers up to and including the closing ']'
+    template<typename T>
+    void ReadNumbers(std::vector<T>* values);
+
 private:
-    Tokenizer(const std::string);
+    Tokenizer() {}
 
-    int GetChar();
-    void UngetChar();
+    void SkipSpaceAndComments();
 
-    std::string m_content;
-    const char* m_pos, * m_end;
-    Loc m_loc;
+    MappedFile m_file;
+    const char* m_pos = nullptr, * m_end = nullptr;
 };
 
 #endif // !__PBRTLOADER_H
@@ -0,0 +1,457 @@
+#include "plyloader.h"
+#include "renderer/core/mappedfile.h"
+
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define PLY_SSE
+#include <immintrin.h>
+#endif
+
+enum PLYType {
+    PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16,
+    PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64, PLY_INVALID
+};
+
+static const int PLYTypeSize[] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+
+static PLYType LookUpPLYType(const std::string& name)
+{
+    static const char* names[][2] = {
+        { "char", "int8" }, { "uchar", "uint8" }, { "short", "int16" }, { "ushort", "uint16" },
+        { "int", "int32" }, { "uint", "uint32" }, { "float", "float32" }, { "double", "float64" } };
+    for (int i = 0; i < PLY_INVALID; i++) {
+        if (name == names[i][0] || name == names[i][1]) {
+            return PLYType(i);
+        }
+    }
+    return PLY_INVALID;
+}
+
+struct PLYProperty {
+    std::string name;
+    PLYType type;
+    // Type of the element count for list properties
+    PLYType countType = PLY_INVALID;
+    // Byte offset inside the element, for elements without lists
+    int offset = 0;
+};
+
+struct PLYElement {
+    std::string name;
+    size_t count = 0;
+    std::vector<PLYProperty> properties;
+    bool hasList = false;
+    int stride = 0;
+
+    int FindProperty(const std::string& name) const
+    {
+        for (int i = 0; i < properties.size(); i++) {
+            if (properties[i].name == name) {
+                return i;
+            }
+        }
+        return -1;
+    }
+};
+
+template<typename T>
+static inline T LoadValue(const char* p, bool swap)
+{
+    T v;
+    if (swap) {
+        char bytes[sizeof(T)];
+        for (int i = 0; i < sizeof(T); i++) {
+            bytes[i] = p[sizeof(T) - 1 - i];
+        }
+        memcpy(&v, bytes, sizeof(T));
+    }
+    else {
+        memcpy(&v, p, sizeof(T));
+    }
+    return v;
+}
+
+static inline int64_t LoadInt(const char* p, PLYType type, bool swap)
+{
+    switch (type) {
+    case PLY_INT8: return (int8_t)*p;
+    case PLY_UINT8: return (uint8_t)*p;
+    case PLY_INT16: return LoadValue<int16_t>(p, swap);
+    case PLY_UINT16: return LoadValue<uint16_t>(p, swap);
+    case PLY_INT32: return LoadValue<int32_t>(p, swap);
+    case PLY_UINT32: return LoadValue<uint32_t>(p, swap);
+    case PLY_FLOAT32: return (int64_t)LoadValue<float>(p, swap);
+    default: return (int64_t)LoadValue<double>(p, swap);
+    }
+}
+
+static inline Float LoadFloat(const char* p, PLYType type, bool swap)
+{
+    if (type == PLY_FLOAT32) {
+        return LoadValue<float>(p, swap);
+    }
+    if (type == PLY_FLOAT64) {
+        return (Float)LoadValue<double>(p, swap);
+    }
+    return (Float)LoadInt(p, type, swap);
+}
+
+/**
+ * Walks count elements holding list properties from *pos and calls
+ * f(values, n) for the list property listIndex. Returns false if the block
+ * runs past the end of the file.
+ */
+template<typename Function>
+static bool ForEachList(
+    const PLYElement& element, int listIndex,
+    const char* data, size_t size, size_t* pos, bool swap, Function f)
+{
+    for (size_t i = 0; i < element.count; i++) {
+        for (int k = 0; k < element.properties.size(); k++) {
+            const PLYProperty& prop = element.properties[k];
+            if (prop.countType == PLY_INVALID) {
+                *pos += PLYTypeSize[prop.type];
+                continue;
+            }
+            if (*pos + PLYTypeSize[prop.countType] > size) {
+                return false;
+            }
+            int64_t n = LoadInt(data + *pos, prop.countType, swap);
+            *pos += PLYTypeSize[prop.countType];
+            if (n < 0 || n * PLYTypeSize[prop.type] > size - *pos) {
+                return false;
+            }
+            if (k == listIndex) {
+                f(data + *pos, (int)n);
+            }
+            *pos += n * PLYTypeSize[prop.type];
+        }
+    }
+    return *pos <= size;
+}
+
+struct PLYAttribute {
+    int offset = -1;
+    PLYType type = PLY_INVALID;
+};
+
+// Positions and normals are transformed four at a time, bit for bit like Transform
+static void ConvertPoints(
+    const char* data, size_t stride, const PLYAttribute xyz[3], bool swap,
+    int n, const Transform& t, Point3f* out)
+{
+    int i = 0;
+#ifdef PLY_SSE
+    static_assert(sizeof(Float) == 4, "The SSE path converts single precision values");
+    __m128 m[4][4];
+    for (int r = 0; r < 4; r++) {
+        for (int c = 0; c < 4; c++) {
+            m[r][c] = _mm_set1_ps(t.mat.m[r][c]);
+        }
+    }
+    for (; i + 4 <= n; i += 4) {
+        alignas(16) Float v[3][4];
+        for (int k = 0; k < 4; k++) {
+            const char* p = data + (i + k) * stride;
+            for (int a = 0; a < 3; a++) {
+                v[a][k] = LoadFloat(p + xyz[a].offset, xyz[a].type, swap);
+            }
+        }
+        __m128 x = _mm_load_ps(v[0]), y = _mm_load_ps(v[1]), z = _mm_load_ps(v[2]);
+        __m128 r[4];
+        for (int row = 0; row < 4; row++) {
+            r[row] = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+                _mm_mul_ps(m[row][0], x), _mm_mul_ps(m[row][1], y)), _mm_mul_ps(m[row][2], z)), m[row][3]);
+        }
+        ASSERT(_mm_movemask_ps(_mm_cmpeq_ps(r[3], _mm_setzero_ps())) == 0, "Divide Zero");
+        // Dividing by a w of one is exact
+        for (int a = 0; a < 3; a++) {
+            _mm_store_ps(v[a], _mm_div_ps(r[a], r[3]));
+        }
+        for (int k = 0; k < 4; k++) {
+            out[i + k] = Point3f(v[0][k], v[1][k], v[2][k]);
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        const char* p = data + i * stride;
+        out[i] = t(Point3f(
+            LoadFloat(p + xyz[0].offset, xyz[0].type, swap),
+            LoadFloat(p + xyz[1].offset, xyz[1].type, swap),
+            LoadFloat(p + xyz[2].offset, xyz[2].type, swap)));
+    }
+}
+
+static void ConvertNormals(
+    const char* data, size_t stride, const PLYAttribute nxyz[3], bool swap,
+    int n, const Transform& t, Normal3f* out)
+{
+    int i = 0;
+#ifdef PLY_SSE
+    // Normals go through the transposed inverse
+    __m128 m[3][3];
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 3; c++) {
+            m[r][c] = _mm_set1_ps(t.invMat.m[c][r]);
+        }
+    }
+    for (; i + 4 <= n; i += 4) {
+        alignas(16) Float v[3][4];
+        for (int k = 0; k < 4; k++) {
+            const char* p = data + (i + k) * stride;
+            for (int a = 0; a < 3; a++) {
+                v[a][k] = LoadFloat(p + nxyz[a].offset, nxyz[a].type, swap);
+            }
+        }
+        __m128 x = _mm_load_ps(v[0]), y = _mm_load_ps(v[1]), z = _mm_load_ps(v[2]);
+        for (int a = 0; a < 3; a++) {
+            _mm_store_ps(v[a], _mm_add_ps(_mm_add_ps(
+                _mm_mul_ps(m[a][0], x), _mm_mul_ps(m[a][1], y)), _mm_mul_ps(m[a][2], z)));
+        }
+        for (int k = 0; k < 4; k++) {
+            out[i + k] = Normal3f(v[0][k], v[1][k], v[2][k]);
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        const char* p = data + i * stride;
+        out[i] = t(Normal3f(
+            LoadFloat(p + nxyz[0].offset, nxyz[0].type, swap),
+            LoadFloat(p + nxyz[1].offset, nxyz[1].type, swap),
+            LoadFloat(p + nxyz[2].offset, nxyz[2].type, swap)));
+    }
+}
+
+static bool FindAttributes(
+    const PLYElement& vertex, const char* names[], int n, PLYAttribute* attributes)
+{
+    for (int i = 0; i < n; i++) {
+        int k = vertex.FindProperty(names[i]);
+        if (k < 0) {
+            return false;
+        }
+        attributes[i].offset = vertex.properties[k].offset;
+        attributes[i].type = vertex.properties[k].type;
+    }
+    return true;
+}
+
+static bool ReadHeader(
+    const MappedFile& file, bool* binary, bool* bigEndian,
+    std::vector<PLYElement>* elements, size_t* dataStart)
+{
+    const char* data = file.Data();
+    size_t size = file.Size();
+    size_t pos = 0;
+    bool first = true;
+    *binary = false;
+    while (pos < size) {
+        const char* eol = (const char*)memchr(data + pos, '\n', size - pos);
+        if (!eol) {
+            return false;
+        }
+        std::istringstream line(std::string(data + pos, eol));
+        pos = eol - data + 1;
+
+        std::string keyword;
+        line >> keyword;
+        if (first) {
+            if (keyword != "ply") {
+                return false;
+            }
+            first = false;
+        }
+        else if (keyword == "format") {
+            std::string format;
+            line >> format;
+            *binary = format != "ascii";
+            *bigEndian = format == "binary_big_endian";
+            if (*binary && !*bigEndian && format != "binary_little_endian") {
+                return false;
+            }
+        }
+        else if (keyword == "element") {
+            PLYElement element;
+            line >> element.name >> element.count;
+            elements->push_back(element);
+        }
+        else if (keyword == "property") {
+            if (elements->empty()) {
+                return false;
+            }
+            PLYElement& element = elements->back();
+            PLYProperty prop;
+            std::string type;
+            line >> type;
+            if (type == "list") {
+                std::string countType;
+                line >> countType >> type;
+                prop.countType = LookUpPLYType(countType);
+                if (prop.countType == PLY_INVALID) {
+                    return false;
+                }
+                element.hasList = true;
+            }
+            line >> prop.name;
+            prop.type = LookUpPLYType(type);
+            if (prop.type == PLY_INVALID) {
+                return false;
+            }
+            prop.offset = element.stride;
+            element.stride += PLYTypeSize[prop.type];
+            element.properties.push_back(prop);
+        }
+        else if (keyword == "end_header") {
+            *dataStart = pos;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool LoadBinaryPLY(
+    const std::string& filename,
+    const Transform& objToWorld,
+    TriangleMesh** mesh)
+{
+    *mesh = nullptr;
+    MappedFile file;
+    if (!file.Open(filename)) {
+        return false;
+    }
+    bool binary, bigEndian;
+    std::vector<PLYElement> elements;
+    size_t pos;
+    if (!ReadHeader(file, &binary, &bigEndian, &elements, &pos) || !binary) {
+        return false;
+    }
+    uint16_t one = 1;
+    bool swap = bigEndian == (*(const char*)&one == 1);
+
+    const PLYElement* vertex = nullptr;
+    const PLYElement* face = nullptr;
+    for (const PLYElement& element : elements) {
+        if (element.name == "vertex") {
+            vertex = &element;
+        }
+        else if (element.name == "face") {
+            face = &element;
+        }
+    }
+    if (!vertex || vertex->hasList) {
+        return false;
+    }
+
+    const char* data = file.Data();
+    size_t size = file.Size();
+    const char* vertexData = nullptr;
+    size_t faceStart = 0;
+    for (const PLYElement& element : elements) {
+        if (&element == vertex) {
+            vertexData = data + pos;
+        }
+        else if (&element == face) {
+            faceStart = pos;
+        }
+        if (element.hasList) {
+            if (!ForEachList(element, -1, data, size, &pos, swap, [](const char*, int) {})) {
+                printf("Warning : Can't read %s, the file is truncated\n", filename.c_str());
+                return true;
+            }
+        }
+        else if (element.count * element.stride > size - pos) {
+            printf("Warning : Can't read %s, the file is truncated\n", filename.c_str());
+            return true;
+        }
+        else {
+            pos += element.count * element.stride;
+        }
+    }
+
+    static const char* positionNames[] = { "x", "y", "z" };
+    static const char* normalNames[] = { "nx", "ny", "nz" };
+    // There seem to be lots of different conventions regarding UV coordinate names
+    static const char* uvNames[][2] = {
+        { "u", "v" }, { "s", "t" }, { "texture_u", "texture_v" }, { "texture_s", "texture_t" } };
+    PLYAttribute p[3], n[3], uv[2];
+    int listIndex = face ? face->FindProperty("vertex_indices") : -1;
+    if (listIndex < 0 && face) {
+        listIndex = face->FindProperty("vertex_index");
+    }
+    if (!FindAttributes(*vertex, positionNames, 3, p) || vertex->count == 0 || listIndex < 0 ||
+        face->properties[listIndex].countType == PLY_INVALID) {
+        printf("Warning : Can't read %s, it has no vertices or faces\n", filename.c_str());
+        return true;
+    }
+    bool hasNormals = FindAttributes(*vertex, normalNames, 3, n);
+    bool hasUV = false;
+    for (int i = 0; i < 4 && !hasUV; i++) {
+        hasUV = FindAttributes(*vertex, uvNames[i], 2, uv);
+    }
+
+    // The first walk counts the triangles of the fans, the second writes them
+    int vertexNum = (int)vertex->count;
+    PLYType indexType = face->properties[listIndex].type;
+    size_t triangleNum = 0;
+    bool badIndex = false;
+    pos = faceStart;
+    ForEachList(*face, listIndex, data, size, &pos, swap, [&](const char* values, int count) {
+        if (count >= 3) {
+            triangleNum += count - 2;
+        }
+        for (int i = 0; i < count; i++) {
+            int64_t index = LoadInt(values + i * PLYTypeSize[indexType], indexType, swap);
+            badIndex |= index < 0 || index >= vertexNum;
+        }
+    });
+    if (badIndex) {
+        printf("Warning : Can't read %s, faces refer to missing vertices\n", filename.c_str());
+        return true;
+    }
+    if (triangleNum == 0) {
+        printf("Warning : Can't read %s, it has no vertices or faces\n", filename.c_str());
+        return true;
+    }
+
+    TriangleMesh* result = new TriangleMesh();
+    result->m_vertexNum = vertexNum;
+    result->m_triangleNum = (int)triangleNum;
+    result->m_indices = new int[triangleNum * 3];
+    int* indices = result->m_indices;
+    pos = faceStart;
+    ForEachList(*face, listIndex, data, size, &pos, swap, [&](const char* values, int count) {
+        int indexSize = PLYTypeSize[indexType];
+        if (indexType == PLY_INT32 && !swap && count == 3) {
+            memcpy(indices, values, 3 * sizeof(int));
+            indices += 3;
+            return;
+        }
+        int v0 = (int)LoadInt(values, indexType, swap);
+        for (int i = 1; i + 1 < count; i++) {
+            *indices++ = v0;
+            *indices++ = (int)LoadInt(values + i * indexSize, indexType, swap);
+            *indices++ = (int)LoadInt(values + (i + 1) * indexSize, indexType, swap);
+        }
+    });
+
+    result->m_P = new Point3f[vertexNum];
+    ConvertPoints(vertexData, vertex->stride, p, swap, vertexNum, objToWorld, result->m_P);
+    if (hasNormals) {
+        result->m_N = new Normal3f[vertexNum];
+        ConvertNormals(vertexData, vertex->stride, n, swap, vertexNum, objToWorld, result->m_N);
+    }
+    if (hasUV) {
+        result->m_UV = new Point2f[vertexNum];
+        for (int i = 0; i < vertexNum; i++) {
+            const char* v = vertexData + size_t(i) * vertex->stride;
+            result->m_UV[i] = Point2f(
+                LoadFloat(v + uv[0].offset, uv[0].type, swap),
+                LoadFloat(v + uv[1].offset, uv[1].type, swap));
+        }
+    }
+    *mesh = result;
+    return true;
+}
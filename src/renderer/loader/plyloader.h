@@ -0,0 +1,21 @@
+#pragma once
+#ifndef __PLYLOADER_H
+#define __PLYLOADER_H
+
+#include "renderer/core/triangle.h"
+
+/**
+ * \brief Reads a binary little or big endian PLY file into a TriangleMesh
+ *
+ * The file is mapped and the vertex and face blocks are converted in bulk
+ * straight into the arrays of the mesh, polygons are split into fans.
+ * Returns false for files it leaves to rply, ASCII ones and vertices with
+ * list properties. Otherwise *mesh is the mesh, or nullptr if the file is
+ * broken.
+ */
+bool LoadBinaryPLY(
+    const std::string& filename,
+    const Transform& objToWorld,
+    TriangleMesh** mesh);
+
+#endif // !__PLYLOADER_H
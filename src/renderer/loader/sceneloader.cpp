@@ -0,0 +1,15 @@
+#include "sceneloader.h"
+#include "renderer/loader/objloader.h"
+#include "renderer/loader/pbrtloader.h"
+
+std::shared_ptr<SceneLoader> CreateSceneLoader(const std::string& filepath)
+{
+    std::string extension = filesystem::path(filepath).extension();
+    if (extension == "pbrt") {
+        return std::make_shared<PBRTLoader>(filepath);
+    }
+    if (extension == "obj") {
+        return std::make_shared<OBJLoader>(filepath);
+    }
+    return nullptr;
+}
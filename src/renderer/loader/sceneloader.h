@@ -29,5 +29,8 @@ public:
     std::shared_ptr<Scene> m_scene;
 };
 
+// Loader for the format of filepath, by its extension, nullptr if unknown
+std::shared_ptr<SceneLoader> CreateSceneLoader(const std::string& filepath);
+
 
 #endif // __SCENELOADER_H
\ No newline at end of file
@@ -3,11 +3,12 @@
 #define __HELPER_LOGGER_H
 
 #include <iostream>
+#include <string>
 
 #define ASSERT(CONDITION, DESCRIPTION) \
     do { \
         if (!(CONDITION)) { \
-            printf("\nAssertion : %s\nFile : %s\nFunction : %s\nLine : %s\n",(DESCRIPTION),__FILE__,__FUNCTION__,__LINE__);\
+            printf("\nAssertion : %s\nFile : %s\nFunction : %s\nLine : %d\n",std::string(DESCRIPTION).c_str(),__FILE__,__FUNCTION__,__LINE__);\
             exit(-1); \
         } \
     } while (0)            